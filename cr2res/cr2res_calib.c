@@ -34,10 +34,47 @@
 #include "cr2res_detlin.h"
 #include "cr2res_utils.h"
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* The calibrations of one detector, loaded once for all the frames */
+struct _cr2res_calib_context_ {
+    int                 chip ;
+    int                 clean_bad ;
+    int                 cosmics_corr ;
+    /* Size of the calibrations, 0 if none is given */
+    cpl_size            nx ;
+    cpl_size            ny ;
+    /* Bad pixels, or NULL */
+    cpl_mask        *   bpm ;
+    /* Master dark and its DIT, or NULL */
+    hdrl_image      *   dark ;
+    double              dark_dit ;
+    /* Non-linearity coefficients, or NULL */
+    hdrl_imagelist  *   detlin ;
+    /* Master flat, or NULL */
+    hdrl_image      *   flat ;
+} ;
+
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
+static int cr2res_calib_context_check_size(
+        cr2res_calib_context    *   ctx,
+        cpl_size                    nx,
+        cpl_size                    ny,
+        const char              *   name) ;
+static hdrl_image * cr2res_calib_context_run(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit) ;
+static int cr2res_calib_context_correct(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out,
+        double                          dit) ;
+
 /*----------------------------------------------------------------------------*/
 /**
   @defgroup cr2res_calib
@@ -60,6 +97,8 @@
   @param    dits        the DITs of the images for the dark correction
   The flat, dark and bpm must have the same size as the input in.
   In the case of detlin, data are only taken in normal mode.
+  The calibrations are loaded once for all the images, see
+  cr2res_calib_context_new().
   @return   the newly allocated imagelist or NULL in error case
  */
 /*----------------------------------------------------------------------------*/
@@ -74,37 +113,20 @@ hdrl_imagelist * cr2res_calib_imagelist(
         const cpl_frame         *   detlin,
         const cpl_vector        *   dits)
 {
-    hdrl_imagelist      *   out ;
-    const hdrl_image    *   cur_ima ;
-    hdrl_image          *   cur_ima_calib ;
-    double                  dit ;
-    cpl_size                i ;
+    cr2res_calib_context    *   ctx ;
+    hdrl_imagelist          *   out ;
 
     /* Check Inputs */
     if (in == NULL) return NULL ;
 
-    /* Initialise */
-    dit = 0.0 ;
-
-    /* Create calibrated image list */
-    out = hdrl_imagelist_new() ;
-
-    /* Loop on the images */
-    for (i=0 ; i<hdrl_imagelist_get_size(in) ; i++) {
-        cur_ima = hdrl_imagelist_get(in, i) ;
-        if (dark != NULL) dit = cpl_vector_get(dits, i) ;
-
-        /* Calibrate */
-        if ((cur_ima_calib = cr2res_calib_image(cur_ima, chip, clean_bad, 
-                        cosmics_corr, flat, dark, bpm, detlin, dit)) == NULL) {
-            cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
-            hdrl_imagelist_delete(out) ;
-            return NULL ;
-        } else {
-            /* All the calibrated image in the list */
-            hdrl_imagelist_set(out, cur_ima_calib, i);
-        }
+    /* Load the calibrations */
+    if ((ctx = cr2res_calib_context_new(chip, clean_bad, cosmics_corr, flat,
+                    dark, bpm, detlin)) == NULL) {
+        cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
+        return NULL ;
     }
+    out = cr2res_calib_context_apply_imagelist(ctx, in, dits) ;
+    cr2res_calib_context_delete(ctx) ;
     return out ;
 }
  
@@ -122,6 +144,7 @@ hdrl_imagelist * cr2res_calib_imagelist(
   @param    dit         the DIT for the dark correction
   The flat, dark and bpm must have the same size as the input in.
   In the case of detlin, data are only taken in normal mode.
+  To calibrate several images, use a cr2res_calib_context instead.
   @return   the newly allocated image or NULL in error case
  */
 /*----------------------------------------------------------------------------*/
@@ -136,107 +159,339 @@ hdrl_image * cr2res_calib_image(
         const cpl_frame     *   detlin,
         double                  dit)
 {
-    hdrl_image          *   out ;
-    hdrl_image          *   calib ;
-    hdrl_imagelist      *   calib_list ;
-    cpl_propertylist    *   plist ;
-    double                  dark_dit ;
+    cr2res_calib_context    *   ctx ;
+    hdrl_image              *   out ;
 
     /* Test entries */
     if (in == NULL) return NULL ;
     if (chip < 1 || chip > CR2RES_NB_DETECTORS) return NULL ;
 
-    /* Create out image */
-    out = hdrl_image_duplicate(in) ;
+    /* Load the calibrations */
+    if ((ctx = cr2res_calib_context_new(chip, clean_bad, cosmics_corr, flat,
+                    dark, bpm, detlin)) == NULL) return NULL ;
+    out = cr2res_calib_context_apply_image(ctx, in, dit) ;
+    cr2res_calib_context_delete(ctx) ;
+    return out ;
+}
 
-    /* Clean the bad pixels */
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load the calibrations of a chip
+  @param    chip        the chip to calibrate (1 to CR2RES_NB_DETECTORS)
+  @param    clean_bad   Flag to activate the cleaning of the bad pixels 
+  @param    cosmics_corr    Flag to correct for cosmics
+  @param    flat        the flat frame or NULL
+  @param    dark        the dark frame or NULL
+  @param    bpm         the bpm frame or NULL
+  @param    detlin      the detlin frame or NULL
+  @return   the newly allocated context or NULL in error case
+
+  The master dark (and its DIT), the master flat, the detlin coefficients
+  and the bad pixels mask are loaded and checked once, the context can
+  then calibrate any number of images of this chip with
+  cr2res_calib_context_apply_image() or
+  cr2res_calib_context_apply_imagelist().
+  All the calibrations must have the same size. The returned context is
+  to be deallocated with cr2res_calib_context_delete().
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_calib_context * cr2res_calib_context_new(
+        int                     chip,
+        int                     clean_bad,
+        int                     cosmics_corr,
+        const cpl_frame     *   flat,
+        const cpl_frame     *   dark,
+        const cpl_frame     *   bpm,
+        const cpl_frame     *   detlin)
+{
+    cr2res_calib_context    *   ctx ;
+    cpl_propertylist        *   plist ;
+    cpl_image               *   bpm_ima ;
+    cpl_errorstate              prestate ;
+
+    /* Test entries */
+    if (chip < 1 || chip > CR2RES_NB_DETECTORS) return NULL ;
+
+    ctx = cpl_calloc(1, sizeof(cr2res_calib_context)) ;
+    ctx->chip = chip ;
+    ctx->clean_bad = clean_bad ;
+    ctx->cosmics_corr = cosmics_corr ;
+
+    /* Load the bad pixels */
     if (bpm != NULL) {
-        cpl_msg_info(__func__, "Correct the bad pixels") ;
-        if (cr2res_bpm_set_and_correct_image(hdrl_image_get_image(out),
-                    cpl_frame_get_filename(bpm), chip, clean_bad) != 0) {
-            cpl_msg_error(__func__, "Cannot clean the bad pixels");
-            hdrl_image_delete(out);
+        cpl_msg_info(__func__, "Load the bad pixels") ;
+        if ((bpm_ima = cr2res_io_load_BPM(cpl_frame_get_filename(bpm), chip,
+                        1)) == NULL) {
+            cpl_msg_error(__func__, "Cannot load the bpm") ;
+            cr2res_calib_context_delete(ctx) ;
+            return NULL ;
+        }
+        /* Convert the map to binary */
+        ctx->bpm = cpl_mask_threshold_image_create(bpm_ima, -0.5, 0.5) ;
+        cpl_mask_not(ctx->bpm) ;
+        cpl_image_delete(bpm_ima) ;
+        if (cr2res_calib_context_check_size(ctx, cpl_mask_get_size_x(ctx->bpm),
+                    cpl_mask_get_size_y(ctx->bpm), "bpm")) {
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
     }
 
-    /* Apply the dark */
+    /* Load the dark */
     if (dark != NULL) {
-        cpl_msg_info(__func__, "Correct for the dark") ;
-
-        /* Load the dark */
-        if ((calib = cr2res_io_load_MASTER_DARK(cpl_frame_get_filename(dark), 
-                        chip)) == NULL) {
+        cpl_msg_info(__func__, "Load the dark") ;
+        if ((ctx->dark = cr2res_io_load_MASTER_DARK(
+                        cpl_frame_get_filename(dark), chip)) == NULL) {
             cpl_msg_error(__func__, "Cannot load the dark") ;
-            hdrl_image_delete(out);
+            cr2res_calib_context_delete(ctx) ;
+            return NULL ;
+        }
+        if (cr2res_calib_context_check_size(ctx,
+                    hdrl_image_get_size_x(ctx->dark),
+                    hdrl_image_get_size_y(ctx->dark), "dark")) {
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
 
         /* Get the dark DIT */
+        prestate = cpl_errorstate_get() ;
         plist = cpl_propertylist_load(cpl_frame_get_filename(dark), 0);
-        dark_dit = cr2res_pfits_get_dit(plist) ;
+        ctx->dark_dit = cr2res_pfits_get_dit(plist) ;
         cpl_propertylist_delete(plist) ;
-
-        /* Multiply the dark by dit/dark_dit */
-        hdrl_value hdrl_dit_corr = {dit/dark_dit, 0.0};
-        hdrl_image_mul_scalar(calib, hdrl_dit_corr) ;
-
-        /* Subtract the dark */
-        if (hdrl_image_sub_image(out, calib) != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot apply the dark") ;
-            hdrl_image_delete(calib) ;
-            hdrl_image_delete(out);
+        if (!cpl_errorstate_is_equal(prestate) || ctx->dark_dit == 0.0) {
+            cpl_msg_error(__func__, "Cannot get the dark DIT") ;
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
-        hdrl_image_delete(calib) ;
     }
 
-    /* Apply the non linearity correction */
+    /* Load the detlin coeffs */
     if (detlin != NULL) {
-        /* Load the detlin coeffs */
         cpl_msg_info(__func__, "Load the Non-Linearity coefficients") ;
-        if ((calib_list = cr2res_io_load_DETLIN_COEFFS(
+        if ((ctx->detlin = cr2res_io_load_DETLIN_COEFFS(
                         cpl_frame_get_filename(detlin), chip)) == NULL) {
             cpl_msg_error(__func__, "Cannot load the detlin") ;
-            hdrl_image_delete(out);
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
-
-        /* Detlin correction */
-        cpl_msg_info(__func__, "Correct for the Non-Linearity") ;
-        if (cr2res_detlin_correct(out, calib_list)) {
-            hdrl_imagelist_delete(calib_list) ;
-            hdrl_image_delete(out);
-            cpl_msg_error(__func__, "Cannot correct for the Non-Linearity") ;
+        if (hdrl_imagelist_get_size(ctx->detlin) < 3) {
+            cpl_msg_error(__func__, "The detlin needs 3 coefficients") ;
+            cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+            cr2res_calib_context_delete(ctx) ;
+            return NULL ;
+        }
+        if (cr2res_calib_context_check_size(ctx,
+                    hdrl_imagelist_get_size_x(ctx->detlin),
+                    hdrl_imagelist_get_size_y(ctx->detlin), "detlin")) {
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
-        hdrl_imagelist_delete(calib_list) ;
     }
 
-    /* Apply the flatfield */
+    /* Load the flat */
     if (flat != NULL) {
-        /* Load the flat */
         cpl_msg_info(__func__, "Load the flat field") ;
-        if ((calib = cr2res_io_load_MASTER_FLAT(
+        if ((ctx->flat = cr2res_io_load_MASTER_FLAT(
                         cpl_frame_get_filename(flat), chip)) == NULL) {
             cpl_msg_error(__func__, "Cannot load the flat field") ;
+            cr2res_calib_context_delete(ctx) ;
+            return NULL ;
+        }
+        if (cr2res_calib_context_check_size(ctx,
+                    hdrl_image_get_size_x(ctx->flat),
+                    hdrl_image_get_size_y(ctx->flat), "flat")) {
+            cr2res_calib_context_delete(ctx) ;
+            return NULL ;
+        }
+    }
+    return ctx ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a calibration context
+  @param    ctx     the context or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_calib_context_delete(cr2res_calib_context * ctx)
+{
+    if (ctx == NULL) return ;
+    if (ctx->bpm != NULL) cpl_mask_delete(ctx->bpm) ;
+    if (ctx->dark != NULL) hdrl_image_delete(ctx->dark) ;
+    if (ctx->detlin != NULL) hdrl_imagelist_delete(ctx->detlin) ;
+    if (ctx->flat != NULL) hdrl_image_delete(ctx->flat) ;
+    cpl_free(ctx) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Tell if the calibration needs the DITs of the images
+  @param    ctx     the calibration context
+  @return   1 if a dark is to be subtracted, 0 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_calib_context_needs_dits(const cr2res_calib_context * ctx)
+{
+    if (ctx == NULL) return 0 ;
+    return ctx->dark != NULL ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate an image with the loaded calibrations
+  @param    ctx     the calibration context
+  @param    in      the input hdrl image
+  @param    dit     the DIT for the dark correction
+  @return   the newly allocated image or NULL in error case
+
+  Same as cr2res_calib_image() with the calibrations of the context.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_calib_context_apply_image(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit)
+{
+    /* Test entries */
+    if (ctx == NULL || in == NULL) return NULL ;
+
+    return cr2res_calib_context_run(ctx, in, dit) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate a list of images with the loaded calibrations
+  @param    ctx     the calibration context
+  @param    in      the input hdrl image list
+  @param    dits    the DITs of the images for the dark correction, can be
+                    NULL without dark
+  @return   the newly allocated imagelist or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_imagelist * cr2res_calib_context_apply_imagelist(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_imagelist        *   in,
+        const cpl_vector            *   dits)
+{
+    hdrl_imagelist      *   out ;
+    hdrl_image          *   cur_ima_calib ;
+    double                  dit ;
+    cpl_size                i ;
+
+    /* Check Inputs */
+    if (ctx == NULL || in == NULL) return NULL ;
+    if (ctx->dark != NULL && (dits == NULL ||
+                cpl_vector_get_size(dits) < hdrl_imagelist_get_size(in))) {
+        cpl_msg_error(__func__, "The dark correction needs the DITs") ;
+        return NULL ;
+    }
+
+    /* Create calibrated image list */
+    out = hdrl_imagelist_new() ;
+
+    /* Loop on the images */
+    for (i=0 ; i<hdrl_imagelist_get_size(in) ; i++) {
+        dit = (ctx->dark != NULL) ? cpl_vector_get(dits, i) : 0.0 ;
+
+        /* Calibrate */
+        if ((cur_ima_calib = cr2res_calib_context_run(ctx,
+                        hdrl_imagelist_get_const(in, i), dit)) == NULL) {
+            cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
+            hdrl_imagelist_delete(out) ;
+            return NULL ;
+        }
+        /* All the calibrated image in the list */
+        hdrl_imagelist_set(out, cur_ima_calib, i);
+    }
+    return out ;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check and store the size of a calibration
+  @param    ctx     the calibration context
+  @param    nx      the calibration size in x
+  @param    ny      the calibration size in y
+  @param    name    the calibration name for the error message
+  @return   0 if ok, -1 if it differs from the previous calibrations
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_calib_context_check_size(
+        cr2res_calib_context    *   ctx,
+        cpl_size                    nx,
+        cpl_size                    ny,
+        const char              *   name)
+{
+    if (ctx->nx == 0 && ctx->ny == 0) {
+        ctx->nx = nx ;
+        ctx->ny = ny ;
+        return 0 ;
+    }
+    if (nx != ctx->nx || ny != ctx->ny) {
+        cpl_msg_error(__func__, "The %s size differs from the other "
+                "calibrations", name) ;
+        cpl_error_set(__func__, CPL_ERROR_INCOMPATIBLE_INPUT) ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate an image
+  @param    ctx     the calibration context
+  @param    in      the input hdrl image
+  @param    dit     the DIT for the dark correction
+  @return   the newly allocated image or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+static hdrl_image * cr2res_calib_context_run(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit)
+{
+    hdrl_image          *   out ;
+
+    /* Test entries */
+    if (ctx->nx > 0 && (hdrl_image_get_size_x(in) != ctx->nx ||
+                hdrl_image_get_size_y(in) != ctx->ny)) {
+        cpl_msg_error(__func__, "The image and calibrations sizes differ") ;
+        cpl_error_set(__func__, CPL_ERROR_INCOMPATIBLE_INPUT) ;
+        return NULL ;
+    }
+
+    /* Create out image */
+    out = hdrl_image_duplicate(in) ;
+
+    /* Clean the bad pixels - needs the neighbours, so not in the pass */
+    if (ctx->bpm != NULL) {
+        cpl_msg_debug(__func__, "Correct the bad pixels") ;
+        cpl_image_reject_from_mask(hdrl_image_get_image(out), ctx->bpm) ;
+        if (ctx->clean_bad && cpl_detector_interpolate_rejected(
+                    hdrl_image_get_image(out)) != CPL_ERROR_NONE) {
+            cpl_error_reset();
+            cpl_msg_error(__func__, "Cannot clean the bad pixels");
             hdrl_image_delete(out);
             return NULL ;
         }
-        
-        /* Divide */
-        cpl_msg_info(__func__, "Correct for the flat field") ;
-        if (hdrl_image_div_image(out, calib) != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot apply the flat field") ;
-            hdrl_image_delete(calib) ;
+    }
+
+    /* Apply the dark, the non linearity and the flat field */
+    if (ctx->dark != NULL || ctx->detlin != NULL || ctx->flat != NULL) {
+        cpl_msg_debug(__func__, "Correct for the dark, the Non-Linearity "
+                "and the flat field") ;
+        if (cr2res_calib_context_correct(ctx, out, dit)) {
+            cpl_msg_error(__func__, "Cannot apply the calibrations") ;
             hdrl_image_delete(out);
             return NULL ;
         }
-        hdrl_image_delete(calib) ;
     }
 
     /* Comics correction */
-    if (cosmics_corr) {
+    if (ctx->cosmics_corr) {
         cpl_msg_info(__func__, "Apply the cosmics corrections") ;
         /* TODO */
         cpl_msg_info(__func__, "NOT YET IMPLEMENTED") ;
@@ -244,5 +499,164 @@ hdrl_image * cr2res_calib_image(
     return out ;
 }
 
-/**@}*/
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Apply the dark, the non linearity and the flat field in place
+  @param    ctx     the calibration context
+  @param    out     the image to correct, same size as the calibrations
+  @param    dit     the DIT for the dark correction
+  @return   0 if ok, -1 otherwise
 
+  The three corrections are done in a single pass on the pixels, with
+  the same error propagation as hdrl_image_sub_image() of the scaled
+  dark, cr2res_detlin_correct() and hdrl_image_div_image() in a row:
+    x1 = x - d * dit / dark_dit
+    x2 = x1 * (a + b * x1 + c * x1^2)
+    x3 = x2 / flat
+  As in these functions, the pixels flagged in the image, the dark or
+  the flat are neither dark subtracted nor flat fielded but still
+  linearity corrected, and the pixels with a null flat are rejected.
+  The flags of the dark and the flat are added to the image bad pixels.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_calib_context_correct(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out,
+        double                          dit)
+{
+    const cpl_mask      *   bpm_in ;
+    cpl_mask            *   bpm_out ;
+    cpl_binary          *   pbpm ;
+    const cpl_mask      *   dark_bpm ;
+    const cpl_mask      *   flat_bpm ;
+    const cpl_binary    *   pdark_bpm ;
+    const cpl_binary    *   pflat_bpm ;
+    const double        *   pdark ;
+    const double        *   pdark_err ;
+    const double        *   pima ;
+    const double        *   perra ;
+    const double        *   pimb ;
+    const double        *   perrb ;
+    const double        *   pimc ;
+    const double        *   perrc ;
+    const double        *   pflat ;
+    const double        *   pflat_err ;
+    const hdrl_image    *   coeff ;
+    double              *   pdata ;
+    double              *   perr ;
+    double                  scale, x, err, derr, ea, eb, ec, ex, flat ;
+    cpl_binary              bad ;
+    cpl_size                i, npix ;
+
+    /* Initialise */
+    npix = hdrl_image_get_size_x(out) * hdrl_image_get_size_y(out) ;
+    pdata = cpl_image_get_data_double(hdrl_image_get_image(out)) ;
+    perr = cpl_image_get_data_double(hdrl_image_get_error(out)) ;
+    if (pdata == NULL || perr == NULL) return -1 ;
+    pdark = pdark_err = pima = perra = pimb = perrb = pimc = perrc = 
+        pflat = pflat_err = NULL ;
+    pdark_bpm = pflat_bpm = NULL ;
+    scale = 0.0 ;
+
+    /* The bad pixels of the image are updated along the pass */
+    bpm_in = cpl_image_get_bpm_const(hdrl_image_get_image(out)) ;
+    if (bpm_in != NULL) bpm_out = cpl_mask_duplicate(bpm_in) ;
+    else bpm_out = cpl_mask_new(hdrl_image_get_size_x(out),
+            hdrl_image_get_size_y(out)) ;
+    pbpm = cpl_mask_get_data(bpm_out) ;
+
+    /* Dark scaled to the DIT of the image */
+    if (ctx->dark != NULL) {
+        scale = dit / ctx->dark_dit ;
+        pdark = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(ctx->dark)) ;
+        pdark_err = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(ctx->dark)) ;
+        dark_bpm = cpl_image_get_bpm_const(
+                hdrl_image_get_image_const(ctx->dark)) ;
+        if (dark_bpm != NULL) pdark_bpm = cpl_mask_get_data_const(dark_bpm) ;
+    }
+
+    /* Non linearity coefficients */
+    if (ctx->detlin != NULL) {
+        coeff = hdrl_imagelist_get_const(ctx->detlin, 0) ;
+        pima = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(coeff)) ;
+        perra = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(coeff)) ;
+        coeff = hdrl_imagelist_get_const(ctx->detlin, 1) ;
+        pimb = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(coeff)) ;
+        perrb = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(coeff)) ;
+        coeff = hdrl_imagelist_get_const(ctx->detlin, 2) ;
+        pimc = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(coeff)) ;
+        perrc = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(coeff)) ;
+    }
+
+    /* Flat field */
+    if (ctx->flat != NULL) {
+        pflat = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(ctx->flat)) ;
+        pflat_err = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(ctx->flat)) ;
+        flat_bpm = cpl_image_get_bpm_const(
+                hdrl_image_get_image_const(ctx->flat)) ;
+        if (flat_bpm != NULL) pflat_bpm = cpl_mask_get_data_const(flat_bpm) ;
+    }
+
+    /* Loop on pixels */
+    for (i=0 ; i<npix ; i++) {
+        x = pdata[i] ;
+        err = perr[i] ;
+        bad = pbpm[i] ;
+
+        /* x1 = x - d * dit / dark_dit */
+        if (pdark != NULL) {
+            if (pdark_bpm != NULL && pdark_bpm[i]) bad = CPL_BINARY_1 ;
+            if (!bad) {
+                derr = pdark_err[i] * scale ;
+                x -= pdark[i] * scale ;
+                err = sqrt(err * err + derr * derr) ;
+            }
+        }
+
+        /* x2 = x1 * (a + b * x1 + c * x1^2) */
+        if (pima != NULL) {
+            ea = perra[i] * x ;
+            eb = perrb[i] * x * x ;
+            ec = perrc[i] * x * x * x ;
+            ex = err * (pima[i] + 2. * pimb[i] * x + 3. * pimc[i] * x * x) ;
+            err = sqrt(ea * ea + eb * eb + ec * ec + ex * ex) ;
+            x = x * (pima[i] + (pimb[i] + pimc[i] * x) * x) ;
+        }
+
+        /* x3 = x2 / flat */
+        if (pflat != NULL) {
+            if (pflat_bpm != NULL && pflat_bpm[i]) bad = CPL_BINARY_1 ;
+            if (!bad) {
+                flat = pflat[i] ;
+                if (flat == 0.0) {
+                    x = err = NAN ;
+                    bad = CPL_BINARY_1 ;
+                } else {
+                    err = sqrt((err / flat) * (err / flat) + 
+                            (x * pflat_err[i] / (flat * flat)) * 
+                            (x * pflat_err[i] / (flat * flat))) ;
+                    x = x / flat ;
+                }
+            }
+        }
+
+        pdata[i] = x ;
+        perr[i] = err ;
+        pbpm[i] = bad ;
+    }
+
+    /* Store the bad pixels */
+    hdrl_image_reject_from_mask(out, bpm_out) ;
+    cpl_mask_delete(bpm_out) ;
+    return 0 ;
+}
@@ -38,6 +38,9 @@ typedef enum {
     CR2RES_COLLAPSE_MEDIAN,
 } cr2res_collapse ;
 
+/* The calibrations of a detector, loaded once for all the frames */
+typedef struct _cr2res_calib_context_ cr2res_calib_context ;
+
 /*-----------------------------------------------------------------------------
                                 Prototypes
  -----------------------------------------------------------------------------*/
@@ -64,4 +67,27 @@ hdrl_image * cr2res_calib_image(
         const cpl_frame     *   detlin,
         double                  dit) ;
 
+cr2res_calib_context * cr2res_calib_context_new(
+        int                     chip,
+        int                     clean_bad,
+        int                     cosmics_corr,
+        const cpl_frame     *   flat,
+        const cpl_frame     *   dark,
+        const cpl_frame     *   bpm,
+        const cpl_frame     *   detlin) ;
+
+void cr2res_calib_context_delete(cr2res_calib_context * ctx) ;
+
+int cr2res_calib_context_needs_dits(const cr2res_calib_context * ctx) ;
+
+hdrl_image * cr2res_calib_context_apply_image(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit) ;
+
+hdrl_imagelist * cr2res_calib_context_apply_imagelist(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_imagelist        *   in,
+        const cpl_vector            *   dits) ;
+
 #endif
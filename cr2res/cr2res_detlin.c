@@ -37,6 +37,28 @@
 #define pow2(x) (x)*(x)
 #define pow3(x) (x)*(x)*(x)
 
+/* Relative determinant under which a detlin fit is singular */
+#define CR2RES_DETLIN_RCOND 1e-12
+
+/*-----------------------------------------------------------------------------
+                                   	Types
+ -----------------------------------------------------------------------------*/
+
+/* The normal equations sums of the quadratic fit of each pixel */
+struct _cr2res_detlin_sums_ {
+    cpl_size            nx ;
+    cpl_size            ny ;
+    /* Number of images added and the DITs of the first 2 */
+    cpl_size            nframes ;
+    double              dit0 ;
+    double              dit1 ;
+    /* Value at dit0 and linear slope between dit0 and dit1 */
+    double          *   ref ;
+    double          *   slope ;
+    /* Sums of w, w^2, w^3, w^4, y, w.y and w^2.y with w = value - ref */
+    double          *   sums[7] ;
+} ;
+
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
@@ -50,6 +72,13 @@ static void cr2res_matrix_fill_normal_vandermonde(cpl_matrix * self,
                                                cpl_boolean is_eqdist,
                                                cpl_size mindeg,
                                                const cpl_vector * values);
+static void cr2res_detlin_solve_quadratic(
+        cpl_size            npix,
+        cpl_size            nvals,
+        const double    *   ref,
+        const double    **  sums,
+        double          **  coeffs,
+        double          **  errors) ;
 
 /*----------------------------------------------------------------------------*/
 /**
@@ -292,6 +321,300 @@ int cr2res_detlin_compute(
     return 0 ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fits the response of all the pixels of a DIT ramp
+  @param    ramp        The images of the ramp, one per DIT
+  @param    dits        Vector with the DIT values
+  @param    selection   Pixels > 0 are fitted (CPL_TYPE_INT), or NULL for all
+  @param    coeffs      [out] The 3 images of the fitted coefficients
+  @param    errors      [out] The 3 images of the coefficients errors
+  @return   0 if ok, -1 in error case
+
+  This is cr2res_detlin_compute() with max_degree=2, run on all the
+  pixels at once: the images are added by increasing DIT to a
+  cr2res_detlin_sums, which is then solved.
+  The coeffs and errors image lists must hold 3 CPL_TYPE_DOUBLE images
+  of the ramp size, they are filled in place (see
+  cr2res_detlin_sums_solve()).
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detlin_compute_image(
+        const hdrl_imagelist    *   ramp,
+        const cpl_vector        *   dits,
+        const cpl_image         *   selection,
+        cpl_imagelist           *   coeffs,
+        cpl_imagelist           *   errors)
+{
+    cr2res_detlin_sums  *   sums ;
+    const cpl_image     *   cur_ima ;
+    const double        *   pdits ;
+    cpl_size            *   order ;
+    cpl_size                nframes, k, l, tmp ;
+    int                     ret ;
+
+    /* Check Inputs */
+    if (ramp == NULL || dits == NULL || coeffs == NULL || errors == NULL)
+        return -1 ;
+    nframes = hdrl_imagelist_get_size(ramp) ;
+    if (nframes < 2 || cpl_vector_get_size(dits) != nframes) {
+        cpl_msg_error(__func__, "Need at least 2 images and 1 DIT per image");
+        return -1 ;
+    }
+
+    /* Sort the images by increasing DIT */
+    pdits = cpl_vector_get_data_const(dits) ;
+    order = cpl_malloc(nframes * sizeof(cpl_size)) ;
+    for (k=0 ; k<nframes ; k++) {
+        order[k] = k ;
+        for (l=k ; l>0 && pdits[order[l]] < pdits[order[l-1]] ; l--) {
+            tmp = order[l] ;
+            order[l] = order[l-1] ;
+            order[l-1] = tmp ;
+        }
+    }
+
+    /* Accumulate and solve */
+    sums = cr2res_detlin_sums_new(hdrl_imagelist_get_size_x(ramp),
+            hdrl_imagelist_get_size_y(ramp)) ;
+    ret = 0 ;
+    for (k=0 ; k<nframes && ret == 0 ; k++) {
+        cur_ima = hdrl_image_get_image_const(
+                hdrl_imagelist_get_const(ramp, order[k])) ;
+        ret = cr2res_detlin_sums_add(sums, cur_ima, pdits[order[k]]) ;
+    }
+    if (ret == 0) ret = cr2res_detlin_sums_solve(sums, selection, coeffs,
+            errors) ;
+    cr2res_detlin_sums_delete(sums) ;
+    cpl_free(order) ;
+    return ret ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the normal equations sums of a quadratic detlin fit
+  @param    nx      the x size of the detector
+  @param    ny      the y size of the detector
+  @return   the newly allocated sums or NULL in error case
+
+  The ramp images are accumulated one by one with cr2res_detlin_sums_add()
+  and the fits are solved with cr2res_detlin_sums_solve(). The sums only
+  hold 9 planes, whatever the number of DITs.
+  The returned object is to be deallocated with cr2res_detlin_sums_delete().
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_detlin_sums * cr2res_detlin_sums_new(
+        cpl_size    nx,
+        cpl_size    ny)
+{
+    cr2res_detlin_sums  *   sums ;
+    cpl_size                l ;
+
+    /* Check Inputs */
+    if (nx < 1 || ny < 1) return NULL ;
+
+    sums = cpl_calloc(1, sizeof(cr2res_detlin_sums)) ;
+    sums->nx = nx ;
+    sums->ny = ny ;
+    sums->ref = cpl_malloc(nx * ny * sizeof(double)) ;
+    sums->slope = cpl_malloc(nx * ny * sizeof(double)) ;
+    for (l=0 ; l<7 ; l++) sums->sums[l] = cpl_calloc(nx * ny, sizeof(double));
+    return sums ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate the normal equations sums of a detlin fit
+  @param    sums    the sums or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_detlin_sums_delete(cr2res_detlin_sums * sums)
+{
+    cpl_size    l ;
+
+    if (sums == NULL) return ;
+    cpl_free(sums->ref) ;
+    cpl_free(sums->slope) ;
+    for (l=0 ; l<7 ; l++) cpl_free(sums->sums[l]) ;
+    cpl_free(sums) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Add one image of the DIT ramp to the detlin fit sums
+  @param    sums    the sums to update
+  @param    ima     the image (CPL_TYPE_DOUBLE)
+  @param    dit     the image DIT
+  @return   0 if ok, -1 in error case
+
+  The images must be added by increasing DIT. As in
+  cr2res_detlin_compute(), the first 2 ones give the expected linear
+  response of each pixel, and the pixel values are used in single
+  precision. The values are shifted by their value at the first DIT
+  before being summed, this keeps the system as well conditioned as the
+  mean-centred one of cpl_polynomial_fit().
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detlin_sums_add(
+        cr2res_detlin_sums  *   sums,
+        const cpl_image     *   ima,
+        double                  dit)
+{
+    const double    *   pima ;
+    double              dk ;
+    cpl_size            j ;
+
+    /* Check Inputs */
+    if (sums == NULL || ima == NULL) return -1 ;
+    if (cpl_image_get_size_x(ima) != sums->nx ||
+            cpl_image_get_size_y(ima) != sums->ny) {
+        cpl_msg_error(__func__, "The image size does not match") ;
+        cpl_error_set(__func__, CPL_ERROR_INCOMPATIBLE_INPUT) ;
+        return -1 ;
+    }
+    if ((pima = cpl_image_get_data_double_const(ima)) == NULL) {
+        cpl_msg_error(__func__, "The image must be double") ;
+        return -1 ;
+    }
+    if ((sums->nframes == 1 && dit < sums->dit0) ||
+            (sums->nframes > 1 && dit < sums->dit1)) {
+        cpl_msg_error(__func__, "The images must come by increasing DIT") ;
+        cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+        return -1 ;
+    }
+
+    /* The first 2 images give the linear reference */
+    if (sums->nframes == 0) sums->dit0 = dit ;
+    else if (sums->nframes == 1) sums->dit1 = dit ;
+    dk = dit - sums->dit0 ;
+
+#pragma omp parallel for schedule(static)
+    for (j=0 ; j<sums->ny ; j++) {
+        const double    *   pcur = pima + j * sums->nx ;
+        double          *   ref = sums->ref + j * sums->nx ;
+        double          *   slope = sums->slope + j * sums->nx ;
+        double          *   s[7] ;
+        double              v, w, w2, y ;
+        cpl_size            i, l ;
+
+        for (l=0 ; l<7 ; l++) s[l] = sums->sums[l] + j * sums->nx ;
+        if (sums->nframes == 0) {
+            for (i=0 ; i<sums->nx ; i++) ref[i] = (float)(pcur[i]) ;
+        } else if (sums->nframes == 1) {
+            for (i=0 ; i<sums->nx ; i++)
+                slope[i] = ((float)(pcur[i]) - ref[i]) / dk ;
+        }
+        if (sums->nframes == 0) {
+            /* The first image is its own reference: w=0 */
+            for (i=0 ; i<sums->nx ; i++) s[4][i] += ref[i] / ref[i] ;
+            continue ;
+        }
+#pragma omp simd private(v, w, w2, y)
+        for (i=0 ; i<sums->nx ; i++) {
+            v = (float)(pcur[i]) ;
+            w = v - ref[i] ;
+            w2 = w * w ;
+            y = (ref[i] + slope[i] * dk) / v ;
+            s[0][i] += w ;
+            s[1][i] += w2 ;
+            s[2][i] += w2 * w ;
+            s[3][i] += w2 * w2 ;
+            s[4][i] += y ;
+            s[5][i] += w * y ;
+            s[6][i] += w2 * y ;
+        }
+    }
+    sums->nframes++ ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Solve the detlin fits of all the pixels
+  @param    sums        the accumulated sums
+  @param    selection   Pixels > 0 are fitted (CPL_TYPE_INT), or NULL for all
+  @param    coeffs      [out] The 3 images of the fitted coefficients
+  @param    errors      [out] The 3 images of the coefficients errors
+  @return   0 if ok, -1 in error case
+
+  Each pixel gets the coefficients and errors cr2res_detlin_compute()
+  computes with max_degree=2, its 3x3 normal equations are solved in
+  closed form.
+  The coeffs and errors image lists must hold 3 CPL_TYPE_DOUBLE images
+  of the sums size, they are filled in place. The pixels that are not
+  selected and the ones whose fit fails (singular system or NaN
+  coefficient) get NaN coefficients and errors.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detlin_sums_solve(
+        const cr2res_detlin_sums    *   sums,
+        const cpl_image             *   selection,
+        cpl_imagelist               *   coeffs,
+        cpl_imagelist               *   errors)
+{
+    const int       *   psel ;
+    double          *   pcoeffs[3] ;
+    double          *   perrors[3] ;
+    cpl_size            nx, ny, j, l ;
+
+    /* Check Inputs */
+    if (sums == NULL || coeffs == NULL || errors == NULL) return -1 ;
+    if (sums->nframes < 2) {
+        cpl_msg_error(__func__, "Need at least 2 images") ;
+        cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
+        return -1 ;
+    }
+    if (cpl_imagelist_get_size(coeffs) != 3 ||
+            cpl_imagelist_get_size(errors) != 3) {
+        cpl_msg_error(__func__, "Need 3 coefficients and errors images") ;
+        return -1 ;
+    }
+    nx = sums->nx ;
+    ny = sums->ny ;
+    if (selection != NULL && (cpl_image_get_size_x(selection) != nx ||
+                cpl_image_get_size_y(selection) != ny ||
+                cpl_image_get_type(selection) != CPL_TYPE_INT)) {
+        cpl_msg_error(__func__, "Invalid selection image") ;
+        return -1 ;
+    }
+    for (l=0 ; l<3 ; l++) {
+        pcoeffs[l] = cpl_image_get_data_double(cpl_imagelist_get(coeffs, l)) ;
+        perrors[l] = cpl_image_get_data_double(cpl_imagelist_get(errors, l)) ;
+        if (pcoeffs[l] == NULL || perrors[l] == NULL ||
+                cpl_image_get_size_x(cpl_imagelist_get(coeffs, l)) != nx ||
+                cpl_image_get_size_y(cpl_imagelist_get(coeffs, l)) != ny ||
+                cpl_image_get_size_x(cpl_imagelist_get(errors, l)) != nx ||
+                cpl_image_get_size_y(cpl_imagelist_get(errors, l)) != ny) {
+            cpl_msg_error(__func__, "Invalid coefficients or errors image") ;
+            return -1 ;
+        }
+    }
+    psel = selection == NULL ? NULL : cpl_image_get_data_int_const(selection);
+
+#pragma omp parallel for schedule(static)
+    for (j=0 ; j<ny ; j++) {
+        const double    *   s[7] ;
+        double          *   c[3] ;
+        double          *   e[3] ;
+        cpl_size            i, ll ;
+
+        for (ll=0 ; ll<7 ; ll++) s[ll] = sums->sums[ll] + j * nx ;
+        for (ll=0 ; ll<3 ; ll++) {
+            c[ll] = pcoeffs[ll] + j * nx ;
+            e[ll] = perrors[ll] + j * nx ;
+        }
+        cr2res_detlin_solve_quadratic(nx, sums->nframes, sums->ref + j * nx,
+                s, c, e) ;
+        if (psel == NULL) continue ;
+        for (i=0 ; i<nx ; i++) {
+            if (psel[i + j * nx] > 0) continue ;
+            for (ll=0 ; ll<3 ; ll++) c[ll][i] = e[ll][i] = NAN ;
+        }
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Sort the frames by increaing DIT
@@ -486,3 +809,99 @@ static void cr2res_matrix_fill_normal_vandermonde(cpl_matrix * self,
 
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Solve the quadratic detlin fits from their normal equations sums
+  @param    npix    Number of pixels
+  @param    nvals   Number of fitted values per pixel
+  @param    ref     Per pixel shift of the values
+  @param    sums    Per pixel sums over the values of w, w^2, w^3, w^4,
+                    y, w.y and w^2.y, with w = value - ref
+  @param    coeffs  [out] The 3 coefficients of each pixel
+  @param    errors  [out] The 3 errors of each pixel
+  @return   void
+
+  The fit is solved for the shifted and scaled values, then transformed
+  back to the polynomial of the raw values. The errors are the diagonal
+  of inv(V'V), scaled by the sum of the residuals, as in
+  cr2res_detlin_compute(). Failed fits get NaN coefficients and errors.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_detlin_solve_quadratic(
+        cpl_size            npix,
+        cpl_size            nvals,
+        const double    *   ref,
+        const double    **  sums,
+        double          **  coeffs,
+        double          **  errors)
+{
+    const double    n = (double)nvals ;
+    cpl_size        i ;
+
+#pragma omp simd
+    for (i=0 ; i<npix ; i++) {
+        double  q, q2, a1, a2, a3, a4, b0, b1, b2, det, idet ;
+        double  i00, i01, i02, i11, i12, i22, u0, u1, u2, d1, d2, r ;
+        double  fac, c0, c1, c2, e0, e1, e2 ;
+        int     ok ;
+
+        /* Scale the shifted values to a unit RMS */
+        q = 1.0 / sqrt(sums[1][i] / n) ;
+        q2 = q * q ;
+        a1 = sums[0][i] * q ;
+        a2 = sums[1][i] * q2 ;
+        a3 = sums[2][i] * q2 * q ;
+        a4 = sums[3][i] * q2 * q2 ;
+        b0 = sums[4][i] ;
+        b1 = sums[5][i] * q ;
+        b2 = sums[6][i] * q2 ;
+
+        /* Invert the symmetric Hankel matrix */
+        i00 = a2 * a4 - a3 * a3 ;
+        i01 = a2 * a3 - a1 * a4 ;
+        i02 = a1 * a3 - a2 * a2 ;
+        i11 = n * a4 - a2 * a2 ;
+        i12 = a1 * a2 - n * a3 ;
+        i22 = n * a2 - a1 * a1 ;
+        det = n * i00 + a1 * i01 + a2 * i02 ;
+        ok = det > CR2RES_DETLIN_RCOND * n * a2 * a4 ;
+        idet = 1.0 / det ;
+        i00 *= idet ;
+        i01 *= idet ;
+        i02 *= idet ;
+        i11 *= idet ;
+        i12 *= idet ;
+        i22 *= idet ;
+
+        /* Coefficients of the scaled values */
+        u0 = i00 * b0 + i01 * b1 + i02 * b2 ;
+        u1 = i01 * b0 + i11 * b1 + i12 * b2 ;
+        u2 = i02 * b0 + i12 * b1 + i22 * b2 ;
+
+        /* Sum of the residuals */
+        fac = nvals > 3 ? (b0 - (u0 * n + u1 * a1 + u2 * a2)) / (n - 3.0) :
+            0.0 ;
+
+        /* Back to the raw values */
+        r = ref[i] ;
+        d1 = u1 * q ;
+        d2 = u2 * q2 ;
+        c0 = u0 - d1 * r + d2 * r * r ;
+        c1 = d1 - 2.0 * d2 * r ;
+        c2 = d2 ;
+        e0 = fac * (i00 + r * r * q2 * i11 + r * r * r * r * q2 * q2 * i22
+                - 2.0 * r * q * i01 + 2.0 * r * r * q2 * i02
+                - 2.0 * r * r * r * q2 * q * i12) ;
+        e1 = fac * (q2 * i11 + 4.0 * r * r * q2 * q2 * i22
+                - 4.0 * r * q2 * q * i12) ;
+        e2 = fac * q2 * q2 * i22 ;
+
+        ok = ok && !isnan(c0) && !isnan(c1) && !isnan(c2) ;
+        coeffs[0][i] = ok ? c0 : NAN ;
+        coeffs[1][i] = ok ? c1 : NAN ;
+        coeffs[2][i] = ok ? c2 : NAN ;
+        errors[0][i] = ok ? e0 : NAN ;
+        errors[1][i] = ok ? e1 : NAN ;
+        errors[2][i] = ok ? e2 : NAN ;
+    }
+}
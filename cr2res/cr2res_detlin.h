@@ -31,6 +31,9 @@
                                     Define
  -----------------------------------------------------------------------------*/
 
+/* The detlin fit sums of a detector, accumulated image by image */
+typedef struct _cr2res_detlin_sums_ cr2res_detlin_sums ;
+
 /*-----------------------------------------------------------------------------
                                 Prototypes
  -----------------------------------------------------------------------------*/
@@ -46,6 +49,30 @@ int cr2res_detlin_compute(
         cpl_polynomial      **  fitted,
         cpl_vector          **  error) ;
 
+int cr2res_detlin_compute_image(
+        const hdrl_imagelist    *   ramp,
+        const cpl_vector        *   dits,
+        const cpl_image         *   selection,
+        cpl_imagelist           *   coeffs,
+        cpl_imagelist           *   errors) ;
+
+cr2res_detlin_sums * cr2res_detlin_sums_new(
+        cpl_size    nx,
+        cpl_size    ny) ;
+
+void cr2res_detlin_sums_delete(cr2res_detlin_sums * sums) ;
+
+int cr2res_detlin_sums_add(
+        cr2res_detlin_sums  *   sums,
+        const cpl_image     *   ima,
+        double                  dit) ;
+
+int cr2res_detlin_sums_solve(
+        const cr2res_detlin_sums    *   sums,
+        const cpl_image             *   selection,
+        cpl_imagelist               *   coeffs,
+        cpl_imagelist               *   errors) ;
+
 cpl_frameset * cr2res_detlin_sort_frames(
         const cpl_frameset  *   in) ;
 
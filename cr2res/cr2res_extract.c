@@ -17,8 +17,6 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
  */
 
-#pragma GCC optimize("O0")
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -27,6 +25,11 @@
                                    Includes
  -----------------------------------------------------------------------------*/
 #include <math.h>
+#include <string.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <cpl.h>
 #include "cr2res_dfs.h"
 #include "cr2res_trace.h"
@@ -41,9 +44,19 @@ typedef unsigned char byte;
 #define min(a,b) (((a)<(b))?(a):(b))
 #define max(a,b) (((a)>(b))?(a):(b))
 #define signum(a) (((a)>0)?1:((a)<0)?-1:0)
-#define zeta_index(x, y, z) (z * ncols * nrows) + (y * ncols) + x
-#define mzeta_index(x, y) (y * ncols) + x
-#define xi_index(x, y, z) (z * ncols * ny) + (y * ncols) + x
+#define zeta_index(x, y, z) (((z) * ncols * nrows) + ((y) * ncols) + (x))
+#define mzeta_index(x, y) (((y) * ncols) + (x))
+#define xi_index(x, y, z) (((z) * ncols * ny) + ((y) * ncols) + (x))
+
+/* Outlier rejection of the fixed slit function extraction */
+#define CR2RES_EXTRACT_HORNE_KAPPA      5.0
+#define CR2RES_EXTRACT_HORNE_MAXCLIP    3
+
+/* Automatic swath width of the slit decomposition */
+#define CR2RES_EXTRACT_SWATH_MIN        40
+#define CR2RES_EXTRACT_SWATH_MAX        400
+#define CR2RES_EXTRACT_SWATH_SNR        100.0
+#define CR2RES_EXTRACT_SWATH_CURV_TOL   0.5
 
 typedef struct {
     int     x ;
@@ -57,10 +70,296 @@ typedef struct {
     double  w;      /* Contribution weight <= 1/osample */
 } zeta_ref;
 
+/* Geometry tensors of a swath of the curved slit decomposition, packed */
+/* for the normal equations. Only the xi references that contribute are */
+/* kept, once grouped by subpixel (l_, for sL) and once by column (p_,  */
+/* for sP), the zeta references are grouped by detector pixel (z_). The */
+/* references of subpixel iy are l_start[iy] ... l_start[iy+1]-1, etc. */
+/* The weights are in w, or in w_f for single_prec.                     */
+typedef struct {
+    int                 ncols ;
+    int                 nrows ;
+    int                 ny ;
+    int                 single_prec ;
+    int                 nxi ;       /* Number of xi references per group */
+    int                 nzeta ;     /* Number of zeta references         */
+    int             *   l_start ;   /* [ny+1]                            */
+    unsigned short  *   l_x ;       /* Column of the subpixel            */
+    unsigned short  *   l_xx ;      /* Detector pixel xx,yy it falls on  */
+    unsigned short  *   l_yy ;
+    double          *   l_w ;
+    float           *   l_w_f ;
+    int             *   p_start ;   /* [ncols+1]                         */
+    unsigned short  *   p_iy ;      /* Subpixel                          */
+    unsigned short  *   p_xx ;
+    unsigned short  *   p_yy ;
+    double          *   p_w ;
+    float           *   p_w_f ;
+    int             *   z_start ;   /* [nrows*ncols+1], pixel y*ncols+x  */
+    unsigned short  *   z_x ;       /* Contributing subpixel x,iy        */
+    unsigned short  *   z_iy ;
+    double          *   z_w ;
+    float           *   z_w_f ;
+} slitdec_csr ;
+
+/* Work buffers of the slit decomposition of one swath. They are set up */
+/* once for a geometry and reused for all the swaths (and traces) of it */
+typedef struct {
+    int                 curved ;    /* Set up for the curved slit       */
+    int                 swath ;     /* ncols                            */
+    int                 height ;    /* nrows                            */
+    int                 osample ;
+    int                 delta_x ;   /* Only used for the curved slit    */
+    int                 single_prec ;   /* float geometry weights       */
+    /* Swath cut-outs */
+    cpl_image       *   img_sw ;
+    cpl_image       *   err_sw ;
+    int             *   mask_sw ;
+    double          *   ycen_sw ;
+    int             *   ycen_offset_sw ;
+    cpl_polynomial  **  slitcurves_sw ;
+    /* Slit decomposition, vertical and curved */
+    double          *   sP_old ;
+    double          *   p_bj ;
+    double          *   Aij ;       /* l_Aij for the curved slit        */
+    double          *   bj ;        /* l_bj for the curved slit         */
+    /* Slit decomposition, vertical */
+    double          *   E ;
+    double          *   Aij_x ;
+    double          *   bj_x ;
+    double          *   Adiag ;
+    double          *   omega ;
+    float           *   omega_f ;   /* omega in single precision        */
+    int             *   omega_iy ;
+    int             *   omega_n ;
+    /* Slit decomposition, curved */
+    double          *   p_Aij ;
+    xi_ref          *   xi ;        /* [ncols][ny][4]                   */
+    zeta_ref        *   zeta ;      /* [ncols][nrows][3*(osample+1)]    */
+    int             *   m_zeta ;    /* [ncols][nrows]                   */
+    slitdec_csr     *   csr ;       /* xi, zeta packed, see slitdec_csr */
+    cpl_image       *   img_mad ;
+} slitdec_ws;
+
+/* Geometry of one trace for the slit decomposition. It only depends on */
+/* the trace table, and is shared by the extractions of several frames */
+typedef struct {
+    int                 order ;
+    int                 trace_id ;
+    int                 lenx ;
+    int                 height ;        /* Extraction height, clipped   */
+    int                 swath ;         /* Adjusted swath width         */
+    int                 delta_x ;       /* Only used for the curved slit*/
+    int                 nswaths ;
+    cpl_vector      *   ycen ;
+    double          *   ycen_rest ;
+    cpl_vector      *   bins_begin ;
+    cpl_vector      *   bins_end ;
+    double          *   slitcurve_a ;   /* [lenx], curved slit only     */
+    double          *   slitcurve_b ;
+    double          *   slitcurve_c ;
+} slitdec_geom ;
+
+/* Geometry tensors of one swath of the curved slit decomposition, */
+/* with the inputs they were computed from */
+typedef struct {
+    int                 order ;
+    int                 trace_id ;
+    int                 swath_id ;
+    int                 ncols ;
+    int                 nrows ;
+    int                 osample ;
+    int                 y_lower_lim ;
+    double          *   ycen ;          /* [ncols]                      */
+    int             *   ycen_offset ;   /* [ncols]                      */
+    double          *   curv ;          /* [ncols][3] curvature coeffs  */
+    slitdec_csr     *   csr ;
+} xi_zeta_entry ;
+
+struct _cr2res_extract_geom_cache_ {
+    cpl_size            max_size ;      /* Memory cap in bytes, 0: none */
+    cpl_size            size ;          /* Memory used by the entries   */
+    int                 nb_entries ;
+    int                 nb_alloc ;
+    xi_zeta_entry   **  entries ;
+    int                 nb_hits ;
+    int                 nb_misses ;
+} ;
+
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
+static int cr2res_extract_traces_run(
+        const hdrl_image    **  imgs,
+        int                     nframes,
+        const cpl_table     *   traces,
+        const cpl_table     *   slit_func_in,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_table           **  extracted,
+        cpl_table           **  slit_func,
+        hdrl_image          **  model_master,
+        int                 *   swaths) ;
+
+static int cr2res_extract_sum_vert_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static int cr2res_extract_median_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static int cr2res_extract_sum_tilt_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static cpl_vector * cr2res_extract_rect_cut(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                 *   height,
+        cpl_image           **  img_rect,
+        cpl_image           **  err_rect) ;
+
+static int cr2res_extract_rect_sum_rows(
+        const cpl_image     *   img_rect,
+        int                     square,
+        double              *   out) ;
+
+static int cr2res_extract_rect_collapse(
+        const cpl_image     *   img_rect,
+        const cpl_image     *   err_rect,
+        int                     use_median,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec) ;
+
+static int cr2res_extract_rect_model(
+        const cpl_bivector  *   spec,
+        const cpl_vector    *   slit_func,
+        const cpl_vector    *   ycen,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static double cr2res_extract_select_median(
+        double  *   buf,
+        int         n) ;
+
+static cpl_table * cr2res_extract_EXTRACT2D_new(
+        const cpl_table *   trace_table,
+        cpl_size            nrows) ;
+
+static cpl_size cr2res_extract2d_trace_npix(
+        const int   *   ylo,
+        const int   *   yhi,
+        cpl_size        lenx) ;
+
+static cpl_size cr2res_extract2d_trace_fill(
+        const hdrl_image        *   in,
+        const int               *   ylo,
+        const int               *   yhi,
+        const cpl_polynomial    *   coef_wave,
+        const cpl_polynomial    *   coef_slit,
+        double                  *   flux,
+        double                  *   err,
+        double                  *   pos_x,
+        double                  *   pos_y,
+        double                  *   wave,
+        double                  *   slit_frac) ;
+
+static double * cr2res_extract2d_column(
+        cpl_table   *   out,
+        char        *   col_name) ;
+
+static int cr2res_extract_horne_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample,
+        double                  kappa,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static int cr2res_extract_slitdec_vert_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        const slitdec_geom  *   geom,
+        slitdec_ws          *   ws,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static int cr2res_extract_slitdec_curved_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        const slitdec_geom  *   geom,
+        slitdec_ws          *   ws,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin) ;
+
+static int cr2res_extract_model_paste(
+        const cpl_image     *   model_rect,
+        const int           *   model_ymin,
+        hdrl_image          *   model) ;
+
 static int cr2res_extract_slit_func_vert(
         int         ncols,
         int         nrows,
@@ -71,13 +370,15 @@ static int cr2res_extract_slit_func_vert(
         double  *   ycen,
         double  *   sL,
         double  *   sP,
-        double  *   unc,
         double  *   model,
+        double  *   unc,
         double      lambda_sP,
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double * slit_func_in) ;
+        const double * slit_func_in,
+        int         *   niter,
+        slitdec_ws  *   ws) ;
 
 static int cr2res_extract_slit_func_curved(
         int         ncols,
@@ -92,6 +393,7 @@ static int cr2res_extract_slit_func_curved(
         //double  *   PSF_curve,
         cpl_polynomial ** slitcurves,
         int         delta_x,
+        const slitdec_csr   *   csr,
         double  *   sL,
         double  *   sP,
         double  *   model,
@@ -100,7 +402,9 @@ static int cr2res_extract_slit_func_curved(
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double   *  slit_func_in) ;
+        const double   *  slit_func_in,
+        int         *   niter,
+        slitdec_ws  *   ws) ;
 
 static int cr2res_extract_xi_zeta_tensors(
         int         ncols,
@@ -115,7 +419,91 @@ static int cr2res_extract_xi_zeta_tensors(
         zeta_ref *  zeta,
         int      *  m_zeta) ;
 
+static slitdec_csr * cr2res_extract_slitdec_csr_new(
+        int             ncols,
+        int             nrows,
+        int             ny,
+        int             nxi,
+        int             nzeta,
+        int             single_prec) ;
+static void cr2res_extract_slitdec_csr_fill(
+        slitdec_csr     *   csr,
+        int                 ncols,
+        int                 nrows,
+        int                 ny,
+        const xi_ref    *   xi,
+        const zeta_ref  *   zeta,
+        const int       *   m_zeta) ;
+static slitdec_csr * cr2res_extract_slitdec_csr_duplicate(
+        const slitdec_csr   *   csr) ;
+static cpl_size cr2res_extract_slitdec_csr_get_size(
+        const slitdec_csr   *   csr) ;
+static void cr2res_extract_slitdec_csr_delete(slitdec_csr * csr) ;
+
 static int cr2res_extract_slitdec_bandsol(double *, double *, int, int, double) ;
+static void cr2res_extract_slitdec_warm_start(
+        cpl_vector          *   spec_sw,
+        int                     sw_start,
+        const cpl_vector    *   spec_prev,
+        int                     prev_start) ;
+static void cr2res_extract_slitdec_report_iter(
+        const int   *   niters,
+        int             nswaths,
+        int             warm_start) ;
+static int cr2res_extract_slitdec_tridiag(double *, double *, int, double) ;
+
+static slitdec_ws * cr2res_extract_slitdec_ws_new(void) ;
+static int cr2res_extract_slitdec_ws_set(
+        slitdec_ws  *   ws,
+        int             curved,
+        int             swath,
+        int             height,
+        int             osample,
+        int             delta_x,
+        int             single_prec) ;
+static void cr2res_extract_slitdec_ws_delete(slitdec_ws * ws) ;
+
+static slitdec_geom * cr2res_extract_slitdec_geom_new(
+        const cpl_table *   trace_tab,
+        int                 order,
+        int                 trace_id,
+        int                 height,
+        int                 swath,
+        cpl_size            lenx,
+        cpl_size            leny,
+        int                 curved) ;
+static void cr2res_extract_slitdec_geom_delete(slitdec_geom * geom) ;
+
+static void cr2res_extract_geom_get_curv(
+        int                 ncols,
+        cpl_polynomial  **  slitcurves,
+        double          *   curv) ;
+static const xi_zeta_entry * cr2res_extract_geom_cache_get(
+        cr2res_extract_geom_cache   *   cache,
+        int                             order,
+        int                             trace_id,
+        int                             swath_id,
+        int                             ncols,
+        int                             nrows,
+        int                             osample,
+        const double                *   ycen,
+        const int                   *   ycen_offset,
+        int                             y_lower_lim,
+        cpl_polynomial              **  slitcurves,
+        int                             single_prec) ;
+static int cr2res_extract_geom_cache_add(
+        cr2res_extract_geom_cache   *   cache,
+        int                             order,
+        int                             trace_id,
+        int                             swath_id,
+        int                             ncols,
+        int                             nrows,
+        int                             osample,
+        const double                *   ycen,
+        const int                   *   ycen_offset,
+        int                             y_lower_lim,
+        cpl_polynomial              **  slitcurves,
+        const slitdec_csr           *   csr) ;
 
 static int cr2res_extract_slitdec_adjust_swath(
         int             sw,
@@ -151,17 +539,36 @@ static int debug_output(int         ncols,
   @param    slit_func_in    The input slit_func or NULL
   @param    reduce_order    The order to extract (-1 for all)
   @param    reduce_trace    The Trace to extract (-1 for all)
-  @param    extr_method     The wished extraction method
+  @param    extr_method     The wished extraction method, CR2RES_EXTR_HORNE
+                            needs slit_func_in
   @param    extr_height     number of pix above and below mid-line or -1
-  @param    swath_width     width per swath
+  @param    swath_width     width per swath, or <= 0 to choose it for each
+                            trace, see cr2res_extract_swath_plan()
   @param    oversample      factor for oversampling
   @param    smooth_slit     
+  @param    warm_start      for the slit decomposition, start each swath
+                            from the solution of the previous one (the
+                            swaths of a trace are then done in sequence)
+  @param    single_prec     for the slit decomposition, store the geometry
+                            weights in single precision (the normal
+                            equations are still solved in double)
+  @param    nthreads        number of traces extracted in parallel (0 for all
+                            available cores)
+  @param    geom_cache      cache for the slit decomposition geometry or NULL,
+                            see cr2res_extract_geom_cache_new()
   @param    extracted       [out] the extracted spectra 
   @param    slit_func       [out] the slit functions
   @param    model_master    [out] the model
+  @param    swaths          [out] the swath width used for each row of
+                            traces, or NULL
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (contining many orders), and a traces table.
+  The traces are extracted independently, the models are then merged in the
+  order of the traces table, so the result does not depend on nthreads.
+  swaths has cpl_table_get_nrow(traces) elements and is allocated by the
+  caller. It receives the width given or planned for the slit decomposition
+  of each extracted trace, and 0 for the other rows.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract_traces(
@@ -175,187 +582,252 @@ int cr2res_extract_traces(
         int                     swath_width,
         int                     oversample,
         double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
         cpl_table           **  extracted,
         cpl_table           **  slit_func,
-        hdrl_image          **  model_master)
+        hdrl_image          **  model_master,
+        int                 *   swaths)
 {
-    cpl_bivector        **  spectrum ;
-    cpl_vector          *   slit_func_in_vec ;
-    cpl_vector          **  slit_func_vec ;
-    cpl_table           *   slit_func_loc ;
-    cpl_table           *   extract_loc ;
-    hdrl_image          *   model_loc ;
-    hdrl_image          *   model_loc_one ;
-    int                     nb_traces, i, order, trace_id ;
-    int                     x, y, badpix;
-
     /* Check Entries */
     if (img == NULL || traces == NULL) return -1 ;
 
-    /* Initialise */
-    nb_traces = cpl_table_get_nrow(traces) ;
-
-    /* Allocate Data containers */
-    spectrum = cpl_malloc(nb_traces * sizeof(cpl_bivector *)) ;
-    slit_func_vec = cpl_malloc(nb_traces * sizeof(cpl_vector *)) ;
-    model_loc = hdrl_image_duplicate(img) ;
-    hdrl_image_mul_scalar(model_loc, (hdrl_value){0.0, 0.0}) ;
-
-    /* Loop over the traces and extract them */
-    for (i=0 ; i<nb_traces ; i++) {
-        /* Initialise */
-        slit_func_vec[i] = NULL ;
-        spectrum[i] = NULL ;
-        model_loc_one = NULL ;
-
-        /* Get Order and trace id */
-        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
-        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
-
-        /* Check if this order needs to be skipped */
-        if (reduce_order > -1 && order != reduce_order) continue ;
+    return cr2res_extract_traces_run(&img, 1, traces, slit_func_in,
+            reduce_order, reduce_trace, extr_method, extr_height,
+            swath_width, oversample, smooth_slit, warm_start, single_prec,
+            nthreads, geom_cache, extracted, slit_func, model_master,
+            swaths) ;
+}
 
-        /* Check if this trace needs to be skipped */
-        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Extracts all the passed traces in several frames at once
+  @param    imgs            Full detector images, all of the same size
+  @param    traces          The traces table, common to all the frames
+  @param    slit_func_in    The input slit_func or NULL
+  @param    reduce_order    The order to extract (-1 for all)
+  @param    reduce_trace    The Trace to extract (-1 for all)
+  @param    extr_method     The wished extraction method
+  @param    extr_height     number of pix above and below mid-line or -1
+  @param    swath_width     width per swath, or <= 0 to choose it for each
+                            trace, see cr2res_extract_swath_plan()
+  @param    oversample      factor for oversampling
+  @param    smooth_slit     
+  @param    warm_start      see cr2res_extract_traces()
+  @param    single_prec     see cr2res_extract_traces()
+  @param    nthreads        number of traces extracted in parallel (0 for all
+                            available cores)
+  @param    geom_cache      cache for the slit decomposition geometry or NULL
+  @param    extracted       [out] the extracted spectra, one per frame
+  @param    slit_func       [out] the slit functions, one per frame, or NULL
+  @param    model_master    [out] the models, one per frame, or NULL
+  @param    swaths          [out] the swath widths, see
+                            cr2res_extract_traces(), or NULL
+  @return   0 if ok, -1 otherwise
 
-        cpl_msg_info(__func__, "Process Order %d/Trace %d",order,trace_id) ;
-        cpl_msg_indent_more() ;
+  Same as cr2res_extract_traces() on each frame of imgs, but the geometry
+  of a trace (ycen, height, slit curvature, swaths) is only computed once
+  and used for all the frames. Without geom_cache, the slit decomposition
+  tensors of a trace are also kept for all the frames.
+  The output arrays have hdrl_imagelist_get_size(imgs) elements and are
+  allocated by the caller. The returned tables and images are to be
+  deallocated by the caller. slit_func and model_master can be NULL if
+  only the spectra are needed (e.g. for a time series).
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_traces_multi(
+        const hdrl_imagelist    *   imgs,
+        const cpl_table     *   traces,
+        const cpl_table     *   slit_func_in,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_table           **  extracted,
+        cpl_table           **  slit_func,
+        hdrl_image          **  model_master,
+        int                 *   swaths)
+{
+    const hdrl_image    **  img_ptrs ;
+    cpl_size                nframes, i ;
+    int                     ret ;
 
-        /* Get the input slit_func if available */
-        if (slit_func_in != NULL) {
-            /* Load the proper slit function vector */
-            cr2res_extract_SLIT_FUNC_get_vector(slit_func_in, order,
-                    trace_id, &slit_func_in_vec) ;
-        } else {
-            slit_func_in_vec = NULL ;
+    /* Check Entries */
+    if (imgs == NULL || traces == NULL || extracted == NULL) return -1 ;
+    nframes = hdrl_imagelist_get_size(imgs) ;
+    if (nframes <= 0) return -1 ;
+
+    img_ptrs = cpl_malloc(nframes * sizeof(hdrl_image *)) ;
+    for (i=0 ; i<nframes ; i++) {
+        img_ptrs[i] = hdrl_imagelist_get_const(imgs, i) ;
+        if (hdrl_image_get_size_x(img_ptrs[i]) !=
+                hdrl_image_get_size_x(img_ptrs[0]) ||
+                hdrl_image_get_size_y(img_ptrs[i]) !=
+                hdrl_image_get_size_y(img_ptrs[0])) {
+            cpl_msg_error(__func__, "The frames sizes differ") ;
+            cpl_free(img_ptrs) ;
+            return -1 ;
         }
+    }
+    ret = cr2res_extract_traces_run(img_ptrs, nframes, traces, slit_func_in,
+            reduce_order, reduce_trace, extr_method, extr_height,
+            swath_width, oversample, smooth_slit, warm_start, single_prec,
+            nthreads, geom_cache, extracted, slit_func, model_master,
+            swaths) ;
+    cpl_free(img_ptrs) ;
+    return ret ;
+}
 
-        /* Call the Extraction */
-        if (extr_method == CR2RES_EXTR_SUM) {
-            if (cr2res_extract_sum_vert(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_MEDIAN) {
-            if (cr2res_extract_median(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (median-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_TILTSUM) {
-            if (cr2res_extract_sum_tilt(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (tiltsum-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_VERT) {
-            if (cr2res_extract_slitdec_vert(img, traces, slit_func_in_vec,
-                        order, trace_id, extr_height, swath_width,
-                        oversample, smooth_slit, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__,
-                        "Cannot (slitdec-vert-) extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_CURV) {
-            if (cr2res_extract_slitdec_curved(img, traces, slit_func_in_vec,
-                        order, trace_id, extr_height, swath_width,
-                        oversample, smooth_slit, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__,
-                        "Cannot (slitdec-curved-) extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        }
-        if (slit_func_in_vec != NULL) cpl_vector_delete(slit_func_in_vec) ;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Choose the swath width of a trace for the slit decomposition
+  @param    img         Full detector image
+  @param    traces      The traces table
+  @param    order       The order
+  @param    trace_id    The Trace
+  @param    height      number of pix above and below mid-line or -1
+  @param    oversample  factor for oversampling
+  @return   the even swath width, or -1 in error case
+
+  A swath must be wide enough for the slit function (oversample values
+  per detector row) to be measured with a S/N of CR2RES_EXTRACT_SWATH_SNR,
+  and narrow enough for the slit curvature to be nearly constant in it.
+  The S/N per column is the median of spectrum/error of a quick sum
+  extraction, and a slit function value collects about swath/oversample
+  columns, so at least oversample*(CR2RES_EXTRACT_SWATH_SNR/snr)^2 columns
+  are needed.
+  The curvature is taken from the SlitPolyB and SlitPolyC columns, in the
+  trace local frame as in the extraction (SlitPolyA is a constant offset
+  there). The swath ends when the shift of the slit edges has changed by
+  CR2RES_EXTRACT_SWATH_CURV_TOL pixels. Without these columns, only the
+  S/N is used.
+  The S/N limit wins if the two conflict, a swath with too little signal
+  makes the decomposition unstable. The result is within
+  [CR2RES_EXTRACT_SWATH_MIN, CR2RES_EXTRACT_SWATH_MAX], and leaves room
+  in the image width for the curved swaths, which are widened by the
+  maximum shift of the slit edges on each side.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_swath_plan(
+        const hdrl_image    *   img,
+        const cpl_table     *   traces,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample)
+{
+    cpl_polynomial  *   slitcurve_B ;
+    cpl_polynomial  *   slitcurve_C ;
+    cpl_image       *   img_rect ;
+    cpl_image       *   err_rect ;
+    cpl_vector      *   ycen ;
+    cpl_vector      *   slitfu ;
+    cpl_bivector    *   spec ;
+    const double    *   pspc ;
+    const double    *   perr ;
+    double          *   buf ;
+    double          *   shift ;
+    double              snr, rate, b, c, h2, lo_snr, hi_curv, dmax ;
+    cpl_errorstate      prestate ;
+    cpl_size            lenx, i ;
+    int                 n, step, sw, delta_x ;
 
-        /* Update the model global image */
-        if (model_loc_one != NULL) {
-            //hdrl_image_add_image(model_loc, model_loc_one) ;
-            for (int x = 1; x <= hdrl_image_get_size_x(model_loc); x++){
-                for (int y = 1; y <= hdrl_image_get_size_y(model_loc); y++){
-                    if (hdrl_image_get_pixel(model_loc_one, x, y, &badpix).data
-                         != 0){
-                        hdrl_image_set_pixel(model_loc, x, y,
-                            hdrl_image_get_pixel(model_loc_one, x, y, &badpix));
-                    }
-                }
-            }
+    /* Check Entries */
+    if (img == NULL || traces == NULL) return -1 ;
+    if (oversample <= 0) oversample = 1 ;
+    lenx = hdrl_image_get_size_x(img) ;
 
-            hdrl_image_delete(model_loc_one) ;
-        }
-        cpl_msg_indent_less() ;
+    /* S/N of a quick sum extraction */
+    if ((ycen = cr2res_extract_rect_cut(img, traces, order, trace_id,
+                    &height, &img_rect, &err_rect)) == NULL) {
+        cpl_msg_error(__func__, "Cannot cut the trace") ;
+        return -1 ;
     }
-
-    /* Create the slit_func_tab for the current detector */
-    if ((slit_func_loc = cr2res_extract_SLITFUNC_create(slit_func_vec,
-                    traces)) == NULL) {
-        cpl_msg_error(__func__, "Cannot compute the slit function") ;
-        for (i=0 ; i<nb_traces ; i++) {
-            if (slit_func_vec[i] != NULL) cpl_vector_delete(slit_func_vec[i]) ;
-            if (spectrum[i] != NULL) cpl_bivector_delete(spectrum[i]) ;
+    if (cr2res_extract_rect_collapse(img_rect, err_rect, 0, &slitfu,
+                &spec) != 0) {
+        cpl_image_delete(img_rect) ;
+        cpl_image_delete(err_rect) ;
+        cpl_vector_delete(ycen) ;
+        return -1 ;
+    }
+    cpl_image_delete(img_rect) ;
+    cpl_image_delete(err_rect) ;
+    cpl_vector_delete(slitfu) ;
+    pspc = cpl_bivector_get_x_data_const(spec) ;
+    perr = cpl_bivector_get_y_data_const(spec) ;
+    buf = cpl_malloc(lenx * sizeof(double)) ;
+    for (i=0, n=0 ; i<lenx ; i++)
+        if (perr[i] > 0.0 && pspc[i] > 0.0) buf[n++] = pspc[i] / perr[i] ;
+    snr = n > 0 ? cr2res_extract_select_median(buf, n) : 0.0 ;
+    cpl_free(buf) ;
+    cpl_bivector_delete(spec) ;
+
+    if (snr <= 0.0) lo_snr = lenx ;
+    else lo_snr = oversample * pow(CR2RES_EXTRACT_SWATH_SNR / snr, 2) ;
+
+    /* Variation of the slit edges shift along the order */
+    hi_curv = CR2RES_EXTRACT_SWATH_MAX ;
+    delta_x = 0 ;
+    prestate = cpl_errorstate_get() ;
+    slitcurve_B = cr2res_get_trace_wave_poly(traces, CR2RES_COL_SLIT_CURV_B,
+            order, trace_id) ;
+    slitcurve_C = cr2res_get_trace_wave_poly(traces, CR2RES_COL_SLIT_CURV_C,
+            order, trace_id) ;
+    if (slitcurve_B != NULL && slitcurve_C != NULL) {
+        /* shift[2*i] and shift[2*i+1] at the top and bottom edges */
+        h2 = height / 2. ;
+        shift = cpl_malloc(2 * lenx * sizeof(double)) ;
+        for (i=0 ; i<lenx ; i++) {
+            b = cpl_polynomial_eval_1d(slitcurve_B, i+1, NULL) ;
+            c = cpl_polynomial_eval_1d(slitcurve_C, i+1, NULL) ;
+            b += 2 * cpl_vector_get(ycen, i) * c ;
+            shift[2*i] = (b + c * h2) * h2 ;
+            shift[2*i+1] = (c * h2 - b) * h2 ;
+        }
+        /* Bound of the margin of cr2res_extract_slitdec_geom_new() */
+        dmax = 0.0 ;
+        for (i=0 ; i<2*lenx ; i++) dmax = max(dmax, fabs(shift[i])) ;
+        delta_x = (int)ceil(dmax) + 1 ;
+        step = min(CR2RES_EXTRACT_SWATH_MIN, lenx-1) ;
+        rate = 0.0 ;
+        for (i=0 ; i+step<lenx ; i++) {
+            rate = max(rate, fabs(shift[2*(i+step)] - shift[2*i]) / step) ;
+            rate = max(rate, fabs(shift[2*(i+step)+1]-shift[2*i+1]) / step) ;
         }
-        cpl_free(spectrum) ;
-        cpl_free(slit_func_vec) ;
-        hdrl_image_delete(model_loc) ;
-        return -1; 
+        cpl_free(shift) ;
+        if (rate * hi_curv > CR2RES_EXTRACT_SWATH_CURV_TOL)
+            hi_curv = CR2RES_EXTRACT_SWATH_CURV_TOL / rate ;
     }
-
-    /* Create the extracted_tab for the current detector */
-    extract_loc = cr2res_extract_EXTRACT1D_create(spectrum, traces) ;
-
-    /* Deallocate Vectors */
-    for (i=0 ; i<nb_traces ; i++) {
-        if (slit_func_vec[i] != NULL) cpl_vector_delete(slit_func_vec[i]) ;
-        if (spectrum[i] != NULL) cpl_bivector_delete(spectrum[i]) ;
+    cpl_polynomial_delete(slitcurve_B) ;
+    cpl_polynomial_delete(slitcurve_C) ;
+    /* The curvature columns are optional */
+    cpl_errorstate_set(prestate) ;
+    cpl_vector_delete(ycen) ;
+
+    /* Widest swath allowed by the curvature, but with enough signal */
+    sw = (int)hi_curv ;
+    if (sw < lo_snr) sw = lo_snr < lenx ? (int)ceil(lo_snr) : lenx ;
+    sw = max(sw, CR2RES_EXTRACT_SWATH_MIN) ;
+    sw = min(sw, CR2RES_EXTRACT_SWATH_MAX) ;
+    sw = min(sw, lenx - 2 * delta_x) ;
+    if (sw % 2 == 1) sw-- ;
+    cpl_msg_debug(__func__,
+            "Order %d/Trace %d: S/N %g, curvature limit %g -> swath %d",
+            order, trace_id, snr, hi_curv, sw) ;
+    if (sw < 2) {
+        cpl_msg_error(__func__, "The trace is too curved for the image") ;
+        return -1 ;
     }
-    cpl_free(spectrum) ;
-    cpl_free(slit_func_vec) ;
-
-    /* Return  */
-    *extracted = extract_loc ;
-    *slit_func = slit_func_loc ;
-    *model_master = model_loc;
-    return 0 ;
+    return sw ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -368,7 +840,7 @@ int cr2res_extract_traces(
   @param    height      number of pix above and below mid-line or -1
   @param    slit_func   the returned slit function, normalized to sum=1
   @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @param    model       the reconstructed image, or NULL to skip it
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (containing many orders), a trace table,
@@ -392,99 +864,92 @@ int cr2res_extract_sum_vert(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    int             *   ycen_int;
-    cpl_vector      *   ycen ;
-    cpl_image       *   img_tmp;
-    cpl_image       *   img_1d;
-    const cpl_image       *   img_in;
-    const cpl_image       *   err_in;
-    cpl_vector      *   spc;
-    cpl_vector      *   slitfu;
-    cpl_vector      *   sigma;
-    cpl_size            lenx, leny;
-    int                 i, j;
-    int                 ymin, ymax;
-    int                 empty_bottom = 0;
-    cpl_type            imtyp;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
 
     /* Check Entries */
     if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
 
-    img_in = hdrl_image_get_image_const(hdrl_in);
-    err_in = hdrl_image_get_error_const(hdrl_in);
-
-    /* use the same type as input for temp images below */
-    imtyp = cpl_image_get_type(img_in);
-    lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
-
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
+    if (cr2res_extract_sum_vert_rect(hdrl_in, trace_tab, order, trace_id,
+                height, slit_func, spec, model == NULL ? NULL : &model_rect,
+                &model_ymin) != 0)
         return -1 ;
-    }
-
-    img_tmp = cr2res_image_cut_rectify(img_in, ycen, height);
-    if (img_tmp == NULL) {
-        cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
-        return -1;
-    }
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_rectorder.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-    img_1d = cpl_image_collapse_create(img_tmp, 0); // sum of rows
-    spc = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_image_delete(img_1d);
-
-    img_1d = cpl_image_collapse_create(img_tmp, 1); // sum of columns
-    slitfu = cpl_vector_new_from_image_column(img_1d, 1);
-    cpl_vector_divide_scalar(slitfu, cpl_vector_get_sum(slitfu));
-    cpl_image_delete(img_1d);
-    cpl_image_delete(img_tmp);
-
-    img_tmp = cpl_image_multiply_create(err_in, err_in);
-    img_1d = cpl_image_collapse_create(img_tmp, 0);
-    sigma = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_vector_sqrt(sigma);
-    cpl_image_delete(img_tmp);
-    cpl_image_delete(img_1d);
-
-    // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            cpl_image_set(img_tmp, i, ycen_int[i-1]-(height/2)+j,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
-        }
-    }
-    cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-
-
-    *slit_func = slitfu;
-    *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
-
-    return 0;
+    if (model == NULL) return 0 ;
+
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(hdrl_in),
+            hdrl_image_get_size_y(hdrl_in)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Simple extraction function
+            (rectified model)
+  @param    hdrl_in     full detector image
+  @param    trace_tab   The traces table
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    slit_func   the returned slit function, normalized to sum=1
+  @param    spec        the returned spectrum, sum of rows
+  @param    model       the reconstructed image, rectified (lenx x height),
+                        or NULL to skip it
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_sum_vert(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_sum_vert_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    cpl_vector      *   ycen ;
+    cpl_image       *   img_rect ;
+    cpl_image       *   err_rect ;
+
+    /* Check Entries */
+    if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
+
+    /* Cut out the straightened order */
+    if ((ycen = cr2res_extract_rect_cut(hdrl_in, trace_tab, order, trace_id,
+                    &height, &img_rect, &err_rect)) == NULL)
+        return -1 ;
+
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        cpl_image_save(img_rect, "debug_rectorder.fits", CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+    }
+
+    /* Sum of rows and of columns */
+    if (cr2res_extract_rect_collapse(img_rect, err_rect, 0, slit_func,
+                spec) != 0) {
+        cpl_msg_error(__func__, "Cannot collapse the order");
+        cpl_image_delete(img_rect);
+        cpl_image_delete(err_rect);
+        cpl_vector_delete(ycen);
+        return -1;
+    }
+    cpl_image_delete(img_rect);
+    cpl_image_delete(err_rect);
+
+    // reconstruct the "model" from the two vectors, rectified
+    if (model != NULL) cr2res_extract_rect_model(*spec, *slit_func, ycen,
+            model, model_ymin) ;
+    cpl_vector_delete(ycen);
+    return 0;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -497,7 +962,7 @@ int cr2res_extract_sum_vert(
   @param    height      number of pix above and below mid-line or -1
   @param    slit_func   the returned slit function, normalized to sum=1
   @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @param    model       the reconstructed image, or NULL to skip it
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (containing many orders), a trace table,
@@ -522,101 +987,91 @@ int cr2res_extract_median(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    int             *   ycen_int;
-    cpl_vector      *   ycen ;
-    cpl_image       *   img_tmp;
-    cpl_image       *   img_1d;
-    const cpl_image       *   img_in;
-    const cpl_image       *   err_in;
-    cpl_vector      *   spc;
-    cpl_vector      *   slitfu;
-    cpl_vector      *   sigma;
-    cpl_size            lenx, leny;
-    int                 i, j;
-    int                 ymin, ymax;
-    int                 empty_bottom = 0;
-    cpl_type            imtyp;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
 
     /* Check Entries */
     if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
 
-    img_in = hdrl_image_get_image_const(hdrl_in);
-    err_in = hdrl_image_get_error_const(hdrl_in);
-
-    /* use the same type as input for temp images below */
-    imtyp = cpl_image_get_type(img_in);
-    lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
-
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
+    if (cr2res_extract_median_rect(hdrl_in, trace_tab, order, trace_id,
+                height, slit_func, spec, model == NULL ? NULL : &model_rect,
+                &model_ymin) != 0)
         return -1 ;
-    }
+    if (model == NULL) return 0 ;
+
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(hdrl_in),
+            hdrl_image_get_size_y(hdrl_in)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
 
-    img_tmp = cr2res_image_cut_rectify(img_in, ycen, height);
-    if (img_tmp == NULL) {
-        cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
-        return -1;
-    }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Simple extraction function with the median
+            (rectified model)
+  @param    hdrl_in     full detector image
+  @param    trace_tab   The traces table
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    slit_func   the returned slit function, normalized to sum=1
+  @param    spec        the returned spectrum, sum of rows
+  @param    model       the reconstructed image, rectified (lenx x height),
+                        or NULL to skip it
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
 
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_rectorder.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-    img_1d = cpl_image_collapse_median_create(img_tmp, 0, 0, 0); // rows
-    spc = cpl_vector_new_from_image_row(img_1d, 1);
+  See cr2res_extract_median(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_median_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    cpl_vector      *   ycen ;
+    cpl_image       *   img_rect ;
+    cpl_image       *   err_rect ;
 
-    // Multiply so that scaling matches a vertical sum
-    cpl_vector_multiply_scalar(spc,(double)height);
-    cpl_image_delete(img_1d);
+    /* Check Entries */
+    if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
 
-    img_1d = cpl_image_collapse_median_create(img_tmp, 1, 0, 0); // cols
-    slitfu = cpl_vector_new_from_image_column(img_1d, 1);
-    cpl_vector_divide_scalar(slitfu, cpl_vector_get_sum(slitfu));
-    cpl_image_delete(img_1d);
-    cpl_image_delete(img_tmp);
-
-    img_tmp = cpl_image_multiply_create(err_in, err_in);
-    img_1d = cpl_image_collapse_create(img_tmp, 0);
-    sigma = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_vector_sqrt(sigma);
-    cpl_image_delete(img_tmp);
-    cpl_image_delete(img_1d);
-
-    // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            cpl_image_set(img_tmp, i, ycen_int[i-1]-(height/2)+j,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
-        }
-    }
-    cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
+    /* Cut out the straightened order */
+    if ((ycen = cr2res_extract_rect_cut(hdrl_in, trace_tab, order, trace_id,
+                    &height, &img_rect, &err_rect)) == NULL)
+        return -1 ;
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
+        cpl_image_save(img_rect, "debug_rectorder.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
     }
 
+    /* Median of rows and of columns */
+    if (cr2res_extract_rect_collapse(img_rect, err_rect, 1, slit_func,
+                spec) != 0) {
+        cpl_msg_error(__func__, "Cannot collapse the order");
+        cpl_image_delete(img_rect);
+        cpl_image_delete(err_rect);
+        cpl_vector_delete(ycen);
+        return -1;
+    }
+    cpl_image_delete(img_rect);
+    cpl_image_delete(err_rect);
 
-    *slit_func = slitfu;
-    *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
-
+    // reconstruct the "model" from the two vectors, rectified
+    if (model != NULL) cr2res_extract_rect_model(*spec, *slit_func, ycen,
+            model, model_ymin) ;
+    cpl_vector_delete(ycen);
     return 0;
 }
 
@@ -630,7 +1085,7 @@ int cr2res_extract_median(
   @param    height      number of pix above and below mid-line or -1
   @param    slit_func   the returned slit function, normalized to sum=1
   @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @param    model       the reconstructed image, or NULL to skip it
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (containing many orders), a trace table,
@@ -655,61 +1110,90 @@ int cr2res_extract_sum_tilt(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    int             *   ycen_int;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
+
+    /* Check Entries */
+    if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
+
+    if (cr2res_extract_sum_tilt_rect(hdrl_in, trace_tab, order, trace_id,
+                height, slit_func, spec, model == NULL ? NULL : &model_rect,
+                &model_ymin) != 0)
+        return -1 ;
+    if (model == NULL) return 0 ;
+
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(hdrl_in),
+            hdrl_image_get_size_y(hdrl_in)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Simple extraction function with curvature correction
+            (rectified model)
+  @param    hdrl_in     full detector image
+  @param    trace_tab   The traces table
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    slit_func   the returned slit function, normalized to sum=1
+  @param    spec        the returned spectrum, sum of rows
+  @param    model       the reconstructed image, rectified (lenx x height),
+                        or NULL to skip it
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_sum_tilt(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_sum_tilt_rect(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
     cpl_vector      *   ycen ;
-    cpl_image       *   img_tmp;
-    cpl_image       *   img_1d;
-    const cpl_image       *   img_in;
-    const cpl_image       *   err_in;
-    cpl_vector      *   spc;
-    cpl_vector      *   slitfu;
-    cpl_vector      *   sigma;
-    cpl_size            lenx, leny;
+    cpl_image       *   img_rect ;
+    cpl_image       *   err_rect ;
+    const cpl_binary *  pbpm ;
+    const cpl_binary *  brow ;
+    double          *   pimg ;
+    double          *   row ;
+    double          *   pa ;
+    double          *   pb ;
+    double          *   pc ;
+    double          *   pxi_y ;
+    double          *   pxt_x ;
+    double          *   pxt_y ;
+    cpl_size            lenx;
     int                 i, j;
-    int                 ymin, ymax;
-    int                 empty_bottom = 0;
-    cpl_type            imtyp;
 
-    int yc, yt, badpix;
-    double a, b, c, value;
+    int yc, yt;
+    double a, b, value;
     cpl_polynomial * slitcurve_A, * slitcurve_B, *slitcurve_C;
     cpl_bivector * xi, *xt;
 
     /* Check Entries */
     if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
 
-    img_in = hdrl_image_get_image_const(hdrl_in);
-    err_in = hdrl_image_get_error_const(hdrl_in);
-
-    /* use the same type as input for temp images below */
-    imtyp = cpl_image_get_type(img_in);
-    lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
-
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
+    /* Cut out the straightened order */
+    if ((ycen = cr2res_extract_rect_cut(hdrl_in, trace_tab, order, trace_id,
+                    &height, &img_rect, &err_rect)) == NULL)
         return -1 ;
-    }
-
-    img_tmp = cr2res_image_cut_rectify(img_in, ycen, height);
-    if (img_tmp == NULL) {
-        cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
-        return -1;
-    }
+    lenx = cpl_image_get_size_x(img_rect);
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_rectorder.fits", imtyp,
+        cpl_image_save(img_rect, "debug_rectorder.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
     }
 
@@ -735,147 +1219,411 @@ int cr2res_extract_sum_tilt(
         cpl_msg_error(__func__, 
                 "No (or incomplete) slitcurve data found in trace table");
         cpl_vector_delete(ycen);
+        cpl_image_delete(img_rect);
+        cpl_image_delete(err_rect);
         cpl_polynomial_delete(slitcurve_A);
         cpl_polynomial_delete(slitcurve_B);
         cpl_polynomial_delete(slitcurve_C);
         return -1;
     }
-     
+
+    // The curvature only depends on the column, evaluate it once
+    pa = cpl_calloc(lenx, sizeof(double));
+    pb = cpl_calloc(lenx, sizeof(double));
+    pc = cpl_calloc(lenx, sizeof(double));
+    for (j = 1; j < lenx - 1; j++){
+        pa[j] = cpl_polynomial_eval_1d(slitcurve_A, j, NULL);
+        pb[j] = cpl_polynomial_eval_1d(slitcurve_B, j, NULL);
+        pc[j] = cpl_polynomial_eval_1d(slitcurve_C, j, NULL);
+    }
+    cpl_polynomial_delete(slitcurve_A);
+    cpl_polynomial_delete(slitcurve_B);
+    cpl_polynomial_delete(slitcurve_C);
 
     // xi is the regular coordinates
     // xt is the shifted coordinates
     xi = cpl_bivector_new(lenx);
     xt = cpl_bivector_new(lenx);
-    for (i = 0; i < lenx; i++){
-        cpl_vector_set(cpl_bivector_get_x(xi), i, i); 
-        cpl_vector_set(cpl_bivector_get_x(xt), i, i);
-        cpl_vector_set(cpl_bivector_get_y(xi), i, 0);
-        cpl_vector_set(cpl_bivector_get_y(xt), i, 0);
+    pxi_y = cpl_bivector_get_y_data(xi);
+    pxt_x = cpl_bivector_get_x_data(xt);
+    pxt_y = cpl_bivector_get_y_data(xt);
+    for (j = 0; j < lenx; j++){
+        cpl_bivector_get_x_data(xi)[j] = j;
+        pxt_x[j] = j;
+        pxi_y[j] = 0;
+        pxt_y[j] = 0;
     }
 
+    pimg = cpl_image_get_data_double(img_rect);
+    pbpm = NULL;
+    if (cpl_image_get_bpm_const(img_rect) != NULL)
+        pbpm = cpl_mask_get_data_const(cpl_image_get_bpm_const(img_rect));
     for (i = 0; i < height; i++){
         yt = i - height / 2;      
         yc = cpl_vector_get(ycen, i);
+        row = pimg + i * lenx;
+        brow = pbpm == NULL ? NULL : pbpm + i * lenx;
 
         for (j = 1; j < lenx - 1; j++){
-            a = cpl_polynomial_eval_1d(slitcurve_A, j, NULL);
-            b = cpl_polynomial_eval_1d(slitcurve_B, j, NULL);
-            c = cpl_polynomial_eval_1d(slitcurve_C, j, NULL);              
-
             // shift polynomial to local frame
-            a = a - j + yc * b + yc * yc * c;
-            b += 2 * yc * c;
+            a = pa[j] - j + yc * pb[j] + yc * yc * pc[j];
+            b = pb[j] + 2 * yc * pc[j];
         
-            value = j - a - yt * b - yt * yt * c;
-            value = max(min(value, lenx-1), 0);
-            cpl_vector_set(cpl_bivector_get_x(xt), j, value);
-            value = cpl_image_get(img_tmp, j + 1, i + 1, &badpix);
-            cpl_vector_set(cpl_bivector_get_y(xt), j, value);
+            value = j - a - yt * b - yt * yt * pc[j];
+            pxt_x[j] = max(min(value, lenx-1), 0);
+            // rejected pixels do not contribute
+            pxt_y[j] = (brow != NULL && brow[j]) ? 0.0 : row[j];
         }
 
         cpl_bivector_interpolate_linear(xi, xt);
-
-        for (j = 0; j < lenx; j++){
-            cpl_image_set(img_tmp, j+1, i+1, 
-                            cpl_vector_get(cpl_bivector_get_y(xi), j));
-        }
+        memcpy(row, pxi_y, lenx * sizeof(double));
     }
+    // every pixel of the shifted order is set
+    cpl_image_accept_all(img_rect);
 
     cpl_bivector_delete(xi);
     cpl_bivector_delete(xt);
-    cpl_polynomial_delete(slitcurve_A);
-    cpl_polynomial_delete(slitcurve_B);
-    cpl_polynomial_delete(slitcurve_C);
+    cpl_free(pa);
+    cpl_free(pb);
+    cpl_free(pc);
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_img_shifted.fits", imtyp,
+        cpl_image_save(img_rect, "debug_img_shifted.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
     }
 
-    img_1d = cpl_image_collapse_create(img_tmp, 0); // sum of rows
-    spc = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_image_delete(img_1d);
-
-    img_1d = cpl_image_collapse_create(img_tmp, 1); // sum of columns
-    slitfu = cpl_vector_new_from_image_column(img_1d, 1);
-    cpl_vector_divide_scalar(slitfu, cpl_vector_get_sum(slitfu));
-    cpl_image_delete(img_1d);
-    cpl_image_delete(img_tmp);
-
-    img_tmp = cpl_image_multiply_create(err_in, err_in);
-    img_1d = cpl_image_collapse_create(img_tmp, 0);
-    sigma = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_vector_sqrt(sigma);
-    cpl_image_delete(img_tmp);
-    cpl_image_delete(img_1d);
-
-    // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            cpl_image_set(img_tmp, i, ycen_int[i-1]-(height/2)+j,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
-        }
-    }
-    cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
-                NULL, CPL_IO_CREATE);
+    /* Sum of rows and of columns */
+    if (cr2res_extract_rect_collapse(img_rect, err_rect, 0, slit_func,
+                spec) != 0) {
+        cpl_msg_error(__func__, "Cannot collapse the order");
+        cpl_image_delete(img_rect);
+        cpl_image_delete(err_rect);
+        cpl_vector_delete(ycen);
+        return -1;
     }
+    cpl_image_delete(img_rect);
+    cpl_image_delete(err_rect);
 
-
-    *slit_func = slitfu;
-    *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
-
+    // reconstruct the "model" from the two vectors, rectified
+    if (model != NULL) cr2res_extract_rect_model(*spec, *slit_func, ycen,
+            model, model_ymin) ;
+    cpl_vector_delete(ycen);
     return 0;
 }
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Create the extract 1D table to be saved
-  @param    spectrum    The extracted spectra of the different orders
-  @param    trace_table The trace table
-  @return   the extract_1D table or NULL
+  @brief    Optimal extraction with a fixed slit function
+  @param    img_hdrl    full detector image
+  @param    trace_tab   The traces table
+  @param    slit_func_vec_in    The slit function [oversample*(height+1)+1]
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    oversample  oversampling factor of slit_func_vec_in
+  @param    kappa       clipping threshold in sigmas, <= 0 for no clipping
+  @param    slit_func   the returned slit function (the normalised input)
+  @param    spec        the returned spectrum
+  @param    model       the returned model
+  @return   0 if ok, -1 otherwise
+
+  With a known slit function, the optimal spectrum is a weighted sum of
+  each column (Horne, 1986, PASP 98, 609):
+    spec[x] = sum(P*D/V) / sum(P*P/V),  err[x] = 1/sqrt(sum(P*P/V))
+  where P is the slit function rebinned to the detector rows of the column,
+  D the data and V its variance. Unlike the slit decomposition, there is
+  no iteration and the slit function is not refined.
+  If kappa > 0, the pixels further than kappa sigmas from the model are
+  then rejected, the worst one first, up to
+  CR2RES_EXTRACT_HORNE_MAXCLIP times per column.
+  The pixels without a positive error are not used.
  */
 /*----------------------------------------------------------------------------*/
-cpl_table * cr2res_extract_EXTRACT1D_create(
-        cpl_bivector    **  spectrum,
-        const cpl_table *   trace_table)
+int cr2res_extract_horne(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample,
+        double                  kappa,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        hdrl_image          **  model)
 {
-    cpl_table       *   out ;
-    char            *   col_name ;
-    const double    *   pspec ;
-    const double    *   perr ;
-    cpl_vector      *   wave_vec ;
-    const double    *   pwl ;
-    int                 nrows, all_null, i, order, trace_id, nb_traces ;
-
-    /* Check entries */
-    if (spectrum == NULL || trace_table == NULL) return NULL ;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
 
-    /* Initialise */
-    nb_traces = cpl_table_get_nrow(trace_table) ;
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
 
-    /* Check if all vectorѕ are not null */
-    all_null = 1 ;
-    for (i=0 ; i<nb_traces ; i++)
-        if (spectrum[i] != NULL) {
-            nrows = cpl_bivector_get_size(spectrum[i]) ;
-            all_null = 0 ;
-        }
-    if (all_null == 1) return NULL ;
+    if (cr2res_extract_horne_rect(img_hdrl, trace_tab, slit_func_vec_in,
+                order, trace_id, height, oversample, kappa, slit_func, spec,
+                &model_rect, &model_ymin) != 0)
+        return -1 ;
 
-    /* Check the sizes */
-    for (i=0 ; i<nb_traces ; i++)
-        if (spectrum[i] != NULL && cpl_bivector_get_size(spectrum[i]) != nrows)
-            return NULL ;
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(img_hdrl),
+            hdrl_image_get_size_y(img_hdrl)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
 
-    /* Create the table */
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Optimal extraction with a fixed slit function (rectified model)
+  @param    img_hdrl    full detector image
+  @param    trace_tab   The traces table
+  @param    slit_func_vec_in    The slit function [oversample*(height+1)+1]
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    oversample  oversampling factor of slit_func_vec_in
+  @param    kappa       clipping threshold in sigmas, <= 0 for no clipping
+  @param    slit_func   the returned slit function (the normalised input)
+  @param    spec        the returned spectrum
+  @param    model       the returned model, rectified (lenx x height)
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_horne(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_horne_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample,
+        double                  kappa,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    const cpl_image *   img_in;
+    const cpl_image *   err_in;
+    cpl_image       *   img_rect;
+    cpl_image       *   err_rect;
+    cpl_image       *   model_rect;
+    cpl_vector      *   ycen ;
+    cpl_vector      *   slitfu;
+    cpl_vector      *   spc;
+    cpl_vector      *   unc;
+    double          *   ycen_rest;
+    double          *   sL;
+    double          *   pmodel;
+    double          *   pspc;
+    double          *   punc;
+    double          *   prof;
+    double          *   data;
+    double          *   var;
+    int             *   mask;
+    int             *   ymin;
+    cpl_size            lenx, leny;
+    double              step, d1, d2, norm, sum_pd, sum_pp, res, res_max;
+    int                 x, y, iy, iy1, iy2, ny_os, badpix, iclip, y_max;
+
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+
+    /* Initialise */
+    img_in = hdrl_image_get_image_const(img_hdrl);
+    err_in = hdrl_image_get_error_const(img_hdrl);
+    lenx = cpl_image_get_size_x(img_in);
+    leny = cpl_image_get_size_y(img_in);
+    if (oversample <= 0) oversample = 1;
+
+    /* Compute height if not given */
+    if (height <= 0) {
+        height = cr2res_trace_get_height(trace_tab, order, trace_id);
+        if (height <= 0) {
+            cpl_msg_error(__func__, "Cannot compute height");
+            return -1;
+        }
+    }
+    if (height > leny) {
+        height = leny;
+        cpl_msg_warning(__func__,
+                "Given height larger than image, clipping height");
+    }
+
+    /* The slit function is required */
+    ny_os = oversample*(height+1) +1;
+    if (slit_func_vec_in == NULL ||
+            cpl_vector_get_size(slit_func_vec_in) != ny_os) {
+        cpl_msg_error(__func__, "Need an input slit function of %d points",
+                ny_os);
+        return -1;
+    }
+
+    /* Get ycen */
+    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
+                    trace_id, lenx)) == NULL) {
+        cpl_msg_error(__func__, "Cannot get ycen");
+        return -1 ;
+    }
+
+    // Get cut-out rectified order
+    img_rect = cr2res_image_cut_rectify(img_in, ycen, height);
+    if (img_rect == NULL){
+        cpl_msg_error(__func__, "Cannot rectify order");
+        cpl_vector_delete(ycen);
+        return -1;
+    }
+    err_rect = cr2res_image_cut_rectify(err_in, ycen, height);
+    ycen_rest = cr2res_vector_get_rest(ycen);
+    ymin = cr2res_rect_get_ymin(ycen, lenx, leny, height);
+    cpl_vector_delete(ycen);
+
+    /* Normalize the slit function, as in the slit decomposition */
+    slitfu = cpl_vector_duplicate(slit_func_vec_in);
+    sL = cpl_vector_get_data(slitfu);
+    norm = 0.e0;
+    for (iy=0; iy<ny_os; iy++) norm += sL[iy];
+    norm /= oversample;
+    for (iy=0; iy<ny_os; iy++) sL[iy] /= norm;
+
+    spc = cpl_vector_new(lenx);
+    unc = cpl_vector_new(lenx);
+    pspc = cpl_vector_get_data(spc);
+    punc = cpl_vector_get_data(unc);
+    model_rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
+    pmodel = cpl_image_get_data_double(model_rect);
+    prof = cpl_malloc(height * sizeof(double));
+    data = cpl_malloc(height * sizeof(double));
+    var = cpl_malloc(height * sizeof(double));
+    mask = cpl_malloc(height * sizeof(int));
+    step = 1.e0/oversample;
+
+    for (x=0; x<lenx; x++) {
+        /* Slit function rebinned to the rows of this column, with the */
+        /* same subpixel weights as the omega tensor of the slit decomp. */
+        iy2 = oversample - floor(ycen_rest[x] / step) - 1;
+        iy1 = iy2 - oversample;
+        d1 = fmod(ycen_rest[x], step);
+        if (d1 == 0) d1 = step;
+        d2 = step - d1;
+        for (y=0; y<height; y++) {
+            iy1 += oversample;
+            iy2 += oversample;
+            prof[y] = 0.e0;
+            for (iy=max(iy1, 0); iy<=min(iy2, ny_os-1); iy++) {
+                if (iy == iy1)      prof[y] += d1 * sL[iy];
+                else if (iy < iy2)  prof[y] += step * sL[iy];
+                else                prof[y] += d2 * sL[iy];
+            }
+
+            data[y] = cpl_image_get(img_rect, x+1, y+1, &badpix);
+            mask[y] = !badpix && !isnan(data[y]);
+            var[y] = cpl_image_get(err_rect, x+1, y+1, &badpix);
+            if (badpix || isnan(var[y]) || var[y] <= 0) mask[y] = 0;
+            var[y] *= var[y];
+        }
+
+        /* Weighted sum, then reject the worst outlier and redo */
+        for (iclip=0; ; iclip++) {
+            sum_pd = sum_pp = 0.e0;
+            for (y=0; y<height; y++) {
+                if (!mask[y]) continue;
+                sum_pd += prof[y] * data[y] / var[y];
+                sum_pp += prof[y] * prof[y] / var[y];
+            }
+            if (sum_pp > 0) {
+                pspc[x] = sum_pd / sum_pp;
+                punc[x] = 1.e0 / sqrt(sum_pp);
+            } else {
+                pspc[x] = punc[x] = 0.e0;
+                break;
+            }
+            if (kappa <= 0 || iclip >= CR2RES_EXTRACT_HORNE_MAXCLIP) break;
+
+            y_max = -1;
+            res_max = kappa * kappa;
+            for (y=0; y<height; y++) {
+                if (!mask[y]) continue;
+                res = data[y] - pspc[x] * prof[y];
+                res = res * res / var[y];
+                if (res > res_max) {
+                    res_max = res;
+                    y_max = y;
+                }
+            }
+            if (y_max < 0) break;
+            mask[y_max] = 0;
+        }
+
+        for (y=0; y<height; y++)
+            pmodel[y*lenx+x] = pspc[x] * prof[y];
+    }
+
+    cpl_free(prof);
+    cpl_free(data);
+    cpl_free(var);
+    cpl_free(mask);
+    cpl_free(ycen_rest);
+    cpl_image_delete(img_rect);
+    cpl_image_delete(err_rect);
+
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        cpl_image_save(model_rect, "debug_model_horne.fits", CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+    }
+
+    *slit_func = slitfu;
+    *spec = cpl_bivector_wrap_vectors(spc, unc);
+    *model = model_rect;
+    *model_ymin = ymin;
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the extract 1D table to be saved
+  @param    spectrum    The extracted spectra of the different orders
+  @param    trace_table The trace table
+  @return   the extract_1D table or NULL
+ */
+/*----------------------------------------------------------------------------*/
+cpl_table * cr2res_extract_EXTRACT1D_create(
+        cpl_bivector    **  spectrum,
+        const cpl_table *   trace_table)
+{
+    cpl_table       *   out ;
+    char            *   col_name ;
+    const double    *   pspec ;
+    const double    *   perr ;
+    cpl_vector      *   wave_vec ;
+    const double    *   pwl ;
+    int                 nrows, all_null, i, order, trace_id, nb_traces ;
+
+    /* Check entries */
+    if (spectrum == NULL || trace_table == NULL) return NULL ;
+
+    /* Initialise */
+    nb_traces = cpl_table_get_nrow(trace_table) ;
+
+    /* Check if all vectorѕ are not null */
+    all_null = 1 ;
+    for (i=0 ; i<nb_traces ; i++)
+        if (spectrum[i] != NULL) {
+            nrows = cpl_bivector_get_size(spectrum[i]) ;
+            all_null = 0 ;
+        }
+    if (all_null == 1) return NULL ;
+
+    /* Check the sizes */
+    for (i=0 ; i<nb_traces ; i++)
+        if (spectrum[i] != NULL && cpl_bivector_get_size(spectrum[i]) != nrows)
+            return NULL ;
+
+    /* Create the table */
     out = cpl_table_new(nrows);
     for (i=0 ; i<nb_traces ; i++) {
         order = cpl_table_get(trace_table, CR2RES_COL_ORDER, i, NULL) ;
@@ -1159,33 +1907,95 @@ int cr2res_extract_slitdec_vert(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    cpl_polynomial  **  traces ;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
+
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+
+    if (cr2res_extract_slitdec_vert_rect(img_hdrl, trace_tab, slit_func_vec_in,
+                order, trace_id, height, swath, oversample, smooth_slit,
+                0, 0, NULL, NULL, slit_func, spec, &model_rect,
+                &model_ymin) != 0)
+        return -1 ;
+
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(img_hdrl),
+            hdrl_image_get_size_y(img_hdrl)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Extract optimally (slit-decomposition) with vertical slit
+            (rectified model)
+  @param    img_hdrl    full detector image
+  @param    trace_tab   The traces table
+  @param    slit_func_vec_in    The input slit_func vector or NULL
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    swath       width per swath
+  @param    oversample  factor for oversampling
+  @param    smooth_slit
+  @param    warm_start  start each swath from the spectrum of the previous one
+  @param    single_prec store the omega tensor in single precision
+  @param    geom        the trace geometry, or NULL to compute it here
+  @param    ws          work buffers of the calling thread or NULL
+  @param    slit_func   the returned slit function
+  @param    spec        the returned spectrum
+  @param    model       the returned model, rectified (lenx x height)
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_slitdec_vert(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_vert_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        const slitdec_geom  *   geom,
+        slitdec_ws          *   ws,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    slitdec_geom    *   geom_loc ;
     int             *   ycen_int;
-    double          *   ycen_rest;
-    double          *   ycen_sw;
-    double          *   img_sw_data;
-    double          *   err_sw_data;
-    double          *   spec_sw_data;
-    double          *   slitfu_sw_data;
+    const double    *   ycen_rest;
     double          *   model_sw;
-    int             *   mask_sw;
-    double          *   unc_sw_data;
+    double          **  model_sws;
+    int             *   niters;
     const double    *   slit_func_in;
     const cpl_image *   img_in;
     const cpl_image *   err_in;
-    cpl_image       *   err_sw;
-    cpl_image       *   img_sw;
     cpl_image       *   img_rect;
     cpl_image       *   err_rect;
     cpl_image       *   model_rect;
-    cpl_vector      *   ycen ;
+    const cpl_vector *  ycen ;
     cpl_image       *   img_tmp;
-    cpl_image       *   img_out;
     cpl_vector      *   spec_sw;
+    cpl_vector      **  spec_sws;
     cpl_vector      *   slitfu_sw;
+    cpl_vector      **  slitfu_sws;
     cpl_vector      *   spc;
     cpl_vector      *   slitfu;
     cpl_vector      *   unc_sw;
+    cpl_vector      **  unc_sws;
     cpl_vector      *   weights_sw;
     cpl_vector      *   tmp_vec;
     cpl_vector      *   bins_begin;
@@ -1193,10 +2003,9 @@ int cr2res_extract_slitdec_vert(
     cpl_vector      *   unc_decomposition;
     cpl_size            lenx, leny, size;
     cpl_type            imtyp;
-    double              pixval, errval, img_median, unc, model_unc, img_unc, 
-                        norm;
+    double              img_median, unc, model_unc, img_unc, norm;
     int                 i, j, k, nswaths, row, col, x, y, ny_os,
-                        sw_start, sw_end, badpix;
+                        sw_start, sw_end;
 
     /* Check Entries */
     if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
@@ -1208,42 +2017,27 @@ int cr2res_extract_slitdec_vert(
     lenx = cpl_image_get_size_x(img_in);
     leny = cpl_image_get_size_y(img_in);
 
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    if (height > leny) {
-        height = leny;
-        cpl_msg_warning(__func__,
-                "Given height larger than image, clipping height");
-    }
-
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
-        return -1 ;
+    /* Get the trace geometry, unless it is shared by the caller */
+    geom_loc = NULL ;
+    if (geom == NULL) {
+        if ((geom_loc = cr2res_extract_slitdec_geom_new(trace_tab, order,
+                        trace_id, height, swath, lenx, leny, 0)) == NULL)
+            return -1 ;
+        geom = geom_loc ;
     }
+    height = geom->height ;
+    swath = geom->swath ;
+    nswaths = geom->nswaths ;
+    ycen = geom->ycen ;
+    ycen_rest = geom->ycen_rest ;
+    /* The bins are modified when merging the swaths */
+    bins_begin = cpl_vector_duplicate(geom->bins_begin) ;
+    bins_end = cpl_vector_duplicate(geom->bins_end) ;
 
     if (oversample <= 0) oversample = 1;
 
     /* Number of rows after oversampling */
-    bins_begin = cpl_vector_new(1);
-    bins_end = cpl_vector_new(1);
     ny_os = oversample*(height+1) +1;
-    if ((swath = cr2res_extract_slitdec_adjust_swath(swath, lenx, 0, bins_begin,
-                    bins_end)) == -1){
-        cpl_msg_error(__func__, "Cannot calculate swath size");
-        cpl_vector_delete(ycen);
-        cpl_vector_delete(bins_begin);
-        cpl_vector_delete(bins_end);
-        return -1;
-    }
-    nswaths = cpl_vector_get_size(bins_begin);
 
     /* Use existing slitfunction if given */
     slit_func_in = NULL;
@@ -1262,9 +2056,9 @@ int cr2res_extract_slitdec_vert(
     img_rect = cr2res_image_cut_rectify(img_in, ycen, height);
     if (img_rect == NULL){
         cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
         cpl_vector_delete(bins_begin);
         cpl_vector_delete(bins_end);
+        cr2res_extract_slitdec_geom_delete(geom_loc);
         return -1;
     }
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -1272,20 +2066,17 @@ int cr2res_extract_slitdec_vert(
                 NULL, CPL_IO_CREATE);
     }
     err_rect = cr2res_image_cut_rectify(err_in, ycen, height);
-    ycen_rest = cr2res_vector_get_rest(ycen);
 
     // Work vectors
     slitfu_sw = cpl_vector_new(ny_os);
     for (j=0; j < ny_os; j++) cpl_vector_set(slitfu_sw, j, 0);
-    slitfu_sw_data = cpl_vector_get_data(slitfu_sw);
-
-    /* Allocate */
-    mask_sw = cpl_malloc(height*swath*sizeof(int));
-    model_sw = cpl_malloc(height*swath*sizeof(double));
-    ycen_sw = cpl_malloc(swath*sizeof(double));
-    img_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    err_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    unc_sw = cpl_vector_new(swath);
+
+    /* Allocate the per swath results */
+    spec_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    unc_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    slitfu_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    model_sws = cpl_malloc(nswaths*sizeof(double *));
+    niters = cpl_calloc(nswaths, sizeof(int));
     weights_sw = cpl_vector_new(swath);
 
     /* Pre-calculate the weights for overlapping swaths*/
@@ -1304,49 +2095,103 @@ int cr2res_extract_slitdec_vert(
         cpl_vector_set(spc, j, 0.);
         cpl_vector_set(unc_decomposition, j, 0.);
     }
-    img_out = cpl_image_new(lenx, leny, CPL_TYPE_DOUBLE);
     model_rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
 
-
-    for (i=0;i<nswaths;i++){
-        sw_start = cpl_vector_get(bins_begin, i);
-        sw_end = cpl_vector_get(bins_end, i);
-
-
-        // Copy swath image into seperate image
-        for(col=1; col<=swath; col++){      // col is x-index in swath
-            x = sw_start + col;          // coords in large image
-            for(y=1;y<=height;y++){
-                pixval = cpl_image_get(img_rect, x, y, &badpix);
-                errval = cpl_image_get(err_rect, x, y, &badpix);
-                cpl_image_set(img_sw, col, y, pixval);
-                cpl_image_set(err_sw, col, y, errval);
-                if(cpl_error_get_code() != CPL_ERROR_NONE)
-                    cpl_msg_error(__func__, "%d %d %s",
-                            x, y, cpl_error_get_where());
-                // raw index for mask, start with 0!
-                j = (y-1)*swath + (col-1) ;
-                if (badpix == 0) mask_sw[j] = 1;
-                else mask_sw[j] = 0;
+    /* The swaths are decomposed independently of each other, each thread */
+    /* uses its own work buffers. The results are merged in swath order */
+    /* below, so that they do not depend on the number of threads. */
+#pragma omp parallel if (!warm_start)
+    {
+        slitdec_ws  *   ws_th;
+        int         *   mask_sw;
+        double      *   ycen_sw;
+        cpl_image   *   img_sw;
+        cpl_image   *   err_sw;
+        cpl_image   *   img_tmp;
+        double          pixval, errval;
+        int             isw, j, col, x, y, sw_start, sw_end, badpix;
+
+        /* The first thread works in the caller workspace, if any */
+        ws_th = ws ;
+#ifdef _OPENMP
+        if (omp_get_thread_num() != 0) ws_th = NULL ;
+#endif
+        if (ws_th == NULL) ws_th = cr2res_extract_slitdec_ws_new() ;
+        cr2res_extract_slitdec_ws_set(ws_th, 0, swath, height, oversample, 0,
+                single_prec);
+        mask_sw = ws_th->mask_sw;
+        ycen_sw = ws_th->ycen_sw;
+        img_sw = ws_th->img_sw;
+        err_sw = ws_th->err_sw;
+
+#pragma omp for schedule(dynamic)
+        for (isw=0;isw<nswaths;isw++){
+            sw_start = cpl_vector_get(bins_begin, isw);
+            sw_end = cpl_vector_get(bins_end, isw);
+
+            // Copy swath image into seperate image
+            for(col=1; col<=swath; col++){      // col is x-index in swath
+                x = sw_start + col;          // coords in large image
+                for(y=1;y<=height;y++){
+                    pixval = cpl_image_get(img_rect, x, y, &badpix);
+                    errval = cpl_image_get(err_rect, x, y, &badpix);
+                    // NaNs would propagate through mask*im, even if masked
+                    if (isnan(pixval) || isnan(errval)){
+                        pixval = 0;
+                        errval = 1;
+                        badpix = 1;
+                    }
+                    cpl_image_set(img_sw, col, y, pixval);
+                    cpl_image_set(err_sw, col, y, errval);
+                    if(cpl_error_get_code() != CPL_ERROR_NONE)
+                        cpl_msg_error(__func__, "%d %d %s",
+                                x, y, cpl_error_get_where());
+                    // raw index for mask, start with 0!
+                    j = (y-1)*swath + (col-1) ;
+                    if (badpix == 0) mask_sw[j] = 1;
+                    else mask_sw[j] = 0;
+                }
             }
-        }
 
-        img_sw_data = cpl_image_get_data_double(img_sw);
-        err_sw_data = cpl_image_get_data_double(err_sw);
-        img_tmp = cpl_image_collapse_median_create(img_sw, 0, 0, 0);
-        spec_sw = cpl_vector_new_from_image_row(img_tmp,1);
-        unc_sw_data = cpl_vector_get_data(unc_sw);
-
-        cpl_image_delete(img_tmp);
-        spec_sw_data = cpl_vector_get_data(spec_sw);
-        for (j=sw_start;j<sw_end;j++) ycen_sw[j-sw_start] = ycen_rest[j];
+            img_tmp = cpl_image_collapse_median_create(img_sw, 0, 0, 0);
+            spec_sws[isw] = cpl_vector_new_from_image_row(img_tmp,1);
+            cpl_image_delete(img_tmp);
+            if (warm_start && isw > 0)
+                cr2res_extract_slitdec_warm_start(spec_sws[isw], sw_start,
+                        spec_sws[isw-1], cpl_vector_get(bins_begin, isw-1));
+            unc_sws[isw] = cpl_vector_new(swath);
+            slitfu_sws[isw] = cpl_vector_duplicate(slitfu_sw);
+            model_sws[isw] = cpl_malloc(height*swath*sizeof(double));
+            for (j=sw_start;j<sw_end;j++) ycen_sw[j-sw_start] = ycen_rest[j];
+
+            /* Finally ready to call the slit-decomp */
+            cr2res_extract_slit_func_vert(swath, height, oversample,
+                    cpl_image_get_data_double(img_sw),
+                    cpl_image_get_data_double(err_sw), mask_sw, ycen_sw,
+                    cpl_vector_get_data(slitfu_sws[isw]),
+                    cpl_vector_get_data(spec_sws[isw]), model_sws[isw],
+                    cpl_vector_get_data(unc_sws[isw]), 0.0, smooth_slit,
+                    1.0e-5, 20, slit_func_in, &(niters[isw]), ws_th);
+
+            if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+#pragma omp critical (cr2res_extract_debug)
+                cpl_image_save(img_sw, "debug_img_sw.fits", CPL_TYPE_DOUBLE,
+                        NULL, CPL_IO_CREATE);
+            }
+        } // End loop over swaths
 
+        if (ws_th != ws) cr2res_extract_slitdec_ws_delete(ws_th) ;
+    }
+    cr2res_extract_slitdec_report_iter(niters, nswaths, warm_start);
+    cpl_free(niters);
 
-        /* Finally ready to call the slit-decomp */
-        cr2res_extract_slit_func_vert(swath, height, oversample, img_sw_data, 
-                err_sw_data, mask_sw, ycen_sw, slitfu_sw_data, spec_sw_data,
-                model_sw, unc_sw_data, 0.0, smooth_slit, 1.0e-5, 20,
-                slit_func_in);
+    /* Merge the swaths */
+    for (i=0;i<nswaths;i++){
+        sw_start = cpl_vector_get(bins_begin, i);
+        sw_end = cpl_vector_get(bins_end, i);
+        spec_sw = spec_sws[i];
+        unc_sw = unc_sws[i];
+        model_sw = model_sws[i];
 
         for(col=1; col<=swath; col++){   // col is x-index in cut-out
             x = sw_start + col;          // coords in large image
@@ -1361,24 +2206,22 @@ int cr2res_extract_slitdec_vert(
         }
 
         // add up slit-functions, divide by nswaths below to get average
-        if (i==0) cpl_vector_copy(slitfu, slitfu_sw);
-        else cpl_vector_add(slitfu, slitfu_sw);
+        if (i==0) cpl_vector_copy(slitfu, slitfu_sws[i]);
+        else cpl_vector_add(slitfu, slitfu_sws[i]);
 
         if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
             cpl_vector_save(spec_sw, "debug_spc.fits", CPL_TYPE_DOUBLE, NULL,
                     CPL_IO_CREATE);
-            tmp_vec = cpl_vector_wrap(swath, ycen_sw);
+            tmp_vec = cpl_vector_wrap(swath, (double *)ycen_rest + sw_start);
             cpl_vector_save(tmp_vec, "debug_ycen.fits", CPL_TYPE_DOUBLE, NULL,
                     CPL_IO_CREATE);
             cpl_vector_unwrap(tmp_vec);
-            cpl_vector_save(slitfu_sw, "debug_slitfu.fits", CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
+            cpl_vector_save(slitfu_sws[i], "debug_slitfu.fits",
+                    CPL_TYPE_DOUBLE, NULL, CPL_IO_CREATE);
             img_tmp = cpl_image_wrap_double(swath, height, model_sw);
             cpl_image_save(img_tmp, "debug_model_sw.fits", CPL_TYPE_DOUBLE,
                     NULL, CPL_IO_CREATE);
             cpl_image_unwrap(img_tmp);
-            cpl_image_save(img_sw, "debug_img_sw.fits", CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
         }
 
 
@@ -1436,37 +2279,36 @@ int cr2res_extract_slitdec_vert(
                     cpl_vector_get(unc_decomposition, j));
         }
         cpl_vector_delete(spec_sw);
+        cpl_vector_delete(unc_sw);
+        cpl_vector_delete(slitfu_sws[i]);
+        cpl_free(model_sw);
 
     } // End loop over swaths
     cpl_vector_delete(slitfu_sw);
     cpl_vector_delete(weights_sw);
     cpl_vector_delete(bins_begin);
     cpl_vector_delete(bins_end);
-    cpl_vector_delete(unc_sw);
+    cpl_free(spec_sws);
+    cpl_free(unc_sws);
+    cpl_free(slitfu_sws);
+    cpl_free(model_sws);
 
-    cpl_free(mask_sw);
-    cpl_free(model_sw);
-    cpl_free(ycen_sw);
-    cpl_image_delete(img_sw);
-    cpl_image_delete(err_sw);
-
-    // insert model_rect into large frame
-    cr2res_image_insert_rect(model_rect, ycen, img_out);
+    // detector row of the first model_rect row in each column
+    ycen_int = cr2res_vector_get_int(ycen);
+    for (i=0; i<lenx; i++) ycen_int[i] -= height/2;
 
     // divide by nswaths to make the slitfu into the average over all swaths.
     cpl_vector_divide_scalar(slitfu, nswaths);
 
     // TODO: Deallocate return arrays in case of error, return -1
     cpl_image_delete(img_rect);
-    cpl_image_delete(model_rect);
     cpl_image_delete(err_rect);
-    cpl_vector_delete(ycen);
-    cpl_free(ycen_rest);
+    cr2res_extract_slitdec_geom_delete(geom_loc);
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, unc_decomposition);
-    *model = hdrl_image_create(img_out, NULL);
-    cpl_image_delete(img_out);
+    *model = model_rect;
+    *model_ymin = ycen_int;
 
     return 0;
 }
@@ -1521,51 +2363,110 @@ int cr2res_extract_slitdec_curved(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    double          *   ycen_rest;
-    double          *   ycen_sw;
-    int             *   ycen_offset_sw;
-    double          *   img_sw_data;
-    double          *   err_sw_data;
-    double          *   spec_sw_data;
-    double          *   slitfu_sw_data;
-    double          *   model_sw;
-    double          *   unc_sw_data;
-    const double    *   slit_func_in;
-    int             *   mask_sw;
-    const cpl_image *   img_in;
-    const cpl_image *   err_in;
-    cpl_image       *   img_sw;
-    cpl_image       *   err_sw;
-    cpl_image       *   img_rect;
-    cpl_image       *   err_rect;
-    cpl_image       *   model_rect;
-    cpl_vector      *   ycen ;
-    cpl_image       *   img_tmp;
-    cpl_image       *   img_tmp2;
-    cpl_mask        *   kernel;
-    cpl_image       *   img_out;
-    cpl_vector      *   spec_sw;
-    cpl_vector      *   slitfu_sw;
-    cpl_vector      *   unc_sw;
-    cpl_vector      *   spc;
+    cpl_image       *   model_rect ;
+    int             *   model_ymin ;
+
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+
+    if (cr2res_extract_slitdec_curved_rect(img_hdrl, trace_tab,
+                slit_func_vec_in, order, trace_id, height, swath, oversample,
+                smooth_slit, 0, 0, NULL, NULL, NULL, slit_func, spec,
+                &model_rect, &model_ymin) != 0)
+        return -1 ;
+
+    /* Paste the model into the full frame */
+    *model = hdrl_image_new(hdrl_image_get_size_x(img_hdrl),
+            hdrl_image_get_size_y(img_hdrl)) ;
+    cr2res_extract_model_paste(model_rect, model_ymin, *model) ;
+    cpl_image_delete(model_rect) ;
+    cpl_free(model_ymin) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Extract optimally (slit-decomposition) with curved slit
+            (rectified model)
+  @param    img_hdrl    full detector image
+  @param    trace_tab   The traces table
+  @param    slit_func_vec_in    The input slit_func vector or NULL
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    swath       width per swath
+  @param    oversample  factor for oversampling
+  @param    smooth_slit
+  @param    warm_start  start each swath from the spectrum of the previous one
+  @param    single_prec store the xi/zeta weights in single precision
+  @param    geom        the trace geometry, or NULL to compute it here
+  @param    ws          work buffers of the calling thread or NULL
+  @param    geom_cache  slit decomposition geometry cache or NULL
+  @param    slit_func   the returned slit function
+  @param    spec        the returned spectrum
+  @param    model       the returned model, rectified (lenx x height)
+  @param    model_ymin  the detector row of the first model row, per column
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_slitdec_curved(). model and model_ymin are to be
+  deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_curved_rect(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        const slitdec_geom  *   geom,
+        slitdec_ws          *   ws,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    slitdec_geom    *   geom_loc ;
+    int             *   ycen_int;
+    const double    *   ycen_rest;
+    double          *   model_sw;
+    double          **  model_sws;
+    int             *   niters;
+    const double    *   slitcurve_a;
+    const double    *   slitcurve_b;
+    const double    *   slitcurve_c;
+    const double    *   slit_func_in;
+    const cpl_image *   img_in;
+    const cpl_image *   err_in;
+    cpl_image       *   img_rect;
+    cpl_image       *   err_rect;
+    cpl_image       *   model_rect;
+    const cpl_vector *  ycen ;
+    cpl_image       *   img_tmp;
+    cpl_vector      *   spec_sw;
+    cpl_vector      **  spec_sws;
+    cpl_vector      *   slitfu_sw;
+    cpl_vector      **  slitfu_sws;
+    cpl_vector      *   unc_sw;
+    cpl_vector      **  unc_sws;
+    cpl_vector      *   spc;
     cpl_vector      *   slitfu;
     cpl_vector      *   weights_sw;
-    cpl_vector      *   tmp_vec;
     cpl_vector      *   bins_begin;
     cpl_vector      *   bins_end;
     cpl_vector      *   unc_decomposition;
-    cpl_size            lenx, leny, pow, size;
+    cpl_size            lenx, leny, size;
     cpl_type            imtyp;
-    cpl_polynomial      *slitcurve_A, *slitcurve_B, *slitcurve_C;
-    cpl_polynomial  **  slitcurves_sw;
-    hdrl_image      *   model_out;
 
-    char            *   path;
-    double              pixval, errval, img_median, norm, model_unc, img_unc,
-                        unc, delta_tmp, a, b, c, yc;
-    int                 i, j, k, nswaths, halfswath, row, col, x, y, ny_os,
-                        sw_start, sw_end, badpix, y_lower_limit, y_upper_limit,
-                        delta_x;
+    double              img_median, norm, model_unc, img_unc, unc;
+    int                 i, j, k, nswaths, halfswath, row, x, y, ny_os,
+                        sw_start, sw_end, badpix, y_upper_limit, delta_x;
 
     /* Check Entries */
     if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
@@ -1578,33 +2479,44 @@ int cr2res_extract_slitdec_curved(
     lenx = cpl_image_get_size_x(img_in);
     leny = cpl_image_get_size_y(img_in);
 
-   
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
+
+    /* Get the trace geometry, unless it is shared by the caller */
+    geom_loc = NULL ;
+    if (geom == NULL) {
+        if ((geom_loc = cr2res_extract_slitdec_geom_new(trace_tab, order,
+                        trace_id, height, swath, lenx, leny, 1)) == NULL)
+            return -1 ;
+        geom = geom_loc ;
     }
-    if (height > leny){
-        height = leny;
-        cpl_msg_warning(__func__,
-                "Given height larger than image, clipping height");
+    height = geom->height ;
+    swath = geom->swath ;
+    delta_x = geom->delta_x ;
+    nswaths = geom->nswaths ;
+    ycen = geom->ycen ;
+    ycen_rest = geom->ycen_rest ;
+    slitcurve_a = geom->slitcurve_a ;
+    slitcurve_b = geom->slitcurve_b ;
+    slitcurve_c = geom->slitcurve_c ;
+
+    /* The packed geometry tensors use 16 bits indices */
+    if (swath > USHRT_MAX || oversample*(height+1)+1 > USHRT_MAX) {
+        cpl_msg_error(__func__, "The swath is too large: %d x %d", swath,
+                height);
+        cr2res_extract_slitdec_geom_delete(geom_loc);
+        return -1;
     }
 
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
-        return -1 ;
-    }
+    /* The bins are modified when merging the swaths */
+    bins_begin = cpl_vector_duplicate(geom->bins_begin) ;
+    bins_end = cpl_vector_duplicate(geom->bins_end) ;
 
     // Get cut-out rectified order
     img_rect = cr2res_image_cut_rectify(img_in, ycen, height);
     if (img_rect == NULL){
         cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
+        cpl_vector_delete(bins_begin);
+        cpl_vector_delete(bins_end);
+        cr2res_extract_slitdec_geom_delete(geom_loc);
         return -1;
     }
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -1612,69 +2524,9 @@ int cr2res_extract_slitdec_curved(
                 NULL, CPL_IO_CREATE);
     }
     err_rect = cr2res_image_cut_rectify(err_in, ycen, height);
-    ycen_rest = cr2res_vector_get_rest(ycen);
-
-    /* Retrieve the polynomials that describe the slit tilt and curvature*/
-    slitcurve_A = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_A,
-                    order, trace_id);
-    slitcurve_B = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_B,
-                    order, trace_id);
-    slitcurve_C = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_C,
-                    order, trace_id);
-    if ((slitcurve_A == NULL) || (slitcurve_B == NULL) || (slitcurve_C == NULL))
-    {
-        cpl_msg_error(__func__, 
-                "No (or incomplete) slitcurve data found in trace table");
-        cpl_vector_delete(ycen);
-        cpl_free(ycen_rest) ;
-        cpl_image_delete(err_rect) ;
-        cpl_image_delete(img_rect) ;
-        cpl_polynomial_delete(slitcurve_A);
-        cpl_polynomial_delete(slitcurve_B);
-        cpl_polynomial_delete(slitcurve_C);
-        return -1;
-    }
-
-    /* Maximum horizontal shift in detector pixels due to slit image curv. */
-    delta_x=0;
-    for (i=1; i<=lenx; i+=swath/2){
-        /* Do a coarse sweep through the order and evaluate the slitcurve */
-        /* polynomials at  +- height/2, update the value. */
-        /* Note: The index i is subtracted from a because the polys have */
-        /* their origin at the edge of the full frame */
-        a = cpl_polynomial_eval_1d(slitcurve_A, i, NULL);
-        b = cpl_polynomial_eval_1d(slitcurve_B, i, NULL);
-        c = cpl_polynomial_eval_1d(slitcurve_C, i, NULL);
-        yc = cpl_vector_get(ycen, i-1);
-
-        // Shift polynomial to local frame
-        // We fix a to 0, see comment later on, when we create the
-        // polynomials for the extraction
-        a = 0; 
-        b += 2 * yc * c;
-
-        delta_tmp = max( fabs(a + (c*height/2. + b)*height/2.),
-                fabs(a + (c*height/-2. + b)*height/-2.));
-        if (delta_tmp > delta_x) delta_x = (int)ceil(delta_tmp);
-    }
-    delta_x += 1;
-    cpl_msg_debug(__func__, "Max delta_x from slit curv: %d pix.", delta_x);
-
-    if (delta_x >= swath / 4){
-        //TODO: Abort
-    }
 
     /* Number of rows after oversampling */
-    bins_begin = cpl_vector_new(1);
-    bins_end = cpl_vector_new(1);
     ny_os = oversample*(height+1) +1;
-    if ((swath = cr2res_extract_slitdec_adjust_swath(swath, lenx, delta_x,
-                    bins_begin, bins_end)) == -1){
-        cpl_msg_error(__func__, "Cannot calculate swath size");
-        cpl_vector_delete(ycen);
-        return -1;
-    }
-    nswaths = cpl_vector_get_size(bins_begin);
 
     /* Use existing slitfunction if given */
     slit_func_in = NULL;
@@ -1689,17 +2541,12 @@ int cr2res_extract_slitdec_curved(
         }
     }
 
-    /* Allocate */
-    mask_sw = cpl_malloc(height * swath*sizeof(int));
-    model_sw = cpl_malloc(height * swath*sizeof(double));
-    unc_sw = cpl_vector_new(swath);
-    img_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    err_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    ycen_sw = cpl_malloc(swath*sizeof(double));
-    ycen_offset_sw = cpl_malloc(swath * sizeof(int));
-
-    slitcurves_sw = cpl_malloc(swath * sizeof(cpl_polynomial*));
-    for (i=0; i<swath; i++) slitcurves_sw[i]= cpl_polynomial_new(1);
+    /* Allocate the per swath results */
+    spec_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    unc_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    slitfu_sws = cpl_malloc(nswaths*sizeof(cpl_vector *));
+    model_sws = cpl_malloc(nswaths*sizeof(double *));
+    niters = cpl_calloc(nswaths, sizeof(int));
 
     // Local versions of return data
     slitfu = cpl_vector_new(ny_os);
@@ -1709,14 +2556,11 @@ int cr2res_extract_slitdec_curved(
         cpl_vector_set(spc, j, 0.);
         cpl_vector_set(unc_decomposition, j, 0.);
     }
-    model_out = hdrl_image_new(lenx, leny);
-    img_out = hdrl_image_get_image(model_out);
     model_rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
 
     // Work vectors
     slitfu_sw = cpl_vector_new(ny_os);
     for (j=0; j < ny_os; j++) cpl_vector_set(slitfu_sw, j, 0);
-    slitfu_sw_data = cpl_vector_get_data(slitfu_sw);
     weights_sw = cpl_vector_new(swath);
     for (i = 0; i < swath; i++) cpl_vector_set(weights_sw, i, 0);
 
@@ -1731,148 +2575,239 @@ int cr2res_extract_slitdec_curved(
 
     // assert cpl_vector_get_sum(weights_sw) == swath / 2 - delta_x
 
-    for (i=0;i<nswaths;i++){
-        sw_start = cpl_vector_get(bins_begin, i);
-        sw_end = cpl_vector_get(bins_end, i);
+    /* The swaths are decomposed independently of each other, each thread */
+    /* uses its own work buffers. The results are merged in swath order */
+    /* below, so that they do not depend on the number of threads. */
+#pragma omp parallel if (!warm_start)
+    {
+        slitdec_ws      *   ws_th;
+        const xi_zeta_entry *   geom;
+        const slitdec_csr   *   csr;
+        int             *   mask_sw;
+        double          *   ycen_sw;
+        int             *   ycen_offset_sw;
+        cpl_polynomial  **  slitcurves_sw;
+        cpl_image       *   img_sw;
+        cpl_image       *   err_sw;
+        cpl_image       *   img_tmp;
+        cpl_image       *   img_tmp2;
+        cpl_mask        *   kernel;
+        cpl_vector      *   tmp_vec;
+        char            *   path;
+        cpl_size            pow;
+        double              pixval, errval;
+        int                 isw, j, col, x, y, sw_start, sw_end, badpix,
+                            y_lower_limit;
+
+        /* The first thread works in the caller workspace, if any */
+        ws_th = ws ;
+#ifdef _OPENMP
+        if (omp_get_thread_num() != 0) ws_th = NULL ;
+#endif
+        if (ws_th == NULL) ws_th = cr2res_extract_slitdec_ws_new() ;
+        cr2res_extract_slitdec_ws_set(ws_th, 1, swath, height, oversample,
+                delta_x, single_prec);
+        mask_sw = ws_th->mask_sw;
+        img_sw = ws_th->img_sw;
+        err_sw = ws_th->err_sw;
+        ycen_sw = ws_th->ycen_sw;
+        ycen_offset_sw = ws_th->ycen_offset_sw;
+        slitcurves_sw = ws_th->slitcurves_sw;
+
+#pragma omp for schedule(dynamic)
+        for (isw=0;isw<nswaths;isw++){
+            sw_start = cpl_vector_get(bins_begin, isw);
+            sw_end = cpl_vector_get(bins_end, isw);
+
+            /* Prepare swath cut-outs and auxiliary data */
+            for(col=1; col<=swath; col++){   // col is x-index in swath
+                x = sw_start + col;          // coords in large image
+
+                /* prepare signal, error and mask */
+                for(y=1;y<=height;y++){
+                    errval = cpl_image_get(err_rect, x, y, &badpix);
+                    pixval = cpl_image_get(img_rect, x, y, &badpix);
+                    if (isnan(pixval) || badpix){
+                        pixval = 0;
+                        errval = 1;
+                    }
+                    cpl_image_set(img_sw, col, y, pixval);
+                    cpl_image_set(err_sw, col, y, errval);
+                    // raw index for mask, start with 0!
+                    j = (y-1)*swath + (col-1) ;
+                    if (badpix == 0) mask_sw[j] = 1;
+                    else mask_sw[j] = 0;
+                }
 
-        /* Prepare swath cut-outs and auxiliary data */
-        for(col=1; col<=swath; col++){   // col is x-index in swath
-            x = sw_start + col;          // coords in large image
+                /* set slit curvature polynomials */
+                /* subtract col because we want origin relative to here */
+                pow = 2;
+                cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
+                    slitcurve_c[x-1]);
+                pow = 1;
+                cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
+                    slitcurve_b[x-1]);
+                pow = 0;
+                cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
+                    slitcurve_a[x-1] - x);
+
+                // Shift polynomial to local frame
+                // -------------------------------
+                // The slit curvature has been determined in the global
+                // reference frame, with the a coefficient set to 0 in the
+                // local frame. The following transformation will shift it
+                // into the local frame again and should result in a = 0.
+                //      a - x + yc * b + yc * yc * c
+                // However this only works, as long as ycen
+                // is the same ycen that was used for the slitcurvature. If
+                // e.g. we switch traces, then ycen will change and a will be
+                // unequal 0. In fact a will be the offset due to the
+                // curvature between the old ycen and the new. This will then
+                // cause an offset in the pixels used for the extraction, so
+                // that all traces will have the same spectrum, with no
+                // relative offsets.
+                // Which would be great, if we didn't have an offset in the
+                // wavelength calibration of the different traces.
+                // Therefore we force a to be 0 in the local frame regardless
+                // of ycen. For the extraction we only need the b and c
+                // coefficient anyways.
+                // Note that this means, we use the curvature a few pixels
+                // offset. Usually this is no problem, since it only varies
+                // slowly over the order.
+                cpl_polynomial_shift_1d(slitcurves_sw[col-1], 0,
+                                                cpl_vector_get(ycen, x-1));
+                cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow, 0);
+            }
 
-            /* prepare signal, error and mask */
-            for(y=1;y<=height;y++){
-                errval = cpl_image_get(err_rect, x, y, &badpix);
-                pixval = cpl_image_get(img_rect, x, y, &badpix);
-                if (isnan(pixval) || badpix){
-                    pixval = 0;
-                    errval = 1;
+            model_sws[isw] = cpl_malloc(height * swath*sizeof(double));
+            for (j=0; j< height * swath; j++) model_sws[isw][j] = 0;
+            unc_sws[isw] = cpl_vector_new(swath);
+            slitfu_sws[isw] = cpl_vector_duplicate(slitfu_sw);
+            // First guess for the spectrum
+            img_tmp = cpl_image_collapse_create(img_sw, 0);
+            img_tmp2 = cpl_image_new(swath, 1, CPL_TYPE_DOUBLE);
+            kernel = cpl_mask_new(5, 1);
+            cpl_mask_not(kernel);
+            cpl_image_filter_mask(img_tmp2, img_tmp, kernel,
+                CPL_FILTER_MEDIAN, CPL_BORDER_FILTER);
+            spec_sws[isw] = cpl_vector_new_from_image_row(img_tmp2, 1);
+            cpl_image_delete(img_tmp);
+            cpl_image_delete(img_tmp2);
+            cpl_mask_delete(kernel);
+            if (warm_start && isw > 0)
+                cr2res_extract_slitdec_warm_start(spec_sws[isw], sw_start,
+                        spec_sws[isw-1], cpl_vector_get(bins_begin, isw-1));
+
+            for (j=sw_start;j<sw_end;j++){
+                ycen_sw[j-sw_start] = ycen_rest[j];
+                ycen_offset_sw[j-sw_start] = (int) cpl_vector_get(ycen, j);
+            }
+            // y_lower_limit = (int) ycen_offset_sw[0];
+            // for (j=0; j < swath; j++) {
+            //     y_lower_limit = min(y_lower_limit, ycen_offset_sw[j]);
+            // }
+            y_lower_limit = height / 2;
+
+            if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+#pragma omp critical (cr2res_extract_debug)
+                {
+                img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
+                cpl_image_save(img_tmp, "debug_mask_before_sw.fits",
+                        CPL_TYPE_INT, NULL, CPL_IO_CREATE);
+                cpl_image_unwrap(img_tmp);
                 }
-                cpl_image_set(img_sw, col, y, pixval);
-                cpl_image_set(err_sw, col, y, errval);
-                // raw index for mask, start with 0!
-                j = (y-1)*swath + (col-1) ;
-                if (badpix == 0) mask_sw[j] = 1;
-                else mask_sw[j] = 0;
+            }
+            /* The geometry only needs to be computed once per swath */
+            geom = cr2res_extract_geom_cache_get(geom_cache, order,
+                    trace_id, isw, swath, height, oversample, ycen_sw,
+                    ycen_offset_sw, y_lower_limit, slitcurves_sw,
+                    single_prec);
+            if (geom == NULL) {
+                cr2res_extract_xi_zeta_tensors(swath, height, ny_os,
+                        ycen_sw, ycen_offset_sw, y_lower_limit, oversample,
+                        slitcurves_sw, ws_th->xi, ws_th->zeta,
+                        ws_th->m_zeta);
+                cr2res_extract_slitdec_csr_fill(ws_th->csr, swath, height,
+                        ny_os, ws_th->xi, ws_th->zeta, ws_th->m_zeta);
+                if (geom_cache != NULL)
+                    cr2res_extract_geom_cache_add(geom_cache, order,
+                            trace_id, isw, swath, height, oversample,
+                            ycen_sw, ycen_offset_sw, y_lower_limit,
+                            slitcurves_sw, ws_th->csr);
+                csr = ws_th->csr;
+            } else {
+                csr = geom->csr;
             }
 
-            /* set slit curvature polynomials */
-            /* subtract col because we want origin relative to here */
-            pow = 2;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_C, x, NULL));
-            pow = 1;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_B, x, NULL));
-            pow = 0;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_A, x, NULL) - x);
+            /* Finally ready to call the slit-decomp */
+            cr2res_extract_slit_func_curved(swath, height, oversample,
+                    cpl_image_get_data_double(img_sw),
+                    cpl_image_get_data_double(err_sw), mask_sw, ycen_sw,
+                    ycen_offset_sw, y_lower_limit, slitcurves_sw, delta_x,
+                    csr,
+                    cpl_vector_get_data(slitfu_sws[isw]),
+                    cpl_vector_get_data(spec_sws[isw]), model_sws[isw],
+                    cpl_vector_get_data(unc_sws[isw]), 0.,
+                    smooth_slit, 1e-7, 200, slit_func_in, &(niters[isw]),
+                    ws_th);
+
+            if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+#pragma omp critical (cr2res_extract_debug)
+                {
+                path = cpl_sprintf("debug_spc_%i.fits", isw);
+                cpl_vector_save(spec_sws[isw], path , CPL_TYPE_DOUBLE, NULL,
+                        CPL_IO_CREATE);
+                cpl_free(path);
+
+                path = cpl_sprintf("debug_mask_%i.fits", isw);
+                img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
+                cpl_image_save(img_tmp, path, CPL_TYPE_INT, NULL,
+                        CPL_IO_CREATE);
+                cpl_free(path);
+                cpl_image_unwrap(img_tmp);
+
+                tmp_vec = cpl_vector_wrap(swath, ycen_sw);
+                cpl_vector_save(tmp_vec, "debug_ycen.fits", CPL_TYPE_DOUBLE,
+                        NULL, CPL_IO_CREATE);
+                cpl_vector_unwrap(tmp_vec);
+                cpl_vector_save(weights_sw, "debug_weights.fits",
+                        CPL_TYPE_DOUBLE, NULL, CPL_IO_CREATE);
+                path = cpl_sprintf("debug_slitfu_%i.fits", isw);
+                cpl_vector_save(slitfu_sws[isw], path, CPL_TYPE_DOUBLE,
+                        NULL, CPL_IO_CREATE);
+                cpl_free(path);
+
+                path = cpl_sprintf("debug_model_%i.fits", isw);
+                img_tmp = cpl_image_wrap_double(swath, height, model_sws[isw]);
+                cpl_image_save(img_tmp, path, CPL_TYPE_DOUBLE,
+                        NULL, CPL_IO_CREATE);
+                cpl_image_unwrap(img_tmp);
+                cpl_free(path);
+
+                path = cpl_sprintf("debug_img_sw_%i.fits", isw);
+                cpl_image_save(img_sw, path, CPL_TYPE_DOUBLE, NULL,
+                        CPL_IO_CREATE);
+                cpl_free(path);
+                }
+            }
+        } // End loop over swaths
 
-            // Shift polynomial to local frame
-            // -------------------------------
-            // The slit curvature has been determined in the global reference
-            // frame, with the a coefficient set to 0 in the local frame.
-            // The following transformation will shift it into the local frame
-            // again and should result in a = 0.
-            //      a - x + yc * b + yc * yc * c
-            // However this only works, as long as ycen
-            // is the same ycen that was used for the slitcurvature. If e.g. we
-            // switch traces, then ycen will change and a will be unequal 0.
-            // in fact a will be the offset due to the curvature between the
-            // old ycen and the new. This will then cause an offset in the
-            // pixels used for the extraction, so that all traces will have the
-            // same spectrum, with no relative offsets.
-            // Which would be great, if we didn't have an offset in the
-            // wavelength calibration of the different traces.
-            // Therefore we force a to be 0 in the local frame regardless of
-            // ycen. For the extraction we only need the b and c coefficient
-            // anyways.
-            // Note that this means, we use the curvature a few pixels offset.
-            // Usually this is no problem, since it only varies slowly over the
-            // order.
-            cpl_polynomial_shift_1d(slitcurves_sw[col-1], 0,
-                                            cpl_vector_get(ycen, x-1));
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow, 0);
-        }
-
-        for (j=0; j< height * swath; j++) model_sw[j] = 0;
-        img_sw_data = cpl_image_get_data_double(img_sw);
-        err_sw_data = cpl_image_get_data_double(err_sw);
-        unc_sw_data = cpl_vector_get_data(unc_sw);
-        // First guess for the spectrum
-        img_tmp = cpl_image_collapse_create(img_sw, 0);
-        img_tmp2 = cpl_image_new(swath, 1, CPL_TYPE_DOUBLE);
-        kernel = cpl_mask_new(5, 1);
-        cpl_mask_not(kernel);
-        cpl_image_filter_mask(img_tmp2, img_tmp, kernel,
-            CPL_FILTER_MEDIAN, CPL_BORDER_FILTER);
-        spec_sw = cpl_vector_new_from_image_row(img_tmp2, 1);
-        cpl_image_delete(img_tmp);
-        cpl_image_delete(img_tmp2);
-        cpl_mask_delete(kernel);
-        spec_sw_data = cpl_vector_get_data(spec_sw);
-
-        for (j=sw_start;j<sw_end;j++){
-            ycen_sw[j-sw_start] = ycen_rest[j];
-            ycen_offset_sw[j-sw_start] = (int) cpl_vector_get(ycen, j);
-        }
-        // y_lower_limit = (int) ycen_offset_sw[0];
-        // for (j=0; j < swath; j++) {
-        //     y_lower_limit = min(y_lower_limit, ycen_offset_sw[j]);
-        // }
-        y_lower_limit = height / 2;
+        if (ws_th != ws) cr2res_extract_slitdec_ws_delete(ws_th) ;
+    }
+    cr2res_extract_slitdec_report_iter(niters, nswaths, warm_start);
+    cpl_free(niters);
 
-        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-            img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
-            cpl_image_save(img_tmp, "debug_mask_before_sw.fits", CPL_TYPE_INT, 
-                    NULL, CPL_IO_CREATE);
-            cpl_image_unwrap(img_tmp);
-        }
-        /* Finally ready to call the slit-decomp */
-        cr2res_extract_slit_func_curved(swath, height, oversample, img_sw_data,
-                err_sw_data, mask_sw, ycen_sw, ycen_offset_sw, y_lower_limit,
-                slitcurves_sw, delta_x,
-                slitfu_sw_data, spec_sw_data, model_sw, unc_sw_data, 0.,
-                smooth_slit, 1e-7, 200, slit_func_in);
+    /* Merge the swaths */
+    for (i=0;i<nswaths;i++){
+        sw_start = cpl_vector_get(bins_begin, i);
+        sw_end = cpl_vector_get(bins_end, i);
+        spec_sw = spec_sws[i];
+        unc_sw = unc_sws[i];
+        model_sw = model_sws[i];
 
         // add up slit-functions, divide by nswaths below to get average
-        if (i==0) cpl_vector_copy(slitfu,slitfu_sw);
-        else cpl_vector_add(slitfu,slitfu_sw);
-
-        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-            path = cpl_sprintf("debug_spc_%i.fits", i);
-            cpl_vector_save(spec_sw, path , CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_mask_%i.fits", i);
-            img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
-            cpl_image_save(img_tmp, path, CPL_TYPE_INT, NULL, CPL_IO_CREATE);
-            cpl_free(path);
-            cpl_image_unwrap(img_tmp);
-
-            tmp_vec = cpl_vector_wrap(swath, ycen_sw);
-            cpl_vector_save(tmp_vec, "debug_ycen.fits", CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_vector_unwrap(tmp_vec);
-            cpl_vector_save(weights_sw, "debug_weights.fits", CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
-            path = cpl_sprintf("debug_slitfu_%i.fits", i);
-            cpl_vector_save(slitfu_sw, path, CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_model_%i.fits", i);
-            img_tmp = cpl_image_wrap_double(swath, height, model_sw);
-            cpl_image_save(img_tmp, path, CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
-            cpl_image_unwrap(img_tmp);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_img_sw_%i.fits", i);
-            cpl_image_save(img_sw, path, CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_free(path);
-        }
+        if (i==0) cpl_vector_copy(slitfu,slitfu_sws[i]);
+        else cpl_vector_add(slitfu,slitfu_sws[i]);
 
         // The last bins are shifted, overwriting the first k values
         // this is the same amount the bin was shifted to the front before
@@ -1969,6 +2904,9 @@ int cr2res_extract_slitdec_curved(
         }
 
         cpl_vector_delete(spec_sw);
+        cpl_vector_delete(unc_sw);
+        cpl_vector_delete(slitfu_sws[i]);
+        cpl_free(model_sw);
     } // End loop over swaths
 
     // divide by nswaths to make the slitfu into the average over all swaths.
@@ -1977,62 +2915,108 @@ int cr2res_extract_slitdec_curved(
     // Deallocate loop memory
     cpl_image_delete(img_rect);
     cpl_image_delete(err_rect);
-    cpl_image_delete(img_sw);
-    cpl_image_delete(err_sw);
 
-    cpl_free(mask_sw);
-    cpl_free(model_sw);
-    cpl_vector_delete(unc_sw);
-    cpl_free(ycen_rest);
-    cpl_free(ycen_sw);
-    cpl_free(ycen_offset_sw);
+    cpl_free(spec_sws);
+    cpl_free(unc_sws);
+    cpl_free(slitfu_sws);
+    cpl_free(model_sws);
 
     cpl_vector_delete(bins_begin);
     cpl_vector_delete(bins_end);
     cpl_vector_delete(slitfu_sw);
     cpl_vector_delete(weights_sw);
 
-    cpl_polynomial_delete(slitcurve_A);
-    cpl_polynomial_delete(slitcurve_B);
-    cpl_polynomial_delete(slitcurve_C);
-    for (i=0; i<swath; i++) cpl_polynomial_delete(slitcurves_sw[i]);
-    cpl_free(slitcurves_sw);
-
-    // insert model_rect into large frame
-    if (cr2res_image_insert_rect(model_rect, ycen, img_out) == -1) {
-        // Cancel
-        cpl_image_delete(model_rect);
-        hdrl_image_delete(model_out);
-        cpl_vector_delete(ycen);
-  
-        cpl_vector_delete(spc);
-        cpl_vector_delete(unc_decomposition);
-        cpl_vector_delete(slitfu);
-        return -1; 
-    }
+    // detector row of the first model_rect row in each column
+    ycen_int = cr2res_vector_get_int(ycen);
+    for (i=0; i<lenx; i++) ycen_int[i] -= height/2;
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
         cpl_image_save(model_rect, "debug_model_rect.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
-        cpl_image_save(img_out, "debug_model_all.fits", CPL_TYPE_DOUBLE,
-                NULL, CPL_IO_CREATE);
         cpl_vector_save(spc, "debug_spc_all.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
     }
 
-    // TODO: Update BPM in img_out
-
     // TODO: Deallocate return arrays in case of error, return -1
-    cpl_image_delete(model_rect);
-    cpl_vector_delete(ycen);
+    cr2res_extract_slitdec_geom_delete(geom_loc);
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, unc_decomposition);
-    *model = model_out;
+    *model = model_rect;
+    *model_ymin = ycen_int;
     return 0;
 }
 
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create a cache for the slit decomposition geometry
+  @param    max_size    Memory cap in bytes (0 for no limit)
+  @return   the cache, to deallocate with cr2res_extract_geom_cache_delete()
+
+  The xi/zeta tensors of cr2res_extract_slit_func_curved() only depend on
+  the trace geometry (ycen, slit curvature), not on the pixel values. The
+  cache keeps them per (order, trace, swath, height, oversample), so that
+  frames extracted with the same TRACE_WAVE only compute them once.
+  The entries are checked against the actual geometry before being used.
+  Once max_size is reached, no new entries are stored.
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_extract_geom_cache * cr2res_extract_geom_cache_new(cpl_size max_size)
+{
+    cr2res_extract_geom_cache   *   cache ;
+
+    /* Check Entries */
+    if (max_size < 0) return NULL ;
+
+    cache = cpl_calloc(1, sizeof(cr2res_extract_geom_cache)) ;
+    cache->max_size = max_size ;
+    return cache ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a slit decomposition geometry cache
+  @param    cache   the cache or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_extract_geom_cache_delete(cr2res_extract_geom_cache * cache)
+{
+    xi_zeta_entry   *   entry ;
+    int                 i ;
+
+    if (cache == NULL) return ;
+    cpl_msg_debug(__func__,
+            "Geometry cache: %d entries, %lld bytes, %d hits, %d misses",
+            cache->nb_entries, (long long)cache->size, cache->nb_hits,
+            cache->nb_misses) ;
+    for (i=0 ; i<cache->nb_entries ; i++) {
+        entry = cache->entries[i] ;
+        cpl_free(entry->ycen) ;
+        cpl_free(entry->ycen_offset) ;
+        cpl_free(entry->curv) ;
+        cr2res_extract_slitdec_csr_delete(entry->csr) ;
+        cpl_free(entry) ;
+    }
+    cpl_free(cache->entries) ;
+    cpl_free(cache) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the memory used by a slit decomposition geometry cache
+  @param    cache   the cache
+  @return   the size in bytes, -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size cr2res_extract_geom_cache_get_size(
+        const cr2res_extract_geom_cache *   cache)
+{
+    if (cache == NULL) return -1 ;
+    return cache->size ;
+}
+
 /*----------------------------------------------------------------------------*/
 /*--------------------         EXTRACT 2d      -------------------------------*/
 /*----------------------------------------------------------------------------*/
@@ -2044,11 +3028,14 @@ int cr2res_extract_slitdec_curved(
   @param    traces          The traces table
   @param    reduce_order    The order to extract (-1 for all)
   @param    reduce_trace    The Trace to extract (-1 for all)
-  @param    smooth_slit     
   @param    extracted       [out] the extracted spectra 
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (contining many orders), and a traces table.
+  The table has as many rows as the largest trace has pixels, the shorter
+  traces are padded with NAN. The pixels are written directly into the
+  table columns, the wavelength and slit fraction are evaluated pixel by
+  pixel, no full frame map is built.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract2d_traces(
@@ -2058,99 +3045,118 @@ int cr2res_extract2d_traces(
         int                     reduce_trace,
         cpl_table           **  extracted)
 {
-    cpl_bivector        **  spectrum ;
-    cpl_bivector        **  position ;
-    cpl_vector          **  wavelength ;
-    cpl_vector          **  slit_fraction ;
     cpl_table           *   extract_loc ;
-    cpl_image           *   wavemap;
-    cpl_image           *   slitmap;
-    int                     nb_traces, i, order, trace_id, npoints ;
+    cpl_polynomial      **  coef_wave ;
+    cpl_polynomial      **  coef_slit ;
+    int                 *   order_idx_values ;
+    int                 *   ylo ;
+    int                 *   yhi ;
+    cpl_size            *   npix ;
+    cpl_size                lenx, leny, npoints ;
+    int                     nb_traces, nb_order_idx_values, nb_extracted,
+                            i, k, order, trace_id ;
 
     /* Check Entries */
-    if (img == NULL || traces == NULL) return -1 ;
+    if (img == NULL || traces == NULL || extracted == NULL) return -1 ;
 
     /* Initialise */
     nb_traces = cpl_table_get_nrow(traces) ;
-    npoints = CR2RES_DETECTOR_SIZE * CR2RES_DETECTOR_SIZE / nb_traces;
-
-    /* Allocate Data containers */
-    spectrum = cpl_malloc(nb_traces * sizeof(cpl_bivector *)) ;
-    position = cpl_malloc(nb_traces * sizeof(cpl_bivector *)) ;
-    wavelength = cpl_malloc(nb_traces * sizeof(cpl_vector *)) ;
-    slit_fraction = cpl_malloc(nb_traces * sizeof(cpl_vector *)) ;
-
-    // Calculate wavelength and slitfunction map once
-    wavemap = cpl_image_new(CR2RES_DETECTOR_SIZE, CR2RES_DETECTOR_SIZE,
-                                                         CPL_TYPE_DOUBLE);
-    slitmap = cpl_image_new(CR2RES_DETECTOR_SIZE, CR2RES_DETECTOR_SIZE,
-                                                        CPL_TYPE_DOUBLE);
-    if (cr2res_slit_pos_image(traces, &slitmap, &wavemap) != 0)
-    {
+    lenx = hdrl_image_get_size_x(img) ;
+    leny = hdrl_image_get_size_y(img) ;
+
+    /* Find the pixels of the traces, the largest one sets the table size */
+    if (cr2res_trace_get_spans(traces, lenx, leny, 0, &ylo, &yhi) != 0) {
+        cpl_msg_error(__func__, "Cannot find the pixels of the traces") ;
+        return -1 ;
+    }
+    npix = cpl_malloc(nb_traces * sizeof(cpl_size)) ;
+    npoints = 1 ;
+    for (i=0 ; i<nb_traces ; i++) {
+        npix[i] = -1 ;
+        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
+        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
+        if (reduce_order > -1 && order != reduce_order) continue ;
+        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
+        if ((npix[i] = cr2res_extract2d_trace_npix(ylo + i*lenx,
+                        yhi + i*lenx, lenx)) < 0) {
+            cpl_msg_error(__func__, "Cannot find the pixels of the trace") ;
+            continue ;
+        }
+        npoints = max(npoints, npix[i]) ;
+    }
+
+    /* Fit the wavelength and slit position of each order once */
+    order_idx_values = cr2res_trace_get_order_idx_values(traces,
+            &nb_order_idx_values) ;
+    coef_wave = cpl_malloc(nb_order_idx_values * sizeof(cpl_polynomial *)) ;
+    coef_slit = cpl_malloc(nb_order_idx_values * sizeof(cpl_polynomial *)) ;
+    for (k=0 ; k<nb_order_idx_values ; k++) {
+        coef_wave[k] = cpl_polynomial_new(2) ;
+        coef_slit[k] = cpl_polynomial_new(2) ;
+    }
+    if (cr2res_slit_pos(traces, &coef_slit, &coef_wave) != 0) {
         cpl_msg_error(__func__,
-            "Could not create wavelength / slit_fraction image");
-        cpl_free(spectrum);
-        cpl_free(position);
-        cpl_free(wavelength);
-        cpl_free(slit_fraction);
+            "Could not compute the wavelength / slit_fraction");
+        for (k=0 ; k<nb_order_idx_values ; k++) {
+            cpl_polynomial_delete(coef_wave[k]) ;
+            cpl_polynomial_delete(coef_slit[k]) ;
+        }
+        cpl_free(ylo) ;
+        cpl_free(yhi) ;
+        cpl_free(npix) ;
+        cpl_free(coef_wave) ;
+        cpl_free(coef_slit) ;
+        cpl_free(order_idx_values) ;
         return -1;
     }
 
-    /* Loop over the traces and extract them */
+    /* Loop over the traces and extract them into the table */
+    extract_loc = cr2res_extract_EXTRACT2D_new(traces, npoints) ;
+    nb_extracted = 0 ;
     for (i=0 ; i<nb_traces ; i++) {
-        /* Initialise */
-        spectrum[i] = NULL ;
-        position[i] = NULL ;
-        wavelength[i] = NULL ;
-        slit_fraction[i] = NULL ;
+        if (npix[i] < 0) continue ;
 
         /* Get Order and trace id */
         order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
         trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
-
-        /* Check if this order needs to be skipped */
-        if (reduce_order > -1 && order != reduce_order) continue ;
-
-        /* Check if this trace needs to be skipped */
-        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
+        for (k=0 ; k<nb_order_idx_values ; k++)
+            if (order_idx_values[k] == order) break ;
 
         cpl_msg_info(__func__, "Process Order %d/Trace %d",order,trace_id) ;
-        cpl_msg_indent_more() ;
 
         /* Call the Extraction */
-        if (cr2res_extract2d_trace(img, traces, order, trace_id,
-                    npoints, wavemap, slitmap, 
-                    &(spectrum[i]), &(position[i]), &(wavelength[i]),
-                    &(slit_fraction[i])) != 0) {
-            cpl_msg_error(__func__, "Cannot extract2d the trace") ;
-            spectrum[i] = NULL ;
-            position[i] = NULL ;
-            wavelength[i] = NULL ;
-            slit_fraction[i] = NULL ;
-            cpl_error_reset() ;
-            cpl_msg_indent_less() ;
-            continue ;
-        }
-        cpl_msg_indent_less() ;
+        cr2res_extract2d_trace_fill(img, ylo + i*lenx, yhi + i*lenx,
+                coef_wave[k], coef_slit[k],
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_SPEC_colname(order, trace_id)),
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_SPEC_ERR_colname(order, trace_id)),
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_POSITIONX_colname(order, trace_id)),
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_POSITIONY_colname(order, trace_id)),
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_WAVELENGTH_colname(order, trace_id)),
+                cr2res_extract2d_column(extract_loc,
+                    cr2res_dfs_SLIT_FRACTION_colname(order, trace_id))) ;
+        nb_extracted++ ;
+    }
+    if (nb_extracted == 0) {
+        cpl_table_delete(extract_loc) ;
+        extract_loc = NULL ;
     }
 
-    /* Create the extracted_tab for the current detector */
-    extract_loc = cr2res_extract_EXTRACT2D_create(spectrum, position,
-            wavelength, slit_fraction, traces) ;
-
-    /* Deallocate Vectors */
-    for (i=0 ; i<nb_traces ; i++) {
-        if (spectrum[i] != NULL) cpl_bivector_delete(spectrum[i]) ;
-        if (position[i] != NULL) cpl_bivector_delete(position[i]) ;
-        if (wavelength[i] != NULL) cpl_vector_delete(wavelength[i]) ;
-        if (slit_fraction[i] != NULL) cpl_vector_delete(slit_fraction[i]) ;
+    /* Deallocate */
+    for (k=0 ; k<nb_order_idx_values ; k++) {
+        cpl_polynomial_delete(coef_wave[k]) ;
+        cpl_polynomial_delete(coef_slit[k]) ;
     }
-    cpl_free(spectrum) ;
-    cpl_free(position) ;
-    cpl_free(wavelength) ;
-    cpl_free(slit_fraction) ;
-    cpl_image_delete(wavemap);
-    cpl_image_delete(slitmap);
+    cpl_free(ylo) ;
+    cpl_free(yhi) ;
+    cpl_free(npix) ;
+    cpl_free(coef_wave) ;
+    cpl_free(coef_slit) ;
+    cpl_free(order_idx_values) ;
 
     /* Return  */
     *extracted = extract_loc ;
@@ -2160,12 +3166,14 @@ int cr2res_extract2d_traces(
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Extraction2d function
-  @param    img_in          full detector image
+  @param    in              full detector image
   @param    trace_tab       The traces table
   @param    order           The order to extract
   @param    trace_id        The Trace to extract
-  @param    wavemap         Map of the wavelength for each pixel
-  @param    slitmap         Map of the slit fraction for each pixel
+  @param    npoints         The size of the returned vectors
+  @param    coef_wave       The wavelength as a function of x and y, or NULL
+  @param    coef_slit       The slit fraction as a function of the
+                            wavelength and y, or NULL
   @param    spectrum        [out] the spectrum and error
   @param    position        [out] the x/y positions
   @param    wavelength      [out] the wavelength values
@@ -2173,124 +3181,93 @@ int cr2res_extract2d_traces(
   @return   0 if ok, -1 otherwise
 
   Return the position, value, wavelength, and slitfraction of each pixel
-  inside a trace
+  inside a trace. The polynomials are the ones of the order computed by
+  cr2res_slit_pos(), without them the wavelength and slit fraction are
+  NAN. The vectors are padded with NAN after the last pixel, npoints
+  needs to be at least the number of pixels in the trace.
 
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract2d_trace(
-        const hdrl_image    *   in,
-        const cpl_table     *   trace_tab,
-        int                     order,
-        int                     trace_id,
-        int                     npoints,
-        const cpl_image     *   wavemap,
-        const cpl_image     *   slitmap,
-        cpl_bivector        **  spectrum,
-        cpl_bivector        **  position,
-        cpl_vector          **  wavelength,
-        cpl_vector          **  slit_fraction)
+        const hdrl_image        *   in,
+        const cpl_table         *   trace_tab,
+        int                         order,
+        int                         trace_id,
+        int                         npoints,
+        const cpl_polynomial    *   coef_wave,
+        const cpl_polynomial    *   coef_slit,
+        cpl_bivector            **  spectrum,
+        cpl_bivector            **  position,
+        cpl_vector              **  wavelength,
+        cpl_vector              **  slit_fraction)
 {
-    cpl_bivector    *   spectrum_local ;
     cpl_vector      *   spectrum_flux ;
     cpl_vector      *   spectrum_error ;
-    cpl_bivector    *   position_local ;
     cpl_vector      *   position_x;
     cpl_vector      *   position_y;
     cpl_vector      *   wavelength_local ;
     cpl_vector      *   slit_fraction_local ;
-    const cpl_array *   lower_array;
-    const cpl_array *   upper_array;
-    cpl_polynomial  *   lower_poly;
-    cpl_polynomial  *   upper_poly;
-    cpl_vector      *   lower;
-    cpl_vector      *   upper;
-    cpl_vector      *   x;
-
-    int k, bad_pix;
-    cpl_size npix_max;
-    cpl_size i, j, row;
-    double flux, err;
+    int             *   ylo ;
+    int             *   yhi ;
+    cpl_size            npix, lenx, row ;
 
     /* Check Entries */
     if (in==NULL || trace_tab==NULL || spectrum==NULL || position==NULL
-            || wavelength==NULL || slit_fraction==NULL) return -1 ;
+            || wavelength==NULL || slit_fraction==NULL || npoints < 1)
+        return -1 ;
 
-    if ((k = cr2res_get_trace_table_index(trace_tab, order, trace_id)) == -1)
-    {
+    // Step 1: Figure out pixels in the current trace
+    // i.e. everything between upper and lower in trace_wave
+    lenx = hdrl_image_get_size_x(in) ;
+    if ((row = cr2res_get_trace_table_index(trace_tab, order,
+                    trace_id)) < 0) {
+        cpl_msg_error(__func__, "Order and/or Trace not found in trace table");
+        return -1;
+    }
+    if (cr2res_trace_get_spans(trace_tab, lenx, hdrl_image_get_size_y(in),
+                0, &ylo, &yhi) != 0) return -1 ;
+    if ((npix = cr2res_extract2d_trace_npix(ylo + row*lenx, yhi + row*lenx,
+                    lenx)) < 0) {
         cpl_msg_error(__func__, "Order and/or Trace not found in trace table");
+        cpl_free(ylo);
+        cpl_free(yhi);
+        return -1;
+    }
+    if (npix > npoints) {
+        cpl_msg_error(__func__, "The trace has %"CPL_SIZE_FORMAT
+                " pixels, more than %d", npix, npoints);
+        cpl_free(ylo);
+        cpl_free(yhi);
         return -1;
     }
 
-    // Step 0: Initialise output arrays
-    npix_max = CR2RES_DETECTOR_SIZE * CR2RES_DETECTOR_SIZE;
+    // Step 2: Iterate over pixels in the given trace
+    // and fill the vectors, the remaining points are NAN
     wavelength_local = cpl_vector_new(npoints);
     slit_fraction_local = cpl_vector_new(npoints);
     position_x = cpl_vector_new(npoints);
     position_y = cpl_vector_new(npoints);
     spectrum_flux = cpl_vector_new(npoints);
     spectrum_error = cpl_vector_new(npoints);
-
-    // Step 1: Figure out pixels in the current trace
-    // i.e. everything between upper and lower in trace_wave
-
-    // The x coordinate of the detector
-    x = cpl_vector_new(CR2RES_DETECTOR_SIZE);
-    for (i = 0; i < CR2RES_DETECTOR_SIZE; i++) cpl_vector_set(x, i, i + 1);
-
-    lower_array = cpl_table_get_array(trace_tab, CR2RES_COL_LOWER, k);
-    upper_array = cpl_table_get_array(trace_tab, CR2RES_COL_UPPER, k);
-    lower_poly = cr2res_convert_array_to_poly(lower_array);
-    upper_poly = cr2res_convert_array_to_poly(upper_array);
-    lower = cr2res_polynomial_eval_vector(lower_poly, x);
-    upper = cr2res_polynomial_eval_vector(upper_poly, x);
-
-    // Step 2: Iterate over pixels in the given trace
-    // and fill the vectors
-    row = -1;
-    for (i = 0; i < CR2RES_DETECTOR_SIZE; i++)
-    {
-        for (j = cpl_vector_get(lower, i); j < cpl_vector_get(upper, i); j++)
-        {
-            row++;
-            cpl_vector_set(position_x, row, i +1);
-            cpl_vector_set(position_y, row, j);
-            flux = cpl_image_get(hdrl_image_get_image_const(in), i + 1, j,
-                                                                     &bad_pix);
-            err = cpl_image_get(hdrl_image_get_error_const(in), i + 1, j,
-                                                                     &bad_pix);
-            cpl_vector_set(spectrum_flux, row, flux);
-            cpl_vector_set(spectrum_error, row, err);
-
-            // Set wavelength
-            cpl_vector_set(wavelength_local, row, cpl_image_get(
-                wavemap, i + 1, j, &bad_pix));
-            // Set Slitfraction
-            cpl_vector_set(slit_fraction_local, row, cpl_image_get(
-                slitmap, i + 1, j, &bad_pix));
-        }
-    }
-
-    // Step 3: resize output
-    for (i = row; i < npoints; i++){
-        cpl_vector_set(position_x, i, NAN);
-        cpl_vector_set(position_y, i, NAN);
-        cpl_vector_set(spectrum_flux, i, NAN);
-        cpl_vector_set(spectrum_error, i, NAN);
-        cpl_vector_set(wavelength_local, i, NAN);
-        cpl_vector_set(slit_fraction_local, i, NAN);
-    }
-
-    position_local = cpl_bivector_wrap_vectors(position_x, position_y);
-    spectrum_local = cpl_bivector_wrap_vectors(spectrum_flux, spectrum_error);
-
-    cpl_polynomial_delete(upper_poly);
-    cpl_polynomial_delete(lower_poly);
-    cpl_vector_delete(upper);
-    cpl_vector_delete(lower);
-    cpl_vector_delete(x);
-
-    *spectrum = spectrum_local ;
-    *position = position_local ;
+    cpl_vector_fill(wavelength_local, NAN);
+    cpl_vector_fill(slit_fraction_local, NAN);
+    cpl_vector_fill(position_x, NAN);
+    cpl_vector_fill(position_y, NAN);
+    cpl_vector_fill(spectrum_flux, NAN);
+    cpl_vector_fill(spectrum_error, NAN);
+    cr2res_extract2d_trace_fill(in, ylo + row*lenx, yhi + row*lenx,
+            coef_wave, coef_slit,
+            cpl_vector_get_data(spectrum_flux),
+            cpl_vector_get_data(spectrum_error),
+            cpl_vector_get_data(position_x),
+            cpl_vector_get_data(position_y),
+            cpl_vector_get_data(wavelength_local),
+            cpl_vector_get_data(slit_fraction_local)) ;
+    cpl_free(ylo);
+    cpl_free(yhi);
+
+    *spectrum = cpl_bivector_wrap_vectors(spectrum_flux, spectrum_error);
+    *position = cpl_bivector_wrap_vectors(position_x, position_y);
     *wavelength = wavelength_local ;
     *slit_fraction = slit_fraction_local ;
     return 0;
@@ -2347,21 +3324,83 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
             return NULL ;
 
     /* Create the table */
-    out = cpl_table_new(nrows);
+    out = cr2res_extract_EXTRACT2D_new(trace_table, nrows) ;
+
+    /* Fill the table */
     for (i=0 ; i<nb_traces ; i++) {
-        order = cpl_table_get(trace_table, CR2RES_COL_ORDER, i, NULL) ;
-        trace_id = cpl_table_get(trace_table, CR2RES_COL_TRACENB, i, NULL) ;
-        /* Create SPEC column */
-        col_name = cr2res_dfs_SPEC_colname(order, trace_id) ;
-        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
-        cpl_free(col_name) ;
-        /* Create SPEC_ERR column */
-        col_name = cr2res_dfs_SPEC_ERR_colname(order, trace_id) ;
-        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
-        cpl_free(col_name) ;
-        /* Create WAVELENGTH column */
-        col_name = cr2res_dfs_WAVELENGTH_colname(order, trace_id) ;
-        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
+        if (spectrum[i]!=NULL && position[i]!=NULL &&
+                wavelength[i]!=NULL && slit_fraction[i]!=NULL) {
+            order = cpl_table_get(trace_table, CR2RES_COL_ORDER, i, NULL) ;
+            trace_id = cpl_table_get(trace_table, CR2RES_COL_TRACENB, i, NULL) ;
+            pspec = cpl_bivector_get_x_data_const(spectrum[i]) ;
+            perr = cpl_bivector_get_y_data_const(spectrum[i]);
+            pxposition = cpl_bivector_get_x_data_const(position[i]) ;
+            pyposition = cpl_bivector_get_y_data_const(position[i]) ;
+            pwave = cpl_vector_get_data_const(wavelength[i]) ;
+            pslit_frac = cpl_vector_get_data_const(slit_fraction[i]) ;
+            /* Fill SPEC column */
+            col_name = cr2res_dfs_SPEC_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, pspec) ;
+            cpl_free(col_name) ;
+            /* Fill SPEC_ERR column */
+            col_name = cr2res_dfs_SPEC_ERR_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, perr) ;
+            cpl_free(col_name) ;
+            /* Fill WAVELENGTH column */
+            col_name = cr2res_dfs_WAVELENGTH_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, pwave) ;
+            cpl_free(col_name) ;
+            /* Fill POSITIONX column */
+            col_name = cr2res_dfs_POSITIONX_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, pxposition) ;
+            cpl_free(col_name) ;
+            /* Fill POSITIONY column */
+            col_name = cr2res_dfs_POSITIONY_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, pyposition) ;
+            cpl_free(col_name) ;
+            /* Fill SLIT_FRACTION column */
+            col_name = cr2res_dfs_SLIT_FRACTION_colname(order, trace_id) ;
+            cpl_table_copy_data_double(out, col_name, pslit_frac) ;
+            cpl_free(col_name) ;
+        }
+    }
+    return out ;
+}
+
+/** @} */
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create an empty extract 2D table
+  @param    trace_table     Trace wave file used for extraction
+  @param    nrows           The number of rows
+  @return   the table with the columns of all the traces
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_table * cr2res_extract_EXTRACT2D_new(
+        const cpl_table *   trace_table,
+        cpl_size            nrows)
+{
+    cpl_table       *   out ;
+    char            *   col_name ;
+    int                 i, order, trace_id, nb_traces ;
+
+    nb_traces = cpl_table_get_nrow(trace_table) ;
+    out = cpl_table_new(nrows);
+    for (i=0 ; i<nb_traces ; i++) {
+        order = cpl_table_get(trace_table, CR2RES_COL_ORDER, i, NULL) ;
+        trace_id = cpl_table_get(trace_table, CR2RES_COL_TRACENB, i, NULL) ;
+        /* Create SPEC column */
+        col_name = cr2res_dfs_SPEC_colname(order, trace_id) ;
+        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
+        cpl_free(col_name) ;
+        /* Create SPEC_ERR column */
+        col_name = cr2res_dfs_SPEC_ERR_colname(order, trace_id) ;
+        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
+        cpl_free(col_name) ;
+        /* Create WAVELENGTH column */
+        col_name = cr2res_dfs_WAVELENGTH_colname(order, trace_id) ;
+        cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
         cpl_free(col_name) ;
         /* Create POSITIONX column */
         col_name = cr2res_dfs_POSITIONX_colname(order, trace_id) ;
@@ -2376,49 +3415,1312 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
         cpl_table_new_column(out, col_name, CPL_TYPE_DOUBLE);
         cpl_free(col_name) ;
     }
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Count the pixels of a trace
+  @param    ylo         the first row in the trace, per column [lenx]
+  @param    yhi         the last row in the trace, per column [lenx]
+  @param    lenx        The detector width
+  @return   the number of pixels in the trace, -1 if it has no edges
+
+  ylo and yhi are one row of the cr2res_trace_get_spans() output.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_extract2d_trace_npix(
+        const int   *   ylo,
+        const int   *   yhi,
+        cpl_size        lenx)
+{
+    cpl_size            i, npix ;
+
+    if (ylo[0] == 0) return -1 ;
+    npix = 0 ;
+    for (i=0 ; i<lenx ; i++)
+        if (yhi[i] >= ylo[i]) npix += yhi[i] - ylo[i] + 1 ;
+    return npix ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Copy the pixels of a trace
+  @param    in          full detector image
+  @param    ylo         the first row in the trace, per column
+  @param    yhi         the last row in the trace, per column
+  @param    coef_wave   The wavelength as a function of x and y, or NULL
+  @param    coef_slit   The slit fraction as a function of the wavelength
+                        and y, or NULL
+  @param    flux        [out] the flux of each pixel
+  @param    err         [out] the error of each pixel
+  @param    pos_x       [out] the x position of each pixel
+  @param    pos_y       [out] the y position of each pixel
+  @param    wave        [out] the wavelength of each pixel
+  @param    slit_frac   [out] the slit fraction of each pixel
+  @return   the number of pixels written
+
+  The pixels are written column by column, reading the image buffers
+  directly. The wavelength and slit fraction are 0 where the slit
+  fraction is not in ]0, 10[, and NAN without the polynomials.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_extract2d_trace_fill(
+        const hdrl_image        *   in,
+        const int               *   ylo,
+        const int               *   yhi,
+        const cpl_polynomial    *   coef_wave,
+        const cpl_polynomial    *   coef_slit,
+        double                  *   flux,
+        double                  *   err,
+        double                  *   pos_x,
+        double                  *   pos_y,
+        double                  *   wave,
+        double                  *   slit_frac)
+{
+    const double    *   pimg ;
+    const double    *   perr ;
+    cpl_vector      *   vec_xy ;
+    double              xy[2] ;
+    double              w, s ;
+    cpl_size            lenx, i, j, pix, row ;
+
+    lenx = hdrl_image_get_size_x(in) ;
+    pimg = cpl_image_get_data_double_const(hdrl_image_get_image_const(in)) ;
+    perr = cpl_image_get_data_double_const(hdrl_image_get_error_const(in)) ;
+    vec_xy = cpl_vector_wrap(2, xy) ;
+
+    row = 0 ;
+    for (i=0 ; i<lenx ; i++) {
+        for (j=ylo[i] ; j<=yhi[i] ; j++) {
+            pix = i + (j-1)*lenx ;
+            pos_x[row] = i + 1 ;
+            pos_y[row] = j ;
+            flux[row] = pimg[pix] ;
+            err[row] = perr[pix] ;
+            if (coef_wave == NULL || coef_slit == NULL) {
+                w = s = NAN ;
+            } else {
+                xy[0] = i + 1 ;
+                xy[1] = j ;
+                w = cpl_polynomial_eval(coef_wave, vec_xy) ;
+                xy[0] = w ;
+                s = cpl_polynomial_eval(coef_slit, vec_xy) ;
+                if (!(s > 0 && s < 10)) w = s = 0.0 ;
+            }
+            wave[row] = w ;
+            slit_frac[row] = s ;
+            row++ ;
+        }
+    }
+    cpl_vector_unwrap(vec_xy) ;
+    return row ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get a column of the extract 2D table, filled with NAN
+  @param    out         the extract 2D table
+  @param    col_name    the column name, deallocated here
+  @return   the column data
+ */
+/*----------------------------------------------------------------------------*/
+static double * cr2res_extract2d_column(
+        cpl_table   *   out,
+        char        *   col_name)
+{
+    double      *   data ;
+
+    cpl_table_fill_column_window_double(out, col_name, 0,
+            cpl_table_get_nrow(out), NAN) ;
+    data = cpl_table_get_data_double(out, col_name) ;
+    cpl_free(col_name) ;
+    return data ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Extracts all the passed traces in several frames
+  @param    imgs            The frames, all of the same size
+  @param    nframes         The number of frames
+  @param    traces          The traces table
+  @param    slit_func_in    The input slit_func or NULL
+  @param    reduce_order    The order to extract (-1 for all)
+  @param    reduce_trace    The Trace to extract (-1 for all)
+  @param    extr_method     The wished extraction method
+  @param    extr_height     number of pix above and below mid-line or -1
+  @param    swath_width     width per swath, or <= 0 to choose it for each
+                            trace, see cr2res_extract_swath_plan()
+  @param    oversample      factor for oversampling
+  @param    smooth_slit
+  @param    warm_start      start each swath from the previous one
+  @param    single_prec     single precision slit decomposition weights
+  @param    nthreads        number of traces extracted in parallel
+  @param    geom_cache      cache for the slit decomposition geometry or NULL
+  @param    extracted       [out] the extracted spectra [nframes]
+  @param    slit_func       [out] the slit functions [nframes] or NULL
+  @param    model_master    [out] the models [nframes] or NULL
+  @param    swaths          [out] the swath widths [nb_traces] or NULL
+  @return   0 if ok, -1 otherwise
+
+  The traces are extracted in parallel, each of them in all the frames.
+  The results are merged in the order of the traces table.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_traces_run(
+        const hdrl_image    **  imgs,
+        int                     nframes,
+        const cpl_table     *   traces,
+        const cpl_table     *   slit_func_in,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_table           **  extracted,
+        cpl_table           **  slit_func,
+        hdrl_image          **  model_master,
+        int                 *   swaths)
+{
+    cpl_bivector        **  spectrum ;
+    cpl_vector          *   slit_func_in_vec ;
+    cpl_vector          **  slit_func_vec ;
+    hdrl_image          *   model_loc ;
+    cpl_image           **  model_rects ;
+    cpl_image           **  quick_model ;
+    int                 **  model_ymins ;
+    slitdec_ws          **  wss ;
+    slitdec_geom        *   geom ;
+    cr2res_extract_geom_cache   *   cache ;
+    cpl_size                lenx, leny ;
+    int                     nb_traces, nb_res, i, f, k, order, trace_id,
+                            ithread, ret, swath ;
+
+    /* The fixed slit function extraction needs the slit functions */
+    if (extr_method == CR2RES_EXTR_HORNE && slit_func_in == NULL) {
+        cpl_msg_error(__func__, "The HORNE extraction needs a slit function") ;
+        return -1 ;
+    }
+
+    /* Initialise */
+    nb_traces = cpl_table_get_nrow(traces) ;
+    nb_res = nframes * nb_traces ;
+    lenx = hdrl_image_get_size_x(imgs[0]) ;
+    leny = hdrl_image_get_size_y(imgs[0]) ;
+#ifdef _OPENMP
+    if (nthreads <= 0) nthreads = omp_get_max_threads() ;
+#endif
+    if (nthreads <= 0) nthreads = 1 ;
+
+    /* Allocate Data containers, the results of trace i in frame f */
+    /* are at f*nb_traces+i */
+    spectrum = cpl_calloc(nb_res, sizeof(cpl_bivector *)) ;
+    slit_func_vec = cpl_calloc(nb_res, sizeof(cpl_vector *)) ;
+    model_rects = cpl_calloc(nb_res, sizeof(cpl_image *)) ;
+    model_ymins = cpl_calloc(nb_res, sizeof(int *)) ;
+    wss = cpl_calloc(nthreads, sizeof(slitdec_ws *)) ;
+    if (swaths != NULL)
+        for (i=0 ; i<nb_traces ; i++) swaths[i] = 0 ;
+
+    /* Loop over the traces and extract them */
+    /* Each thread keeps its slit decomposition work buffers from one */
+    /* trace to the next, they are only rebuilt if the geometry changes */
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) \
+    private(order, trace_id, slit_func_in_vec, ithread, geom, cache, f, k, \
+            ret, quick_model, swath)
+    for (i=0 ; i<nb_traces ; i++) {
+        /* Initialise */
+        ithread = 0 ;
+#ifdef _OPENMP
+        ithread = omp_get_thread_num() ;
+#endif
+
+        /* Get Order and trace id */
+        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
+        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
+
+        /* Check if this order needs to be skipped */
+        if (reduce_order > -1 && order != reduce_order) continue ;
+
+        /* Check if this trace needs to be skipped */
+        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
+
+        cpl_msg_info(__func__, "Process Order %d/Trace %d",order,trace_id) ;
+
+        /* The trace geometry is shared by all the frames */
+        geom = NULL ;
+        cache = geom_cache ;
+        swath = swath_width ;
+        if (extr_method == CR2RES_EXTR_OPT_VERT ||
+                extr_method == CR2RES_EXTR_OPT_CURV) {
+            if (wss[ithread] == NULL)
+                wss[ithread] = cr2res_extract_slitdec_ws_new() ;
+            /* The swath width is planned on the first frame */
+            if (swath <= 0) {
+                if ((swath = cr2res_extract_swath_plan(imgs[0], traces,
+                                order, trace_id, extr_height,
+                                oversample)) < 0) {
+                    cpl_msg_error(__func__, "Cannot plan the swath width") ;
+                    cpl_error_reset() ;
+                    continue ;
+                }
+                cpl_msg_info(__func__, "Swath width: %d", swath) ;
+            }
+            if ((geom = cr2res_extract_slitdec_geom_new(traces, order,
+                            trace_id, extr_height, swath, lenx, leny,
+                            extr_method == CR2RES_EXTR_OPT_CURV)) == NULL) {
+                cpl_msg_error(__func__, "Cannot (slitdec-) extract the trace") ;
+                cpl_error_reset() ;
+                continue ;
+            }
+            if (swaths != NULL) swaths[i] = swath ;
+            /* Keep the slit decomposition tensors for the next frames */
+            if (extr_method == CR2RES_EXTR_OPT_CURV && cache == NULL &&
+                    nframes > 1)
+                cache = cr2res_extract_geom_cache_new(0) ;
+        }
+
+        /* Get the input slit_func if available */
+        if (slit_func_in != NULL) {
+            /* Load the proper slit function vector */
+            cr2res_extract_SLIT_FUNC_get_vector(slit_func_in, order,
+                    trace_id, &slit_func_in_vec) ;
+        } else {
+            slit_func_in_vec = NULL ;
+        }
+
+        /* Call the Extraction */
+        for (f=0 ; f<nframes ; f++) {
+            k = f * nb_traces + i ;
+            ret = 0 ;
+            /* The quick-look extractions skip the unused models */
+            quick_model = model_master == NULL ? NULL : &(model_rects[k]) ;
+            if (extr_method == CR2RES_EXTR_SUM) {
+                if ((ret = cr2res_extract_sum_vert_rect(imgs[f], traces,
+                                order, trace_id, extr_height,
+                                &(slit_func_vec[k]), &(spectrum[k]),
+                                quick_model, &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
+            } else if (extr_method == CR2RES_EXTR_MEDIAN) {
+                if ((ret = cr2res_extract_median_rect(imgs[f], traces,
+                                order, trace_id, extr_height,
+                                &(slit_func_vec[k]), &(spectrum[k]),
+                                quick_model, &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__,
+                            "Cannot (median-)extract the trace") ;
+            } else if (extr_method == CR2RES_EXTR_TILTSUM) {
+                if ((ret = cr2res_extract_sum_tilt_rect(imgs[f], traces,
+                                order, trace_id, extr_height,
+                                &(slit_func_vec[k]), &(spectrum[k]),
+                                quick_model, &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__,
+                            "Cannot (tiltsum-)extract the trace") ;
+            } else if (extr_method == CR2RES_EXTR_HORNE) {
+                if ((ret = cr2res_extract_horne_rect(imgs[f], traces,
+                                slit_func_in_vec, order, trace_id,
+                                extr_height, oversample,
+                                CR2RES_EXTRACT_HORNE_KAPPA,
+                                &(slit_func_vec[k]), &(spectrum[k]),
+                                &(model_rects[k]), &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__,
+                            "Cannot (horne-)extract the trace") ;
+            } else if (extr_method == CR2RES_EXTR_OPT_VERT) {
+                if ((ret = cr2res_extract_slitdec_vert_rect(imgs[f], traces,
+                                slit_func_in_vec, order, trace_id,
+                                extr_height, swath, oversample,
+                                smooth_slit, warm_start, single_prec, geom,
+                                wss[ithread], &(slit_func_vec[k]),
+                                &(spectrum[k]), &(model_rects[k]),
+                                &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__,
+                            "Cannot (slitdec-vert-) extract the trace") ;
+            } else if (extr_method == CR2RES_EXTR_OPT_CURV) {
+                if ((ret = cr2res_extract_slitdec_curved_rect(imgs[f],
+                                traces, slit_func_in_vec, order, trace_id,
+                                extr_height, swath, oversample,
+                                smooth_slit, warm_start, single_prec, geom,
+                                wss[ithread], cache,
+                                &(slit_func_vec[k]), &(spectrum[k]),
+                                &(model_rects[k]), &(model_ymins[k]))) != 0)
+                    cpl_msg_error(__func__,
+                            "Cannot (slitdec-curved-) extract the trace") ;
+            }
+            if (ret != 0) {
+                slit_func_vec[k] = NULL ;
+                spectrum[k] = NULL ;
+                model_rects[k] = NULL ;
+                model_ymins[k] = NULL ;
+                cpl_error_reset() ;
+            }
+        }
+        if (slit_func_in_vec != NULL) cpl_vector_delete(slit_func_in_vec) ;
+        if (cache != geom_cache) cr2res_extract_geom_cache_delete(cache) ;
+        cr2res_extract_slitdec_geom_delete(geom) ;
+    }
+    for (i=0 ; i<nthreads ; i++) cr2res_extract_slitdec_ws_delete(wss[i]) ;
+    cpl_free(wss) ;
+
+    /* Create the products of each frame */
+    ret = 0 ;
+    for (f=0 ; f<nframes ; f++) {
+        extracted[f] = NULL ;
+        if (slit_func != NULL) slit_func[f] = NULL ;
+        if (model_master != NULL) model_master[f] = NULL ;
+    }
+    for (f=0 ; f<nframes ; f++) {
+        /* Update the model global image, in the traces order */
+        model_loc = NULL ;
+        if (model_master != NULL) {
+            model_loc = hdrl_image_duplicate(imgs[f]) ;
+            hdrl_image_mul_scalar(model_loc, (hdrl_value){0.0, 0.0}) ;
+        }
+        for (i=0 ; i<nb_traces ; i++) {
+            k = f * nb_traces + i ;
+            if (model_rects[k] != NULL) {
+                if (model_loc != NULL)
+                    cr2res_extract_model_paste(model_rects[k],
+                            model_ymins[k], model_loc) ;
+                cpl_image_delete(model_rects[k]) ;
+                cpl_free(model_ymins[k]) ;
+            }
+        }
+        if (model_master != NULL) model_master[f] = model_loc ;
+
+        /* Create the slit_func_tab and the extracted_tab */
+        if (ret == 0 && slit_func != NULL) {
+            if ((slit_func[f] = cr2res_extract_SLITFUNC_create(
+                            slit_func_vec + f * nb_traces, traces)) == NULL) {
+                cpl_msg_error(__func__, "Cannot compute the slit function") ;
+                ret = -1 ;
+            }
+        }
+        if (ret == 0) extracted[f] = cr2res_extract_EXTRACT1D_create(
+                spectrum + f * nb_traces, traces) ;
+    }
+
+    /* Deallocate Vectors */
+    for (k=0 ; k<nb_res ; k++) {
+        if (slit_func_vec[k] != NULL) cpl_vector_delete(slit_func_vec[k]) ;
+        if (spectrum[k] != NULL) cpl_bivector_delete(spectrum[k]) ;
+    }
+    cpl_free(spectrum) ;
+    cpl_free(slit_func_vec) ;
+    cpl_free(model_rects) ;
+    cpl_free(model_ymins) ;
+
+    /* Nothing is returned in error case */
+    if (ret != 0) {
+        for (f=0 ; f<nframes ; f++) {
+            cpl_table_delete(extracted[f]) ;
+            extracted[f] = NULL ;
+            if (slit_func != NULL) {
+                cpl_table_delete(slit_func[f]) ;
+                slit_func[f] = NULL ;
+            }
+            if (model_master != NULL) {
+                hdrl_image_delete(model_master[f]) ;
+                model_master[f] = NULL ;
+            }
+        }
+        return -1 ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Cut out the straightened order of a trace
+  @param    hdrl_in     full detector image
+  @param    trace_tab   The traces table
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      [in/out] the extraction height, computed if <= 0
+  @param    img_rect    the returned rectified order (lenx x height)
+  @param    err_rect    the returned rectified error (lenx x height)
+  @return   the trace center per column, or NULL in error case
+
+  Only the rows covered by the order are copied, the rectified images and
+  the returned vector are to be deallocated by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_vector * cr2res_extract_rect_cut(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                 *   height,
+        cpl_image           **  img_rect,
+        cpl_image           **  err_rect)
+{
+    cpl_vector      *   ycen ;
+    cpl_size            lenx ;
+
+    lenx = hdrl_image_get_size_x(hdrl_in) ;
+
+    /* Compute height if not given */
+    if (*height <= 0) {
+        *height = cr2res_trace_get_height(trace_tab, order, trace_id);
+        if (*height <= 0) {
+            cpl_msg_error(__func__, "Cannot compute height");
+            return NULL;
+        }
+    }
+    /* Get ycen */
+    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
+                    trace_id, lenx)) == NULL) {
+        cpl_msg_error(__func__, "Cannot get ycen");
+        return NULL ;
+    }
+
+    *img_rect = cr2res_image_cut_rectify(hdrl_image_get_image_const(hdrl_in),
+            ycen, *height);
+    *err_rect = cr2res_image_cut_rectify(hdrl_image_get_error_const(hdrl_in),
+            ycen, *height);
+    if (*img_rect == NULL || *err_rect == NULL) {
+        cpl_msg_error(__func__, "Cannot rectify order");
+        cpl_image_delete(*img_rect);
+        cpl_image_delete(*err_rect);
+        cpl_vector_delete(ycen);
+        return NULL;
+    }
+    return ycen ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Sum the rows of a rectified order
+  @param    img_rect    the rectified image (lenx x height)
+  @param    square      sum the squared values instead
+  @param    out         [out] the sum of each column (lenx)
+  @return   0 if ok, -1 otherwise
+
+  The rejected pixels are ignored and the sums are scaled to the full
+  column length, a column without any good pixel gives 0.
+  The sums are accumulated one image row at a time, along the contiguous
+  axis of the buffer, so that the inner loop can be vectorized.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_rect_sum_rows(
+        const cpl_image     *   img_rect,
+        int                     square,
+        double              *   out)
+{
+    const double        *   pimg ;
+    const double        *   row ;
+    const cpl_binary    *   pbpm ;
+    const cpl_binary    *   brow ;
+    int                 *   ngood ;
+    cpl_size                lenx, height, i, j ;
+
+    lenx = cpl_image_get_size_x(img_rect) ;
+    height = cpl_image_get_size_y(img_rect) ;
+    if ((pimg = cpl_image_get_data_double_const(img_rect)) == NULL) return -1;
+    pbpm = NULL ;
+    if (cpl_image_get_bpm_const(img_rect) != NULL)
+        pbpm = cpl_mask_get_data_const(cpl_image_get_bpm_const(img_rect)) ;
+
+    for (i=0 ; i<lenx ; i++) out[i] = 0.0 ;
+    if (pbpm == NULL) {
+        for (j=0 ; j<height ; j++) {
+            row = pimg + j*lenx ;
+            if (square) for (i=0 ; i<lenx ; i++) out[i] += row[i] * row[i] ;
+            else        for (i=0 ; i<lenx ; i++) out[i] += row[i] ;
+        }
+        return 0 ;
+    }
+
+    ngood = cpl_calloc(lenx, sizeof(int)) ;
+    for (j=0 ; j<height ; j++) {
+        row = pimg + j*lenx ;
+        brow = pbpm + j*lenx ;
+        for (i=0 ; i<lenx ; i++) {
+            if (brow[i]) continue ;
+            out[i] += square ? row[i] * row[i] : row[i] ;
+            ngood[i]++ ;
+        }
+    }
+    for (i=0 ; i<lenx ; i++) {
+        if (ngood[i] == 0) out[i] = 0.0 ;
+        else if (ngood[i] < height) out[i] = out[i] * height / ngood[i] ;
+    }
+    cpl_free(ngood) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Collapse a rectified order into a spectrum and a slit function
+  @param    img_rect    the rectified order (lenx x height)
+  @param    err_rect    the rectified error (lenx x height)
+  @param    use_median  collapse with the median instead of the sum
+  @param    slit_func   the returned slit function, normalized to sum=1
+  @param    spec        the returned spectrum and its error
+  @return   0 if ok, -1 otherwise
+
+  The rejected pixels are ignored. The sums are scaled to the full column
+  (or row) length, a column (or row) without any good pixel gives 0. The
+  median spectrum is multiplied by the height to match the scaling of a
+  vertical sum. The error is the quadratic sum of err_rect over each
+  column. The medians are found by selection instead of sorting.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_rect_collapse(
+        const cpl_image     *   img_rect,
+        const cpl_image     *   err_rect,
+        int                     use_median,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec)
+{
+    const double        *   pimg ;
+    const double        *   row ;
+    const cpl_binary    *   pbpm ;
+    const cpl_binary    *   brow ;
+    cpl_vector          *   spc ;
+    cpl_vector          *   slitfu ;
+    cpl_vector          *   sigma ;
+    double              *   pspc ;
+    double              *   pslitfu ;
+    double              *   buf ;
+    double                  sum ;
+    cpl_size                lenx, height, i, j ;
+    int                     n ;
+
+    lenx = cpl_image_get_size_x(img_rect) ;
+    height = cpl_image_get_size_y(img_rect) ;
+    pimg = cpl_image_get_data_double_const(img_rect) ;
+    if (pimg == NULL ||
+            cpl_image_get_data_double_const(err_rect) == NULL) {
+        cpl_msg_error(__func__, "Only double images are supported");
+        return -1;
+    }
+    pbpm = NULL ;
+    if (cpl_image_get_bpm_const(img_rect) != NULL)
+        pbpm = cpl_mask_get_data_const(cpl_image_get_bpm_const(img_rect)) ;
+
+    spc = cpl_vector_new(lenx) ;
+    sigma = cpl_vector_new(lenx) ;
+    slitfu = cpl_vector_new(height) ;
+    pspc = cpl_vector_get_data(spc) ;
+    pslitfu = cpl_vector_get_data(slitfu) ;
+
+    /* Quadratic sum of the errors */
+    cr2res_extract_rect_sum_rows(err_rect, 1, cpl_vector_get_data(sigma)) ;
+    cpl_vector_sqrt(sigma) ;
+
+    buf = cpl_malloc(max(lenx, height) * sizeof(double)) ;
+    if (!use_median) {
+        cr2res_extract_rect_sum_rows(img_rect, 0, pspc) ;
+    } else {
+        /* Median of rows, multiplied to match a vertical sum */
+        for (i=0 ; i<lenx ; i++) {
+            for (j=0, n=0 ; j<height ; j++)
+                if (pbpm == NULL || !pbpm[i+j*lenx]) buf[n++] = pimg[i+j*lenx];
+            pspc[i] = n > 0 ? cr2res_extract_select_median(buf, n) : 0.0 ;
+            pspc[i] *= (double)height ;
+        }
+    }
+
+    /* Collapse of the columns */
+    for (j=0 ; j<height ; j++) {
+        row = pimg + j*lenx ;
+        brow = pbpm == NULL ? NULL : pbpm + j*lenx ;
+        if (use_median) {
+            for (i=0, n=0 ; i<lenx ; i++)
+                if (brow == NULL || !brow[i]) buf[n++] = row[i] ;
+            pslitfu[j] = n > 0 ? cr2res_extract_select_median(buf, n) : 0.0 ;
+        } else {
+            for (i=0, n=0, sum=0.0 ; i<lenx ; i++) {
+                if (brow != NULL && brow[i]) continue ;
+                sum += row[i] ;
+                n++ ;
+            }
+            if (n == 0) sum = 0.0 ;
+            else if (n < lenx) sum = sum * lenx / n ;
+            pslitfu[j] = sum ;
+        }
+    }
+    cpl_free(buf) ;
+    cpl_vector_divide_scalar(slitfu, cpl_vector_get_sum(slitfu));
+
+    *slit_func = slitfu ;
+    *spec = cpl_bivector_wrap_vectors(spc, sigma) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reconstruct the rectified model of a collapsed order
+  @param    spec        the spectrum
+  @param    slit_func   the slit function
+  @param    ycen        the trace center per column
+  @param    model       the returned model, rectified (lenx x height)
+  @param    model_ymin  the returned detector row of the first model row,
+                        per column
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_rect_model(
+        const cpl_bivector  *   spec,
+        const cpl_vector    *   slit_func,
+        const cpl_vector    *   ycen,
+        cpl_image           **  model,
+        int                 **  model_ymin)
+{
+    cpl_image       *   img_tmp ;
+    int             *   ycen_int ;
+    double          *   pmodel ;
+    const double    *   pspc ;
+    const double    *   pslitfu ;
+    cpl_size            lenx, height, i, j ;
+
+    lenx = cpl_bivector_get_size(spec) ;
+    height = cpl_vector_get_size(slit_func) ;
+
+    img_tmp = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
+    pmodel = cpl_image_get_data_double(img_tmp);
+    pspc = cpl_bivector_get_x_data_const(spec);
+    pslitfu = cpl_vector_get_data_const(slit_func);
+    for (j=0 ; j<height ; j++)
+        for (i=0 ; i<lenx ; i++)
+            pmodel[i+j*lenx] = pspc[i]*pslitfu[j];
+
+    // detector row of the first model row in each column
+    ycen_int = cr2res_vector_get_int(ycen);
+    for (i=0 ; i<lenx ; i++) ycen_int[i] += 1-(height/2);
+
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        cpl_image_save(img_tmp, "debug_model.fits", CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+    }
+    *model = img_tmp ;
+    *model_ymin = ycen_int ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Median of an array, by selection
+  @param    buf     the values, reordered on output
+  @param    n       the number of values (> 0)
+  @return   the median, the mean of the two central values if n is even
+
+  The k-th smallest value is found in place with Wirth's selection, in
+  linear time on average, without sorting the whole array.
+ */
+/*----------------------------------------------------------------------------*/
+static double cr2res_extract_select_median(
+        double  *   buf,
+        int         n)
+{
+    double      x, tmp, lo ;
+    int         k, l, m, i, j ;
+
+    k = n / 2 ;
+    l = 0 ;
+    m = n - 1 ;
+    while (l < m) {
+        x = buf[k] ;
+        i = l ;
+        j = m ;
+        do {
+            while (buf[i] < x) i++ ;
+            while (x < buf[j]) j-- ;
+            if (i <= j) {
+                tmp = buf[i] ;
+                buf[i] = buf[j] ;
+                buf[j] = tmp ;
+                i++ ;
+                j-- ;
+            }
+        } while (i <= j) ;
+        if (j < k) l = i ;
+        if (k < i) m = j ;
+    }
+    if (n % 2) return buf[k] ;
+
+    /* The lower central value is the largest one below k */
+    lo = buf[0] ;
+    for (i=1 ; i<k ; i++) if (buf[i] > lo) lo = buf[i] ;
+    return 0.5 * (lo + buf[k]) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Paste a rectified trace model into a full frame model
+  @param    model_rect  the rectified model (lenx x height)
+  @param    model_ymin  the detector row of the first model_rect row, per
+                        column
+  @param    model       [in/out] the full frame model
+  @return   0 if ok, -1 otherwise
+
+  Only the non-zero pixels of model_rect are copied, the parts falling
+  outside of the frame are skipped. The updated pixels get a zero error
+  and are flagged as good.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_model_paste(
+        const cpl_image     *   model_rect,
+        const int           *   model_ymin,
+        hdrl_image          *   model)
+{
+    cpl_image       *   img_out ;
+    cpl_image       *   err_out ;
+    const double    *   prect ;
+    double          *   pimg ;
+    double          *   perr ;
+    cpl_binary      *   pbpm_img ;
+    cpl_binary      *   pbpm_err ;
+    cpl_size            lenx, leny, height, x, y, j, pix ;
+    double              val ;
+
+    /* Check Entries */
+    if (model_rect == NULL || model_ymin == NULL || model == NULL) return -1 ;
+
+    img_out = hdrl_image_get_image(model) ;
+    err_out = hdrl_image_get_error(model) ;
+    lenx = cpl_image_get_size_x(img_out) ;
+    leny = cpl_image_get_size_y(img_out) ;
+    height = cpl_image_get_size_y(model_rect) ;
+    if (cpl_image_get_size_x(model_rect) != lenx) {
+        cpl_msg_error(__func__, "Length of rect and img need to be the same");
+        return -1;
+    }
+    prect = cpl_image_get_data_double_const(model_rect) ;
+    pimg = cpl_image_get_data_double(img_out) ;
+    perr = cpl_image_get_data_double(err_out) ;
+    if (prect == NULL || pimg == NULL || perr == NULL) {
+        cpl_msg_error(__func__, "Only double images are supported");
+        return -1;
+    }
+    /* Only touch the existing bad pixel masks */
+    pbpm_img = pbpm_err = NULL ;
+    if (cpl_image_get_bpm_const(img_out) != NULL)
+        pbpm_img = cpl_mask_get_data(cpl_image_get_bpm(img_out)) ;
+    if (cpl_image_get_bpm_const(err_out) != NULL)
+        pbpm_err = cpl_mask_get_data(cpl_image_get_bpm(err_out)) ;
+
+    for (j=0 ; j<height ; j++) {
+        for (x=0 ; x<lenx ; x++) {
+            y = model_ymin[x] - 1 + j ;
+            if (y < 0 || y >= leny) continue ;
+            val = prect[x + j*lenx] ;
+            if (val == 0.0) continue ;
+            pix = x + y*lenx ;
+            pimg[pix] = val ;
+            perr[pix] = 0.0 ;
+            if (pbpm_img != NULL) pbpm_img[pix] = CPL_BINARY_0 ;
+            if (pbpm_err != NULL) pbpm_err[pix] = CPL_BINARY_0 ;
+        }
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create an empty slit decomposition workspace
+  @return   the workspace, to be set up with cr2res_extract_slitdec_ws_set()
+ */
+/*----------------------------------------------------------------------------*/
+static slitdec_ws * cr2res_extract_slitdec_ws_new(void)
+{
+    return cpl_calloc(1, sizeof(slitdec_ws)) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate the buffers of a slit decomposition workspace
+  @param    ws      the workspace
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_ws_clear(slitdec_ws * ws)
+{
+    int     j ;
+
+    if (ws->slitcurves_sw != NULL) {
+        for (j=0 ; j<ws->swath ; j++)
+            cpl_polynomial_delete(ws->slitcurves_sw[j]) ;
+    }
+    cpl_image_delete(ws->img_sw) ;
+    cpl_image_delete(ws->err_sw) ;
+    cpl_free(ws->mask_sw) ;
+    cpl_free(ws->ycen_sw) ;
+    cpl_free(ws->ycen_offset_sw) ;
+    cpl_free(ws->slitcurves_sw) ;
+    cpl_free(ws->sP_old) ;
+    cpl_free(ws->p_bj) ;
+    cpl_free(ws->Aij) ;
+    cpl_free(ws->bj) ;
+    cpl_free(ws->E) ;
+    cpl_free(ws->Aij_x) ;
+    cpl_free(ws->bj_x) ;
+    cpl_free(ws->Adiag) ;
+    cpl_free(ws->omega) ;
+    cpl_free(ws->omega_f) ;
+    cpl_free(ws->omega_iy) ;
+    cpl_free(ws->omega_n) ;
+    cpl_free(ws->p_Aij) ;
+    cpl_free(ws->xi) ;
+    cpl_free(ws->zeta) ;
+    cpl_free(ws->m_zeta) ;
+    cr2res_extract_slitdec_csr_delete(ws->csr) ;
+    cpl_image_delete(ws->img_mad) ;
+    memset(ws, 0, sizeof(slitdec_ws)) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Set up a slit decomposition workspace for a swath geometry
+  @param    ws          the workspace
+  @param    curved      1 for cr2res_extract_slit_func_curved(), 0 for _vert()
+  @param    swath       swath width in pixels (ncols)
+  @param    height      extraction height in pixels (nrows)
+  @param    osample     subpixel oversampling factor
+  @param    delta_x     maximum horizontal shift due to the curvature
+  @param    single_prec 1 to store the geometry weights in single precision
+  @return   0 if ok, -1 otherwise
+
+  Nothing is done if the workspace is already set up for this geometry,
+  so that it can be used for all the swaths and traces of a detector.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_ws_set(
+        slitdec_ws  *   ws,
+        int             curved,
+        int             swath,
+        int             height,
+        int             osample,
+        int             delta_x,
+        int             single_prec)
+{
+    int     ny, nd, nx, j ;
+
+    /* Check Entries */
+    if (ws == NULL || swath < 1 || height < 1 || osample < 1) return -1 ;
+    if (!curved) delta_x = 0 ;
+    single_prec = (single_prec != 0) ;
+
+    /* Reuse the buffers if possible */
+    if (ws->img_sw != NULL && ws->curved == curved && ws->swath == swath &&
+            ws->height == height && ws->osample == osample &&
+            ws->delta_x == delta_x && ws->single_prec == single_prec)
+        return 0 ;
+    cr2res_extract_slitdec_ws_clear(ws) ;
+
+    ws->curved = curved ;
+    ws->swath = swath ;
+    ws->height = height ;
+    ws->osample = osample ;
+    ws->delta_x = delta_x ;
+    ws->single_prec = single_prec ;
+    ny = osample * (height + 1) + 1 ;
+
+    ws->img_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE) ;
+    ws->err_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE) ;
+    ws->mask_sw = cpl_malloc(height * swath * sizeof(int)) ;
+    ws->ycen_sw = cpl_malloc(swath * sizeof(double)) ;
+    ws->sP_old = cpl_malloc(swath * sizeof(double)) ;
+    ws->p_bj = cpl_malloc(swath * sizeof(double)) ;
+    ws->bj = cpl_malloc(ny * sizeof(double)) ;
+    if (!curved) {
+        nd = 2 * osample + 1 ;
+        ws->Aij = cpl_malloc(ny * nd * sizeof(double)) ;
+        ws->E = cpl_malloc(swath * sizeof(double)) ;
+        ws->Aij_x = cpl_malloc(ny * nd * sizeof(double)) ;
+        ws->bj_x = cpl_malloc(ny * sizeof(double)) ;
+        ws->Adiag = cpl_malloc(swath * 3 * sizeof(double)) ;
+        if (single_prec)
+            ws->omega_f = cpl_malloc((osample + 1) * height * swath *
+                    sizeof(float)) ;
+        else
+            ws->omega = cpl_malloc((osample + 1) * height * swath *
+                    sizeof(double)) ;
+        ws->omega_iy = cpl_malloc(height * swath * sizeof(int)) ;
+        ws->omega_n = cpl_malloc(height * swath * sizeof(int)) ;
+    } else {
+        nx = 4 * delta_x + 1 ;
+        if (nx < 3) nx = 3 ;
+        ws->Aij = cpl_malloc(ny * (4 * osample + 1) * sizeof(double)) ;
+        ws->p_Aij = cpl_malloc(swath * nx * sizeof(double)) ;
+        ws->xi = cpl_malloc(swath * ny * 4 * sizeof(xi_ref)) ;
+        ws->zeta = cpl_malloc(swath * height * 3 * (osample + 1) *
+                sizeof(zeta_ref)) ;
+        ws->m_zeta = cpl_malloc(swath * height * sizeof(int)) ;
+        if ((ws->csr = cr2res_extract_slitdec_csr_new(swath, height, ny,
+                        swath * ny * 4, swath * height * 3 * (osample + 1),
+                        single_prec)) == NULL) {
+            cr2res_extract_slitdec_ws_clear(ws) ;
+            return -1 ;
+        }
+        ws->img_mad = cpl_image_new(swath, height, CPL_TYPE_DOUBLE) ;
+        ws->ycen_offset_sw = cpl_malloc(swath * sizeof(int)) ;
+        ws->slitcurves_sw = cpl_malloc(swath * sizeof(cpl_polynomial *)) ;
+        for (j=0 ; j<swath ; j++)
+            ws->slitcurves_sw[j] = cpl_polynomial_new(1) ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a slit decomposition workspace
+  @param    ws      the workspace or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_ws_delete(slitdec_ws * ws)
+{
+    if (ws == NULL) return ;
+    cr2res_extract_slitdec_ws_clear(ws) ;
+    cpl_free(ws) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the slit decomposition geometry of a trace
+  @param    trace_tab   The traces table
+  @param    order       The order
+  @param    trace_id    The Trace
+  @param    height      number of pix above and below mid-line or -1
+  @param    swath       wished width per swath
+  @param    lenx        image size in x
+  @param    leny        image size in y
+  @param    curved      flag to also get the slit curvature
+  @return   the geometry or NULL in error case
+
+  The geometry only depends on the trace table and the image size, it
+  can be used for the extraction of the trace in any frame.
+ */
+/*----------------------------------------------------------------------------*/
+static slitdec_geom * cr2res_extract_slitdec_geom_new(
+        const cpl_table *   trace_tab,
+        int                 order,
+        int                 trace_id,
+        int                 height,
+        int                 swath,
+        cpl_size            lenx,
+        cpl_size            leny,
+        int                 curved)
+{
+    slitdec_geom    *   geom ;
+    cpl_polynomial  *   slitcurve_A ;
+    cpl_polynomial  *   slitcurve_B ;
+    cpl_polynomial  *   slitcurve_C ;
+    double              a, b, c, yc, delta_tmp ;
+    int                 i, x, delta_x ;
+
+    /* The swaths overlap by half their width */
+    if (swath < 2) {
+        cpl_msg_error(__func__, "The swath width must be at least 2") ;
+        cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+        return NULL ;
+    }
+
+    /* Compute height if not given */
+    if (height <= 0) {
+        height = cr2res_trace_get_height(trace_tab, order, trace_id);
+        if (height <= 0) {
+            cpl_msg_error(__func__, "Cannot compute height");
+            return NULL;
+        }
+    }
+    if (height > leny) {
+        height = leny;
+        cpl_msg_warning(__func__,
+                "Given height larger than image, clipping height");
+    }
+
+    geom = cpl_calloc(1, sizeof(slitdec_geom)) ;
+    geom->order = order ;
+    geom->trace_id = trace_id ;
+    geom->lenx = lenx ;
+    geom->height = height ;
+
+    /* Get ycen */
+    if ((geom->ycen = cr2res_trace_get_ycen(trace_tab, order,
+                    trace_id, lenx)) == NULL) {
+        cpl_msg_error(__func__, "Cannot get ycen");
+        cr2res_extract_slitdec_geom_delete(geom) ;
+        return NULL ;
+    }
+    geom->ycen_rest = cr2res_vector_get_rest(geom->ycen);
+
+    delta_x = 0 ;
+    if (curved) {
+        /* Retrieve the polynomials that describe the slit tilt and curv. */
+        slitcurve_A = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_A, order, trace_id);
+        slitcurve_B = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_B, order, trace_id);
+        slitcurve_C = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_C, order, trace_id);
+        if ((slitcurve_A == NULL) || (slitcurve_B == NULL) ||
+                (slitcurve_C == NULL)) {
+            cpl_msg_error(__func__, 
+                    "No (or incomplete) slitcurve data found in trace table");
+            cpl_polynomial_delete(slitcurve_A);
+            cpl_polynomial_delete(slitcurve_B);
+            cpl_polynomial_delete(slitcurve_C);
+            cr2res_extract_slitdec_geom_delete(geom) ;
+            return NULL;
+        }
+
+        /* Maximum horizontal shift in detector pixels due to slit curv. */
+        for (i=1; i<=lenx; i+=swath/2){
+            /* Do a coarse sweep through the order and evaluate the */
+            /* slitcurve polynomials at  +- height/2, update the value. */
+            /* Note: The index i is subtracted from a because the polys */
+            /* have their origin at the edge of the full frame */
+            a = cpl_polynomial_eval_1d(slitcurve_A, i, NULL);
+            b = cpl_polynomial_eval_1d(slitcurve_B, i, NULL);
+            c = cpl_polynomial_eval_1d(slitcurve_C, i, NULL);
+            yc = cpl_vector_get(geom->ycen, i-1);
+
+            // Shift polynomial to local frame
+            // We fix a to 0, see comment in
+            // cr2res_extract_slitdec_curved_rect(), when we create the
+            // polynomials for the extraction
+            a = 0; 
+            b += 2 * yc * c;
+
+            delta_tmp = max( fabs(a + (c*height/2. + b)*height/2.),
+                    fabs(a + (c*height/-2. + b)*height/-2.));
+            if (delta_tmp > delta_x) delta_x = (int)ceil(delta_tmp);
+        }
+        delta_x += 1;
+        cpl_msg_debug(__func__, "Max delta_x from slit curv: %d pix.",
+                delta_x);
+
+        /* Evaluate the slit curvature once for all columns */
+        geom->slitcurve_a = cpl_malloc(lenx*sizeof(double));
+        geom->slitcurve_b = cpl_malloc(lenx*sizeof(double));
+        geom->slitcurve_c = cpl_malloc(lenx*sizeof(double));
+        for (x=1; x<=lenx; x++) {
+            geom->slitcurve_a[x-1] =
+                cpl_polynomial_eval_1d(slitcurve_A, x, NULL);
+            geom->slitcurve_b[x-1] =
+                cpl_polynomial_eval_1d(slitcurve_B, x, NULL);
+            geom->slitcurve_c[x-1] =
+                cpl_polynomial_eval_1d(slitcurve_C, x, NULL);
+        }
+        cpl_polynomial_delete(slitcurve_A);
+        cpl_polynomial_delete(slitcurve_B);
+        cpl_polynomial_delete(slitcurve_C);
+    }
+    geom->delta_x = delta_x ;
+
+    /* Swaths */
+    geom->bins_begin = cpl_vector_new(1);
+    geom->bins_end = cpl_vector_new(1);
+    if ((geom->swath = cr2res_extract_slitdec_adjust_swath(swath, lenx,
+                    delta_x, geom->bins_begin, geom->bins_end)) == -1){
+        cpl_msg_error(__func__, "Cannot calculate swath size");
+        cr2res_extract_slitdec_geom_delete(geom) ;
+        return NULL;
+    }
+    geom->nswaths = cpl_vector_get_size(geom->bins_begin);
+    return geom ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a slit decomposition geometry
+  @param    geom    the geometry or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_geom_delete(slitdec_geom * geom)
+{
+    if (geom == NULL) return ;
+    cpl_vector_delete(geom->ycen) ;
+    cpl_free(geom->ycen_rest) ;
+    cpl_vector_delete(geom->bins_begin) ;
+    cpl_vector_delete(geom->bins_end) ;
+    cpl_free(geom->slitcurve_a) ;
+    cpl_free(geom->slitcurve_b) ;
+    cpl_free(geom->slitcurve_c) ;
+    cpl_free(geom) ;
+}
 
-    /* Fill the table */
-    for (i=0 ; i<nb_traces ; i++) {
-        if (spectrum[i]!=NULL && position[i]!=NULL &&
-                wavelength[i]!=NULL && slit_fraction[i]!=NULL) {
-            order = cpl_table_get(trace_table, CR2RES_COL_ORDER, i, NULL) ;
-            trace_id = cpl_table_get(trace_table, CR2RES_COL_TRACENB, i, NULL) ;
-            pspec = cpl_bivector_get_x_data_const(spectrum[i]) ;
-            perr = cpl_bivector_get_y_data_const(spectrum[i]);
-            pxposition = cpl_bivector_get_x_data_const(position[i]) ;
-            pyposition = cpl_bivector_get_y_data_const(position[i]) ;
-            pwave = cpl_vector_get_data_const(wavelength[i]) ;
-            pslit_frac = cpl_vector_get_data_const(slit_fraction[i]) ;
-            /* Fill SPEC column */
-            col_name = cr2res_dfs_SPEC_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, pspec) ;
-            cpl_free(col_name) ;
-            /* Fill SPEC_ERR column */
-            col_name = cr2res_dfs_SPEC_ERR_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, perr) ;
-            cpl_free(col_name) ;
-            /* Fill WAVELENGTH column */
-            col_name = cr2res_dfs_WAVELENGTH_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, pwave) ;
-            cpl_free(col_name) ;
-            /* Fill POSITIONX column */
-            col_name = cr2res_dfs_POSITIONX_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, pxposition) ;
-            cpl_free(col_name) ;
-            /* Fill POSITIONY column */
-            col_name = cr2res_dfs_POSITIONY_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, pyposition) ;
-            cpl_free(col_name) ;
-            /* Fill SLIT_FRACTION column */
-            col_name = cr2res_dfs_SLIT_FRACTION_colname(order, trace_id) ;
-            cpl_table_copy_data_double(out, col_name, pslit_frac) ;
-            cpl_free(col_name) ;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the slit curvature coefficients of a swath
+  @param    ncols       swath width
+  @param    slitcurves  the curvature polynomials of the swath [ncols]
+  @param    curv        [out] the coefficients of degree 0 to 2 [ncols][3]
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_geom_get_curv(
+        int                 ncols,
+        cpl_polynomial  **  slitcurves,
+        double          *   curv)
+{
+    cpl_size    pow ;
+    int         x ;
+
+    for (x=0 ; x<ncols ; x++)
+        for (pow=0 ; pow<3 ; pow++)
+            curv[3*x+pow] = cpl_polynomial_get_coeff(slitcurves[x], &pow) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Look for the geometry tensors of a swath in the cache
+  @param    cache       the cache
+  @param    order       the order of the trace
+  @param    trace_id    the trace number
+  @param    swath_id    the swath index in the trace
+  @param    ncols       swath width
+  @param    nrows       extraction height
+  @param    osample     oversampling factor
+  @param    ycen        see cr2res_extract_xi_zeta_tensors()
+  @param    ycen_offset
+  @param    y_lower_lim
+  @param    slitcurves
+  @param    single_prec 1 for the tensors with single precision weights
+  @return   the matching entry or NULL
+
+  The returned entry stays valid until the cache is deleted.
+ */
+/*----------------------------------------------------------------------------*/
+static const xi_zeta_entry * cr2res_extract_geom_cache_get(
+        cr2res_extract_geom_cache   *   cache,
+        int                             order,
+        int                             trace_id,
+        int                             swath_id,
+        int                             ncols,
+        int                             nrows,
+        int                             osample,
+        const double                *   ycen,
+        const int                   *   ycen_offset,
+        int                             y_lower_lim,
+        cpl_polynomial              **  slitcurves,
+        int                             single_prec)
+{
+    const xi_zeta_entry *   found ;
+    xi_zeta_entry       *   entry ;
+    double              *   curv ;
+    int                     i, x ;
+
+    /* Check Entries */
+    if (cache == NULL) return NULL ;
+
+    curv = cpl_malloc(3 * ncols * sizeof(double)) ;
+    cr2res_extract_geom_get_curv(ncols, slitcurves, curv) ;
+
+    found = NULL ;
+#pragma omp critical (cr2res_extract_geom_cache)
+    {
+        for (i=0 ; i<cache->nb_entries && found == NULL ; i++) {
+            entry = cache->entries[i] ;
+            if (entry->order != order || entry->trace_id != trace_id ||
+                    entry->swath_id != swath_id || entry->ncols != ncols ||
+                    entry->nrows != nrows || entry->osample != osample ||
+                    entry->y_lower_lim != y_lower_lim ||
+                    entry->csr->single_prec != (single_prec != 0)) continue ;
+            for (x=0 ; x<ncols ; x++) {
+                if (entry->ycen[x] != ycen[x] ||
+                        entry->ycen_offset[x] != ycen_offset[x] ||
+                        entry->curv[3*x] != curv[3*x] ||
+                        entry->curv[3*x+1] != curv[3*x+1] ||
+                        entry->curv[3*x+2] != curv[3*x+2]) break ;
+            }
+            if (x == ncols) found = entry ;
         }
+        if (found != NULL) cache->nb_hits++ ;
+        else cache->nb_misses++ ;
     }
-    return out ;
+    cpl_free(curv) ;
+    return found ;
 }
 
-/** @} */
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Store the geometry tensors of a swath in the cache
+  @param    cache       the cache
+  @param    order       see cr2res_extract_geom_cache_get()
+  @param    trace_id
+  @param    swath_id
+  @param    ncols
+  @param    nrows
+  @param    osample
+  @param    ycen
+  @param    ycen_offset
+  @param    y_lower_lim
+  @param    slitcurves
+  @param    csr         the packed tensors to store, they are copied
+  @return   0 if stored, 1 if the cache is full, -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_geom_cache_add(
+        cr2res_extract_geom_cache   *   cache,
+        int                             order,
+        int                             trace_id,
+        int                             swath_id,
+        int                             ncols,
+        int                             nrows,
+        int                             osample,
+        const double                *   ycen,
+        const int                   *   ycen_offset,
+        int                             y_lower_lim,
+        cpl_polynomial              **  slitcurves,
+        const slitdec_csr           *   csr)
+{
+    xi_zeta_entry   *   entry ;
+    cpl_size            size ;
+    int                 full ;
+
+    /* Check Entries */
+    if (cache == NULL || csr == NULL) return -1 ;
+
+    size = sizeof(xi_zeta_entry) + ncols * (4 * sizeof(double) + sizeof(int))
+        + cr2res_extract_slitdec_csr_get_size(csr) ;
+
+    /* Reserve the room first, the copies are done outside of the lock */
+    full = 0 ;
+#pragma omp critical (cr2res_extract_geom_cache)
+    {
+        if (cache->max_size > 0 && cache->size + size > cache->max_size)
+            full = 1 ;
+        else
+            cache->size += size ;
+    }
+    if (full) return 1 ;
+
+    entry = cpl_malloc(sizeof(xi_zeta_entry)) ;
+    entry->order = order ;
+    entry->trace_id = trace_id ;
+    entry->swath_id = swath_id ;
+    entry->ncols = ncols ;
+    entry->nrows = nrows ;
+    entry->osample = osample ;
+    entry->y_lower_lim = y_lower_lim ;
+    entry->ycen = cpl_malloc(ncols * sizeof(double)) ;
+    memcpy(entry->ycen, ycen, ncols * sizeof(double)) ;
+    entry->ycen_offset = cpl_malloc(ncols * sizeof(int)) ;
+    memcpy(entry->ycen_offset, ycen_offset, ncols * sizeof(int)) ;
+    entry->curv = cpl_malloc(3 * ncols * sizeof(double)) ;
+    cr2res_extract_geom_get_curv(ncols, slitcurves, entry->curv) ;
+    entry->csr = cr2res_extract_slitdec_csr_duplicate(csr) ;
+
+#pragma omp critical (cr2res_extract_geom_cache)
+    {
+        if (cache->nb_entries == cache->nb_alloc) {
+            cache->nb_alloc = 2 * cache->nb_alloc + 16 ;
+            cache->entries = cpl_realloc(cache->entries,
+                    cache->nb_alloc * sizeof(xi_zeta_entry *)) ;
+        }
+        cache->entries[cache->nb_entries++] = entry ;
+    }
+    return 0 ;
+}
 
 /*----------------------------------------------------------------------------*/
 /**
@@ -2427,17 +4729,27 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
   @param    nrows       Extraction slit height in pixels
   @param    osample     Subpixel ovsersampling factor
   @param    im          Image to be decomposed
+  @param    pix_unc     Uncertainty of each pixel of im
   @param    mask        int mask of same dimension as image
   @param    ycen        Order centre line offset from pixel row boundary
   @param    sL          Slit function resulting from decomposition, start
                         guess is input, gets overwriteten with result
   @param    sP          Spectrum resulting from decomposition
   @param    model       the model reconstruction of im
+  @param    unc         [out] the uncertainty of sP
   @param    lambda_sP   Smoothing parameter for the spectrum, could be zero
   @param    lambda_sL   Smoothing parameter for the slit function, usually >0
   @param    sP_stop     Fraction of spectyrum change, stop condition
   @param    maxiter     Max number of iterations
+  @param    slit_func_in    Fixed slit function [ny] or NULL
+  @param    niter       [out] Number of iterations done, or NULL
+  @param    ws          Work buffers, set up for (ncols, nrows, osample)
   @return
+
+  unc is the pix_unc variance propagated through the last spectrum
+  solution, sP = sum(P*im)/sum(P*P) over the good pixels of a column with
+  the model profile P. It is accumulated in the model pass, the spectrum
+  smoothing (lambda_sP) and the slit function error are neglected.
  */
 /*----------------------------------------------------------------------------*/
 static int cr2res_extract_slit_func_vert(
@@ -2456,35 +4768,52 @@ static int cr2res_extract_slit_func_vert(
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double * slit_func_in)
+        const double * slit_func_in,
+        int         *   niter,
+        slitdec_ws  *   ws)
 {
-    int x, y, iy, jy, iy1, iy2, ny, nd, i, j;
-    double step, d1, d2, sum, norm, dev, lambda, diag_tot, sP_change, sP_max;
+    int x, y, iy, jy, iy1, iy2, ny, nd, nw, xy, k, kk;
+    double step, d1, d2, w, sum, norm, dev, lambda, diag_tot, sP_change, sP_max;
     int info, iter, isum;
     /* Initialise */
     nd=2*osample+1;
+    nw=osample+1;           /* Non-zero omega entries per pixel */
     ny=osample*(nrows+1)+1; /* The size of the sf array */
     step=1.e0/osample;
-    double * E = cpl_malloc(ncols*sizeof(double)); // double E[ncols];
-    double * sP_old = cpl_malloc(ncols*sizeof(double)); // double sP_old[ncols];
-    double * Aij = cpl_malloc(ny*(2 * osample + 1)*sizeof(double)); //double Aij[ny*ny];
-    double * bj = cpl_malloc(ny*sizeof(double)); // double bj[ny];
-    // double Adiag[ncols*3];
-    double * Adiag = cpl_malloc(ncols*3*sizeof(double));
-    // double omega[ny][nrows][ncols];
-    double * omega = cpl_malloc(ny*nrows*ncols*sizeof(double));
-    // index as: [iy+(y*ny)+(x*ny*nrows)]
-    double *p_bj   = cpl_malloc(ncols * sizeof(double));
+    /* The work arrays come from the workspace, see slitdec_ws */
+    double * E = ws->E; // double E[ncols];
+    double * sP_old = ws->sP_old; // double sP_old[ncols];
+    double * Aij = ws->Aij; //double Aij[ny][nd], see bandsol()
+    double * bj = ws->bj; // double bj[ny];
+    /* Contribution of a single column to Aij and bj */
+    double * Aij_x = ws->Aij_x;
+    double * bj_x = ws->bj_x;
+    // double Adiag[ncols][3], see tridiag()
+    double * Adiag = ws->Adiag;
+    // double omega[ncols][nrows][nw], or float with ws->single_prec
+    double * omega = ws->omega;
+    float * omega_f = ws->omega_f;
+    int single_prec = ws->single_prec;
+    // index as: [k+(xy*nw)] with xy=y+(x*nrows), for iy=omega_iy[xy]+k
+    int * omega_iy = ws->omega_iy;
+    int * omega_n = ws->omega_n;
+    double *p_bj   = ws->p_bj;
+
+    /* The band corners of Aij are never set below, they must be 0 */
+    memset(Aij, 0, ny*nd*sizeof(double));
 
     /*
-      Construct the omega tensor. Normally it has the dimensionality of
-      ny*nrows*ncols.
-      The tensor is mostly empty and can be easily compressed to ny*nx, but
-      this will complicate matrix operations at later stages. I will keep
-      it as it is for now.
+      Construct the omega tensor. Its full dimensionality is ny*nrows*ncols,
+      but each detector pixel (x,y) only covers the nw=osample+1 subpixels
+      iy1...iy2 of the slit function. Only those are stored, together with
+      the first subpixel omega_iy and the number of entries omega_n (they are
+      clipped to 0...ny-1).
       Note, that omega is used in in the equations for sL, sP and for the model
       but it does not involve the data, only the geometry. Thus it can be
       pre-computed once.
+      With ws->single_prec it is stored in float (omega_f), which halves the
+      memory traffic of the loops below. The products and sums are still
+      done in double.
       */
     for(x=0; x<ncols; x++) {
         iy2 = osample - floor(ycen[x] / step) - 1;
@@ -2498,12 +4827,16 @@ static int cr2res_extract_slit_func_vert(
         for(y=0; y<nrows; y++) {
             iy1+=osample;
             iy2+=osample;
-            for(iy=0; iy<ny; iy++) {
-                if(iy<iy1)                omega[iy+(y*ny)+(x*ny*nrows)] = 0.;
-                else if(iy==iy1)          omega[iy+(y*ny)+(x*ny*nrows)] = d1;
-                else if(iy>iy1 && iy<iy2) omega[iy+(y*ny)+(x*ny*nrows)] = step;
-                else if(iy==iy2)          omega[iy+(y*ny)+(x*ny*nrows)] = d2;
-                else                      omega[iy+(y*ny)+(x*ny*nrows)] = 0.;
+            xy = y+(x*nrows);
+            omega_iy[xy] = max(iy1, 0);
+            omega_n[xy] = 0;
+            for(iy=omega_iy[xy]; iy<=min(iy2, ny-1); iy++) {
+                if(iy==iy1)      w = d1;
+                else if(iy<iy2)  w = step;
+                else             w = d2;
+                if(single_prec)  omega_f[omega_n[xy]+(xy*nw)] = (float)w;
+                else             omega[omega_n[xy]+(xy*nw)] = w;
+                omega_n[xy]++;
             }
         }
     }
@@ -2526,42 +4859,54 @@ static int cr2res_extract_slit_func_vert(
             /* Compute slit function sL */
 
             /* Fill in SLE arrays */
-            diag_tot=0.e0;
             for(iy=0; iy<ny; iy++) {
                 bj[iy]=0.e0;
-                for(jy=max(iy-osample,0); jy<=min(iy+osample,ny-1); jy++) {
-                    Aij[iy+ny*(jy-iy+osample)]=0.e0;
-                    for(x=0; x<ncols; x++) {
-                        sum=0.e0;
-                        for(y=0; y<nrows; y++)
-                            sum+=omega[iy+(y*ny)+(x*ny*nrows)] *
-                                omega[jy+(y*ny)+(x*ny*nrows)]*mask[y*ncols+x];
-                        Aij[iy+ny*(jy-iy+osample)]+=sum*sP[x]*sP[x];
+                for(jy=max(iy-osample,0); jy<=min(iy+osample,ny-1); jy++)
+                    Aij[iy*nd+jy-iy+osample]=0.e0;
+            }
+            for(x=0; x<ncols; x++) {
+                /* Sum over the rows first, only the non-zero omega */
+                for(iy=0; iy<ny*nd; iy++) Aij_x[iy]=0.e0;
+                for(iy=0; iy<ny; iy++) bj_x[iy]=0.e0;
+                for(y=0; y<nrows; y++) {
+                    if(!mask[y*ncols+x]) continue;
+                    xy = y+(x*nrows);
+                    for(k=0; k<omega_n[xy]; k++) {
+                        iy = omega_iy[xy]+k;
+                        w = single_prec ? omega_f[k+(xy*nw)] :
+                            omega[k+(xy*nw)];
+                        for(kk=0; kk<omega_n[xy]; kk++) {
+                            jy = omega_iy[xy]+kk;
+                            Aij_x[iy*nd+jy-iy+osample]+=w * (single_prec ?
+                                omega_f[kk+(xy*nw)] : omega[kk+(xy*nw)]) *
+                                mask[y*ncols+x];
+                        }
+                        bj_x[iy]+=w*mask[y*ncols+x]*im[y*ncols+x];
                     }
                 }
-                for(x=0; x<ncols; x++) {
-                    sum=0.e0;
-                    for(y=0; y<nrows; y++)
-                        sum+=omega[iy+(y*ny)+(x*ny*nrows)]*
-                            mask[y*ncols+x]*im[y*ncols+x];
-                    bj[iy]+=sum*sP[x];
+                for(iy=0; iy<ny; iy++) {
+                    for(jy=max(iy-osample,0); jy<=min(iy+osample,ny-1); jy++)
+                        Aij[iy*nd+jy-iy+osample]+=
+                            Aij_x[iy*nd+jy-iy+osample]*sP[x]*sP[x];
+                    bj[iy]+=bj_x[iy]*sP[x];
                 }
-                diag_tot+=Aij[iy+ny*osample];
             }
+            diag_tot=0.e0;
+            for(iy=0; iy<ny; iy++) diag_tot+=Aij[iy*nd+osample];
 
             /* Scale regularization parameters */
             lambda=lambda_sL*diag_tot/ny;
 
             /* Add regularization parts for the slit function */
-            Aij[ny*osample]    +=lambda;           /* Main diagonal  */
-            Aij[ny*(osample+1)]-=lambda;           /* Upper diagonal */
+            Aij[osample]    +=lambda;              /* Main diagonal  */
+            Aij[osample+1]  -=lambda;              /* Upper diagonal */
             for(iy=1; iy<ny-1; iy++) {
-                Aij[iy+ny*(osample-1)]-=lambda;      /* Lower diagonal */
-                Aij[iy+ny*osample    ]+=lambda*2.e0; /* Main diagonal  */
-                Aij[iy+ny*(osample+1)]-=lambda;      /* Upper diagonal */
+                Aij[iy*nd+osample-1]-=lambda;        /* Lower diagonal */
+                Aij[iy*nd+osample  ]+=lambda*2.e0;   /* Main diagonal  */
+                Aij[iy*nd+osample+1]-=lambda;        /* Upper diagonal */
             }
-            Aij[ny-1+ny*(osample-1)]-=lambda;      /* Lower diagonal */
-            Aij[ny-1+ny*osample]    +=lambda;      /* Main diagonal  */
+            Aij[(ny-1)*nd+osample-1]-=lambda;      /* Lower diagonal */
+            Aij[(ny-1)*nd+osample]  +=lambda;      /* Main diagonal  */
 
             /* Solve the system of equations */
             info=cr2res_extract_slitdec_bandsol(Aij, bj, ny, nd, lambda);
@@ -2579,18 +4924,20 @@ static int cr2res_extract_slit_func_vert(
 
         /* Compute spectrum sP */
         for(x=0; x<ncols; x++) {
-            Adiag[x]=0.e0;
-            Adiag[x+ncols]=0.e0;
-            Adiag[x+2 *ncols]=0.e0;
+            Adiag[3*x]=0.e0;
+            Adiag[3*x+1]=0.e0;
+            Adiag[3*x+2]=0.e0;
 
             E[x]=0.e0;
             for(y=0; y<nrows; y++) {
+                xy = y+(x*nrows);
                 sum=0.e0;
-                for(iy=0; iy<ny; iy++) {
-                    sum+=omega[iy+(y*ny)+(x*ny*nrows)]*sL[iy];
+                for(k=0; k<omega_n[xy]; k++) {
+                    sum+=(single_prec ? omega_f[k+(xy*nw)] :
+                            omega[k+(xy*nw)])*sL[omega_iy[xy]+k];
                 }
 
-                Adiag[x+ncols]+=sum*sum*mask[y*ncols+x];
+                Adiag[3*x+1]+=sum*sum*mask[y*ncols+x];
                 E[x]+=sum*im[y*ncols+x]*mask[y*ncols+x];
             }
         }
@@ -2602,34 +4949,43 @@ static int cr2res_extract_slit_func_vert(
             }
             norm/=ncols;
             lambda=lambda_sP*norm;
-            Adiag[0        ]  = 0.e0;
-            Adiag[0+ncols  ] += lambda;
-            Adiag[0+ncols*2] -= lambda;
+            Adiag[0] = 0.e0;
+            Adiag[1] += lambda;
+            Adiag[2] -= lambda;
             for(x=1; x<ncols-1; x++) {
-                Adiag[x]=-lambda;
-                Adiag[x+ncols  ]+= 2.e0*lambda;
-                Adiag[x+ncols*2] =-lambda;
+                Adiag[3*x  ] =-lambda;
+                Adiag[3*x+1]+= 2.e0*lambda;
+                Adiag[3*x+2] =-lambda;
             }
-            Adiag[ncols - 1            ] -= lambda;
-            Adiag[ncols - 1 +     ncols] += lambda;
-            Adiag[ncols - 1 + 2 * ncols] = 0.e0;
+            Adiag[3*(ncols-1)  ] -= lambda;
+            Adiag[3*(ncols-1)+1] += lambda;
+            Adiag[3*(ncols-1)+2] = 0.e0;
 
-            info=cr2res_extract_slitdec_bandsol(Adiag, E, ncols, 3, lambda);
+            info=cr2res_extract_slitdec_tridiag(Adiag, E, ncols, lambda);
             for(x=0; x<ncols; x++) sP[x]=E[x];
         } else {
             for(x=0; x<ncols; x++) {
                 sP_old[x]=sP[x];
-                sP[x]=E[x]/Adiag[x+ncols];
+                sP[x]=E[x]/Adiag[3*x+1];
             }
         }
 
-        /* Compute the model */
+        /* Compute the model, and the variance of sP on the way */
+        for(x=0; x<ncols; x++) {
+            unc[x]=0.e0;
+            p_bj[x]=0.e0;
+        }
         for(y=0; y<nrows; y++) {
             for(x=0; x<ncols; x++) {
+                xy = y+(x*nrows);
                 sum=0.e0;
-                for(iy=0; iy<ny; iy++)
-                    sum+=omega[iy+(y*ny)+(x*ny*nrows)]*sL[iy];
+                for(k=0; k<omega_n[xy]; k++)
+                    sum+=(single_prec ? omega_f[k+(xy*nw)] :
+                            omega[k+(xy*nw)])*sL[omega_iy[xy]+k];
                 model[y*ncols+x]=sum*sP[x];
+                w=sum*sum*mask[y*ncols+x];
+                unc[x]+=w*pix_unc[y*ncols+x]*pix_unc[y*ncols+x];
+                p_bj[x]+=w;
             }
         }
 
@@ -2663,37 +5019,12 @@ static int cr2res_extract_slit_func_vert(
         }
         /* Check the convergence */
     } while(iter++ < maxiter && sP_change > sP_stop*sP_max);
+    if (niter != NULL) *niter = iter;
 
-    /* Uncertainty estimate */
-    for (x = 0; x < ncols; x++) {
-        unc[x] = 0.;
-        p_bj[x] = 0.;
-    }
-    for (x = 0; x < ncols; x++) {
-        // Loop through all pixels contributing to x
-        for (y = 0; y < nrows; y++) {
-            unc[x] += (im[y * ncols + x] - model[y * ncols + x]) *
-                (im[y * ncols + x] - model[y * ncols + x]) *
-                sL[y] * mask[y * ncols + x];
-            unc[x] += pix_unc[y * ncols + x] * pix_unc[y * ncols + x] *
-                sL[y] * mask[y * ncols + x];
-            // Norm
-            p_bj[x] += sL[y] * mask[y * ncols + x];
-        }
-        
-    }
-    for (x = 0; x < ncols; x++) {
-        unc[x] = sqrt(unc[x] / p_bj[x] * nrows);
-    }
-
-
-    cpl_free(E);
-    cpl_free(sP_old);
-    cpl_free(omega);
-    cpl_free(Aij);
-    cpl_free(bj);
-    cpl_free(Adiag);
-    cpl_free(p_bj);
+    /* Uncertainty of sP=E/Adiag, propagated from pix_unc */
+    /* A fully masked column has no weight, and no uncertainty */
+    for (x = 0; x < ncols; x++)
+        unc[x] = p_bj[x] > 0 ? sqrt(unc[x]) / p_bj[x] : 0.0;
 
     return 0;
 }
@@ -2742,9 +5073,11 @@ static int cr2res_extract_xi_zeta_tensors(
         zeta_ref *  zeta,
         int      *  m_zeta)
 {
-    int x, xx, y, yy, ix, ix1, ix2, iy, iy1, iy2, m;
+    int x, xx, y, yy, ix, ix1, ix2, iy, iy1, iy2, m, mz_max;
     double step, delta, dy, w, d1, d2;
     step = 1.e0 / osample;
+    /* Capacity of zeta per detector pixel, see the allocation */
+    mz_max = 3 * (osample + 1);
 
     /* Clean xi */
     for (x = 0; x < ncols; x++)
@@ -2766,7 +5099,7 @@ static int cr2res_extract_xi_zeta_tensors(
         for (y = 0; y < nrows; y++)
         {
             m_zeta[mzeta_index(x, y)] = 0;
-            for (ix = 0; ix < 3 * (osample + 1); ix++)
+            for (ix = 0; ix < mz_max; ix++)
             {
                 zeta[zeta_index(x, y, ix)].x = -1;
                 zeta[zeta_index(x, y, ix)].iy = -1;
@@ -2883,7 +5216,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 3)].x = xx;
                             xi[xi_index(x, iy, 3)].y = yy;
                             xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -2903,7 +5237,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 2)].x = xx;
                             xi[xi_index(x, iy, 2)].y = yy;
                             xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -2922,7 +5257,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 2)].x = xx;
                             xi[xi_index(x, iy, 2)].y = yy;
                             xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -2935,7 +5271,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 3)].x = xx;
                             xi[xi_index(x, iy, 3)].y = yy;
                             xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -2952,7 +5289,8 @@ static int cr2res_extract_xi_zeta_tensors(
                         xi[xi_index(x, iy, 2)].x = xx;
                         xi[xi_index(x, iy, 2)].y = yy;
                         xi[xi_index(x, iy, 2)].w = w;
-                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0 &&
+                                m_zeta[mzeta_index(xx, yy)] < mz_max)
                         {
                             m = m_zeta[mzeta_index(xx, yy)];
                             zeta[zeta_index(xx, yy, m)].x = x;
@@ -2973,7 +5311,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 1)].x = xx;
                             xi[xi_index(x, iy, 1)].y = yy;
                             xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -2986,7 +5325,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 0)].x = xx;
                             xi[xi_index(x, iy, 0)].y = yy;
                             xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3005,7 +5345,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 0)].x = xx;
                             xi[xi_index(x, iy, 0)].y = yy;
                             xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3018,7 +5359,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 1)].x = xx;
                             xi[xi_index(x, iy, 1)].y = yy;
                             xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3035,7 +5377,8 @@ static int cr2res_extract_xi_zeta_tensors(
                         xi[xi_index(x, iy, 0)].x = xx;
                         xi[xi_index(x, iy, 0)].y = yy;
                         xi[xi_index(x, iy, 0)].w = w;
-                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0 &&
+                                m_zeta[mzeta_index(xx, yy)] < mz_max)
                         {
                             m = m_zeta[mzeta_index(xx, yy)];
                             zeta[zeta_index(xx, yy, m)].x = x;
@@ -3056,7 +5399,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 1)].x = xx;
                             xi[xi_index(x, iy, 1)].y = yy;
                             xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3069,7 +5413,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 0)].x = xx;
                             xi[xi_index(x, iy, 0)].y = yy;
                             xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3088,7 +5433,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 1)].x = xx;
                             xi[xi_index(x, iy, 1)].y = yy;
                             xi[xi_index(x, iy, 1)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3101,7 +5447,8 @@ static int cr2res_extract_xi_zeta_tensors(
                             xi[xi_index(x, iy, 0)].x = xx;
                             xi[xi_index(x, iy, 0)].y = yy;
                             xi[xi_index(x, iy, 0)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0 &&
+                                    m_zeta[mzeta_index(xx, yy)] < mz_max)
                             {
                                 m = m_zeta[mzeta_index(xx, yy)];
                                 zeta[zeta_index(xx, yy, m)].x = x;
@@ -3118,7 +5465,8 @@ static int cr2res_extract_xi_zeta_tensors(
                         xi[xi_index(x, iy, 0)].x = xx;
                         xi[xi_index(x, iy, 0)].y = yy;
                         xi[xi_index(x, iy, 0)].w = w;
-                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                        if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0 &&
+                                m_zeta[mzeta_index(xx, yy)] < mz_max)
                         {
                             m = m_zeta[mzeta_index(xx, yy)];
                             zeta[zeta_index(xx, yy, m)].x = x;
@@ -3134,6 +5482,261 @@ static int cr2res_extract_xi_zeta_tensors(
     return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Allocate packed geometry tensors of the curved slit decomposition
+  @param    ncols       Swath width in pixels
+  @param    nrows       Extraction slit height in pixels
+  @param    ny          Size of the slit function array
+  @param    nxi         Room for the xi references (of each group)
+  @param    nzeta       Room for the zeta references
+  @param    single_prec 1 for float weights, 0 for double
+  @return   the packed tensors, to be filled with
+            cr2res_extract_slitdec_csr_fill(), or NULL in error case
+
+  The indices are stored on 16 bits, ncols and ny must not exceed USHRT_MAX.
+ */
+/*----------------------------------------------------------------------------*/
+static slitdec_csr * cr2res_extract_slitdec_csr_new(
+        int             ncols,
+        int             nrows,
+        int             ny,
+        int             nxi,
+        int             nzeta,
+        int             single_prec)
+{
+    slitdec_csr     *   csr ;
+
+    /* Check Entries */
+    if (ncols < 1 || nrows < 1 || ny < 1 || nxi < 0 || nzeta < 0) return NULL;
+    if (ncols > USHRT_MAX || ny > USHRT_MAX) return NULL ;
+    if (nxi == 0) nxi = 1 ;
+    if (nzeta == 0) nzeta = 1 ;
+
+    csr = cpl_calloc(1, sizeof(slitdec_csr)) ;
+    csr->ncols = ncols ;
+    csr->nrows = nrows ;
+    csr->ny = ny ;
+    csr->single_prec = (single_prec != 0) ;
+    csr->l_start = cpl_malloc((ny + 1) * sizeof(int)) ;
+    csr->l_x = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->l_xx = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->l_yy = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->p_start = cpl_malloc((ncols + 1) * sizeof(int)) ;
+    csr->p_iy = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->p_xx = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->p_yy = cpl_malloc(nxi * sizeof(unsigned short)) ;
+    csr->z_start = cpl_malloc((nrows * ncols + 1) * sizeof(int)) ;
+    csr->z_x = cpl_malloc(nzeta * sizeof(unsigned short)) ;
+    csr->z_iy = cpl_malloc(nzeta * sizeof(unsigned short)) ;
+    if (csr->single_prec) {
+        csr->l_w_f = cpl_malloc(nxi * sizeof(float)) ;
+        csr->p_w_f = cpl_malloc(nxi * sizeof(float)) ;
+        csr->z_w_f = cpl_malloc(nzeta * sizeof(float)) ;
+    } else {
+        csr->l_w = cpl_malloc(nxi * sizeof(double)) ;
+        csr->p_w = cpl_malloc(nxi * sizeof(double)) ;
+        csr->z_w = cpl_malloc(nzeta * sizeof(double)) ;
+    }
+    csr->l_start[0] = csr->p_start[0] = csr->z_start[0] = 0 ;
+    return csr ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Pack the geometry tensors of a swath
+  @param    csr     the packed tensors, with enough room
+  @param    ncols   Swath width in pixels
+  @param    nrows   Extraction slit height in pixels
+  @param    ny      Size of the slit function array
+  @param    xi      the tensors of cr2res_extract_xi_zeta_tensors()
+  @param    zeta
+  @param    m_zeta
+  @return   void
+
+  The xi references are kept if they have a weight, and fall on a pixel
+  of the swath that has zeta references, as in the equations for sL and
+  sP. The references keep the order of the loops over xi and zeta, so
+  that the sums are done in the same order.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_csr_fill(
+        slitdec_csr     *   csr,
+        int                 ncols,
+        int                 nrows,
+        int                 ny,
+        const xi_ref    *   xi,
+        const zeta_ref  *   zeta,
+        const int       *   m_zeta)
+{
+    const xi_ref    *   ref ;
+    int                 x, y, iy, n, m, k ;
+
+    csr->ncols = ncols ;
+    csr->nrows = nrows ;
+    csr->ny = ny ;
+
+    /* xi, grouped by subpixel */
+    k = 0 ;
+    for (iy = 0; iy < ny; iy++) {
+        csr->l_start[iy] = k ;
+        for (x = 0; x < ncols; x++) {
+            for (n = 0; n < 4; n++) {
+                ref = &(xi[xi_index(x, iy, n)]) ;
+                if (!(ref->w > 0) || ref->x < 0 || ref->x >= ncols ||
+                        ref->y < 0 || ref->y >= nrows ||
+                        m_zeta[mzeta_index(ref->x, ref->y)] <= 0) continue ;
+                csr->l_x[k] = x ;
+                csr->l_xx[k] = ref->x ;
+                csr->l_yy[k] = ref->y ;
+                if (csr->single_prec) csr->l_w_f[k] = (float)ref->w ;
+                else csr->l_w[k] = ref->w ;
+                k++ ;
+            }
+        }
+    }
+    csr->l_start[ny] = k ;
+    csr->nxi = k ;
+
+    /* xi, grouped by column */
+    k = 0 ;
+    for (x = 0; x < ncols; x++) {
+        csr->p_start[x] = k ;
+        for (iy = 0; iy < ny; iy++) {
+            for (n = 0; n < 4; n++) {
+                ref = &(xi[xi_index(x, iy, n)]) ;
+                if (!(ref->w > 0) || ref->x < 0 || ref->x >= ncols ||
+                        ref->y < 0 || ref->y >= nrows ||
+                        m_zeta[mzeta_index(ref->x, ref->y)] <= 0) continue ;
+                csr->p_iy[k] = iy ;
+                csr->p_xx[k] = ref->x ;
+                csr->p_yy[k] = ref->y ;
+                if (csr->single_prec) csr->p_w_f[k] = (float)ref->w ;
+                else csr->p_w[k] = ref->w ;
+                k++ ;
+            }
+        }
+    }
+    csr->p_start[ncols] = k ;
+
+    /* zeta, grouped by detector pixel */
+    k = 0 ;
+    for (y = 0; y < nrows; y++) {
+        for (x = 0; x < ncols; x++) {
+            csr->z_start[mzeta_index(x, y)] = k ;
+            for (m = 0; m < m_zeta[mzeta_index(x, y)]; m++) {
+                csr->z_x[k] = zeta[zeta_index(x, y, m)].x ;
+                csr->z_iy[k] = zeta[zeta_index(x, y, m)].iy ;
+                if (csr->single_prec)
+                    csr->z_w_f[k] = (float)zeta[zeta_index(x, y, m)].w ;
+                else
+                    csr->z_w[k] = zeta[zeta_index(x, y, m)].w ;
+                k++ ;
+            }
+        }
+    }
+    csr->z_start[nrows * ncols] = k ;
+    csr->nzeta = k ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Copy packed geometry tensors, with just the room they need
+  @param    csr     the packed tensors
+  @return   the copy or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+static slitdec_csr * cr2res_extract_slitdec_csr_duplicate(
+        const slitdec_csr   *   csr)
+{
+    slitdec_csr     *   dup ;
+    int                 nxi, nzeta ;
+
+    /* Check Entries */
+    if (csr == NULL) return NULL ;
+
+    nxi = csr->nxi ;
+    nzeta = csr->nzeta ;
+    if ((dup = cr2res_extract_slitdec_csr_new(csr->ncols, csr->nrows,
+                    csr->ny, nxi, nzeta, csr->single_prec)) == NULL)
+        return NULL ;
+    dup->nxi = nxi ;
+    dup->nzeta = nzeta ;
+    memcpy(dup->l_start, csr->l_start, (csr->ny + 1) * sizeof(int)) ;
+    memcpy(dup->l_x, csr->l_x, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->l_xx, csr->l_xx, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->l_yy, csr->l_yy, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->p_start, csr->p_start, (csr->ncols + 1) * sizeof(int)) ;
+    memcpy(dup->p_iy, csr->p_iy, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->p_xx, csr->p_xx, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->p_yy, csr->p_yy, nxi * sizeof(unsigned short)) ;
+    memcpy(dup->z_start, csr->z_start,
+            (csr->nrows * csr->ncols + 1) * sizeof(int)) ;
+    memcpy(dup->z_x, csr->z_x, nzeta * sizeof(unsigned short)) ;
+    memcpy(dup->z_iy, csr->z_iy, nzeta * sizeof(unsigned short)) ;
+    if (csr->single_prec) {
+        memcpy(dup->l_w_f, csr->l_w_f, nxi * sizeof(float)) ;
+        memcpy(dup->p_w_f, csr->p_w_f, nxi * sizeof(float)) ;
+        memcpy(dup->z_w_f, csr->z_w_f, nzeta * sizeof(float)) ;
+    } else {
+        memcpy(dup->l_w, csr->l_w, nxi * sizeof(double)) ;
+        memcpy(dup->p_w, csr->p_w, nxi * sizeof(double)) ;
+        memcpy(dup->z_w, csr->z_w, nzeta * sizeof(double)) ;
+    }
+    return dup ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the memory used by packed geometry tensors
+  @param    csr     the packed tensors, as returned by _duplicate()
+  @return   the size in bytes
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_extract_slitdec_csr_get_size(
+        const slitdec_csr   *   csr)
+{
+    cpl_size    wsize ;
+
+    if (csr == NULL) return 0 ;
+    wsize = csr->single_prec ? sizeof(float) : sizeof(double) ;
+    return sizeof(slitdec_csr)
+        + ((cpl_size)csr->ny + csr->ncols + csr->nrows * csr->ncols + 3)
+            * sizeof(int)
+        + 2 * (cpl_size)csr->nxi * (3 * sizeof(unsigned short) + wsize)
+        + (cpl_size)csr->nzeta * (2 * sizeof(unsigned short) + wsize) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate packed geometry tensors
+  @param    csr     the packed tensors or NULL
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_csr_delete(slitdec_csr * csr)
+{
+    if (csr == NULL) return ;
+    cpl_free(csr->l_start) ;
+    cpl_free(csr->l_x) ;
+    cpl_free(csr->l_xx) ;
+    cpl_free(csr->l_yy) ;
+    cpl_free(csr->l_w) ;
+    cpl_free(csr->l_w_f) ;
+    cpl_free(csr->p_start) ;
+    cpl_free(csr->p_iy) ;
+    cpl_free(csr->p_xx) ;
+    cpl_free(csr->p_yy) ;
+    cpl_free(csr->p_w) ;
+    cpl_free(csr->p_w_f) ;
+    cpl_free(csr->z_start) ;
+    cpl_free(csr->z_x) ;
+    cpl_free(csr->z_iy) ;
+    cpl_free(csr->z_w) ;
+    cpl_free(csr->z_w_f) ;
+    cpl_free(csr) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Slit decomposition of single swath with slit tilt & curvature
@@ -3150,6 +5753,9 @@ static int cr2res_extract_xi_zeta_tensors(
   @param PSF_curve  Slit curvature
   @param delta_x    Maximum horizontal shift in detector pixels due to slit
                     image curvature
+  @param csr        Geometry tensors of the swath, as computed by
+                    cr2res_extract_xi_zeta_tensors() and packed by
+                    cr2res_extract_slitdec_csr_fill()
   @param sL         Slit function resulting from decomposition    [ny]
   @param sP         Spectrum resulting from decomposition      [ncols]
   @param model      Model constructed from sp and sf
@@ -3158,6 +5764,9 @@ static int cr2res_extract_xi_zeta_tensors(
   @param lambda_sL  Smoothing parameter for the slit function, usually>0
   @param sP_stop
   @param maxiter
+  @param slit_func_in   Fixed slit function [ny] or NULL
+  @param niter      [out] Number of iterations done, or NULL
+  @param ws         Work buffers, set up for (ncols, nrows, osample, delta_x)
   @return
  */
 /*----------------------------------------------------------------------------*/
@@ -3173,6 +5782,7 @@ static int cr2res_extract_slit_func_curved(
         int         y_lower_lim,
         cpl_polynomial  ** slitcurves,
         int         delta_x,
+        const slitdec_csr   *   csr,
         double  *   sL,
         double  *   sP,
         double  *   model,
@@ -3181,44 +5791,38 @@ static int cr2res_extract_slit_func_curved(
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double  *   slit_func_in)
+        const double  *   slit_func_in,
+        int         *   niter,
+        slitdec_ws  *   ws)
 {
-    int         x, xx, xxx, y, yy, iy, jy, n, m, ny, y_upper_lim, i, nx;
+    int         x, xx, xxx, y, iy, jy, ny, nd, y_upper_lim, i, nx;
+    int         e, z, xy;
     double      sum, norm, dev, lambda, diag_tot, ww, www, sP_change, sP_max;
     double      tmp, mad;
     int         info, iter, isum;
+    int         single_prec = csr->single_prec;
 
-    cpl_image * img_mad = cpl_image_new(ncols, nrows, CPL_TYPE_DOUBLE);
+    cpl_image * img_mad = ws->img_mad;
 
     /* The size of the sL array. */
     /* Extra osample is because ycen can be between 0 and 1. */
     ny = osample * (nrows + 1) + 1;
+    nd = 4 * osample + 1;
     nx = 4 * delta_x + 1;
     if(nx < 3) nx = 3;
 
     y_upper_lim = nrows - 1 - y_lower_lim;
-    double *sP_old = cpl_malloc(ncols * sizeof(double));
-    double *l_Aij  = cpl_malloc(ny * (4*osample+1) * sizeof(double));
-    double *p_Aij  = cpl_malloc(ncols * nx * sizeof(double));
-    double *l_bj   = cpl_malloc(ny * sizeof(double));
-    double *p_bj   = cpl_malloc(ncols * sizeof(double));
-
-    /*
-       Convolution tensor telling the coordinates of detector pixels on which
-       {x, iy} element falls and the corresponding projections. [ncols][ny][4]
-     */
-    xi_ref * xi = cpl_malloc(ncols * ny * 4 * sizeof(xi_ref));
-
-    /* Convolution tensor telling the coordinates of subpixels {x, iy}
-       contributing to detector pixel {x, y}. [ncols][nrows][3*(osample+1)]
-     */
-    zeta_ref * zeta = cpl_malloc(ncols * nrows * 3 * (osample + 1) * sizeof(zeta_ref));
-
-    /* The actual number of contributing elements in zeta  [ncols][nrows]  */
-    int * m_zeta = cpl_malloc(ncols * nrows * sizeof(int));
-
-    i = cr2res_extract_xi_zeta_tensors(ncols, nrows, ny, ycen, ycen_offset,
-            y_lower_lim, osample, slitcurves, xi, zeta, m_zeta);
+    /* The work arrays come from the workspace, see slitdec_ws */
+    double *sP_old = ws->sP_old;        /* [ncols]                 */
+    double *l_Aij  = ws->Aij;           /* [ny][nd], see bandsol() */
+    double *p_Aij  = ws->p_Aij;         /* [ncols][nx]             */
+    double *l_bj   = ws->bj;            /* [ny]                    */
+    double *p_bj   = ws->p_bj;          /* [ncols]                 */
+
+    /* img_mad starts clean, as if it was new */
+    memset(cpl_image_get_data_double(img_mad), 0,
+            ncols * nrows * sizeof(double));
+    cpl_image_accept_all(img_mad);
 
     // If a slit func is given, use that instead of recalculating it
     if (slit_func_in != NULL){
@@ -3232,30 +5836,6 @@ static int cr2res_extract_slit_func_curved(
         for(iy=0; iy<ny; iy++) sL[iy]/=norm;
     }
 
-    /* Loop through sL , sP reconstruction until convergence is reached */
-    if (slit_func_in != NULL){
-        // Normalize the input just in case
-        norm = 0.e0;
-        for(iy = 0; iy < ny; iy++) {
-            sL[iy] = slit_func_in[iy];
-            norm += sL[iy];
-        }
-        norm /= osample;
-        for(iy=0; iy<ny; iy++) sL[iy]/=norm;
-    }
-
-    /* Loop through sL , sP reconstruction until convergence is reached */
-    if (slit_func_in != NULL){
-        // Normalize the input just in case
-        norm = 0.e0;
-        for(iy = 0; iy < ny; iy++) {
-            sL[iy] = slit_func_in[iy];
-            norm += sL[iy];
-        }
-        norm /= osample;
-        for(iy=0; iy<ny; iy++) sL[iy]/=norm;
-    }
-
     /* Loop through sL , sP reconstruction until convergence is reached */
     iter = 0;
     do {
@@ -3266,58 +5846,49 @@ static int cr2res_extract_slit_func_curved(
                 l_bj[iy] = 0.e0;
                 /* Clean RHS                */
                 for (jy = 0; jy <= 4 * osample; jy++)
-                    l_Aij[iy + ny * jy] = 0.e0;
+                    l_Aij[iy * nd + jy] = 0.e0;
             }
             /* Fill in SLE arrays for slit function */
+            /* Only the xi references of pixels in the swath are packed */
             diag_tot = 0.e0;
             for (iy = 0; iy < ny; iy++) {
-                for (x = 0; x < ncols; x++) {
-                    for (n = 0; n < 4; n++) {
-                        ww = xi[xi_index(x,iy,n)].w;
-                        if (ww > 0) {
-                            xx = xi[xi_index(x,iy,n)].x;
-                            yy = xi[xi_index(x,iy,n)].y;
-                            if (m_zeta[mzeta_index(xx,yy)] > 0 && xx >= 0 && xx < ncols &&
-                                    yy >= 0 && yy < nrows) {
-                                for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
-                                    xxx = zeta[zeta_index(xx,yy,m)].x;
-                                    jy = zeta[zeta_index(xx,yy,m)].iy;
-                                    www = zeta[zeta_index(xx,yy,m)].w;
-                                    l_Aij[iy + ny * (jy - iy + 2 * osample)] +=
-                                        sP[xxx] * sP[x] * www * ww * mask[yy *
-                                        ncols + xx];
-                                }
-                                l_bj[iy] += im[yy * ncols + xx] * mask[yy * ncols +
-                                    xx] * sP[x] * ww;
-                            }
-                        }
+                for (e = csr->l_start[iy]; e < csr->l_start[iy+1]; e++) {
+                    x = csr->l_x[e];
+                    xy = csr->l_yy[e] * ncols + csr->l_xx[e];
+                    ww = single_prec ? csr->l_w_f[e] : csr->l_w[e];
+                    for (z = csr->z_start[xy]; z < csr->z_start[xy+1]; z++) {
+                        xxx = csr->z_x[z];
+                        jy = csr->z_iy[z];
+                        www = single_prec ? csr->z_w_f[z] : csr->z_w[z];
+                        l_Aij[iy * nd + jy - iy + 2 * osample] +=
+                            sP[xxx] * sP[x] * www * ww * mask[xy];
                     }
+                    l_bj[iy] += im[xy] * mask[xy] * sP[x] * ww;
                 }
-                diag_tot += l_Aij[iy + ny * 2 * osample];
+                diag_tot += l_Aij[iy * nd + 2 * osample];
             }
             /* Scale regularization parameters */
             lambda = lambda_sL * diag_tot / ny;
             /* Add regularization parts for the SLE matrix */
             /* Main diagonal  */
-            l_Aij[ny * 2 * osample] += lambda;
+            l_Aij[2 * osample] += lambda;
             /* Upper diagonal */
-            l_Aij[ny * (2 * osample + 1)] -= lambda;
+            l_Aij[2 * osample + 1] -= lambda;
             for (iy = 1; iy < ny - 1; iy++) {
                 /* Lower diagonal */
-                l_Aij[iy + ny * (2 * osample - 1)] -= lambda;
+                l_Aij[iy * nd + 2 * osample - 1] -= lambda;
                 /* Main diagonal  */
-                l_Aij[iy + ny * 2 * osample] += lambda * 2.e0;
+                l_Aij[iy * nd + 2 * osample] += lambda * 2.e0;
                 /* Upper diagonal */
-                l_Aij[iy + ny * (2 * osample + 1)] -= lambda;
+                l_Aij[iy * nd + 2 * osample + 1] -= lambda;
             }
             /* Lower diagonal */
-            l_Aij[ny - 1 + ny * (2 * osample - 1)] -= lambda;
+            l_Aij[(ny - 1) * nd + 2 * osample - 1] -= lambda;
             /* Main diagonal  */
-            l_Aij[ny - 1 + ny * 2 * osample] += lambda;
+            l_Aij[(ny - 1) * nd + 2 * osample] += lambda;
 
             /* Solve the system of equations */
-            info = cr2res_extract_slitdec_bandsol(l_Aij, l_bj, ny,
-                4 * osample + 1, lambda);
+            info = cr2res_extract_slitdec_bandsol(l_Aij, l_bj, ny, nd, lambda);
             if (info) cpl_msg_error(__func__, "info(sL)=%d\n", info);
 
             /* Normalize the slit function */
@@ -3332,31 +5903,22 @@ static int cr2res_extract_slit_func_curved(
 
         /*  Compute spectrum sP */
         for (x = 0; x < ncols; x++) {
-            for (xx = 0; xx < nx; xx++) p_Aij[xx * ncols + x] = 0.;
+            for (xx = 0; xx < nx; xx++) p_Aij[x * nx + xx] = 0.;
             p_bj[x] = 0;
         }
         for (x = 0; x < ncols; x++) {
-            for (iy = 0; iy < ny; iy++) {
-                for (n=0; n < 4; n++) {
-                    ww = xi[xi_index(x,iy,n)].w;
-                    if (ww > 0) {
-                        xx = xi[xi_index(x,iy,n)].x;
-                        yy = xi[xi_index(x,iy,n)].y;
-                        if (m_zeta[mzeta_index(xx,yy)] > 0 && xx >= 0 && 
-                            xx < ncols && yy >= 0 && yy < nrows) {
-                            for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
-                                xxx = zeta[zeta_index(xx,yy,m)].x;
-                                jy = zeta[zeta_index(xx,yy,m)].iy;
-                                www = zeta[zeta_index(xx,yy,m)].w;
-                                p_Aij[x + ncols * (xxx - x + 2 * delta_x)] += 
-                                    sL[jy] * sL[iy] * www * ww * 
-                                    mask[yy * ncols + xx];
-                            }
-                            p_bj[x] += im[yy * ncols + xx] * mask[yy * ncols +
-                                xx] * sL[iy] * ww;
-                        }
-                    }
+            for (e = csr->p_start[x]; e < csr->p_start[x+1]; e++) {
+                iy = csr->p_iy[e];
+                xy = csr->p_yy[e] * ncols + csr->p_xx[e];
+                ww = single_prec ? csr->p_w_f[e] : csr->p_w[e];
+                for (z = csr->z_start[xy]; z < csr->z_start[xy+1]; z++) {
+                    xxx = csr->z_x[z];
+                    jy = csr->z_iy[z];
+                    www = single_prec ? csr->z_w_f[z] : csr->z_w[z];
+                    p_Aij[x * nx + xxx - x + 2 * delta_x] +=
+                        sL[jy] * sL[iy] * www * ww * mask[xy];
                 }
+                p_bj[x] += im[xy] * mask[xy] * sL[iy] * ww;
             }
         }
 
@@ -3369,20 +5931,20 @@ static int cr2res_extract_slit_func_curved(
             }
             norm /= ncols;
             lambda = lambda_sP * norm; /* Scale regularization parameter */
-            p_Aij[ncols * (2 * delta_x)] += lambda; /* Main diagonal  */
-            p_Aij[ncols * (2 * delta_x + 1)] -= lambda; /* Upper diagonal */
+            p_Aij[2 * delta_x] += lambda; /* Main diagonal  */
+            p_Aij[2 * delta_x + 1] -= lambda; /* Upper diagonal */
             for (x = 1; x < ncols - 1; x++) {
                 /* Lower diagonal */
-                p_Aij[x + ncols * (2 * delta_x - 1)] -= lambda;
+                p_Aij[x * nx + 2 * delta_x - 1] -= lambda;
                 /* Main diagonal  */
-                p_Aij[x + ncols * (2 * delta_x)] += lambda * 2.e0;
+                p_Aij[x * nx + 2 * delta_x] += lambda * 2.e0;
                 /* Upper diagonal */
-                p_Aij[x + ncols * (2 * delta_x + 1)] -= lambda;
+                p_Aij[x * nx + 2 * delta_x + 1] -= lambda;
             }
             /* Lower diagonal */
-            p_Aij[ncols - 1 + ncols * (2 * delta_x - 1)] -= lambda;
+            p_Aij[(ncols - 1) * nx + 2 * delta_x - 1] -= lambda;
             /* Main diagonal  */
-            p_Aij[ncols - 1 + ncols * (2 * delta_x)] += lambda;
+            p_Aij[(ncols - 1) * nx + 2 * delta_x] += lambda;
         }
 
         /* Solve the system of equations */
@@ -3400,14 +5962,10 @@ static int cr2res_extract_slit_func_curved(
         for (y = 0; y < nrows * ncols; y++) {
                 model[y] = 0.;
         }
-        for (y = 0; y < nrows; y++) {
-            for (x = 0; x < ncols; x++) {
-                for (m = 0; m < m_zeta[mzeta_index(x,y)]; m++) {
-                    xx = zeta[zeta_index(x,y,m)].x;
-                    iy = zeta[zeta_index(x,y,m)].iy;
-                    ww = zeta[zeta_index(x,y,m)].w;
-                    model[y * ncols + x] += sP[xx] * sL[iy] * ww;
-                }
+        for (xy = 0; xy < nrows * ncols; xy++) {
+            for (z = csr->z_start[xy]; z < csr->z_start[xy+1]; z++) {
+                ww = single_prec ? csr->z_w_f[z] : csr->z_w[z];
+                model[xy] += sP[csr->z_x[z]] * sL[csr->z_iy[z]] * ww;
             }
         }
         /* Compare model and data */
@@ -3469,61 +6027,105 @@ static int cr2res_extract_slit_func_curved(
             iter, mad, sP_change);
         iter++;
     } while (iter == 1 || (iter < maxiter && sP_change > sP_stop * sP_max));
+    if (niter != NULL) *niter = iter;
 
     /* Uncertainty estimate */
     for (x = 0; x < ncols; x++) {
         unc[x] = 0.;
         p_bj[x] = 0.;
     }
-    for (y = 0; y < nrows; y++) {
-        for (x = 0; x < ncols; x++) {
-            // Loop through all pixels contributing to x,y
-            for (m = 0; m < m_zeta[mzeta_index(x,y)]; m++) {
-                xx = zeta[zeta_index(x,y,m)].x;
-                iy = zeta[zeta_index(x,y,m)].iy;
-                ww = zeta[zeta_index(x,y,m)].w;
-                unc[xx] += (im[y * ncols + x] - model[y * ncols + x]) *
-                    (im[y * ncols + x] - model[y * ncols + x]) *
-                    ww * mask[y * ncols + x];
-                unc[xx] += pix_unc[y * ncols + x] * pix_unc[y * ncols + x] *
-                    ww * mask[y * ncols + x];
-                // Norm
-                p_bj[xx] += ww * mask[y * ncols + x];
-            }
+    for (xy = 0; xy < nrows * ncols; xy++) {
+        // Loop through all pixels contributing to x,y
+        for (z = csr->z_start[xy]; z < csr->z_start[xy+1]; z++) {
+            xx = csr->z_x[z];
+            ww = single_prec ? csr->z_w_f[z] : csr->z_w[z];
+            unc[xx] += (im[xy] - model[xy]) * (im[xy] - model[xy]) *
+                ww * mask[xy];
+            unc[xx] += pix_unc[xy] * pix_unc[xy] * ww * mask[xy];
+            // Norm
+            p_bj[xx] += ww * mask[xy];
         }
     }
     for (x = 0; x < ncols; x++) {
         unc[x] = sqrt(unc[x] / p_bj[x] * nrows);
     }
-    cpl_image_delete(img_mad);
-    cpl_free(sP_old);
-    cpl_free(l_Aij);
-    cpl_free(p_Aij);
-    cpl_free(l_bj);
-    cpl_free(p_bj);
-
-    cpl_free(xi);
-    cpl_free(zeta);
-    cpl_free(m_zeta);
     return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Start a swath from the spectrum of the previous one
+  @param    spec_sw     first guess of the swath spectrum, updated
+  @param    sw_start    first column of the swath
+  @param    spec_prev   the decomposed spectrum of the previous swath
+  @param    prev_start  first column of the previous swath
+  @return   void
+
+  The columns covered by both swaths take the value of the previous swath,
+  the others keep their first guess.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_warm_start(
+        cpl_vector          *   spec_sw,
+        int                     sw_start,
+        const cpl_vector    *   spec_prev,
+        int                     prev_start)
+{
+    double          *   psw ;
+    const double    *   pprev ;
+    int                 j, sw_end, prev_end ;
+
+    psw = cpl_vector_get_data(spec_sw) ;
+    pprev = cpl_vector_get_data_const(spec_prev) ;
+    sw_end = sw_start + cpl_vector_get_size(spec_sw) ;
+    prev_end = prev_start + cpl_vector_get_size(spec_prev) ;
+    for (j=max(sw_start, prev_start) ; j<min(sw_end, prev_end) ; j++)
+        psw[j-sw_start] = pprev[j-prev_start] ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Report the iterations of the slit decomposition of a trace
+  @param    niters      number of iterations per swath
+  @param    nswaths     number of swaths
+  @param    warm_start  the warm start flag
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_report_iter(
+        const int   *   niters,
+        int             nswaths,
+        int             warm_start)
+{
+    int     i, total ;
+
+    if (nswaths < 1) return ;
+    total = 0 ;
+    for (i=0 ; i<nswaths ; i++) {
+        cpl_msg_debug(__func__, "Swath %d: %d iterations", i+1, niters[i]) ;
+        total += niters[i] ;
+    }
+    cpl_msg_info(__func__, "%d swaths, %.1f iterations per swath%s",
+            nswaths, (double)total/nswaths, warm_start ? " (warm start)" : "");
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Solve a sparse system of linear equations
-  @param    a   2D array [n,nd]i
+  @param    a   2D array [n][nd]
   @param    r   array of RHS of size n
   @param    n   number of equations
   @param    nd  width of the band (3 for tri-diagonal system)
-  @return   0 on success, -1 on incorrect size of "a" and -4 on
-            degenerate matrix
+  @param    lambda  replaces the zero pivots
+  @return   0 on success
 
   Solve a sparse system of linear equations with band-diagonal matrix.
   Band is assumed to be symmetrix relative to the main diaginal.
 
-  nd must be an odd number. The main diagonal should be in a(*,nd/2)
-  The first lower subdiagonal should be in a(1:n-1,nd/2-1), the first
-  upper subdiagonal is in a(0:n-2,nd/2+1) etc. For example:
+  nd must be an odd number. The band is stored row by row: the diagonal
+  element of row i is a[i*nd+nd/2], the element of row i in column i+k is
+  a[i*nd+nd/2+k], for -nd/2 <= k <= nd/2. The elements falling outside
+  of the matrix must be 0. For example:
                     / 0 0 X X X \
                     | 0 X X X X |
                     | X X X X X |
@@ -3533,6 +6135,9 @@ static int cr2res_extract_slit_func_curved(
                     | X X X X X |
                     | X X X X 0 |
                     \ X X X 0 0 /
+  With this layout the eliminations run along contiguous memory, which
+  the compiler can vectorise. The operations are the same, in the same
+  order, as for the former column-major layout.
  */
 /*----------------------------------------------------------------------------*/
 static int cr2res_extract_slitdec_bandsol(
@@ -3542,54 +6147,113 @@ static int cr2res_extract_slitdec_bandsol(
         int         nd,
         double      lambda)
 {
-    double aa;
-    int i, j, k;
+    double          aa;
+    double      *   ai;
+    double      *   aj;
+    int             i, j, k, md;
 
-    //if(fmod(nd,2)==0) return -1;
+    md = nd/2;
 
     /* Forward sweep */
     for(i=0; i<n-1; i++)
     {
-        aa=a[i+n*(nd/2)];
+        ai = a + i*nd;
+        aa = ai[md];
         if(aa==0.e0) aa = lambda; //return -3;
         r[i]/=aa;
-        for(j=0; j<nd; j++) a[i+j*n]/=aa;
-        for(j=1; j<min(nd/2+1,n-i); j++)
+        for(k=0; k<nd; k++) ai[k]/=aa;
+        for(j=1; j<min(md+1,n-i); j++)
         {
-            aa=a[i+j+n*(nd/2-j)];
+            aj = a + (i+j)*nd;
+            aa = aj[md-j];
             r[i+j]-=r[i]*aa;
-            for(k=0; k<n*(nd-j); k+=n) a[i+j+k]-=a[i+k+n*j]*aa;
+            for(k=0; k<nd-j; k++) aj[k]-=ai[k+j]*aa;
         }
     }
 
     /* Backward sweep */
-    aa = a[n-1+n*(nd/2)];
+    aa = a[(n-1)*nd+md];
     if (aa == 0) aa = lambda; //return -4;
     r[n-1]/=aa;
     for(i=n-1; i>0; i--)
     {
-        for(j=1; j<=min(nd/2,i); j++){
-            r[i-j]-=r[i]*a[i-j+n*(nd/2+j)];
+        for(j=1; j<=min(md,i); j++){
+            r[i-j]-=r[i]*a[(i-j)*nd+md+j];
         }
-        aa = a[i-1+n*(nd/2)];
+        aa = a[(i-1)*nd+md];
         if(aa==0.e0) aa = lambda; //return -5;
-        
+
         r[i-1]/=aa;
     }
 
-    aa = a[n*(nd/2)];
+    aa = a[md];
     if(aa==0.e0) aa = lambda; //return -6;
     r[0]/=aa;
     return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Solve a tri-diagonal system of linear equations
+  @param    a   2D array [n][3], see cr2res_extract_slitdec_bandsol()
+  @param    r   array of RHS of size n, replaced by the solution
+  @param    n   number of equations
+  @param    lambda  replaces the zero pivots
+  @return   0 on success
+
+  Thomas algorithm, the nd=3 case of cr2res_extract_slitdec_bandsol()
+  without the updates of elements that are not read again. The results
+  are identical.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_tridiag(
+        double  *   a,
+        double  *   r,
+        int         n,
+        double      lambda)
+{
+    double  aa;
+    int     i;
+
+    /* Forward sweep: normalise row i, eliminate the lower diagonal of i+1 */
+    for(i=0; i<n-1; i++)
+    {
+        aa = a[3*i+1];
+        if(aa==0.e0) aa = lambda;
+        r[i]/=aa;
+        a[3*i+1]/=aa;
+        a[3*i+2]/=aa;
+        aa = a[3*i+3];
+        r[i+1]-=r[i]*aa;
+        a[3*i+4]-=a[3*i+2]*aa;
+    }
+
+    /* Backward sweep */
+    aa = a[3*(n-1)+1];
+    if (aa == 0) aa = lambda;
+    r[n-1]/=aa;
+    for(i=n-1; i>0; i--)
+    {
+        r[i-1]-=r[i]*a[3*(i-1)+2];
+        aa = a[3*(i-1)+1];
+        if(aa==0.e0) aa = lambda;
+        r[i-1]/=aa;
+    }
+
+    aa = a[1];
+    if(aa==0.e0) aa = lambda;
+    r[0]/=aa;
+    return 0;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief   Adjust the swath width to match the length of detector
   @param sw     Swath width to start from
   @param nx     number of pixel columns to match
   @param dx     delta_x, number of pixels offset due to curvature
-  @return   The new swath width and swath edges. All bins end up with
+  @return   The new swath width and swath edges, or -1 if the swath and
+            its dx margins do not fit in nx. All bins end up with
             the same even swath size
     Note that the last swath shifted forward to have the same length as the
     others, therefore the overlap will be larger
@@ -3602,11 +6266,13 @@ static int cr2res_extract_slitdec_adjust_swath(
         cpl_vector  *   bins_begin,
         cpl_vector  *   bins_end)
 {
-    if (sw <= 0  || nx <= 0) return -1;
+    if (sw < 2  || nx <= 0) return -1;
     if (bins_begin == NULL || bins_end == NULL) return -1;
 
     if (sw > nx) sw = nx-1;
     if (sw % 2 == 1) sw += 1;
+    /* The curved swaths are widened by dx on each side */
+    if (sw > nx - 2 * dx) return -1;
 
     int nbin, i = 0;
     double step = 0;
@@ -37,8 +37,12 @@ typedef enum {
     CR2RES_EXTR_TILTSUM,
     CR2RES_EXTR_OPT_VERT,
     CR2RES_EXTR_OPT_CURV,
+    CR2RES_EXTR_HORNE,
 } cr2res_extr_method ;
 
+/* Slit decomposition geometry, shared by the extractions of several frames */
+typedef struct _cr2res_extract_geom_cache_ cr2res_extract_geom_cache ;
+
 /*-----------------------------------------------------------------------------
                                        Prototypes
  -----------------------------------------------------------------------------*/
@@ -54,9 +58,42 @@ int cr2res_extract_traces(
         int                     swath_width,
         int                     oversample,
         double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
         cpl_table           **  extracted,
         cpl_table           **  slit_func,
-        hdrl_image          **  model_master) ;
+        hdrl_image          **  model_master,
+        int                 *   swaths) ;
+
+int cr2res_extract_traces_multi(
+        const hdrl_imagelist    *   imgs,
+        const cpl_table     *   traces,
+        const cpl_table     *   slit_func_in,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        double                  smooth_slit,
+        int                     warm_start,
+        int                     single_prec,
+        int                     nthreads,
+        cr2res_extract_geom_cache   *   geom_cache,
+        cpl_table           **  extracted,
+        cpl_table           **  slit_func,
+        hdrl_image          **  model_master,
+        int                 *   swaths) ;
+
+int cr2res_extract_swath_plan(
+        const hdrl_image    *   img,
+        const cpl_table     *   traces,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample) ;
 
 int cr2res_extract_sum_vert(
         const hdrl_image    *   hdrl_in,
@@ -88,6 +125,19 @@ int cr2res_extract_sum_tilt(
         cpl_bivector        **  spec,
         hdrl_image          **  model) ;
 
+int cr2res_extract_horne(
+        const hdrl_image    *   img_hdrl,
+        const cpl_table     *   trace_tab,
+        const cpl_vector    *   slit_func_vec_in,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     oversample,
+        double                  kappa,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        hdrl_image          **  model) ;
+
 int cr2res_extract_slitdec_vert(
         const hdrl_image    *   img_hdrl,
         const cpl_table     *   trace_tab,
@@ -116,6 +166,11 @@ int cr2res_extract_slitdec_curved(
         cpl_bivector        **  spec,
         hdrl_image          **  model) ;
 
+cr2res_extract_geom_cache * cr2res_extract_geom_cache_new(cpl_size max_size) ;
+void cr2res_extract_geom_cache_delete(cr2res_extract_geom_cache * cache) ;
+cpl_size cr2res_extract_geom_cache_get_size(
+        const cr2res_extract_geom_cache *   cache) ;
+
 cpl_table * cr2res_extract_SLITFUNC_create(
         cpl_vector      **  slit_func,
         const cpl_table *   trace_table) ; 
@@ -145,17 +200,17 @@ int cr2res_extract2d_traces(
         cpl_table           **  extracted) ;
 
 int cr2res_extract2d_trace(
-        const hdrl_image    *   in,
-        const cpl_table     *   trace_tab,
-        int                     order,
-        int                     trace_id,
-        int                     npoints,
-        const cpl_image     *   wavemap,
-        const cpl_image     *   slitmap,
-        cpl_bivector        **  spectrum,
-        cpl_bivector        **  position,
-        cpl_vector          **  wavelength,
-        cpl_vector          **  slit_fraction) ;
+        const hdrl_image        *   in,
+        const cpl_table         *   trace_tab,
+        int                         order,
+        int                         trace_id,
+        int                         npoints,
+        const cpl_polynomial    *   coef_wave,
+        const cpl_polynomial    *   coef_slit,
+        cpl_bivector            **  spectrum,
+        cpl_bivector            **  position,
+        cpl_vector              **  wavelength,
+        cpl_vector              **  slit_fraction) ;
 
 cpl_table * cr2res_extract_EXTRACT2D_create(
         cpl_bivector    **  spectrum,
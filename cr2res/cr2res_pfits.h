@@ -83,6 +83,7 @@
 #define CR2RES_HEADER_QC_SLITFWHM           "ESO QC SLITFWHM"
 #define CR2RES_HEADER_QC_REAL_ORDER         "ESO QC REALORDER%d"
 #define CR2RES_HEADER_QC_SNR                "ESO QC SNR%d"
+#define CR2RES_HEADER_QC_SWATH              "ESO QC SWATH%d-%d"
 
 /*-----------------------------------------------------------------------------
                                    Functions prototypes
@@ -152,7 +152,6 @@ int cr2res_slit_curv_compute_order_trace(
     cpl_vector          *   sfunc;
     cpl_vector          *   ycen;
     cpl_bivector        *   spec_bi;
-    hdrl_image          *   model;
     cpl_vector          *   peaks;
     cpl_image           *   img_rect;
     cpl_vector          *   vec_a;
@@ -177,14 +176,13 @@ int cr2res_slit_curv_compute_order_trace(
     
     // Determine the peaks and remove peaks at the edges of the order
     if (cr2res_extract_sum_vert(hdrl_other, trace_wave, order, trace,
-            height, &sfunc, &spec_bi, &model) != 0){
+            height, &sfunc, &spec_bi, NULL) != 0){
         return -1;
     }
     peaks = cr2res_etalon_get_maxpos(cpl_bivector_get_x(spec_bi));
     cr2res_slit_curv_remove_peaks_at_edge(&peaks, window, ncols);
     cpl_bivector_delete(spec_bi);
     cpl_vector_delete(sfunc);
-    hdrl_image_delete(model);
     
 
     // Rectify the image
@@ -431,12 +429,12 @@ hdrl_image * cr2res_slit_curv_gen_map(
     cpl_polynomial  *   slit_poly_a ;
     cpl_polynomial  *   slit_poly_b ;
     cpl_polynomial  *   slit_poly_c ;
-    cpl_polynomial  *   upper_poly ;
-    cpl_polynomial  *   lower_poly ;
     cpl_polynomial  *   slit_curv_poly ;
+    int             *   ylo ;
+    int             *   yhi ;
     int                 cur_order, cur_trace_id ;
-    double              upper_pos, lower_pos, x_slit_pos, value, val1, val2 ;
-    cpl_size            i, j, k, nrows, nx, ny, x1, x2, ref_x ;
+    double              x_slit_pos, value, val1, val2 ;
+    cpl_size            i, j, k, nrows, nx, ny, x1, x2, ref_x, jmin, jmax ;
 
     /* Check Entries */
     if (trace_wave == NULL) return NULL ;
@@ -452,6 +450,12 @@ hdrl_image * cr2res_slit_curv_gen_map(
     ny = cpl_image_get_size_y(out_ima) ;
     pout_ima = cpl_image_get_data_double(out_ima) ;
 
+    /* Get the rows of the traces */
+    if (cr2res_trace_get_spans(trace_wave, nx, ny, 1, &ylo, &yhi) != 0) {
+        hdrl_image_delete(out) ;
+        return NULL ;
+    }
+
     /* Loop on the traces */
     for (k=0 ; k<nrows ; k++) {
         /* Only specified order / trace */
@@ -469,18 +473,8 @@ hdrl_image * cr2res_slit_curv_gen_map(
         slit_poly_c = cr2res_convert_array_to_poly(tmp_array) ;
 
         if (slit_poly_a != NULL && slit_poly_b != NULL && slit_poly_c != NULL) {
-            /* Get the Upper Polynomial */
-            tmp_array = cpl_table_get_array(trace_wave, CR2RES_COL_UPPER, k) ;
-            upper_poly = cr2res_convert_array_to_poly(tmp_array) ;
-
-            /* Get the Lower Polynomial */
-            tmp_array = cpl_table_get_array(trace_wave, CR2RES_COL_LOWER, k) ;
-            lower_poly = cr2res_convert_array_to_poly(tmp_array) ;
-
-            /* Check if all Polynomials are available */
-            if (upper_poly == NULL || lower_poly == NULL) {
-                if (upper_poly != NULL) cpl_polynomial_delete(upper_poly) ;
-                if (lower_poly != NULL) cpl_polynomial_delete(lower_poly) ;
+            /* Check if the Upper / Lower Polynomials are available */
+            if (ylo[k*nx] == 0) {
                 cpl_msg_warning(__func__, "Cannot get UPPER/LOWER information");
                 cpl_polynomial_delete(slit_poly_a) ;
                 cpl_polynomial_delete(slit_poly_b) ;
@@ -501,36 +495,36 @@ hdrl_image * cr2res_slit_curv_gen_map(
                 slit_curv_poly = cr2res_slit_curv_build_poly(slit_poly_a, 
                         slit_poly_b, slit_poly_c, ref_x) ;
 
-                upper_pos = cpl_polynomial_eval_1d(upper_poly, ref_x, NULL) ;
-                lower_pos = cpl_polynomial_eval_1d(lower_poly, ref_x, NULL) ;
-                for (j=0 ; j<ny ; j++) {
-                    if ((j+1 >= lower_pos && j+1 <= upper_pos) || full_trace) {
-                        x_slit_pos = cpl_polynomial_eval_1d(slit_curv_poly, 
-                                j+1, NULL) ;
-                        x1 = (cpl_size)x_slit_pos ;
-                        x2 = x1 + 1 ;
-                        val1 = value * (x2-x_slit_pos) ;
-                        val2 = value - val1 ;
-                        /*cpl_msg_debug(__func__, 
-                                "%"CPL_SIZE_FORMAT" %"CPL_SIZE_FORMAT" (%g) / %"CPL_SIZE_FORMAT" %"CPL_SIZE_FORMAT" (%g)", 
-                                x1-1, j, val1, x2-1, j, val2) ; */
-                        if (x1>=1 && x1<=nx) pout_ima[(x1-1)+j*nx] = val1 ;
-                        if (x2>=1 && x2<=nx) pout_ima[(x2-1)+j*nx] = val2 ;
-                    }
+                if (full_trace) {
+                    jmin = 1 ;
+                    jmax = ny ;
+                } else {
+                    jmin = ylo[k*nx+i] ;
+                    jmax = yhi[k*nx+i] ;
+                }
+                for (j=jmin ; j<=jmax ; j++) {
+                    x_slit_pos = cpl_polynomial_eval_1d(slit_curv_poly, j,
+                            NULL) ;
+                    x1 = (cpl_size)x_slit_pos ;
+                    x2 = x1 + 1 ;
+                    val1 = value * (x2-x_slit_pos) ;
+                    val2 = value - val1 ;
+                    if (x1>=1 && x1<=nx) pout_ima[(x1-1)+(j-1)*nx] = val1 ;
+                    if (x2>=1 && x2<=nx) pout_ima[(x2-1)+(j-1)*nx] = val2 ;
                 }
                 cpl_polynomial_delete(slit_curv_poly) ;
             }
             cpl_polynomial_delete(slit_poly_a) ;
             cpl_polynomial_delete(slit_poly_b) ;
             cpl_polynomial_delete(slit_poly_c) ;
-            cpl_polynomial_delete(upper_poly) ;
-            cpl_polynomial_delete(lower_poly) ;
         } else {
             if (slit_poly_a != NULL) cpl_polynomial_delete(slit_poly_a) ; 
             if (slit_poly_b != NULL) cpl_polynomial_delete(slit_poly_b) ; 
             if (slit_poly_c != NULL) cpl_polynomial_delete(slit_poly_c) ; 
         }
     }
+    cpl_free(ylo) ;
+    cpl_free(yhi) ;
     return out ;
 }
 
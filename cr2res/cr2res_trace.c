@@ -302,17 +302,19 @@ cpl_image * cr2res_trace_gen_image(
 {
     cpl_image       *   out ;
     int             *   pout ;
-    const cpl_array *   coeffs_upper ;
-    const cpl_array *   coeffs_lower ;
-    cpl_polynomial  *   poly_upper ;
-    cpl_polynomial  *   poly_lower ;
+    int             *   ylo ;
+    int             *   yhi ;
     int                 order_idx, i ;
-    cpl_size            j, k, y_pos_lower, y_pos_upper ;
+    cpl_size            j, k ;
 
     /* Check entries */
     if (trace == NULL) return NULL ;
     if (nx < 1 || ny < 1) return NULL ;
 
+    /* Get the rows of the traces */
+    if (cr2res_trace_get_spans(trace, nx, ny, 0, &ylo, &yhi) != 0)
+        return NULL ;
+
     /* Create the empty image */
     out = cpl_image_new(nx, ny, CPL_TYPE_INT) ;
     cpl_image_add_scalar(out, -1.0) ;
@@ -326,29 +328,89 @@ cpl_image * cr2res_trace_gen_image(
         else
             order_idx = 100 ;
 
-        /* Get the Upper polynomial*/
-        coeffs_upper = cpl_table_get_array(trace, CR2RES_COL_UPPER, i) ;
-        poly_upper = cr2res_convert_array_to_poly(coeffs_upper) ;
+        /* Draw It  */
+        for (j=0 ; j<nx ; j++)
+            for (k=ylo[i*nx+j] ; k<=yhi[i*nx+j] ; k++)
+                pout[j+(k-1)*nx] = order_idx ;
+    }
+    cpl_free(ylo) ;
+    cpl_free(yhi) ;
+    return out;
+}
 
-        /* Get the Lower polynomial*/
-        coeffs_lower = cpl_table_get_array(trace, CR2RES_COL_LOWER, i) ;
-        poly_lower = cr2res_convert_array_to_poly(coeffs_lower) ;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the detector rows covered by each trace, per column
+  @param trace      The trace table
+  @param nx         X size of the detector
+  @param ny         Y size of the detector
+  @param centers    Only take the rows whose center is between the edges
+  @param ylo        [out] first row of the traces (1-based) [nrows * nx]
+  @param yhi        [out] last row of the traces (1-based) [nrows * nx]
+  @return   0 if ok, -1 in error case
+
+  The Lower and Upper polynomials of each row of the table are evaluated
+  once per column. The rows of the trace in the table row i at column x
+  are ylo[i*nx+x-1] <= y <= yhi[i*nx+x-1], inside of the detector. With
+  centers, these are the rows with lower <= y <= upper, otherwise all the
+  rows the edges run through, from (int)lower to (int)upper. A column
+  outside of the detector gives yhi < ylo, a trace without Lower or Upper
+  polynomial gives ylo = 0 and yhi = -1 in all columns.
+  ylo and yhi need to be deallocated with cpl_free().
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_trace_get_spans(
+        const cpl_table *   trace,
+        int                 nx,
+        int                 ny,
+        int                 centers,
+        int             **  ylo,
+        int             **  yhi)
+{
+    cpl_polynomial  *   poly_upper ;
+    cpl_polynomial  *   poly_lower ;
+    double              lower, upper ;
+    cpl_size            i, j, nrows ;
 
-        /* Draw It  */
-        for (j=0 ; j<nx ; j++) {
-            y_pos_lower = (cpl_size)cpl_polynomial_eval_1d(poly_lower,
-                    (double)j+1, NULL) ;
-            y_pos_upper = (cpl_size)cpl_polynomial_eval_1d(poly_upper,
-                    (double)j+1, NULL) ;
-            for (k = y_pos_lower-1 ; k < y_pos_upper ; k++)
-                if (k < ny && k >=0)
-                    pout[j+k*nx] = order_idx ;
+    /* Check entries */
+    if (trace == NULL || ylo == NULL || yhi == NULL) return -1 ;
+    if (nx < 1 || ny < 1) return -1 ;
 
+    nrows = cpl_table_get_nrow(trace) ;
+    *ylo = cpl_malloc(nrows * nx * sizeof(int)) ;
+    *yhi = cpl_malloc(nrows * nx * sizeof(int)) ;
+
+    /* Loop on the traces */
+    for (i=0 ; i<nrows ; i++) {
+        poly_upper = cr2res_convert_array_to_poly(
+                cpl_table_get_array(trace, CR2RES_COL_UPPER, i)) ;
+        poly_lower = cr2res_convert_array_to_poly(
+                cpl_table_get_array(trace, CR2RES_COL_LOWER, i)) ;
+        for (j=0 ; j<nx ; j++) {
+            if (poly_upper == NULL || poly_lower == NULL) {
+                (*ylo)[i*nx+j] = 0 ;
+                (*yhi)[i*nx+j] = -1 ;
+                continue ;
+            }
+            (*ylo)[i*nx+j] = 1 ;
+            (*yhi)[i*nx+j] = 0 ;
+            lower = cpl_polynomial_eval_1d(poly_lower, (double)j+1, NULL) ;
+            upper = cpl_polynomial_eval_1d(poly_upper, (double)j+1, NULL) ;
+            if (centers) {
+                lower = ceil(lower) ;
+                upper = floor(upper) ;
+            } else {
+                lower = trunc(lower) ;
+                upper = trunc(upper) ;
+            }
+            if (lower > ny || upper < 1) continue ;
+            (*ylo)[i*nx+j] = lower < 1 ? 1 : (int)lower ;
+            (*yhi)[i*nx+j] = upper > ny ? ny : (int)upper ;
         }
         cpl_polynomial_delete(poly_upper) ;
         cpl_polynomial_delete(poly_lower) ;
     }
-    return out;
+    return 0 ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1382,7 +1444,6 @@ cpl_table * cr2res_trace_adjust(
             CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse") ;
         hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
         return NULL ;
     }
     hdrl_imagelist_delete(imlist) ;
@@ -1395,7 +1456,6 @@ cpl_table * cr2res_trace_adjust(
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
         cpl_msg_error(__func__, "Failed compute the traces") ;
         hdrl_image_delete(collapsed) ;
-        cpl_msg_indent_less() ;
         return NULL ;
     }
     hdrl_image_delete(collapsed) ;
@@ -50,6 +50,14 @@ cpl_image * cr2res_trace_gen_image(
         int             nx,
         int             ny) ;
 
+int cr2res_trace_get_spans(
+        const cpl_table *   trace,
+        int                 nx,
+        int                 ny,
+        int                 centers,
+        int             **  ylo,
+        int             **  yhi) ;
+
 int * cr2res_trace_get_order_idx_values(
         const cpl_table *   trace,
         int             *   nb_order_idx_values) ;
@@ -27,8 +27,13 @@
 
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <cpl.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "cr2res_utils.h"
 #include "cr2res_io.h"
 #include "cr2res_pfits.h"
@@ -36,6 +41,23 @@
 #include "cr2res_extract.h"
 #include "cr2res_trace.h"
 
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static int cr2res_slit_pos_get_coeffs(
+        const cpl_polynomial    *   poly,
+        int                         deg,
+        double                  *   coeffs) ;
+static int cr2res_slit_pos_order_band(
+        const cpl_table *   trace_wave,
+        int                 order_idx,
+        const int       *   span_lo,
+        const int       *   span_hi,
+        cpl_size            lenx,
+        int             *   ylo,
+        int             *   yhi) ;
+
 /*----------------------------------------------------------------------------*/
 /**
  * @defgroup cr2res_utils     Miscellaneous Utilities
@@ -346,11 +368,15 @@ cpl_polynomial * cr2res_fit_noise(
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Get a picture of the slit position (and wavelength?) depend on x, y
-  @param
-  @param
-  @param
-  @param
+  @param    trace_wave  the trace wave table
+  @param    coef_slit   [out] per order, the slit position as a function of
+                        the wavelength and y
+  @param    coef_wave   [out] per order, the wavelength as a function of x
+                        and y
   @return   0 on success, -1 on fail
+
+  The orders are in the cr2res_trace_get_order_idx_values() order, the
+  2D polynomials are allocated by the caller.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_slit_pos(
@@ -376,7 +402,7 @@ int cr2res_slit_pos(
     int             *  order_idx_values;
     int             *  traces;
     const cpl_size maxdeg = 2;
-    int i, j, k, row;
+    int i, j, k, l, row;
     int order_idx, trace;
     double px, py, pw, ps;
     int nb_order_idx_values, nb_traces;
@@ -416,11 +442,11 @@ int cr2res_slit_pos(
             slit = cpl_table_get_array(trace_wave, CR2RES_COL_SLIT_FRACTION, k);
 
             // calculate polynomials for all traces
-            for (i = 0; i < CR2RES_DETECTOR_SIZE; i++) {
+            for (l = 0; l < CR2RES_DETECTOR_SIZE; l++) {
                 // For each of the three edges (upper, all, lower) of a trace
                 for (k = 0; k < 3; k++){
                     row++;
-                    px = cpl_vector_get(x, i);
+                    px = cpl_vector_get(x, l);
                     py = cpl_polynomial_eval_1d(line[k], px, NULL);
                     pw = cpl_polynomial_eval_1d(wave, px, NULL);
                     ps = cpl_array_get_double(slit, k, NULL);
@@ -441,13 +467,13 @@ int cr2res_slit_pos(
         }
 
         // fit 2D wavelengths
-        errcode = cpl_polynomial_fit((*coef_wave)[j], matrix_xy, NULL, vec_w, 
+        errcode = cpl_polynomial_fit((*coef_wave)[i], matrix_xy, NULL, vec_w, 
                 NULL, FALSE, NULL, &maxdeg);
         if (errcode != CPL_ERROR_NONE){
             // TODO: What to do in case of error?
             cpl_error_reset();
         }
-        errcode = cpl_polynomial_fit((*coef_slit)[j], matrix_wd, NULL, vec_s, 
+        errcode = cpl_polynomial_fit((*coef_slit)[i], matrix_wd, NULL, vec_s, 
                 NULL, FALSE, NULL, &maxdeg);
         if (errcode != CPL_ERROR_NONE){
             cpl_error_reset();
@@ -468,13 +494,19 @@ int cr2res_slit_pos(
 /*----------------------------------------------------------------------------*/
 /**
   @brief    get a image of the slitposition (and wavelength) along the slit
-  @param    tw_decker_1     tracewave table for traces with decker 1
-  @param    tw_decker_2     tracewave_table for traces with decker 2
+  @param    trace_wave      tracewave table
   @param    slitpos         output image of slit positions
   @param    wavelength      output image of wavelength
   @return   return 0 if successful, -1 otherwise
 
-  Uses the polynomials from cr2res_slit_pos to calculate the slit position and wavelength of each pixel 
+  Uses the polynomials from cr2res_slit_pos to calculate the slit position
+  and wavelength of each pixel. Only the pixels between the lowest Lower
+  and the highest Upper edge of the traces of each order are computed,
+  the others are left untouched. The images need to be of type double.
+  The polynomials are evaluated with the Horner scheme, the wavelength
+  polynomial is reduced to a polynomial in y once per column. The columns
+  are computed in parallel, an order overwrites the previous ones where
+  they overlap.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_slit_pos_image(
@@ -482,21 +514,41 @@ int cr2res_slit_pos_image(
         cpl_image   **  slitpos, 
         cpl_image   **  wavelength)
 {
-    if (trace_wave == NULL | slitpos == NULL | 
+    cpl_polynomial  **  coef_slit;
+    cpl_polynomial  **  coef_wave;
+    double          *   pc_wave;
+    double          *   pc_slit;
+    double          *   col_wave;
+    double          *   pslit;
+    double          *   pwave;
+    cpl_binary      *   pbpm_slit;
+    cpl_binary      *   pbpm_wave;
+    int             *   order_idx_values;
+    int             *   span_lo;
+    int             *   span_hi;
+    int             *   ylo;
+    int             *   yhi;
+    double              w, s, t;
+    cpl_size            lenx, leny, pix;
+    int                 i, j, k, x, y, deg, ncoef, nb_order_idx_values;
+
+    if (trace_wave == NULL || slitpos == NULL || 
             wavelength == NULL) return -1;
-    if (*slitpos == NULL | *wavelength == NULL) return -1;
-
-    double w, s;
-    int i, k, x, y, nb_order_idx_values;
-    cpl_vector * vec_xy;
-    cpl_vector * vec_wd;
-    cpl_polynomial ** coef_slit;
-    cpl_polynomial ** coef_wave;
-    int *order_idx_values;
+    if (*slitpos == NULL || *wavelength == NULL) return -1;
+
+    lenx = cpl_image_get_size_x(*slitpos);
+    leny = cpl_image_get_size_y(*slitpos);
+    pslit = cpl_image_get_data_double(*slitpos);
+    pwave = cpl_image_get_data_double(*wavelength);
+    if (pslit == NULL || pwave == NULL ||
+            cpl_image_get_size_x(*wavelength) != lenx ||
+            cpl_image_get_size_y(*wavelength) != leny) {
+        cpl_msg_error(__func__, "Need two double images of the same size");
+        return -1;
+    }
 
     order_idx_values = cr2res_trace_get_order_idx_values(trace_wave, 
             &nb_order_idx_values);
-    cpl_free(order_idx_values);
 
     coef_wave = cpl_malloc(nb_order_idx_values * sizeof(cpl_polynomial*));
     coef_slit = cpl_malloc(nb_order_idx_values * sizeof(cpl_polynomial*));
@@ -512,39 +564,87 @@ int cr2res_slit_pos_image(
         }
         cpl_free(coef_wave);
         cpl_free(coef_slit);
+        cpl_free(order_idx_values);
         return -1;
     }
 
-    vec_xy = cpl_vector_new(2);
-    vec_wd = cpl_vector_new(2);
-
+    /* Dense coefficients, c[i*(deg+1)+j] multiplies x^i y^j */
+    deg = 0;
+    for (k = 0; k < nb_order_idx_values; k++) {
+        if (cpl_polynomial_get_degree(coef_wave[k]) > deg)
+            deg = cpl_polynomial_get_degree(coef_wave[k]);
+        if (cpl_polynomial_get_degree(coef_slit[k]) > deg)
+            deg = cpl_polynomial_get_degree(coef_slit[k]);
+    }
+    ncoef = (deg + 1) * (deg + 1);
+    pc_wave = cpl_calloc(nb_order_idx_values * ncoef, sizeof(double));
+    pc_slit = cpl_calloc(nb_order_idx_values * ncoef, sizeof(double));
     for (k = 0; k < nb_order_idx_values; k++) {
-        for (x=1; x <= CR2RES_DETECTOR_SIZE; x++) {
-            for (y=1; y <= CR2RES_DETECTOR_SIZE; y++) {
-                cpl_vector_set(vec_xy, 0, (double)x);
-                cpl_vector_set(vec_xy, 1, (double)y);
-                w = cpl_polynomial_eval(coef_wave[k], vec_xy);
+        cr2res_slit_pos_get_coeffs(coef_wave[k], deg, pc_wave + k * ncoef);
+        cr2res_slit_pos_get_coeffs(coef_slit[k], deg, pc_slit + k * ncoef);
+        cpl_polynomial_delete(coef_wave[k]);
+        cpl_polynomial_delete(coef_slit[k]);
+    }
+    cpl_free(coef_slit);
+    cpl_free(coef_wave);
 
-                cpl_vector_set(vec_wd, 0, w);
-                cpl_vector_set(vec_wd, 1, (double)y);
-                s = cpl_polynomial_eval(coef_slit[k], vec_wd);
+    /* Rows covered by the traces of each order, per column */
+    if (cr2res_trace_get_spans(trace_wave, lenx, leny, 1, &span_lo,
+                &span_hi) != 0) {
+        cpl_free(pc_wave);
+        cpl_free(pc_slit);
+        cpl_free(order_idx_values);
+        return -1;
+    }
+    ylo = cpl_malloc(nb_order_idx_values * lenx * sizeof(int));
+    yhi = cpl_malloc(nb_order_idx_values * lenx * sizeof(int));
+    for (k = 0; k < nb_order_idx_values; k++)
+        cr2res_slit_pos_order_band(trace_wave, order_idx_values[k], span_lo,
+                span_hi, lenx, ylo + k * lenx, yhi + k * lenx);
+    cpl_free(span_lo);
+    cpl_free(span_hi);
+    cpl_free(order_idx_values);
 
+    /* Only touch the existing bad pixel masks */
+    pbpm_slit = pbpm_wave = NULL;
+    if (cpl_image_get_bpm_const(*slitpos) != NULL)
+        pbpm_slit = cpl_mask_get_data(cpl_image_get_bpm(*slitpos));
+    if (cpl_image_get_bpm_const(*wavelength) != NULL)
+        pbpm_wave = cpl_mask_get_data(cpl_image_get_bpm(*wavelength));
+
+#pragma omp parallel for private(i, j, k, y, w, s, t, pix, col_wave)
+    for (x = 0; x < lenx; x++) {
+        col_wave = cpl_malloc((deg + 1) * sizeof(double));
+        for (k = 0; k < nb_order_idx_values; k++) {
+            /* Wavelength polynomial of this column, in y */
+            for (j = 0; j <= deg; j++) {
+                for (i = deg, t = 0.0; i >= 0; i--)
+                    t = t * (x + 1) + pc_wave[k * ncoef + i * (deg + 1) + j];
+                col_wave[j] = t;
+            }
+            for (y = ylo[k * lenx + x]; y <= yhi[k * lenx + x]; y++) {
+                for (j = deg, w = 0.0; j >= 0; j--) w = w * y + col_wave[j];
+                for (i = deg, s = 0.0; i >= 0; i--) {
+                    for (j = deg, t = 0.0; j >= 0; j--)
+                        t = t * y + pc_slit[k * ncoef + i * (deg + 1) + j];
+                    s = s * w + t;
+                }
                 if ((s > 0) && (s < 10)) {
-                    cpl_image_set(*slitpos, x, y, s);
-                    cpl_image_set(*wavelength, x, y, w);
+                    pix = x + (y - 1) * lenx;
+                    pslit[pix] = s;
+                    pwave[pix] = w;
+                    if (pbpm_slit != NULL) pbpm_slit[pix] = CPL_BINARY_0;
+                    if (pbpm_wave != NULL) pbpm_wave[pix] = CPL_BINARY_0;
                 }
             }
         }
+        cpl_free(col_wave);
     }
 
-    for (i=0; i < nb_order_idx_values; i++){
-        cpl_polynomial_delete(coef_wave[i]);
-        cpl_polynomial_delete(coef_slit[i]);
-    }
-    cpl_free(coef_slit);
-    cpl_free(coef_wave);
-    cpl_vector_delete(vec_wd);
-    cpl_vector_delete(vec_xy);
+    cpl_free(pc_wave);
+    cpl_free(pc_slit);
+    cpl_free(ylo);
+    cpl_free(yhi);
     return 0;
 }
 
@@ -555,6 +655,9 @@ int cr2res_slit_pos_image(
   @param    ycen
   @param    height
   @return   img_out
+
+  The bad pixel mask of img_in is carried along. The pixels falling
+  outside of img_in are set to 0.
  */
 /*----------------------------------------------------------------------------*/
 cpl_image * cr2res_image_cut_rectify(
@@ -563,55 +666,34 @@ cpl_image * cr2res_image_cut_rectify(
         int                   height)
 {
     cpl_image       * img_out;
-    cpl_image       * img_1d;
-    cpl_type        imtyp;
+    cpl_binary      * bpm_out;
+    const cpl_mask  * bpm_in;
     cpl_size        lenx, leny;
-    int             * ycen_int;
-    int             i, ymin, ymax;
-    int             empty_bottom = 0;
+    int             * ymin;
 
     if (img_in == NULL || ycen == NULL || height < 1) return NULL;
 
-    imtyp = cpl_image_get_type(img_in);
     lenx = cpl_image_get_size_x(img_in);
     leny = cpl_image_get_size_y(img_in);
-    ycen_int = cr2res_vector_get_int(ycen);
-    img_out = cpl_image_new(lenx, height, imtyp);
-
-    /* Loop over columns, cut out around ycen, insert into img_out*/
-    for (i=1;i<=lenx;i++){ // All image indx start at 1!
-
-        /* treat edge cases, summing over shorter column where needed*/
-        ymin = ycen_int[i-1]-(height/2);
-        ymax = ycen_int[i-1]+(height/2) + height%2 ;
-        if (ymin < 1) {
-            empty_bottom = 1 - ymin; // save for later insertion
-            ymin = 1;
-        }
-        if (ymax > leny)
-            ymax = leny; // Simply stop when we reach the top.
-        if (ymax <= ymin) {
-            cpl_msg_error(__func__,"Unreasonable borders in column %i",i);
-            cpl_free(ycen_int);
-            cpl_image_delete(img_out);
-            return NULL;
-        }
+    if ((ymin = cr2res_rect_get_ymin(ycen, lenx, leny, height)) == NULL)
+        return NULL;
 
-        /* Cut out and insert */
-        img_1d = cpl_image_extract(img_in,i,ymin, i, ymax);
-        cpl_image_copy(img_out, img_1d, i, 1+empty_bottom);
-        if (cpl_error_get_code() != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__,
-                    "Cannot extract and copy column %d, %d %d %d, %s",
-                    i, ymin, ymax, empty_bottom, cpl_error_get_where());
-            cpl_free(ycen_int);
-            cpl_image_delete(img_out);
-            if (img_1d != NULL) cpl_image_delete(img_1d);
-            return NULL;
-        }
-        cpl_image_delete(img_1d);
+    img_out = cpl_image_new(lenx, height, cpl_image_get_type(img_in));
+    bpm_in = cpl_image_get_bpm_const(img_in);
+    bpm_out = NULL;
+    if (bpm_in != NULL)
+        bpm_out = cpl_mask_get_data(cpl_image_get_bpm(img_out));
+
+    if (cr2res_rect_cut_buffer(cpl_image_get_data_const(img_in),
+                bpm_in == NULL ? NULL : cpl_mask_get_data_const(bpm_in),
+                cpl_image_get_type(img_in), lenx, leny, ymin, height,
+                cpl_image_get_data(img_out), bpm_out, lenx) != 0) {
+        cpl_msg_error(__func__, "Cannot cut out the order");
+        cpl_free(ymin);
+        cpl_image_delete(img_out);
+        return NULL;
     }
-    cpl_free(ycen_int);
+    cpl_free(ymin);
     return img_out;
 }
 
@@ -621,6 +703,9 @@ cpl_image * cr2res_image_cut_rectify(
   @param    rect_in
   @param    ycen
   @return   img_out
+
+  The bad pixel mask of rect_in replaces the one of img_out where the
+  cut-out is inserted.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_image_insert_rect(
@@ -628,11 +713,11 @@ int cr2res_image_insert_rect(
         const cpl_vector    * ycen,
         cpl_image           * img_out)
 {
-    cpl_image       * img_1d;
+    const cpl_mask  * bpm_in;
+    cpl_binary      * bpm_out;
     cpl_size        lenx, leny, height;
-    int             * ycen_int;
-    int             i, ymin, ymax;
-    int             empty_bottom;
+    int             * ymin;
+    int             ret;
 
     if (rect_in == NULL || ycen == NULL || img_out == NULL) return -1;
 
@@ -643,40 +728,224 @@ int cr2res_image_insert_rect(
         cpl_msg_error(__func__, "Length of rect and img need to be the same");
         return -1;
     }
+    if (cpl_image_get_type(rect_in) != cpl_image_get_type(img_out)) {
+        cpl_msg_error(__func__, "Type of rect and img need to be the same");
+        return -1;
+    }
+    if ((ymin = cr2res_rect_get_ymin(ycen, lenx, leny, height)) == NULL)
+        return -1;
+
+    /* The mask of img_out is only needed if one of the two has one */
+    bpm_in = cpl_image_get_bpm_const(rect_in);
+    bpm_out = NULL;
+    if (bpm_in != NULL || cpl_image_get_bpm_const(img_out) != NULL)
+        bpm_out = cpl_mask_get_data(cpl_image_get_bpm(img_out));
+
+    ret = cr2res_rect_insert_buffer(cpl_image_get_data_const(rect_in),
+            bpm_in == NULL ? NULL : cpl_mask_get_data_const(bpm_in),
+            cpl_image_get_type(rect_in), lenx, height, lenx, ymin, leny,
+            cpl_image_get_data(img_out), bpm_out);
+    cpl_free(ymin);
+    if (ret != 0) {
+        cpl_msg_error(__func__, "Cannot re-insert the order");
+        return -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the first detector row of a rectified order, per column
+  @param    ycen        the order center, at least lenx values
+  @param    lenx        the detector width
+  @param    leny        the detector height
+  @param    height      the height of the rectified order
+  @return   the lenx first rows (1-based, may be outside of the detector)
+            or NULL in error case. To be deallocated with cpl_free().
+
+  The row of the rectified order j (0-based) in column x is the detector
+  row ymin[x]+j. This fails if a column has (almost) no pixel on the
+  detector.
+ */
+/*----------------------------------------------------------------------------*/
+int * cr2res_rect_get_ymin(
+        const cpl_vector    * ycen,
+        cpl_size              lenx,
+        cpl_size              leny,
+        int                   height)
+{
+    int             * ymin;
+    int             i, ylo, yhi;
 
-    ycen_int = cr2res_vector_get_int(ycen);
+    if (ycen == NULL || height < 1) return NULL;
+    if (cpl_vector_get_size(ycen) < lenx) {
+        cpl_msg_error(__func__, "ycen is shorter than the image");
+        return NULL;
+    }
 
-    for (i=1;i<=lenx;i++){ // All image indices start at 1!
-        empty_bottom = 0;
-        /* treat edge cases, shorten column where needed*/
-        ymin = ycen_int[i-1]-(height/2);
-        ymax = ycen_int[i-1]+(height/2) + height%2 ;
-        if (ymin < 1) {
-            empty_bottom = 1 - ymin; // save for later insertion
-            ymin = 1;
+    ymin = cr2res_vector_get_int(ycen);
+    for (i=0;i<lenx;i++){
+        ylo = ymin[i]-(height/2);
+        yhi = ymin[i]+(height/2) + height%2 ;
+        if (ylo < 1) ylo = 1;
+        if (yhi > leny) yhi = leny;
+        if (yhi <= ylo) {
+            cpl_msg_error(__func__,"Unreasonable borders in column %i",i+1);
+            cpl_free(ymin);
+            return NULL;
         }
-        if (ymax > leny)
-            ymax = leny; // Simply stop when we reach the top.
-        if (ymax <= ymin) {
-            cpl_msg_error(__func__, "Unreasonable borders in column %i", i);
-            cpl_free(ycen_int);
+        ymin[i] -= height/2;
+    }
+    return ymin;
+}
+
+/* Gather / scatter loops, shared by all the pixel types */
+#define CR2RES_RECT_CUT_LOOP(TYPE)                                  \
+    for (j=0;j<height;j++) {                                        \
+        const TYPE * pin = (const TYPE *)in;                        \
+        TYPE * pout = (TYPE *)out + j*stride;                       \
+        for (x=0;x<lenx;x++) {                                      \
+            y = ymin[x]-1+j;                                        \
+            pout[x] = (y < 0 || y >= leny) ? 0 : pin[x+y*lenx];     \
+        }                                                           \
+    }
+#define CR2RES_RECT_INSERT_LOOP(TYPE)                               \
+    for (j=0;j<height;j++) {                                        \
+        const TYPE * prect = (const TYPE *)rect + j*stride;         \
+        TYPE * pout = (TYPE *)out;                                  \
+        for (x=0;x<lenx;x++) {                                      \
+            y = ymin[x]-1+j;                                        \
+            if (y >= 0 && y < leny) pout[x+y*lenx] = prect[x];      \
+        }                                                           \
+    }
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Cut a bent order into a rectangular buffer, shifting columns
+  @param    in          the detector pixels (lenx x leny)
+  @param    bpm_in      the detector bad pixel mask or NULL
+  @param    type        the pixel type (CPL_TYPE_DOUBLE, _FLOAT or _INT)
+  @param    lenx        the detector width
+  @param    leny        the detector height
+  @param    ymin        the first detector row (1-based) per column, see
+                        cr2res_rect_get_ymin()
+  @param    height      the number of rows to cut out
+  @param    out         [out] the rectified pixels (height rows of stride)
+  @param    bpm_out     [out] the rectified mask (same layout) or NULL
+  @param    stride      the row length of out and bpm_out (>= lenx)
+  @return   0 if ok, -1 otherwise
+
+  The columns are gathered straight from the detector buffer, no image is
+  allocated. The pixels falling outside of the detector are set to 0 and
+  flagged as good.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_rect_cut_buffer(
+        const void          * in,
+        const cpl_binary    * bpm_in,
+        cpl_type              type,
+        cpl_size              lenx,
+        cpl_size              leny,
+        const int           * ymin,
+        cpl_size              height,
+        void                * out,
+        cpl_binary          * bpm_out,
+        cpl_size              stride)
+{
+    cpl_size        x, y, j;
+
+    if (in == NULL || ymin == NULL || out == NULL || stride < lenx) return -1;
+
+    switch (type) {
+        case CPL_TYPE_DOUBLE:
+            CR2RES_RECT_CUT_LOOP(double)
+            break;
+        case CPL_TYPE_FLOAT:
+            CR2RES_RECT_CUT_LOOP(float)
+            break;
+        case CPL_TYPE_INT:
+            CR2RES_RECT_CUT_LOOP(int)
+            break;
+        default:
+            cpl_msg_error(__func__, "Unsupported pixel type");
             return -1;
+    }
+    if (bpm_out != NULL) {
+        for (j=0;j<height;j++) {
+            for (x=0;x<lenx;x++) {
+                y = ymin[x]-1+j;
+                bpm_out[x+j*stride] = (bpm_in == NULL || y < 0 || y >= leny) ?
+                    CPL_BINARY_0 : bpm_in[x+y*lenx];
+            }
         }
+    }
+    return 0;
+}
 
-        img_1d = cpl_image_extract(rect_in, i, empty_bottom+1, i, height);
-        cpl_image_copy(img_out, img_1d, i, ymin);
-        if (cpl_error_get_code() != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot re-insert column %d, %d %d %d, %s",
-                            i, ymin, ymax, empty_bottom, cpl_error_get_where());
-            cpl_free(ycen_int);
-            if (img_1d != NULL) cpl_image_delete(img_1d);
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Re-insert a rectangular buffer of an order into a detector buffer
+  @param    rect        the rectified pixels (height rows of stride)
+  @param    bpm_rect    the rectified mask (same layout) or NULL
+  @param    type        the pixel type (CPL_TYPE_DOUBLE, _FLOAT or _INT)
+  @param    lenx        the detector width
+  @param    height      the number of rectified rows
+  @param    stride      the row length of rect and bpm_rect (>= lenx)
+  @param    ymin        the first detector row (1-based) per column, see
+                        cr2res_rect_get_ymin()
+  @param    leny        the detector height
+  @param    out         [in/out] the detector pixels (lenx x leny)
+  @param    bpm_out     [in/out] the detector mask or NULL
+  @return   0 if ok, -1 otherwise
+
+  The rows falling outside of the detector are skipped. Where the order
+  is inserted, bpm_out is replaced by bpm_rect (good if NULL).
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_rect_insert_buffer(
+        const void          * rect,
+        const cpl_binary    * bpm_rect,
+        cpl_type              type,
+        cpl_size              lenx,
+        cpl_size              height,
+        cpl_size              stride,
+        const int           * ymin,
+        cpl_size              leny,
+        void                * out,
+        cpl_binary          * bpm_out)
+{
+    cpl_size        x, y, j;
+
+    if (rect == NULL || ymin == NULL || out == NULL || stride < lenx) return -1;
+
+    switch (type) {
+        case CPL_TYPE_DOUBLE:
+            CR2RES_RECT_INSERT_LOOP(double)
+            break;
+        case CPL_TYPE_FLOAT:
+            CR2RES_RECT_INSERT_LOOP(float)
+            break;
+        case CPL_TYPE_INT:
+            CR2RES_RECT_INSERT_LOOP(int)
+            break;
+        default:
+            cpl_msg_error(__func__, "Unsupported pixel type");
             return -1;
+    }
+    if (bpm_out != NULL) {
+        for (j=0;j<height;j++) {
+            for (x=0;x<lenx;x++) {
+                y = ymin[x]-1+j;
+                if (y < 0 || y >= leny) continue;
+                bpm_out[x+y*lenx] = (bpm_rect == NULL) ?
+                    CPL_BINARY_0 : bpm_rect[x+j*stride];
+            }
         }
-        cpl_image_delete(img_1d);
     }
-    cpl_free(ycen_int);
     return 0;
 }
+#undef CR2RES_RECT_CUT_LOOP
+#undef CR2RES_RECT_INSERT_LOOP
 
 /*----------------------------------------------------------------------------*/
 /**
@@ -1162,6 +1431,106 @@ int cr2res_plot_wavecal_result(
     return 0 ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the reduction of the detectors in parallel
+  @param    reduce      The reduction of one detector
+  @param    data        Recipe data passed to reduce
+  @param    reduce_det  The detector to reduce, 0 for all
+  @return   the number of detectors that failed, -1 in error case
+
+  The detectors are independent, reduce() is called concurrently for
+  each of them, one thread per detector. It must only write the outputs
+  of its own detector (e.g. the det_nr-1 entries of the recipe product
+  arrays), so that the products can be saved in the detector order once
+  all detectors are done. It must not change the process-wide messaging
+  state either, e.g. with cpl_msg_indent_more().
+
+  Each detector is reduced in its own CPL error state. If reduce()
+  returns -1 a warning is issued and the errors it raised are discarded,
+  as the recipes do for a failed detector. An error left set by a
+  reduction that succeeded is set again in the calling thread, for the
+  first such detector.
+
+  The threads left by OMP_NUM_THREADS are shared by the parallel
+  sections of the detector reductions (e.g. the extraction).
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_reduce_detectors(
+        cr2res_detector_reduce      reduce,
+        void                    *   data,
+        int                         reduce_det)
+{
+    cpl_error_code      codes[CR2RES_NB_DETECTORS] ;
+    int                 failed[CR2RES_NB_DETECTORS] ;
+    int                 det_list[CR2RES_NB_DETECTORS] ;
+    int                 ndet, nfailed, i ;
+#ifdef _OPENMP
+    int                 nthreads, nthreads_det, max_levels ;
+#endif
+
+    /* Check Entries */
+    if (reduce == NULL) return -1 ;
+    if (reduce_det < 0 || reduce_det > CR2RES_NB_DETECTORS) return -1 ;
+
+    /* The detectors to reduce */
+    ndet = 0 ;
+    for (i=1 ; i<=CR2RES_NB_DETECTORS ; i++) {
+        if (reduce_det != 0 && i != reduce_det) continue ;
+        det_list[ndet] = i ;
+        codes[ndet] = CPL_ERROR_NONE ;
+        failed[ndet] = 0 ;
+        ndet++ ;
+    }
+
+#ifdef _OPENMP
+    /* Share the threads, the inner parallel sections need nesting */
+    nthreads = omp_get_max_threads() ;
+    nthreads_det = nthreads < ndet ? nthreads : ndet ;
+    max_levels = omp_get_max_active_levels() ;
+    if (nthreads_det > 1 && max_levels < 2) omp_set_max_active_levels(2) ;
+#endif
+
+#pragma omp parallel for num_threads(nthreads_det) schedule(static, 1)
+    for (i=0 ; i<ndet ; i++) {
+        cpl_errorstate  prestate ;
+        int             det_nr ;
+
+#ifdef _OPENMP
+        /* The parallel sections of this detector reduction */
+        omp_set_num_threads(nthreads/nthreads_det > 1 ?
+                nthreads/nthreads_det : 1) ;
+#endif
+        det_nr = det_list[i] ;
+        prestate = cpl_errorstate_get() ;
+
+        cpl_msg_info(__func__, "Process detector number %d", det_nr) ;
+        if (reduce(det_nr, data) == -1) {
+            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
+            failed[i] = 1 ;
+        } else if (!cpl_errorstate_is_equal(prestate)) {
+            codes[i] = cpl_error_get_code() ;
+        }
+        /* The errors of this detector do not leak into the others */
+        cpl_errorstate_set(prestate) ;
+    }
+
+#ifdef _OPENMP
+    if (nthreads_det > 1 && max_levels < 2) 
+        omp_set_max_active_levels(max_levels) ;
+#endif
+
+    /* Report in the detector order */
+    nfailed = 0 ;
+    for (i=0 ; i<ndet ; i++) {
+        if (failed[i]) nfailed++ ;
+        else if (codes[i] != CPL_ERROR_NONE && !cpl_error_get_code())
+            cpl_error_set_message(__func__, codes[i],
+                    "Error in the reduction of detector %d", det_list[i]) ;
+    }
+    return nfailed ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Get the pipeline copyright and license
@@ -1195,3 +1564,75 @@ const char * cr2res_get_license(void)
 }
 
 /**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the dense coefficients of a 2D polynomial
+  @param    poly    the 2D polynomial
+  @param    deg     the degree of the dense array, at least the one of poly
+  @param    coeffs  [out] coeffs[i*(deg+1)+j] multiplies x^i y^j
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_slit_pos_get_coeffs(
+        const cpl_polynomial    *   poly,
+        int                         deg,
+        double                  *   coeffs)
+{
+    cpl_size    pows[2];
+    int         i, j, pdeg;
+
+    pdeg = cpl_polynomial_get_degree(poly);
+    for (i = 0; i <= deg; i++) {
+        for (j = 0; j <= deg; j++) {
+            pows[0] = i;
+            pows[1] = j;
+            coeffs[i * (deg + 1) + j] = (i + j <= pdeg) ?
+                cpl_polynomial_get_coeff(poly, pows) : 0.0;
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the detector rows covered by the traces of an order
+  @param    trace_wave  the trace wave table
+  @param    order_idx   the order
+  @param    span_lo     the first row of the traces, from cr2res_trace_get_spans
+  @param    span_hi     the last row of the traces, from cr2res_trace_get_spans
+  @param    lenx        the detector width
+  @param    ylo         [out] the first row (1-based) per column [lenx]
+  @param    yhi         [out] the last row (1-based) per column [lenx]
+  @return   0 if ok, -1 otherwise
+
+  The rows go from the lowest Lower to the highest Upper edge of the
+  traces. A column without rows has yhi < ylo.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_slit_pos_order_band(
+        const cpl_table *   trace_wave,
+        int                 order_idx,
+        const int       *   span_lo,
+        const int       *   span_hi,
+        cpl_size            lenx,
+        int             *   ylo,
+        int             *   yhi)
+{
+    cpl_size            i, x;
+
+    for (x = 0; x < lenx; x++) {
+        ylo[x] = INT_MAX;
+        yhi[x] = 0;
+    }
+    for (i = 0; i < cpl_table_get_nrow(trace_wave); i++) {
+        if (cpl_table_get(trace_wave, CR2RES_COL_ORDER, i, NULL) != order_idx)
+            continue;
+        for (x = 0; x < lenx; x++) {
+            if (span_hi[i * lenx + x] < span_lo[i * lenx + x]) continue;
+            if (span_lo[i * lenx + x] < ylo[x]) ylo[x] = span_lo[i * lenx + x];
+            if (span_hi[i * lenx + x] > yhi[x]) yhi[x] = span_hi[i * lenx + x];
+        }
+    }
+    return 0;
+}
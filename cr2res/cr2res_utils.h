@@ -46,6 +46,9 @@ typedef enum {
     CR2RES_DECKER_2_4
 } cr2res_decker ;
 
+/* Reduction of one detector, called by cr2res_reduce_detectors() */
+typedef int (*cr2res_detector_reduce)(int det_nr, void * data) ;
+
 /*-----------------------------------------------------------------------------
                                        Prototypes
  -----------------------------------------------------------------------------*/
@@ -89,6 +92,33 @@ int cr2res_image_insert_rect(
         const cpl_image     * rect_in,
         const cpl_vector    * ycen,
         cpl_image           * img_out  );
+int * cr2res_rect_get_ymin(
+        const cpl_vector    * ycen,
+        cpl_size              lenx,
+        cpl_size              leny,
+        int                   height);
+int cr2res_rect_cut_buffer(
+        const void          * in,
+        const cpl_binary    * bpm_in,
+        cpl_type              type,
+        cpl_size              lenx,
+        cpl_size              leny,
+        const int           * ymin,
+        cpl_size              height,
+        void                * out,
+        cpl_binary          * bpm_out,
+        cpl_size              stride);
+int cr2res_rect_insert_buffer(
+        const void          * rect,
+        const cpl_binary    * bpm_rect,
+        cpl_type              type,
+        cpl_size              lenx,
+        cpl_size              height,
+        cpl_size              stride,
+        const int           * ymin,
+        cpl_size              leny,
+        void                * out,
+        cpl_binary          * bpm_out);
 cpl_vector * cr2res_polynomial_eval_vector(
         const cpl_polynomial * poly,
         const cpl_vector     * vec);
@@ -124,6 +154,11 @@ int cr2res_plot_wavecal_result(
         double                      wmin,
         double                      wmax) ;
 
+int cr2res_reduce_detectors(
+        cr2res_detector_reduce      reduce,
+        void                    *   data,
+        int                         reduce_det) ;
+
 const char * cr2res_get_license(void) ;
 
 #endif
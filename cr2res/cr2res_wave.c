@@ -1016,7 +1016,6 @@ cpl_polynomial * cr2res_wave_xcorr(
     /* Clean the spectrum from the low frequency signal if requested */
     if (cleaning_filter_size > 0) {
         cpl_msg_info(__func__, "Low Frequency removal from spectrum") ;
-        cpl_msg_indent_more() ;
         /* Subtract the low frequency part */
         if ((filtered=cpl_vector_filter_median_create(
                         cpl_bivector_get_y(spectrum),
@@ -1028,7 +1027,6 @@ cpl_polynomial * cr2res_wave_xcorr(
             cpl_vector_subtract(spec_clean, filtered) ;
             cpl_vector_delete(filtered) ;
         }
-        cpl_msg_indent_less() ;
     } else {
         spec_clean = cpl_vector_duplicate(cpl_bivector_get_y(spectrum)) ;
     }
@@ -1070,7 +1068,6 @@ cpl_polynomial * cr2res_wave_xcorr(
             "XCORR: Deg:%d - Err:%g nm (%g pix) - %d samples -> %g polys",
             degree_loc,wl_error_nm,wl_error_pix,nsamples,pow(nsamples,
                 degree_loc+1)) ;
-    cpl_msg_indent_more() ;
     if ((sol = keep_higher_degrees_flag ?
                 irplib_wlxcorr_best_poly_prop(spec_clean, lines_list_filtered,
                     degree_loc, sol_guess, wl_errors, nsamples, slit_width,
@@ -1085,7 +1082,6 @@ cpl_polynomial * cr2res_wave_xcorr(
         cpl_vector_delete(spec_clean) ;
         if (xcorrs != NULL) cpl_vector_delete(xcorrs) ;
         cpl_error_reset() ;
-        cpl_msg_indent_less() ;
         return NULL ;
     }
     cpl_vector_delete(wl_errors) ;
@@ -1114,7 +1110,6 @@ cpl_polynomial * cr2res_wave_xcorr(
                 "", xcorrs) ;
     }
     if (xcorrs != NULL) cpl_vector_delete(xcorrs) ;
-    cpl_msg_indent_less() ;
 
     cpl_vector_delete(spec_clean) ;
     cpl_bivector_delete(lines_list_filtered) ;
@@ -1333,9 +1328,9 @@ hdrl_image * cr2res_wave_gen_wave_map(
     double          *   pout_ima ;
     const cpl_array *   tmp_array ;
     cpl_polynomial  *   wave_poly ;
-    cpl_polynomial  *   upper_poly ;
-    cpl_polynomial  *   lower_poly ;
-    double              upper_pos, lower_pos, wavelength ;
+    int             *   ylo ;
+    int             *   yhi ;
+    double              wavelength ;
     cpl_size            i, j, k, nrows, nx, ny ;
 
     /* Check Entries */
@@ -1351,24 +1346,20 @@ hdrl_image * cr2res_wave_gen_wave_map(
     ny = cpl_image_get_size_y(out_ima) ;
     pout_ima = cpl_image_get_data_double(out_ima) ;
 
+    /* Get the rows of the traces */
+    if (cr2res_trace_get_spans(trace_wave, nx, ny, 1, &ylo, &yhi) != 0) {
+        hdrl_image_delete(out) ;
+        return NULL ;
+    }
+
     /* Loop on the traces */
     for (k=0 ; k<nrows ; k++) {
         /* Check if there is a Wavelength Polynomial available */
         tmp_array = cpl_table_get_array(trace_wave, CR2RES_COL_WAVELENGTH, k) ;
         wave_poly = cr2res_convert_array_to_poly(tmp_array) ;
         if (wave_poly != NULL) {
-            /* Get the Upper Polynomial */
-            tmp_array = cpl_table_get_array(trace_wave, CR2RES_COL_UPPER, k) ;
-            upper_poly = cr2res_convert_array_to_poly(tmp_array) ;
-
-            /* Get the Lower Polynomial */
-            tmp_array = cpl_table_get_array(trace_wave, CR2RES_COL_LOWER, k) ;
-            lower_poly = cr2res_convert_array_to_poly(tmp_array) ;
-
-            /* Check if all Polynomials are available */
-            if (upper_poly == NULL || lower_poly == NULL) {
-                if (upper_poly != NULL) cpl_polynomial_delete(upper_poly) ;
-                if (lower_poly != NULL) cpl_polynomial_delete(lower_poly) ;
+            /* Check if the Upper / Lower Polynomials are available */
+            if (ylo[k*nx] == 0) {
                 cpl_msg_warning(__func__, "Cannot get UPPER/LOWER information");
                 cpl_polynomial_delete(wave_poly) ;
                 continue ;
@@ -1376,19 +1367,15 @@ hdrl_image * cr2res_wave_gen_wave_map(
 
             /* Set the Pixels in the trace */
             for (i=0 ; i<nx ; i++) {
-                upper_pos = cpl_polynomial_eval_1d(upper_poly, i+1, NULL) ;
-                lower_pos = cpl_polynomial_eval_1d(lower_poly, i+1, NULL) ;
                 wavelength = cpl_polynomial_eval_1d(wave_poly, i+1, NULL) ;
-                for (j=0 ; j<ny ; j++) {
-                    if (j+1 >= lower_pos && j+1 <= upper_pos)
-                        pout_ima[i+j*nx] = wavelength ;
-                }
+                for (j=ylo[k*nx+i] ; j<=yhi[k*nx+i] ; j++)
+                    pout_ima[i+(j-1)*nx] = wavelength ;
             }
             cpl_polynomial_delete(wave_poly) ;
-            cpl_polynomial_delete(upper_poly) ;
-            cpl_polynomial_delete(lower_poly) ;
         }
     }
+    cpl_free(ylo) ;
+    cpl_free(yhi) ;
     return out ;
 }
 
@@ -50,6 +50,7 @@
 static hdrl_image * create_hdrl(int nx, int ny, double value, double error);
 
 static void test_cr2res_calib_image(void);
+static void test_cr2res_calib_context(void);
 static void test_cr2res_calib_cosmic(void);
 static void test_cr2res_calib_flat(void);
 static void test_cr2res_calib_dark(void);
@@ -287,14 +288,17 @@ static void test_cr2res_calib_image()
 	char *my_path1 = cpl_sprintf("%s/TEST_master_flat.fits", localdir);
 	char *my_path2 = cpl_sprintf("%s/TEST_master_dark.fits", localdir);
 	char *my_path3 = cpl_sprintf("%s/TEST_bpm.fits", localdir);
+	char *my_path4 = cpl_sprintf("%s/TEST_master_detlin.fits", localdir);
     cpl_frame * flat = create_master_flat(my_path1, nx, ny, 1, 0, NULL);
     cpl_frame * dark = create_master_dark(my_path2, nx, ny, 10, 1, 10, NULL);
     cpl_frame * bpm = create_bpm(my_path3, nx, ny, 0);
     cpl_frame * detlin = NULL;
     double dit = 10;
+    double x, sx;
 
     hdrl_image * out;
     hdrl_image * cmp;
+    hdrl_image * ima, * imb, * imc;
 
     // NULL input / output
     out = cr2res_calib_image(NULL, chip, 0, 0, NULL, NULL, NULL, NULL, dit);
@@ -313,8 +317,34 @@ static void test_cr2res_calib_image()
     cpl_test_image_abs(hdrl_image_get_error(in), hdrl_image_get_error(out), DBL_EPSILON);
     hdrl_image_delete(out);
 
-    // Test all
-    // out = cr2res_calib_image(in, chip, 0, cosmics_corr, flat, dark, bpm, detlin, dit);
+    // Test all, the dark, detlin and flat are applied in this order
+    ima = create_hdrl(nx, ny, 1, 0);
+    imb = create_hdrl(nx, ny, 1e-2, 0);
+    imc = create_hdrl(nx, ny, 1e-4, 0);
+    detlin = create_detlin(my_path4, ima, imb, imc);
+    cpl_frame_delete(flat);
+    flat = create_master_flat(my_path1, nx, ny, 2, 1, NULL);
+    out = cr2res_calib_image(in, chip, 0, 0, flat, dark, bpm, detlin, dit);
+    cpl_test_nonnull(out);
+
+    // dark: 100 - 10, sqrt(1 + 1)
+    x = img_value - 10;
+    sx = sqrt(pow2(img_error) + 1);
+    // detlin
+    sx = deterr(x, 1, 1e-2, 1e-4, sx, 0, 0, 0);
+    x = detlin(x, 1, 1e-2, 1e-4);
+    // flat
+    cmp = create_hdrl(nx, ny, x / 2, sqrt(pow2(sx / 2) + pow2(x / 4)));
+    cpl_test_image_abs(hdrl_image_get_image(cmp), hdrl_image_get_image(out), 
+            1e-10);
+    cpl_test_image_abs(hdrl_image_get_error(cmp), hdrl_image_get_error(out), 
+            1e-10);
+    cpl_test_eq(hdrl_image_count_rejected(out), 0);
+    hdrl_image_delete(out);
+    hdrl_image_delete(cmp);
+    hdrl_image_delete(ima);
+    hdrl_image_delete(imb);
+    hdrl_image_delete(imc);
 
     hdrl_image_delete(in);
     cpl_frame_delete(flat);
@@ -324,6 +354,106 @@ static void test_cr2res_calib_image()
     cpl_free(my_path1) ;
     cpl_free(my_path2) ;
     cpl_free(my_path3) ;
+    cpl_free(my_path4) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the calibration of several images with one context
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_calib_context()
+{
+    int nx = 5;
+    int ny = 5;
+    int chip = 1;
+    int i;
+
+    hdrl_image * in;
+    hdrl_image * out;
+    hdrl_image * ima, * imb, * imc;
+    hdrl_imagelist * list;
+    hdrl_imagelist * list_out;
+    cpl_vector * dits;
+    cr2res_calib_context * ctx;
+
+	char *my_path1 = cpl_sprintf("%s/TEST_master_flat.fits", localdir);
+	char *my_path2 = cpl_sprintf("%s/TEST_master_dark.fits", localdir);
+	char *my_path3 = cpl_sprintf("%s/TEST_bpm.fits", localdir);
+	char *my_path4 = cpl_sprintf("%s/TEST_master_detlin.fits", localdir);
+    cpl_frame * flat = create_master_flat(my_path1, nx, ny, 2, 1, NULL);
+    cpl_frame * dark = create_master_dark(my_path2, nx, ny, 10, 1, 10, NULL);
+    cpl_frame * bpm = create_bpm(my_path3, nx, ny, 0);
+    ima = create_hdrl(nx, ny, 1, 0.1);
+    imb = create_hdrl(nx, ny, 1e-2, 1e-3);
+    imc = create_hdrl(nx, ny, 1e-4, 1e-5);
+    cpl_frame * detlin = create_detlin(my_path4, ima, imb, imc);
+
+    // NULL input
+    cpl_test_null(cr2res_calib_context_new(0, 0, 0, flat, dark, bpm, detlin));
+    cpl_test_null(cr2res_calib_context_apply_image(NULL, ima, 10));
+    cpl_test_null(cr2res_calib_context_apply_imagelist(NULL, NULL, NULL));
+    cpl_test_zero(cr2res_calib_context_needs_dits(NULL));
+
+    ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, bpm, detlin);
+    cpl_test_nonnull(ctx);
+    cpl_test_eq(cr2res_calib_context_needs_dits(ctx), 1);
+
+    // Images with different levels and DITs
+    list = hdrl_imagelist_new();
+    dits = cpl_vector_new(3);
+    for (i=0 ; i<3 ; i++) {
+        hdrl_imagelist_set(list, create_hdrl(nx, ny, 100 * (i + 1), i + 1), i);
+        cpl_vector_set(dits, i, 10 * (i % 2 + 1));
+    }
+
+    // The dark needs the DITs
+    cpl_test_null(cr2res_calib_context_apply_imagelist(ctx, list, NULL));
+
+    // Same result as the calibration of each image
+    list_out = cr2res_calib_context_apply_imagelist(ctx, list, dits);
+    cpl_test_nonnull(list_out);
+    cpl_test_eq(hdrl_imagelist_get_size(list_out), 3);
+    for (i=0 ; i<3 ; i++) {
+        in = hdrl_imagelist_get(list, i);
+        out = cr2res_calib_image(in, chip, 0, 0, flat, dark, bpm, detlin,
+                cpl_vector_get(dits, i));
+        cpl_test_image_abs(hdrl_image_get_image(out),
+                hdrl_image_get_image(hdrl_imagelist_get(list_out, i)), 0);
+        cpl_test_image_abs(hdrl_image_get_error(out),
+                hdrl_image_get_error(hdrl_imagelist_get(list_out, i)), 0);
+        hdrl_image_delete(out);
+
+        out = cr2res_calib_context_apply_image(ctx, in, 
+                cpl_vector_get(dits, i));
+        cpl_test_image_abs(hdrl_image_get_image(out),
+                hdrl_image_get_image(hdrl_imagelist_get(list_out, i)), 0);
+        hdrl_image_delete(out);
+    }
+    hdrl_imagelist_delete(list_out);
+
+    // Wrong image size
+    in = create_hdrl(nx + 1, ny, 100, 1);
+    cpl_test_null(cr2res_calib_context_apply_image(ctx, in, 10));
+    cpl_test_error(CPL_ERROR_INCOMPATIBLE_INPUT);
+    hdrl_image_delete(in);
+
+    cr2res_calib_context_delete(ctx);
+    cr2res_calib_context_delete(NULL);
+
+    hdrl_imagelist_delete(list);
+    cpl_vector_delete(dits);
+    hdrl_image_delete(ima);
+    hdrl_image_delete(imb);
+    hdrl_image_delete(imc);
+    cpl_frame_delete(flat);
+    cpl_frame_delete(dark);
+    cpl_frame_delete(bpm);
+    cpl_frame_delete(detlin);
+    cpl_free(my_path1) ;
+    cpl_free(my_path2) ;
+    cpl_free(my_path3) ;
+    cpl_free(my_path4) ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1080,6 +1210,7 @@ int main(void)
     create_empty_fits();
 
     test_cr2res_calib_image();
+    test_cr2res_calib_context();
     test_cr2res_calib_cosmic();
     test_cr2res_calib_flat();
     test_cr2res_calib_dark();
@@ -0,0 +1,418 @@
+/*
+ * This file is part of the CR2RES Pipeline
+ * Copyright (C) 2002,2003 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <cpl.h>
+#include <hdrl.h>
+#include <cr2res_detlin.h>
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static hdrl_imagelist * create_ramp(int nx, int ny, int nframes,
+        const double * values, const double * gains);
+static void create_outputs(int nx, int ny, cpl_imagelist ** coeffs,
+        cpl_imagelist ** errors);
+static void test_cr2res_detlin_compute_image(void);
+static void test_cr2res_detlin_compute_image_quadratic(void);
+static void test_cr2res_detlin_compute_image_failed(void);
+static void test_cr2res_detlin_sums(void);
+static void test_cr2res_detlin_sums_errors(void);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup cr2res_detlin-test    Unit test of cr2res_detlin
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create a DIT ramp
+  @param    nx          x size of the images
+  @param    ny          y size of the images
+  @param    nframes     Number of images
+  @param    values      The nframes pixel values of a unit gain pixel
+  @param    gains       The nx*ny gains of the pixels
+  @return   the ramp, pixel i of image k is gains[i]*values[k]
+ */
+/*----------------------------------------------------------------------------*/
+static hdrl_imagelist * create_ramp(int nx, int ny, int nframes,
+        const double * values, const double * gains)
+{
+    hdrl_imagelist * ramp = hdrl_imagelist_new();
+    cpl_image * ima;
+    double * pima;
+    int i, k;
+
+    for (k = 0; k < nframes; k++) {
+        ima = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE);
+        pima = cpl_image_get_data_double(ima);
+        for (i = 0; i < nx * ny; i++) pima[i] = gains[i] * values[k];
+        hdrl_imagelist_set(ramp, hdrl_image_create(ima, NULL), k);
+        cpl_image_delete(ima);
+    }
+    return ramp;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the 3 coefficients and errors images of a fit
+  @param    nx          x size of the images
+  @param    ny          y size of the images
+  @param    coeffs      [out] The coefficients images
+  @param    errors      [out] The errors images
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void create_outputs(int nx, int ny, cpl_imagelist ** coeffs,
+        cpl_imagelist ** errors)
+{
+    int l;
+
+    *coeffs = cpl_imagelist_new();
+    *errors = cpl_imagelist_new();
+    for (l = 0; l < 3; l++) {
+        cpl_imagelist_set(*coeffs, cpl_image_new(nx, ny, CPL_TYPE_DOUBLE), l);
+        cpl_imagelist_set(*errors, cpl_image_new(nx, ny, CPL_TYPE_DOUBLE), l);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the fit of all the pixels with cr2res_detlin_compute()
+
+  cr2res_detlin_compute() lets cpl_polynomial_fit() assume a symmetric
+  sampling, the pixel values of the ramp are therefore equidistant. The
+  DITs are not, so that the response is not linear.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_compute_image(void)
+{
+    int nx = 4;
+    int ny = 3;
+    int nframes = 5;
+    double dits[] = {1.0, 2.1, 3.3, 4.6, 6.0};
+    double values[] = {1000.0, 2000.0, 3000.0, 4000.0, 5000.0};
+    double gains[nx * ny];
+    hdrl_imagelist * ramp;
+    cpl_vector * dits_vec;
+    cpl_vector * pix_values;
+    cpl_imagelist * coeffs;
+    cpl_imagelist * errors;
+    cpl_polynomial * fitted;
+    cpl_vector * error;
+    double coeff, ref;
+    cpl_size i, k, l;
+
+    for (i = 0; i < nx * ny; i++) gains[i] = i + 1;
+    ramp = create_ramp(nx, ny, nframes, values, gains);
+    dits_vec = cpl_vector_wrap(nframes, dits);
+    create_outputs(nx, ny, &coeffs, &errors);
+
+    cpl_test_eq(0, cr2res_detlin_compute_image(ramp, dits_vec, NULL, coeffs,
+                errors));
+
+    pix_values = cpl_vector_new(nframes);
+    for (i = 0; i < nx * ny; i++) {
+        for (k = 0; k < nframes; k++)
+            cpl_vector_set(pix_values, k, gains[i] * values[k]);
+        cpl_test_eq(0, cr2res_detlin_compute(dits_vec, pix_values, 2,
+                    &fitted, &error));
+        for (l = 0; l < 3; l++) {
+            coeff = cpl_image_get_data_double(
+                    cpl_imagelist_get(coeffs, l))[i];
+            ref = cpl_polynomial_get_coeff(fitted, &l);
+            cpl_test_abs(coeff, ref, 1e-8 * fabs(ref));
+            /* The residuals of the fit sum to 0, both errors are */
+            /* rounding noise, small compared to the squared coefficient */
+            cpl_test_abs(cpl_image_get_data_double(
+                        cpl_imagelist_get(errors, l))[i],
+                    cpl_vector_get(error, l), 1e-6 * ref * ref);
+        }
+        cpl_polynomial_delete(fitted);
+        cpl_vector_delete(error);
+    }
+
+    cpl_vector_delete(pix_values);
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_vector_unwrap(dits_vec);
+    hdrl_imagelist_delete(ramp);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fit a known quadratic response on an asymmetric ramp
+
+  The first 2 DITs give the expected linear counts v0 + m*(dit-dit0), and
+  their ratio to the measured counts v is 1 + a*(v-v0)*(v-v1). The DITs
+  are computed from the pixel values, which are not equidistant. A pixel
+  with a gain g has the coefficients 1+a*v0*v1, -a*(v0+v1)/g and a/g^2.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_compute_image_quadratic(void)
+{
+    int nx = 5;
+    int ny = 2;
+    int nframes = 6;
+    double values[] = {1000.0, 2000.0, 3500.0, 6000.0, 9000.0, 13000.0};
+    double a = -1e-9;
+    double m = 1000.0;
+    double dits[nframes];
+    double gains[nx * ny];
+    double ref[3];
+    double * pcoeffs;
+    hdrl_imagelist * ramp;
+    cpl_vector * dits_vec;
+    cpl_imagelist * coeffs;
+    cpl_imagelist * errors;
+    double v0 = values[0];
+    double v1 = values[1];
+    cpl_size i, k, l;
+
+    for (k = 0; k < nframes; k++)
+        dits[k] = 1.0 + (values[k] * (1.0 + a * (values[k] - v0) *
+                    (values[k] - v1)) - v0) / m;
+    for (i = 0; i < nx * ny; i++) gains[i] = 1 + i % 4;
+    ramp = create_ramp(nx, ny, nframes, values, gains);
+    dits_vec = cpl_vector_wrap(nframes, dits);
+    create_outputs(nx, ny, &coeffs, &errors);
+
+    cpl_test_eq(0, cr2res_detlin_compute_image(ramp, dits_vec, NULL, coeffs,
+                errors));
+
+    for (i = 0; i < nx * ny; i++) {
+        ref[0] = 1.0 + a * v0 * v1;
+        ref[1] = -a * (v0 + v1) / gains[i];
+        ref[2] = a / (gains[i] * gains[i]);
+        for (l = 0; l < 3; l++) {
+            pcoeffs = cpl_image_get_data_double(cpl_imagelist_get(coeffs, l));
+            cpl_test_abs(pcoeffs[i], ref[l], 1e-8 * fabs(ref[l]));
+        }
+    }
+
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_vector_unwrap(dits_vec);
+    hdrl_imagelist_delete(ramp);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the pixels that cannot be fitted or are not selected
+
+  A constant pixel and a zero pixel have no fit, and a pixel out of the
+  selection is not fitted. They get NaN coefficients and errors, the
+  other pixels are fitted.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_compute_image_failed(void)
+{
+    int nx = 3;
+    int ny = 2;
+    int nframes = 4;
+    double dits[] = {1.0, 2.0, 3.0, 4.5};
+    double values[] = {1000.0, 2000.0, 2900.0, 4100.0};
+    double gains[] = {1.0, 2.0, 3.0, 4.0, 0.0, 5.0};
+    hdrl_imagelist * ramp;
+    cpl_vector * dits_vec;
+    cpl_image * selection;
+    cpl_imagelist * coeffs;
+    cpl_imagelist * errors;
+    double * pcoeffs;
+    double * perrors;
+    cpl_size i, k, l;
+
+    /* Pixel 1 is constant, pixel 4 is zero, pixel 2 is not selected */
+    ramp = create_ramp(nx, ny, nframes, values, gains);
+    for (k = 0; k < nframes; k++)
+        cpl_image_get_data_double(hdrl_image_get_image(
+                    hdrl_imagelist_get(ramp, k)))[1] = 1000.0;
+    selection = cpl_image_new(nx, ny, CPL_TYPE_INT);
+    cpl_image_add_scalar(selection, 1.0);
+    cpl_image_get_data_int(selection)[2] = 0;
+    dits_vec = cpl_vector_wrap(nframes, dits);
+    create_outputs(nx, ny, &coeffs, &errors);
+
+    cpl_test_eq(0, cr2res_detlin_compute_image(ramp, dits_vec, selection,
+                coeffs, errors));
+
+    for (l = 0; l < 3; l++) {
+        pcoeffs = cpl_image_get_data_double(cpl_imagelist_get(coeffs, l));
+        perrors = cpl_image_get_data_double(cpl_imagelist_get(errors, l));
+        for (i = 0; i < nx * ny; i++) {
+            if (i == 1 || i == 2 || i == 4) {
+                cpl_test(isnan(pcoeffs[i]));
+                cpl_test(isnan(perrors[i]));
+            } else {
+                cpl_test(isfinite(pcoeffs[i]));
+                cpl_test(isfinite(perrors[i]));
+            }
+        }
+    }
+
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_image_delete(selection);
+    cpl_vector_unwrap(dits_vec);
+    hdrl_imagelist_delete(ramp);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the streamed sums with the fit of the whole ramp
+
+  The images of a shuffled ramp are added one by one by increasing DIT,
+  as cr2res_cal_detlin does while it loads them. The solved sums must
+  give exactly what cr2res_detlin_compute_image() gives on the shuffled
+  ramp.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_sums(void)
+{
+    int nx = 7;
+    int ny = 3;
+    int nframes = 6;
+    double dits[] = {4.5, 1.0, 9.0, 2.0, 6.0, 3.1};
+    double values[] = {4300.0, 1000.0, 8100.0, 2000.0, 5600.0, 3050.0};
+    int sorted[] = {1, 3, 5, 0, 4, 2};
+    double gains[nx * ny];
+    hdrl_imagelist * ramp;
+    cpl_vector * dits_vec;
+    cpl_imagelist * coeffs_ref;
+    cpl_imagelist * errors_ref;
+    cpl_imagelist * coeffs;
+    cpl_imagelist * errors;
+    cr2res_detlin_sums * sums;
+    cpl_size i, k, l;
+
+    for (i = 0; i < nx * ny; i++) gains[i] = 1.0 + 0.25 * i;
+    ramp = create_ramp(nx, ny, nframes, values, gains);
+    dits_vec = cpl_vector_wrap(nframes, dits);
+    create_outputs(nx, ny, &coeffs_ref, &errors_ref);
+    create_outputs(nx, ny, &coeffs, &errors);
+
+    cpl_test_eq(0, cr2res_detlin_compute_image(ramp, dits_vec, NULL,
+                coeffs_ref, errors_ref));
+
+    sums = cr2res_detlin_sums_new(nx, ny);
+    cpl_test_nonnull(sums);
+    for (k = 0; k < nframes; k++)
+        cpl_test_eq(0, cr2res_detlin_sums_add(sums, hdrl_image_get_image(
+                        hdrl_imagelist_get(ramp, sorted[k])),
+                    dits[sorted[k]]));
+    cpl_test_eq(0, cr2res_detlin_sums_solve(sums, NULL, coeffs, errors));
+
+    for (l = 0; l < 3; l++) {
+        for (i = 0; i < nx * ny; i++) {
+            cpl_test_abs(cpl_image_get_data_double(
+                        cpl_imagelist_get(coeffs, l))[i],
+                    cpl_image_get_data_double(
+                        cpl_imagelist_get(coeffs_ref, l))[i], 0.0);
+            cpl_test_abs(cpl_image_get_data_double(
+                        cpl_imagelist_get(errors, l))[i],
+                    cpl_image_get_data_double(
+                        cpl_imagelist_get(errors_ref, l))[i], 0.0);
+        }
+    }
+
+    cr2res_detlin_sums_delete(sums);
+    cpl_imagelist_delete(coeffs_ref);
+    cpl_imagelist_delete(errors_ref);
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_vector_unwrap(dits_vec);
+    hdrl_imagelist_delete(ramp);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the misuses of the detlin sums
+
+  An image whose DIT is lower than the one of the previous image is
+  refused, and the sums cannot be solved with less than 2 images.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_sums_errors(void)
+{
+    int nx = 3;
+    int ny = 2;
+    cr2res_detlin_sums * sums;
+    cpl_imagelist * coeffs;
+    cpl_imagelist * errors;
+    cpl_image * ima;
+
+    ima = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE);
+    cpl_image_add_scalar(ima, 1000.0);
+    create_outputs(nx, ny, &coeffs, &errors);
+    sums = cr2res_detlin_sums_new(nx, ny);
+
+    /* Less than 2 images */
+    cpl_test_eq(-1, cr2res_detlin_sums_solve(sums, NULL, coeffs, errors));
+    cpl_test_error(CPL_ERROR_DATA_NOT_FOUND);
+    cpl_test_eq(0, cr2res_detlin_sums_add(sums, ima, 2.0));
+    cpl_test_eq(-1, cr2res_detlin_sums_solve(sums, NULL, coeffs, errors));
+    cpl_test_error(CPL_ERROR_DATA_NOT_FOUND);
+
+    /* Out of order DITs, the refused images are not added */
+    cpl_test_eq(-1, cr2res_detlin_sums_add(sums, ima, 1.0));
+    cpl_test_error(CPL_ERROR_ILLEGAL_INPUT);
+    cpl_test_eq(0, cr2res_detlin_sums_add(sums, ima, 3.0));
+    cpl_test_eq(-1, cr2res_detlin_sums_add(sums, ima, 2.5));
+    cpl_test_error(CPL_ERROR_ILLEGAL_INPUT);
+    cpl_test_eq(0, cr2res_detlin_sums_add(sums, ima, 4.0));
+
+    cr2res_detlin_sums_delete(sums);
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_image_delete(ima);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the Unit tests
+ */
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_WARNING);
+
+    test_cr2res_detlin_compute_image();
+    test_cr2res_detlin_compute_image_quadratic();
+    test_cr2res_detlin_compute_image_failed();
+    test_cr2res_detlin_sums();
+    test_cr2res_detlin_sums_errors();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -46,6 +46,16 @@ static void test_cr2res_slitdec_curved(void);
 static void test_cr2res_slitdec_compare_vert_curved(void);
 static void test_cr2res_slitdec_errors(void);
 static void test_cr2res_slitdec_input_slitfunc(void);
+static void test_cr2res_slitdec_golden(void);
+static void test_cr2res_slitdec_vert_unc(void);
+static void test_cr2res_extract_geom_cache(void);
+static void test_cr2res_extract_warm_start(void);
+static void test_cr2res_extract_traces_multi(void);
+static void test_cr2res_extract_horne(void);
+static void test_cr2res_extract_single_prec(void);
+static void test_cr2res_extract_quick_look(void);
+static void test_cr2res_extract2d_trace(void);
+static void test_cr2res_extract_swath_plan(void);
 
 
 static cpl_table *create_test_table()
@@ -594,6 +604,10 @@ static void test_cr2res_slitdec_vert_edge_cases(void)
     cpl_test_eq(-1, cr2res_extract_slitdec_vert(img_hdrl, trace_table,
                 NULL, order, trace, height, -1,
                 oversample, smooth_slit, &slit_func, &spec, &model));
+    cpl_test_eq(-1, cr2res_extract_slitdec_vert(img_hdrl, trace_table,
+                NULL, order, trace, height, 1,
+                oversample, smooth_slit, &slit_func, &spec, &model));
+    cpl_test_error(CPL_ERROR_ILLEGAL_INPUT);
 
     cpl_test_eq( 0, cr2res_extract_slitdec_vert(img_hdrl, trace_table,
                 NULL, order, trace, height, 10000,
@@ -964,6 +978,972 @@ static void test_cr2res_slitdec_input_slitfunc(void)
     hdrl_image_delete(img_hdrl);
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare both slit decompositions against stored reference output
+  
+  The reference values were produced by the unoptimised build (the
+  extraction module used to be pinned to -O0), printed with 10 significant
+  digits. The spectrum has to agree to 1e-8 relative, its uncertainty to
+  1e-7 relative and the slit function to 1e-10 absolute, i.e. just above
+  the print precision. The vertical uncertainty is propagated from an
+  error image of 0.1 + 1% of the flux. Any change in
+  the decomposition itself (geometry, solver, masking, swath merging) moves
+  the results by orders of magnitude more than that.
+  The spectrum and its error are sampled every 17th pixel starting at 10.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_slitdec_golden(void)
+{
+    int width = 400;
+    int height = 20;
+    int order = 1;
+    int trace = 1;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    int nsample = 22;
+    int i;
+
+    static const double ref_sf_vert[] = {
+            -3.391698399e-05, -3.391698399e-05, -2.109796642e-05,
+            1.73590863e-05, 8.145417416e-05, 0.0001764872799, 0.0003077583863,
+            0.0004752674933, 0.0007364645439, 0.001148799481, 0.001712272304,
+            0.002538552922, 0.003739311243, 0.005314547265, 0.007454866851,
+            0.01035087586, 0.01400257429, 0.01861790157, 0.0244047971,
+            0.0313632609, 0.03954606055, 0.04900596367, 0.05974297025,
+            0.07144716433, 0.08380862992, 0.09682736705, 0.1098082335,
+            0.1220560871, 0.1335709277, 0.1435919364, 0.1513582938, 0.15687,
+            0.1597929204, 0.1597929204, 0.1568699999, 0.1513582937,
+            0.1435919364, 0.1335709281, 0.1220560875, 0.1098082332,
+            0.09682736531, 0.08380862806, 0.0714471657, 0.05974297822,
+            0.04900597221, 0.03954605426, 0.03136322435, 0.02440475793,
+            0.01861793043, 0.01400274186, 0.01035105546, 0.007454734497,
+            0.005313778961, 0.003738487754, 0.002539159773, 0.001715795018,
+            0.001152575219, 0.0007336821058, 0.0004591156774, 0.0002904464393,
+            0.0001892448964, 0.0001555110488, 0.0001555110488, 0.0001555110488};
+    static const double ref_spec_vert[] = {
+            44.73006195, 47.4724118, 25.58279267, 12.62038262, 28.45797269,
+            48.81480669, 42.48163366, 19.16789989, 14.6161068, 35.80465057,
+            50.24917829, 35.80465057, 14.6161068, 19.16789989, 42.48163366,
+            48.81480669, 28.45797269, 12.62038262, 25.58279267, 47.4724118,
+            44.73006195, 21.56006511};
+    static const double ref_err_vert[] = {
+            0.4735633611, 0.4843813279, 0.3982200609, 0.3474747818,
+            0.409508831, 0.489678785, 0.4646981291, 0.3730736048,
+            0.3552693628, 0.4383971047, 0.4953405996, 0.4383971047,
+            0.3552693628, 0.3730736048, 0.4646981291, 0.489678785,
+            0.409508831, 0.3474747818, 0.3982200609, 0.4843813279,
+            0.4735633611, 0.3824439658};
+    static const double ref_sf_curv[] = {
+            -3.411002775e-05, -3.411002775e-05, -3.411002775e-05,
+            -2.120699441e-05, 1.74929414e-05, 8.243497537e-05, 0.0001780098458,
+            0.000308577831, 0.000474042397, 0.0007347880298, 0.001153224041,
+            0.001723078588, 0.002552455851, 0.003751462727, 0.005317907547,
+            0.007453344727, 0.01037989539, 0.0140268424, 0.01863399877,
+            0.02442407255, 0.03138582323, 0.03956645786, 0.04903144784,
+            0.05973996994, 0.07142571191, 0.08379571295, 0.09683857698,
+            0.1098286693, 0.1220631458, 0.1335534011, 0.1435749583,
+            0.1513629904, 0.1568960984, 0.1598122542, 0.1597965401,
+            0.1568537715, 0.1513505134, 0.1436054413, 0.1335973325,
+            0.1220685289, 0.1097986244, 0.09680364802, 0.08379417683,
+            0.07144946668, 0.05975383705, 0.04901071693, 0.03954490747,
+            0.03136210031, 0.02440047398, 0.0186085415, 0.01400227047,
+            0.01034968089, 0.007435238769, 0.005291357678, 0.003737661366,
+            0.002553611514, 0.001730864177, 0.00115576962, 0.0007281980411,
+            0.000453325427, 0.0002895154359, 0.0001917653439, 0.0001594052727,
+            0.0001594052727};
+    static const double ref_spec_curv[] = {
+            44.38044126, 47.72923177, 26.05076827, 12.58042228, 27.96907289,
+            48.62285817, 42.87733379, 19.54121538, 14.39037484, 35.32360663,
+            50.25060872, 36.28631824, 14.84012254, 18.79279131, 42.08226154,
+            49.0028483, 28.94447514, 12.65795693, 25.11245785, 47.21406314,
+            45.07842546, 21.97977671};
+    static const double ref_err_curv[] = {
+            0.09569653513, 0.08989712047, 0.1269340623, 0.0157949669,
+            0.1209244257, 0.0671615631, 0.114750225, 0.0959609749,
+            0.06200977005, 0.1396072912, 0.06354132191, 0.1385325178,
+            0.06636771719, 0.09270358462, 0.11529418, 0.06712419807,
+            0.1218395229, 0.0176420532, 0.1244947377, 0.08765762977,
+            0.10290921, 0.1119872066};
+
+    cpl_image * img_in;
+    cpl_image * err_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_vector * slit_func;
+    cpl_bivector * spec;
+    hdrl_image * model;
+
+    /* Vertical slit */
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    err_in = cpl_image_duplicate(img_in);
+    cpl_image_multiply_scalar(err_in, 0.01);
+    cpl_image_add_scalar(err_in, 0.1);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    cpl_image_delete(err_in);
+    trace_table = create_table_linear_increase(width, height, 0);
+
+    cpl_test_eq(0, cr2res_extract_slitdec_vert(img_hdrl, trace_table, NULL,
+                order, trace, height, swath, oversample, smooth_slit,
+                &slit_func, &spec, &model));
+    cpl_test_eq(cpl_vector_get_size(slit_func), oversample * (height + 1) + 1);
+    for (i = 0; i < cpl_vector_get_size(slit_func); i++)
+        cpl_test_abs(cpl_vector_get(slit_func, i), ref_sf_vert[i], 1e-10);
+    for (i = 0; i < nsample; i++) {
+        cpl_test_rel(cpl_bivector_get_x_data(spec)[10 + 17 * i],
+                ref_spec_vert[i], 1e-8);
+        cpl_test_rel(cpl_bivector_get_y_data(spec)[10 + 17 * i],
+                ref_err_vert[i], 1e-7);
+    }
+
+    cpl_vector_delete(slit_func);
+    cpl_bivector_delete(spec);
+    hdrl_image_delete(model);
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+
+    /* Tilted slit */
+    img_in = apply_shear(img_in, width, height, 0.5);
+    img_hdrl = hdrl_image_create(img_in, NULL);
+    trace_table = create_table_linear_increase(width, height, 0.5);
+
+    cpl_test_eq(0, cr2res_extract_slitdec_curved(img_hdrl, trace_table, NULL,
+                order, trace, height, swath, oversample, smooth_slit,
+                &slit_func, &spec, &model));
+    cpl_test_eq(cpl_vector_get_size(slit_func), oversample * (height + 1) + 1);
+    for (i = 0; i < cpl_vector_get_size(slit_func); i++)
+        cpl_test_abs(cpl_vector_get(slit_func, i), ref_sf_curv[i], 1e-10);
+    for (i = 0; i < nsample; i++) {
+        cpl_test_rel(cpl_bivector_get_x_data(spec)[10 + 17 * i],
+                ref_spec_curv[i], 1e-8);
+        cpl_test_rel(cpl_bivector_get_y_data(spec)[10 + 17 * i],
+                ref_err_curv[i], 1e-7);
+    }
+
+    cpl_vector_delete(slit_func);
+    cpl_bivector_delete(spec);
+    hdrl_image_delete(model);
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the vertical decomposition error with a Monte-Carlo run
+
+  A flat order with gaussian noise of known sigma is extracted many times
+  with a fixed flat slit function. The scatter of the spectrum over the
+  realisations must match the returned uncertainty.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_slitdec_vert_unc(void)
+{
+    int width = 100;
+    int height = 20;
+    int swath = 50;
+    int oversample = 3;
+    int nreal = 300;
+    double smooth_slit = 1;
+    double flux = 100.;
+    double sigma = 2.;
+    double sum[width];
+    double sum2[width];
+    double err[width];
+    double * pimg;
+    double u1, u2, std, ratio;
+    int i, j, k;
+
+    cpl_table * trace_table = create_table_linear_increase(width, height, 0);
+    cpl_image * img_in = cpl_image_new(width, height, CPL_TYPE_DOUBLE);
+    cpl_image * err_in = cpl_image_new(width, height, CPL_TYPE_DOUBLE);
+    cpl_vector * slit_func_in = cpl_vector_new(oversample * (height + 1) + 1);
+    hdrl_image * img_hdrl;
+    cpl_vector * slit_func;
+    cpl_bivector * spec;
+    hdrl_image * model;
+
+    cpl_image_add_scalar(err_in, sigma);
+    cpl_vector_fill(slit_func_in, 1.);
+    pimg = cpl_image_get_data_double(img_in);
+    for (i = 0; i < width; i++) sum[i] = sum2[i] = 0.;
+
+    srand(42);
+    for (k = 0; k < nreal; k++) {
+        /* Box-Muller */
+        for (j = 0; j < width * height; j++) {
+            u1 = (rand() + 1.) / (RAND_MAX + 2.);
+            u2 = (rand() + 1.) / (RAND_MAX + 2.);
+            pimg[j] = flux + sigma * sqrt(-2. * log(u1)) * cos(2. * CPL_MATH_PI * u2);
+        }
+        img_hdrl = hdrl_image_create(img_in, err_in);
+        cpl_test_eq(0, cr2res_extract_slitdec_vert(img_hdrl, trace_table,
+                    slit_func_in, 1, 1, height, swath, oversample, smooth_slit,
+                    &slit_func, &spec, &model));
+        for (i = 0; i < width; i++) {
+            sum[i] += cpl_bivector_get_x_data(spec)[i];
+            sum2[i] += cpl_bivector_get_x_data(spec)[i] *
+                cpl_bivector_get_x_data(spec)[i];
+            if (k == 0) err[i] = cpl_bivector_get_y_data(spec)[i];
+            else cpl_test_abs(cpl_bivector_get_y_data(spec)[i], err[i],
+                    1e-6 * err[i]);
+        }
+        cpl_vector_delete(slit_func);
+        cpl_bivector_delete(spec);
+        hdrl_image_delete(model);
+        hdrl_image_delete(img_hdrl);
+    }
+
+    /* The error matches the scatter on average, and in every column */
+    ratio = 0.;
+    for (i = 0; i < width; i++) {
+        std = sqrt((sum2[i] - sum[i] * sum[i] / nreal) / (nreal - 1));
+        cpl_test_rel(std, err[i], 0.25);
+        ratio += std / err[i];
+    }
+    cpl_test_abs(ratio / width, 1., 0.03);
+
+    cpl_vector_delete(slit_func_in);
+    cpl_image_delete(img_in);
+    cpl_image_delete(err_in);
+    cpl_table_delete(trace_table);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check that the geometry cache does not change the extraction
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_geom_cache(void)
+{
+    int width = 400;
+    int height = 20;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    cpl_image * img_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_table * extracted_ref;
+    cpl_table * extracted;
+    cpl_table * slit_func;
+    hdrl_image * model_ref;
+    hdrl_image * model;
+    cr2res_extract_geom_cache * cache;
+    cpl_vector * spec_ref;
+    cpl_vector * spec;
+    cpl_size size;
+    char * colname;
+    int i, k;
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, 0.5);
+    img_hdrl = hdrl_image_create(img_in, NULL);
+    trace_table = create_table_linear_increase(width, height, 0.5);
+
+    /* Wrong inputs */
+    cpl_test_null(cr2res_extract_geom_cache_new(-1));
+    cpl_test_eq(cr2res_extract_geom_cache_get_size(NULL), -1);
+    cr2res_extract_geom_cache_delete(NULL);
+
+    /* Reference, without cache */
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, -1, -1,
+                CR2RES_EXTR_OPT_CURV, height, swath, oversample, smooth_slit,
+                0, 0, 1, NULL, &extracted_ref, &slit_func, &model_ref, NULL));
+    cpl_table_delete(slit_func);
+
+    /* The first extraction fills the cache, the second one reads it */
+    cache = cr2res_extract_geom_cache_new(0);
+    cpl_test_nonnull(cache);
+    cpl_test_eq(cr2res_extract_geom_cache_get_size(cache), 0);
+    size = 0;
+    for (k = 0; k < 2; k++) {
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+                    -1, -1, CR2RES_EXTR_OPT_CURV, height, swath, oversample,
+                    smooth_slit, 0, 0, 1, cache, &extracted, &slit_func,
+                    &model, NULL));
+        if (k == 0) {
+            size = cr2res_extract_geom_cache_get_size(cache);
+            cpl_test(size > 0);
+        } else {
+            cpl_test_eq(cr2res_extract_geom_cache_get_size(cache), size);
+        }
+        for (i = 1; i <= 2; i++) {
+            colname = cr2res_dfs_SPEC_colname(1, i);
+            spec_ref = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted_ref, colname));
+            spec = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted, colname));
+            cpl_test_vector_abs(spec_ref, spec, 0);
+            cpl_vector_unwrap(spec_ref);
+            cpl_vector_unwrap(spec);
+            cpl_free(colname);
+        }
+        cpl_test_image_abs(hdrl_image_get_image(model_ref),
+                hdrl_image_get_image(model), 0);
+        cpl_table_delete(extracted);
+        cpl_table_delete(slit_func);
+        hdrl_image_delete(model);
+    }
+    cr2res_extract_geom_cache_delete(cache);
+
+    /* Nothing is stored above the memory cap */
+    cache = cr2res_extract_geom_cache_new(1);
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, -1, -1,
+                CR2RES_EXTR_OPT_CURV, height, swath, oversample, smooth_slit,
+                0, 0, 1, cache, &extracted, &slit_func, &model, NULL));
+    cpl_test_eq(cr2res_extract_geom_cache_get_size(cache), 0);
+    cr2res_extract_geom_cache_delete(cache);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+
+    cpl_table_delete(extracted_ref);
+    hdrl_image_delete(model_ref);
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check that warm started swaths converge to the same solution
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_warm_start(void)
+{
+    int width = 400;
+    int height = 20;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    cr2res_extr_method methods[2] = {CR2RES_EXTR_OPT_VERT,
+        CR2RES_EXTR_OPT_CURV};
+    cpl_image * img_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_table * extracted_ref;
+    cpl_table * extracted;
+    cpl_table * extracted_par;
+    cpl_table * slit_func;
+    hdrl_image * model_ref;
+    hdrl_image * model;
+    hdrl_image * model_par;
+    cpl_vector * spec_ref;
+    cpl_vector * spec;
+    char * colname;
+    int i, k;
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, 0.5);
+    img_hdrl = hdrl_image_create(img_in, NULL);
+    trace_table = create_table_linear_increase(width, height, 0.5);
+
+    for (k = 0; k < 2; k++) {
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+                    -1, -1, methods[k], height, swath, oversample,
+                    smooth_slit, 0, 0, 1, NULL, &extracted_ref, &slit_func,
+                    &model_ref, NULL));
+        cpl_table_delete(slit_func);
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+                    -1, -1, methods[k], height, swath, oversample,
+                    smooth_slit, 1, 0, 1, NULL, &extracted, &slit_func,
+                    &model, NULL));
+        cpl_table_delete(slit_func);
+        /* The swaths of a trace stay in order with several threads */
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+                    -1, -1, methods[k], height, swath, oversample,
+                    smooth_slit, 1, 0, 2, NULL, &extracted_par, &slit_func,
+                    &model_par, NULL));
+        cpl_table_delete(slit_func);
+
+        for (i = 1; i <= 2; i++) {
+            colname = cr2res_dfs_SPEC_colname(1, i);
+            spec_ref = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted_ref, colname));
+            spec = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted, colname));
+            cpl_test_vector_abs(spec_ref, spec, 1e-5);
+            cpl_vector_unwrap(spec);
+            spec = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted_par, colname));
+            cpl_vector_unwrap(spec_ref);
+            spec_ref = cpl_vector_wrap(width,
+                    cpl_table_get_data_double(extracted, colname));
+            cpl_test_vector_abs(spec_ref, spec, 0);
+            cpl_vector_unwrap(spec_ref);
+            cpl_vector_unwrap(spec);
+            cpl_free(colname);
+        }
+        cpl_test_image_abs(hdrl_image_get_image(model),
+                hdrl_image_get_image(model_par), 0);
+
+        cpl_table_delete(extracted_ref);
+        cpl_table_delete(extracted);
+        cpl_table_delete(extracted_par);
+        hdrl_image_delete(model_ref);
+        hdrl_image_delete(model);
+        hdrl_image_delete(model_par);
+    }
+
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check that the batched extraction matches the one of each frame
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_traces_multi(void)
+{
+    int width = 400;
+    int height = 20;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    cr2res_extr_method methods[3] = {CR2RES_EXTR_SUM, CR2RES_EXTR_OPT_VERT,
+        CR2RES_EXTR_OPT_CURV};
+    cpl_image * img_in;
+    hdrl_image * img_hdrl;
+    hdrl_imagelist * imgs;
+    cpl_table * trace_table;
+    cpl_table * extracted_ref;
+    cpl_table * slit_func_ref;
+    hdrl_image * model_ref;
+    cpl_table * extracted[3];
+    cpl_table * slit_func[3];
+    hdrl_image * model[3];
+    cpl_vector * spec_ref;
+    cpl_vector * spec;
+    char * colname;
+    int i, f, k;
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, 0.5);
+    trace_table = create_table_linear_increase(width, height, 0.5);
+    imgs = hdrl_imagelist_new();
+    for (f = 0; f < 3; f++) {
+        img_hdrl = hdrl_image_create(img_in, NULL);
+        hdrl_image_mul_scalar(img_hdrl, (hdrl_value){f + 1.0, 0.0});
+        hdrl_imagelist_set(imgs, img_hdrl, f);
+    }
+
+    /* Wrong inputs */
+    cpl_test_eq(-1, cr2res_extract_traces_multi(NULL, trace_table, NULL,
+                -1, -1, CR2RES_EXTR_OPT_CURV, height, swath, oversample,
+                smooth_slit, 0, 0, 1, NULL, extracted, NULL, NULL, NULL));
+    cpl_test_eq(-1, cr2res_extract_traces_multi(imgs, trace_table, NULL,
+                -1, -1, CR2RES_EXTR_OPT_CURV, height, swath, oversample,
+                smooth_slit, 0, 0, 1, NULL, NULL, NULL, NULL, NULL));
+
+    for (k = 0; k < 3; k++) {
+        cpl_test_eq(0, cr2res_extract_traces_multi(imgs, trace_table, NULL,
+                    -1, -1, methods[k], height, swath, oversample,
+                    smooth_slit, 0, 0, 2, NULL, extracted, slit_func, model,
+                    NULL));
+        for (f = 0; f < 3; f++) {
+            cpl_test_eq(0, cr2res_extract_traces(
+                        hdrl_imagelist_get_const(imgs, f), trace_table, NULL,
+                        -1, -1, methods[k], height, swath, oversample,
+                        smooth_slit, 0, 0, 1, NULL, &extracted_ref,
+                        &slit_func_ref, &model_ref, NULL));
+            cpl_test_nonnull(slit_func[f]);
+            for (i = 1; i <= 2; i++) {
+                colname = cr2res_dfs_SPEC_colname(1, i);
+                spec_ref = cpl_vector_wrap(width,
+                        cpl_table_get_data_double(extracted_ref, colname));
+                spec = cpl_vector_wrap(width,
+                        cpl_table_get_data_double(extracted[f], colname));
+                cpl_test_vector_abs(spec_ref, spec, 0);
+                cpl_vector_unwrap(spec_ref);
+                cpl_vector_unwrap(spec);
+                cpl_free(colname);
+            }
+            cpl_test_image_abs(hdrl_image_get_image(model_ref),
+                    hdrl_image_get_image(model[f]), 0);
+            cpl_table_delete(extracted_ref);
+            cpl_table_delete(slit_func_ref);
+            hdrl_image_delete(model_ref);
+            cpl_table_delete(extracted[f]);
+            cpl_table_delete(slit_func[f]);
+            hdrl_image_delete(model[f]);
+        }
+    }
+
+    /* Only the spectra */
+    cpl_test_eq(0, cr2res_extract_traces_multi(imgs, trace_table, NULL,
+                -1, -1, CR2RES_EXTR_OPT_CURV, height, swath, oversample,
+                smooth_slit, 0, 0, 1, NULL, extracted, NULL, NULL, NULL));
+    for (f = 0; f < 3; f++) {
+        cpl_test_nonnull(extracted[f]);
+        cpl_table_delete(extracted[f]);
+    }
+
+    hdrl_imagelist_delete(imgs);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the fixed slit function extraction against the slit decomp.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_horne(void)
+{
+    int width = 400;
+    int height = 20;
+    int order = 1;
+    int trace = 1;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    cpl_image * img_in;
+    cpl_image * err_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_table * slit_func_tab;
+    cpl_table * extracted;
+    cpl_table * slit_func_out;
+    cpl_vector * slit_func_ref;
+    cpl_vector * slit_func;
+    cpl_vector * slit_funcs[2];
+    cpl_bivector * spec_ref;
+    cpl_bivector * spec;
+    hdrl_image * model_ref;
+    hdrl_image * model;
+    int i, x_hot;
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    err_in = cpl_image_new(width, height, CPL_TYPE_DOUBLE);
+    cpl_image_add_scalar(err_in, 1.0);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    trace_table = create_table_linear_increase(width, height, 0);
+
+    /* Slit function from the decomposition */
+    cpl_test_eq(0, cr2res_extract_slitdec_vert(img_hdrl, trace_table, NULL,
+                order, trace, height, swath, oversample, smooth_slit,
+                &slit_func_ref, &spec_ref, &model_ref));
+
+    /* Wrong inputs */
+    cpl_test_eq(-1, cr2res_extract_horne(img_hdrl, trace_table, NULL,
+                order, trace, height, oversample, 5, &slit_func, &spec,
+                &model));
+    cpl_test_eq(-1, cr2res_extract_horne(img_hdrl, trace_table,
+                slit_func_ref, order, trace, height, oversample + 1, 5,
+                &slit_func, &spec, &model));
+    cpl_test_eq(-1, cr2res_extract_traces(img_hdrl, trace_table, NULL, -1,
+                -1, CR2RES_EXTR_HORNE, height, swath, oversample,
+                smooth_slit, 0, 0, 1, NULL, &extracted, &slit_func_out,
+                &model, NULL));
+
+    /* Same slit function, same spectrum, without any iteration */
+    cpl_test_eq(0, cr2res_extract_horne(img_hdrl, trace_table,
+                slit_func_ref, order, trace, height, oversample, 0,
+                &slit_func, &spec, &model));
+    cpl_test_vector_abs(slit_func_ref, slit_func, 1e-12);
+    for (i = 10; i < width - 10; i++) {
+        cpl_test_rel(cpl_bivector_get_x_data(spec)[i],
+                cpl_bivector_get_x_data(spec_ref)[i], 1e-3);
+        /* 1/sqrt(sum(P^2)) with unit errors */
+        cpl_test_lt(0, cpl_bivector_get_y_data(spec)[i]);
+    }
+    cpl_test_image_abs(hdrl_image_get_image(model_ref),
+            hdrl_image_get_image(model), 1e-2 * cpl_image_get_max(
+                hdrl_image_get_image(model_ref)));
+    cpl_vector_delete(slit_func);
+    cpl_bivector_delete(spec);
+    hdrl_image_delete(model);
+
+    /* A hot pixel is only removed with the clipping */
+    x_hot = width / 2;
+    cpl_image_set(hdrl_image_get_image(img_hdrl), x_hot, height / 2,
+            1e4 * spec_in[x_hot - 1]);
+    cpl_test_eq(0, cr2res_extract_horne(img_hdrl, trace_table,
+                slit_func_ref, order, trace, height, oversample, 0,
+                &slit_func, &spec, &model));
+    cpl_test(fabs(cpl_bivector_get_x_data(spec)[x_hot - 1] -
+                cpl_bivector_get_x_data(spec_ref)[x_hot - 1]) >
+            0.1 * cpl_bivector_get_x_data(spec_ref)[x_hot - 1]);
+    cpl_vector_delete(slit_func);
+    cpl_bivector_delete(spec);
+    hdrl_image_delete(model);
+    cpl_test_eq(0, cr2res_extract_horne(img_hdrl, trace_table,
+                slit_func_ref, order, trace, height, oversample, 5,
+                &slit_func, &spec, &model));
+    cpl_test_rel(cpl_bivector_get_x_data(spec)[x_hot - 1],
+            cpl_bivector_get_x_data(spec_ref)[x_hot - 1], 1e-2);
+    cpl_vector_delete(slit_func);
+    cpl_bivector_delete(spec);
+    hdrl_image_delete(model);
+
+    /* Selected as an extraction method, with a SLIT_FUNC table */
+    slit_funcs[0] = slit_funcs[1] = slit_func_ref;
+    slit_func_tab = cr2res_extract_SLITFUNC_create(slit_funcs, trace_table);
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table,
+                slit_func_tab, -1, -1, CR2RES_EXTR_HORNE, height, swath,
+                oversample, smooth_slit, 0, 0, 1, NULL, &extracted,
+                &slit_func_out, &model, NULL));
+    cpl_test_nonnull(extracted);
+    cpl_table_delete(slit_func_tab);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func_out);
+    hdrl_image_delete(model);
+
+    cpl_vector_delete(slit_func_ref);
+    cpl_bivector_delete(spec_ref);
+    hdrl_image_delete(model_ref);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+    cpl_image_delete(err_in);
+    hdrl_image_delete(img_hdrl);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Bound the single precision slit decomposition against the double
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_single_prec(void)
+{
+    int width = 400;
+    int height = 20;
+    int swath = 100;
+    int oversample = 3;
+    double smooth_slit = 1;
+    double spec_in[width];
+    cr2res_extr_method methods[2] = {CR2RES_EXTR_OPT_VERT,
+        CR2RES_EXTR_OPT_CURV};
+    cpl_image * img_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_table * extracted_ref;
+    cpl_table * extracted;
+    cpl_table * slit_func;
+    hdrl_image * model_ref;
+    hdrl_image * model;
+    cpl_vector * spec_ref;
+    cpl_vector * spec;
+    char * colname;
+    int i, k, m;
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, 0.5);
+    img_hdrl = hdrl_image_create(img_in, NULL);
+    trace_table = create_table_linear_increase(width, height, 0.5);
+
+    for (m = 0; m < 2; m++) {
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+                    -1, -1, methods[m], height, swath, oversample,
+                    smooth_slit, 0, 0, 1, NULL, &extracted_ref, &slit_func,
+                    &model_ref, NULL));
+        cpl_table_delete(slit_func);
+
+        /* Same result with one or several threads */
+        for (k = 1; k <= 2; k++) {
+            cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table,
+                        NULL, -1, -1, methods[m], height, swath, oversample,
+                        smooth_slit, 0, 1, k, NULL, &extracted, &slit_func,
+                        &model, NULL));
+            cpl_table_delete(slit_func);
+
+            /* The weights are rounded to float, the solution moves by */
+            /* about the float precision relative to the spectrum */
+            for (i = 1; i <= 2; i++) {
+                colname = cr2res_dfs_SPEC_colname(1, i);
+                spec_ref = cpl_vector_wrap(width,
+                        cpl_table_get_data_double(extracted_ref, colname));
+                spec = cpl_vector_wrap(width,
+                        cpl_table_get_data_double(extracted, colname));
+                cpl_test_vector_abs(spec_ref, spec,
+                        1e-5 * cpl_vector_get_max(spec_ref));
+                cpl_vector_unwrap(spec_ref);
+                cpl_vector_unwrap(spec);
+                cpl_free(colname);
+            }
+            cpl_test_image_abs(hdrl_image_get_image(model_ref),
+                    hdrl_image_get_image(model), 1e-5 *
+                    cpl_image_get_max(hdrl_image_get_image(model_ref)));
+
+            cpl_table_delete(extracted);
+            hdrl_image_delete(model);
+        }
+        cpl_table_delete(extracted_ref);
+        hdrl_image_delete(model_ref);
+    }
+
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Quick-look extraction without the model, and selection median
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_quick_look(void)
+{
+    int width = 200;
+    int height = 50;
+    int extr_height = 20;
+    double spec_in[width];
+    cpl_image * img_in;
+    cpl_image * err_in;
+    cpl_image * img_rect;
+    cpl_image * ref;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_vector * ycen;
+    cpl_vector * slit_func_ref;
+    cpl_vector * slit_func;
+    cpl_bivector * spec_ref;
+    cpl_bivector * spec;
+    hdrl_image * model;
+    int i, m, rej;
+
+    img_in = create_image_linear_increase(width, height, spec_in);
+    err_in = cpl_image_new(width, height, CPL_TYPE_DOUBLE);
+    cpl_image_add_scalar(err_in, 0.5);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    trace_table = create_table_linear_increase(width, height, 0);
+
+    ycen = cr2res_trace_get_ycen(trace_table, 1, 1, width);
+    img_rect = cr2res_image_cut_rectify(img_in, ycen, extr_height);
+
+    for (m = 0; m < 2; m++) {
+        if (m == 0) {
+            cpl_test_eq(0, cr2res_extract_sum_vert(img_hdrl, trace_table, 1,
+                        1, extr_height, &slit_func_ref, &spec_ref, &model));
+            cpl_test_eq(0, cr2res_extract_sum_vert(img_hdrl, trace_table, 1,
+                        1, extr_height, &slit_func, &spec, NULL));
+        } else {
+            cpl_test_eq(0, cr2res_extract_median(img_hdrl, trace_table, 1,
+                        1, extr_height, &slit_func_ref, &spec_ref, &model));
+            cpl_test_eq(0, cr2res_extract_median(img_hdrl, trace_table, 1,
+                        1, extr_height, &slit_func, &spec, NULL));
+        }
+        cpl_test_nonnull(model);
+
+        /* Skipping the model does not change the extraction */
+        cpl_test_vector_abs(cpl_bivector_get_x(spec_ref),
+                cpl_bivector_get_x(spec), 0);
+        cpl_test_vector_abs(slit_func_ref, slit_func, 0);
+
+        /* The error only adds up the extracted rows */
+        for (i = 0; i < width; i++)
+            cpl_test_abs(cpl_bivector_get_y_data(spec)[i],
+                    0.5 * sqrt(extr_height), 1e-12);
+
+        /* The selection median matches the one of CPL */
+        if (m == 1) {
+            ref = cpl_image_collapse_median_create(img_rect, 0, 0, 0);
+            for (i = 0; i < width; i++)
+                cpl_test_rel(cpl_bivector_get_x_data(spec)[i],
+                        extr_height * cpl_image_get(ref, i + 1, 1, &rej),
+                        10 * DBL_EPSILON);
+            cpl_image_delete(ref);
+        }
+
+        cpl_vector_delete(slit_func_ref);
+        cpl_vector_delete(slit_func);
+        cpl_bivector_delete(spec_ref);
+        cpl_bivector_delete(spec);
+        hdrl_image_delete(model);
+    }
+
+    cpl_image_delete(img_rect);
+    cpl_vector_delete(ycen);
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+    cpl_image_delete(err_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    2D extraction of the pixels of a trace
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract2d_trace(void)
+{
+    int width = 100;
+    int height = 50;
+    double spec_in[width];
+    cpl_image * img_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_bivector * spectrum;
+    cpl_bivector * position;
+    cpl_vector * wavelength;
+    cpl_vector * slit_fraction;
+    const double * px;
+    const double * py;
+    int i, rej, npix;
+
+    img_in = create_image_linear_increase(width, height, spec_in);
+    img_hdrl = hdrl_image_create(img_in, NULL);
+    trace_table = create_table_linear_increase(width, height, 0);
+
+    /* The trace goes from row 10.2 to row 40.8 in every column */
+    npix = 31 * width;
+
+    /* Too small output */
+    cpl_test_eq(-1, cr2res_extract2d_trace(img_hdrl, trace_table, 1, 1,
+                npix - 1, NULL, NULL, &spectrum, &position, &wavelength,
+                &slit_fraction));
+
+    cpl_test_eq(0, cr2res_extract2d_trace(img_hdrl, trace_table, 1, 1,
+                npix + 10, NULL, NULL, &spectrum, &position, &wavelength,
+                &slit_fraction));
+    cpl_test_eq(cpl_bivector_get_size(spectrum), npix + 10);
+    px = cpl_bivector_get_x_data_const(position);
+    py = cpl_bivector_get_y_data_const(position);
+    cpl_test_abs(px[0], 1, 0);
+    cpl_test_abs(py[0], 10, 0);
+    cpl_test_abs(px[npix-1], width, 0);
+    cpl_test_abs(py[npix-1], 40, 0);
+    for (i = 0; i < npix; i++) {
+        cpl_test_abs(cpl_bivector_get_x_data_const(spectrum)[i],
+                cpl_image_get(img_in, px[i], py[i], &rej), 0);
+        cpl_test(isnan(cpl_vector_get(wavelength, i)));
+    }
+    /* The remaining points are padded */
+    for (i = npix; i < npix + 10; i++) {
+        cpl_test(isnan(px[i]));
+        cpl_test(isnan(cpl_bivector_get_x_data_const(spectrum)[i]));
+    }
+
+    cpl_bivector_delete(spectrum);
+    cpl_bivector_delete(position);
+    cpl_vector_delete(wavelength);
+    cpl_vector_delete(slit_fraction);
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Automatic swath width, from the S/N and the slit curvature
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_extract_swath_plan(void)
+{
+    int width = 1000;
+    int height = 20;
+    int extr_height = 12;
+    int oversample = 3;
+    double spec_in[width];
+    cpl_image * img_in;
+    cpl_image * err_in;
+    hdrl_image * img_hdrl;
+    cpl_table * trace_table;
+    cpl_array * slitcurve;
+    cpl_table * extracted;
+    cpl_table * slit_func;
+    hdrl_image * model;
+    cpl_image * narrow_in;
+    cpl_image * narrow_err;
+    hdrl_image * narrow_hdrl;
+    cpl_table * narrow_table;
+    int swaths[2];
+
+    img_in = create_image_sinusoidal(width, height, spec_in);
+    err_in = cpl_image_new(width, height, CPL_TYPE_DOUBLE);
+    cpl_image_add_scalar(err_in, 0.01);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    trace_table = create_table_linear_increase(width, height, 0);
+
+    cpl_test_eq(-1, cr2res_extract_swath_plan(NULL, trace_table, 1, 1,
+                extr_height, oversample));
+    cpl_test_eq(-1, cr2res_extract_swath_plan(img_hdrl, NULL, 1, 1,
+                extr_height, oversample));
+
+    /* Bright and constant curvature: the widest swath */
+    cpl_test_eq(400, cr2res_extract_swath_plan(img_hdrl, trace_table, 1, 1,
+                extr_height, oversample));
+
+    /* The error set by the caller is kept */
+    cpl_error_set(cpl_func, CPL_ERROR_UNSPECIFIED);
+    cpl_test_eq(400, cr2res_extract_swath_plan(img_hdrl, trace_table, 1, 1,
+                extr_height, oversample));
+    cpl_test_error(CPL_ERROR_UNSPECIFIED);
+
+    /* Faint: the widest swath */
+    hdrl_image_delete(img_hdrl);
+    cpl_image_multiply_scalar(err_in, 500);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    cpl_test_eq(400, cr2res_extract_swath_plan(img_hdrl, trace_table, 1, 1,
+                extr_height, oversample));
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, 1, 1,
+                CR2RES_EXTR_OPT_CURV, extr_height, -1, oversample, 1.0, 0, 0,
+                1, NULL, &extracted, &slit_func, &model, swaths));
+    cpl_test_error(CPL_ERROR_NONE);
+    cpl_test_eq(400, swaths[0]);
+    cpl_test_eq(0, swaths[1]);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+
+    /* Faint and narrow: the curved swath margins stay in the image */
+    narrow_in = cpl_image_extract(img_in, 1, 1, 300, height);
+    narrow_err = cpl_image_extract(err_in, 1, 1, 300, height);
+    narrow_hdrl = hdrl_image_create(narrow_in, narrow_err);
+    narrow_table = create_table_linear_increase(300, height, 0);
+    cpl_test_eq(298, cr2res_extract_swath_plan(narrow_hdrl, narrow_table, 1,
+                1, extr_height, oversample));
+    cpl_test_eq(0, cr2res_extract_traces(narrow_hdrl, narrow_table, NULL, 1,
+                1, CR2RES_EXTR_OPT_CURV, extr_height, -1, oversample, 1.0, 0,
+                0, 1, NULL, &extracted, &slit_func, &model, swaths));
+    cpl_test_error(CPL_ERROR_NONE);
+    cpl_test_eq(298, swaths[0]);
+    cpl_test_eq(1, cpl_table_get_nrow(slit_func) > 0);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+    hdrl_image_delete(narrow_hdrl);
+    cpl_image_delete(narrow_in);
+    cpl_image_delete(narrow_err);
+    cpl_table_delete(narrow_table);
+
+    /* Bright, the slit edges shift by 0.001*extr_height/2 pix per column */
+    hdrl_image_delete(img_hdrl);
+    cpl_image_divide_scalar(err_in, 500);
+    img_hdrl = hdrl_image_create(img_in, err_in);
+    slitcurve = cpl_array_new(2, CPL_TYPE_DOUBLE);
+    cpl_array_set(slitcurve, 0, 0);
+    cpl_array_set(slitcurve, 1, 0.001);
+    cpl_table_set_array(trace_table, CR2RES_COL_SLIT_CURV_B, 0, slitcurve);
+    cpl_array_delete(slitcurve);
+    cpl_test_eq(82, cr2res_extract_swath_plan(img_hdrl, trace_table, 1, 1,
+                extr_height, oversample));
+
+    /* The extraction plans the swaths if none is given */
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, 1, 1,
+                CR2RES_EXTR_OPT_CURV, extr_height, -1, oversample, 1.0, 0, 0,
+                1, NULL, &extracted, &slit_func, &model, swaths));
+    cpl_test_error(CPL_ERROR_NONE);
+    cpl_test_eq(82, swaths[0]);
+    cpl_test_eq(0, swaths[1]);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+
+    hdrl_image_delete(img_hdrl);
+    cpl_table_delete(trace_table);
+    cpl_image_delete(img_in);
+    cpl_image_delete(err_in);
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Run the Unit tests
@@ -989,6 +1969,16 @@ int main(void)
 
     test_cr2res_slitdec_errors();
     test_cr2res_slitdec_input_slitfunc();
+    test_cr2res_slitdec_golden();
+    test_cr2res_slitdec_vert_unc();
+    test_cr2res_extract_geom_cache();
+    test_cr2res_extract_warm_start();
+    test_cr2res_extract_traces_multi();
+    test_cr2res_extract_horne();
+    test_cr2res_extract_single_prec();
+    test_cr2res_extract_quick_look();
+    test_cr2res_extract2d_trace();
+    test_cr2res_extract_swath_plan();
 
     return cpl_test_end(0);
 }
@@ -44,6 +44,7 @@
 static void test_cr2res_trace(void);
 static void test_cr2res_trace_clean(void);
 static void test_cr2res_trace_gen_image(void);
+static void test_cr2res_trace_get_spans(void);
 static void test_cr2res_trace_get_order_idx_values(void);
 static void test_cr2res_trace_get_ycen(void);
 static void test_cr2res_trace_get_height(void);
@@ -406,6 +407,84 @@ static void test_cr2res_trace_gen_image(void)
     cpl_table_delete(trace);
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief   Check the rows of constant traces, with and without clipping
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_trace_get_spans(void)
+{
+    int nx = 10;
+    int ny = 20;
+    int *ylo;
+    int *yhi;
+    int i, rej;
+    cpl_image *img;
+    cpl_table *trace = cpl_table_new(2);
+    cpl_array *array = cpl_array_new(1, CPL_TYPE_DOUBLE);
+
+    cpl_table_new_column_array(trace, CR2RES_COL_UPPER, CPL_TYPE_DOUBLE, 1);
+    cpl_table_new_column_array(trace, CR2RES_COL_LOWER, CPL_TYPE_DOUBLE, 1);
+    cpl_array_set(array, 0, 2.5);
+    cpl_table_set_array(trace, CR2RES_COL_LOWER, 0, array);
+    cpl_array_set(array, 0, 7.5);
+    cpl_table_set_array(trace, CR2RES_COL_UPPER, 0, array);
+    cpl_array_set(array, 0, 18.4);
+    cpl_table_set_array(trace, CR2RES_COL_LOWER, 1, array);
+    cpl_array_set(array, 0, 25.0);
+    cpl_table_set_array(trace, CR2RES_COL_UPPER, 1, array);
+
+    cpl_test_eq(-1, cr2res_trace_get_spans(NULL, nx, ny, 0, &ylo, &yhi));
+    cpl_test_eq(-1, cr2res_trace_get_spans(trace, 0, ny, 0, &ylo, &yhi));
+    cpl_test_eq(-1, cr2res_trace_get_spans(trace, nx, ny, 0, NULL, &yhi));
+
+    /* All the rows the edges run through */
+    cpl_test_eq(0, cr2res_trace_get_spans(trace, nx, ny, 0, &ylo, &yhi));
+    for (i = 0; i < nx; i++) {
+        cpl_test_eq(ylo[i], 2);
+        cpl_test_eq(yhi[i], 7);
+        cpl_test_eq(ylo[nx + i], 18);
+        cpl_test_eq(yhi[nx + i], ny);
+    }
+    cpl_free(ylo);
+    cpl_free(yhi);
+
+    /* Only the rows with their center between the edges */
+    cpl_test_eq(0, cr2res_trace_get_spans(trace, nx, ny, 1, &ylo, &yhi));
+    for (i = 0; i < nx; i++) {
+        cpl_test_eq(ylo[i], 3);
+        cpl_test_eq(yhi[i], 7);
+        cpl_test_eq(ylo[nx + i], 19);
+        cpl_test_eq(yhi[nx + i], ny);
+    }
+    cpl_free(ylo);
+    cpl_free(yhi);
+
+    /* A Lower edge in the last row is truncated into it */
+    cpl_array_set(array, 0, 20.5);
+    cpl_table_set_array(trace, CR2RES_COL_LOWER, 1, array);
+    cpl_test_eq(0, cr2res_trace_get_spans(trace, nx, ny, 0, &ylo, &yhi));
+    for (i = 0; i < nx; i++) {
+        cpl_test_eq(ylo[nx + i], ny);
+        cpl_test_eq(yhi[nx + i], ny);
+    }
+    cpl_free(ylo);
+    cpl_free(yhi);
+    cpl_test_eq(0, cr2res_trace_get_spans(trace, nx, ny, 1, &ylo, &yhi));
+    for (i = 0; i < nx; i++) cpl_test(yhi[nx + i] < ylo[nx + i]);
+    cpl_free(ylo);
+    cpl_free(yhi);
+    cpl_test_nonnull(img = cr2res_trace_gen_image(trace, nx, ny));
+    for (i = 0; i < nx; i++) {
+        cpl_test_eq(cpl_image_get(img, i + 1, ny, &rej), 100);
+        cpl_test_eq(cpl_image_get(img, i + 1, ny - 1, &rej), -1);
+    }
+    cpl_image_delete(img);
+
+    cpl_array_delete(array);
+    cpl_table_delete(trace);
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief   Extracted order numbers are compared with known input table
@@ -1202,6 +1281,7 @@ int main(void)
     test_cr2res_trace();
     test_cr2res_trace_clean();
     test_cr2res_trace_gen_image();
+    test_cr2res_trace_get_spans();
     test_cr2res_trace_get_order_idx_values();
     test_cr2res_trace_get_ycen();
     test_cr2res_trace_get_height();
@@ -46,6 +46,7 @@ static void test_cr2res_vector_get_int(void);
 static void test_cr2res_vector_get_rest(void);
 static void test_cr2res_image_cut_rectify(void);
 static void test_cr2res_image_insert_rect(void);
+static void test_cr2res_rect_buffer(void);
 static void test_cr2res_polynomial_eval_vector(void);
 static void test_cr2res_threshold_spec(void);
 static void test_cr2res_get_base_name(void);
@@ -58,6 +59,7 @@ static void test_cr2res_detector_shotnoise_model(void);
 static void test_cr2res_fit_noise(void);
 static void test_cr2res_slit_pos(void);
 static void test_cr2res_slit_pos_img(void);
+static void test_cr2res_reduce_detectors(void);
 static void test_cr2res_get_license(void);
 static void test_cr2res_slit_curv_compute_order_trace(void);
 
@@ -211,6 +213,85 @@ static void test_cr2res_image_insert_rect(void)
 
     return;
 }
+static void test_cr2res_rect_buffer(void)
+{
+    double      imdata[4*6];
+    double      ydata[] = {1.5, 3.2, 5.0, 6.7};
+    // Rectified rows, with a stride of 5, the last column is not touched
+    double      cmpdata[] = { 0, 22, 43, 54, -1,
+                             11, 32, 53, 64, -1,
+                             21, 42, 63,  0, -1};
+    double      rect[5*3], back[4*6];
+    cpl_binary  bpm_in[4*6], bpm_rect[5*3], bpm_back[4*6];
+    double      ydata2[] = {0.5, 3.0};
+    cpl_vector  *ycen;
+    cpl_image   *img, *res;
+    int         *ymin;
+    int         i, x, y, rej;
+
+    // value 10*y+x, pixel (2,3) is bad
+    for (y=1; y<=6; y++) for (x=1; x<=4; x++) {
+        imdata[(x-1)+(y-1)*4] = 10*y+x;
+        bpm_in[(x-1)+(y-1)*4] = (x==2 && y==3) ? CPL_BINARY_1 : CPL_BINARY_0;
+    }
+    ycen = cpl_vector_wrap(4, ydata);
+
+    cpl_test_null(cr2res_rect_get_ymin(NULL, 4, 6, 3));
+    cpl_test_null(cr2res_rect_get_ymin(ycen, 5, 6, 3));
+    cpl_test(ymin = cr2res_rect_get_ymin(ycen, 4, 6, 3));
+    cpl_test_eq(ymin[0], 0);
+    cpl_test_eq(ymin[3], 5);
+
+    for (i=0; i<5*3; i++) rect[i] = -1;
+    cpl_test_eq(-1, cr2res_rect_cut_buffer(imdata, bpm_in, CPL_TYPE_DOUBLE,
+                4, 6, ymin, 3, rect, bpm_rect, 3));
+    cpl_test_eq(-1, cr2res_rect_cut_buffer(imdata, bpm_in, CPL_TYPE_STRING,
+                4, 6, ymin, 3, rect, bpm_rect, 5));
+    cpl_test_zero(cr2res_rect_cut_buffer(imdata, bpm_in, CPL_TYPE_DOUBLE,
+                4, 6, ymin, 3, rect, bpm_rect, 5));
+    for (i=0; i<5*3; i++) cpl_test_abs(rect[i], cmpdata[i], 0);
+    for (i=0; i<3; i++) for (x=0; x<4; x++)
+        cpl_test_eq(bpm_rect[x+i*5], (x==1 && i==1) ? 1 : 0);
+
+    // Insert it back, only the order pixels are set
+    for (i=0; i<4*6; i++) {
+        back[i] = 0;
+        bpm_back[i] = CPL_BINARY_1;
+    }
+    cpl_test_zero(cr2res_rect_insert_buffer(rect, bpm_rect, CPL_TYPE_DOUBLE,
+                4, 3, 5, ymin, 6, back, bpm_back));
+    for (y=0; y<6; y++) for (x=0; x<4; x++) {
+        i = x+y*4;
+        if (y+1 >= ymin[x] && y+1 < ymin[x]+3) {
+            cpl_test_abs(back[i], imdata[i], 0);
+            cpl_test_eq(bpm_back[i], bpm_in[i]);
+        } else {
+            cpl_test_abs(back[i], 0, 0);
+            cpl_test_eq(bpm_back[i], CPL_BINARY_1);
+        }
+    }
+    cpl_free(ymin);
+    cpl_vector_unwrap(ycen);
+
+    // The order leaves the detector in the first column only
+    img = cpl_image_wrap_double(2, 6, imdata);
+    for (y=1; y<=6; y++) for (x=1; x<=2; x++)
+        imdata[(x-1)+(y-1)*2] = 10*y+x;
+    cpl_image_reject(img, 2, 3);
+    ycen = cpl_vector_wrap(2, ydata2);
+    cpl_test(res = cr2res_image_cut_rectify(img, ycen, 3));
+    cpl_test_abs(cpl_image_get(res, 1, 1, &rej), 0, 0);
+    cpl_test_abs(cpl_image_get(res, 1, 3, &rej), 11, 0);
+    cpl_test_abs(cpl_image_get(res, 2, 1, &rej), 22, 0);
+    cpl_test_abs(cpl_image_get(res, 2, 3, &rej), 42, 0);
+    cpl_test(cpl_image_is_rejected(res, 2, 2));
+    cpl_test_eq(cpl_image_count_rejected(res), 1);
+
+    cpl_image_delete(res);
+    cpl_image_unwrap(img);
+    cpl_vector_unwrap(ycen);
+    return;
+}
 static void test_cr2res_polynomial_eval_vector(void)
 {
     int i;
@@ -715,6 +796,54 @@ static void test_cr2res_slit_pos()
     cpl_free(coef_slit);
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief Create a trace wave table of two orders with overlapping bands
+  @return the table with one trace per order, needs to be deallocated
+
+  Order 1 runs between the rows 100 and 120, order 2 between the rows 115
+  and 135, both with the slit fractions 0.2, 0.5 and 0.8 on their edges.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_table * create_slit_pos_table(void)
+{
+    cpl_table *tw = cpl_table_new(2);
+    cpl_array *array = cpl_array_new(2, CPL_TYPE_DOUBLE);
+    cpl_array *slit_frac = cpl_array_new(3, CPL_TYPE_DOUBLE);
+    int i;
+
+    cpl_table_new_column_array(tw, CR2RES_COL_ALL, CPL_TYPE_DOUBLE, 2);
+    cpl_table_new_column_array(tw, CR2RES_COL_UPPER, CPL_TYPE_DOUBLE, 2);
+    cpl_table_new_column_array(tw, CR2RES_COL_LOWER, CPL_TYPE_DOUBLE, 2);
+    cpl_table_new_column(tw, CR2RES_COL_ORDER, CPL_TYPE_INT);
+    cpl_table_new_column(tw, CR2RES_COL_TRACENB, CPL_TYPE_INT);
+    cpl_table_new_column_array(tw, CR2RES_COL_WAVELENGTH, CPL_TYPE_DOUBLE, 2);
+    cpl_table_new_column_array(tw, CR2RES_COL_SLIT_FRACTION, CPL_TYPE_DOUBLE,
+        3);
+
+    cpl_array_set(slit_frac, 0, 0.2);
+    cpl_array_set(slit_frac, 1, 0.5);
+    cpl_array_set(slit_frac, 2, 0.8);
+    for (i = 0; i < 2; i++) {
+        cpl_table_set(tw, CR2RES_COL_ORDER, i, i + 1);
+        cpl_table_set(tw, CR2RES_COL_TRACENB, i, 1);
+        cpl_array_set(array, 1, 0.0);
+        cpl_array_set(array, 0, 100.0 + 15 * i);
+        cpl_table_set_array(tw, CR2RES_COL_LOWER, i, array);
+        cpl_array_set(array, 0, 110.0 + 15 * i);
+        cpl_table_set_array(tw, CR2RES_COL_ALL, i, array);
+        cpl_array_set(array, 0, 120.0 + 15 * i);
+        cpl_table_set_array(tw, CR2RES_COL_UPPER, i, array);
+        cpl_array_set(array, 0, 1000.0 * (i + 1));
+        cpl_array_set(array, 1, 0.01);
+        cpl_table_set_array(tw, CR2RES_COL_WAVELENGTH, i, array);
+        cpl_table_set_array(tw, CR2RES_COL_SLIT_FRACTION, i, slit_frac);
+    }
+    cpl_array_delete(array);
+    cpl_array_delete(slit_frac);
+    return tw;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief Load sample data and check if it runs
@@ -736,8 +865,86 @@ static void test_cr2res_slit_pos_img()
     cpl_test_eq(-1, cr2res_slit_pos_image(tw_decker1, NULL, &wavelength));
     cpl_test_eq(-1, cr2res_slit_pos_image(tw_decker1, &slitpos, NULL));
 
+    cpl_image *int_img = cpl_image_new(CR2RES_DETECTOR_SIZE,
+        CR2RES_DETECTOR_SIZE, CPL_TYPE_INT);
+    cpl_test_eq(-1, cr2res_slit_pos_image(tw_decker1, &int_img, &wavelength));
+    cpl_image_delete(int_img);
+
     cpl_test_eq(0, cr2res_slit_pos_image(tw_decker1, &slitpos, &wavelength));
 
+    /* Two orders whose bands overlap in the rows 115 to 120 */
+    cpl_table *tw = create_slit_pos_table();
+    int i, k, x, y, nb_orders, pix_rej;
+    int *orders = cr2res_trace_get_order_idx_values(tw, &nb_orders);
+    cpl_polynomial **coef_wave = cpl_malloc(nb_orders *
+        sizeof(cpl_polynomial*));
+    cpl_polynomial **coef_slit = cpl_malloc(nb_orders *
+        sizeof(cpl_polynomial*));
+    for (i = 0; i < nb_orders; i++) {
+        coef_wave[i] = cpl_polynomial_new(2);
+        coef_slit[i] = cpl_polynomial_new(2);
+    }
+    cpl_test_eq(2, nb_orders);
+    cpl_test_eq(0, cr2res_slit_pos(tw, &coef_slit, &coef_wave));
+    cpl_image *slitpos_tw = cpl_image_new(CR2RES_DETECTOR_SIZE,
+        CR2RES_DETECTOR_SIZE, CPL_TYPE_DOUBLE);
+    cpl_image *wavelength_tw = cpl_image_new(CR2RES_DETECTOR_SIZE,
+        CR2RES_DETECTOR_SIZE, CPL_TYPE_DOUBLE);
+    cpl_test_eq(0, cr2res_slit_pos_image(tw, &slitpos_tw, &wavelength_tw));
+
+    /* Each pixel of a band matches the cr2res_slit_pos polynomials of */
+    /* the last order covering it, the others are untouched */
+    int xs[] = {1, 1024, CR2RES_DETECTOR_SIZE};
+    int band_lo[] = {100, 115};
+    int band_hi[] = {120, 135};
+    double w, s;
+    cpl_vector *vec = cpl_vector_new(2);
+    for (i = 0; i < 3; i++) {
+        x = xs[i];
+        for (y = 90; y <= 145; y++) {
+            k = -1;
+            if (y >= band_lo[0] && y <= band_hi[0]) k = 0;
+            if (y >= band_lo[1] && y <= band_hi[1]) k = 1;
+            if (k < 0) {
+                cpl_test_abs(0, cpl_image_get(slitpos_tw, x, y, &pix_rej), 0);
+                cpl_test_abs(0, cpl_image_get(wavelength_tw, x, y, &pix_rej),
+                    0);
+                continue;
+            }
+            cpl_vector_set(vec, 0, x);
+            cpl_vector_set(vec, 1, y);
+            w = cpl_polynomial_eval(coef_wave[k], vec);
+            cpl_vector_set(vec, 0, w);
+            s = cpl_polynomial_eval(coef_slit[k], vec);
+            cpl_test(s > 0 && s < 10);
+            cpl_test_rel(s, cpl_image_get(slitpos_tw, x, y, &pix_rej), 1e-9);
+            cpl_test_rel(w, cpl_image_get(wavelength_tw, x, y, &pix_rej),
+                1e-9);
+        }
+    }
+
+    /* In the overlap, the later order wins */
+    cpl_vector_set(vec, 0, 1024);
+    cpl_vector_set(vec, 1, 118);
+    w = cpl_polynomial_eval(coef_wave[0], vec);
+    cpl_vector_set(vec, 0, w);
+    s = cpl_polynomial_eval(coef_slit[0], vec);
+    cpl_test(fabs(s - cpl_image_get(slitpos_tw, 1024, 118, &pix_rej)) > 0.1);
+    cpl_test(fabs(w - cpl_image_get(wavelength_tw, 1024, 118, &pix_rej)) >
+        100);
+
+    for (i = 0; i < nb_orders; i++) {
+        cpl_polynomial_delete(coef_wave[i]);
+        cpl_polynomial_delete(coef_slit[i]);
+    }
+    cpl_free(coef_wave);
+    cpl_free(coef_slit);
+    cpl_free(orders);
+    cpl_vector_delete(vec);
+    cpl_image_delete(slitpos_tw);
+    cpl_image_delete(wavelength_tw);
+    cpl_table_delete(tw);
+
     cpl_image_save(slitpos, "TEST_slit.fits", CPL_TYPE_DOUBLE,
         NULL, CPL_IO_CREATE);
     cpl_image_save(wavelength, "TEST_wave.fits", CPL_TYPE_DOUBLE,
@@ -805,6 +1012,58 @@ static void test_cr2res_slit_curv_compute_order_trace(){
 
 }
 
+/* Toy detector reduction: the second detector fails, the third one */
+/* succeeds but leaves an error set */
+static int test_reduce_det(int det_nr, void * data)
+{
+    int     *   outputs = (int *)data ;
+
+    if (det_nr == 2) {
+        cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+        return -1 ;
+    }
+    outputs[det_nr-1] = 10 * det_nr ;
+    if (det_nr == 3) cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the reduction of the detectors in parallel
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_reduce_detectors(void)
+{
+    int     outputs[CR2RES_NB_DETECTORS] ;
+    int     i ;
+
+    /* NULL Input */
+    cpl_test_eq(cr2res_reduce_detectors(NULL, outputs, 0), -1) ;
+    cpl_test_eq(cr2res_reduce_detectors(test_reduce_det, outputs, 4), -1) ;
+
+    /* All detectors */
+    for (i=0 ; i<CR2RES_NB_DETECTORS ; i++) outputs[i] = 0 ;
+    cpl_test_eq(cr2res_reduce_detectors(test_reduce_det, outputs, 0), 1) ;
+    cpl_test_eq(outputs[0], 10) ;
+    cpl_test_eq(outputs[1], 0) ;
+    cpl_test_eq(outputs[2], 30) ;
+    /* Only the error of the detector that succeeded is kept */
+    cpl_test_error(CPL_ERROR_DATA_NOT_FOUND) ;
+
+    /* One detector */
+    for (i=0 ; i<CR2RES_NB_DETECTORS ; i++) outputs[i] = 0 ;
+    cpl_test_eq(cr2res_reduce_detectors(test_reduce_det, outputs, 1), 0) ;
+    cpl_test_error(CPL_ERROR_NONE) ;
+    cpl_test_eq(outputs[0], 10) ;
+    cpl_test_eq(outputs[1], 0) ;
+    cpl_test_eq(outputs[2], 0) ;
+
+    /* The failed detector */
+    cpl_test_eq(cr2res_reduce_detectors(test_reduce_det, outputs, 2), 1) ;
+    cpl_test_error(CPL_ERROR_NONE) ;
+    return ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Get the pipeline copyright and license
@@ -835,6 +1094,7 @@ int main(void)
     test_cr2res_polynomial_eval_vector();
     test_cr2res_image_cut_rectify();
     test_cr2res_image_insert_rect();
+    test_cr2res_rect_buffer();
     test_cr2res_threshold_spec();
     test_cr2res_get_base_name();
     test_cr2res_get_root_name();
@@ -843,6 +1103,7 @@ int main(void)
     test_cr2res_convert_poly_to_array();
     test_cr2res_detector_shotnoise_model();
     test_cr2res_get_license();
+    test_cr2res_reduce_detectors();
     test_cr2res_fit_noise();
     test_cr2res_slit_pos();
     test_cr2res_slit_pos_img();
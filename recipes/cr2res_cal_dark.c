@@ -44,6 +44,25 @@
 
 #define RECIPE_STRING "cr2res_cal_dark"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions of one setting */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    const hdrl_parameter *  collapse_params ;
+    int                     ron_hsize ;
+    int                     ron_nsamples ;
+    double                  bpm_kappa ;
+    double                  bpm_lines_ratio ;
+    double                  gain ;
+    int                     ndit ;
+    hdrl_image          **  master_darks ;
+    cpl_image           **  bpms ;
+    cpl_propertylist    **  ext_plist ;
+} cr2res_cal_dark_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -57,6 +76,20 @@ int cpl_plugin_get_info(cpl_pluginlist * list);
 static int cr2res_cal_dark_compare(
         const cpl_frame   *   frame1,
         const cpl_frame   *   frame2) ;
+static int cr2res_cal_dark_reduce(
+        const cpl_frameset      *   rawframes,
+        const hdrl_parameter    *   collapse_params,
+        int                         ron_hsize,
+        int                         ron_nsamples,
+        double                      bpm_kappa,
+        double                      bpm_lines_ratio,
+        double                      gain,
+        int                         ndit,
+        int                         reduce_det,
+        hdrl_image              **  master_dark,
+        cpl_image               **  bpm,
+        cpl_propertylist        **  ext_plist) ;
+static int cr2res_cal_dark_reduce_det(int det_nr, void * data) ;
 
 static int cr2res_cal_dark_create(cpl_plugin *);
 static int cr2res_cal_dark_exec(cpl_plugin *);
@@ -295,8 +328,7 @@ static int cr2res_cal_dark(
 {
     const cpl_parameter *   par ;
     int                     reduce_det, ron_hsize, ron_nsamples, ndit ;
-    double                  gain, dit, bpm_kappa, bpm_lines_ratio, bpm_high, 
-                            bpm_low, med, sigma, mean, ron1, ron2, ron ;
+    double                  gain, dit, bpm_kappa, bpm_lines_ratio ;
     hdrl_parameter      *   collapse_params ;
     cpl_frameset        *   rawframes ;
     cpl_frameset        *   raw_one ;
@@ -308,19 +340,10 @@ static int cr2res_cal_dark(
     hdrl_image          *   master_darks[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpms[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_cal_dark_data    data ;
 
-    hdrl_imagelist      *   dark_cube ;
-    cpl_mask            *   my_bpm ;
-    const char          *   fname ;
-    hdrl_image          *   ima_data ;
-    hdrl_image          *   ima_data_err ;
-    cpl_image           *   ima_err ;
-
-    hdrl_image          *   master;
-    cpl_image           *   contrib_map;
-    cpl_mask            *   bpm ;
     char                *   filename ;
-    int                     nb_frames, i, l, det_nr, nb_bad ;
+    int                     l, det_nr ;
     int                     single_dit_ndit ;
     int                     original_ndit ;
     double                  original_dit ;
@@ -426,7 +449,6 @@ static int cr2res_cal_dark(
     for (l=0 ; l<(int)nlabels ; l++) {
         /* Get the frames for the current setting */
         raw_one = cpl_frameset_extract(rawframes, labels, (cpl_size)l) ;
-        nb_frames = cpl_frameset_get_size(raw_one) ;
 
         /* Get the current setting */
         plist = cpl_propertylist_load(cpl_frame_get_filename(
@@ -441,179 +463,45 @@ static int cr2res_cal_dark(
                 setting_id, dit, ndit) ;
         cpl_msg_indent_more() ;
 
-        /* Loop on the detectors */
+        /* Initialise */
         for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-            /* Initialise */
             master_darks[det_nr-1] = NULL ;
             bpms[det_nr-1] = NULL ;
             ext_plist[det_nr-1] = NULL ;
+        }
 
-            /* Compute only one detector */
-            if (reduce_det != 0 && det_nr != reduce_det) continue ;
-
-            cpl_msg_info(__func__, "Process Detector nb %i", det_nr) ;
-            cpl_msg_indent_more() ;
-
-            /* Loop on the frames */
-            dark_cube = hdrl_imagelist_new();
-            for (i=0; i<nb_frames ; i++) {
-                /* Identify current file */
-                fname=cpl_frame_get_filename(
-                        cpl_frameset_get_position(raw_one, i)) ; 
-                cpl_msg_info(__func__, "Load Image from File %s / Detector %i", 
-                        cr2res_get_base_name(fname), det_nr) ;
-
-                /* Load the image */
-                if ((ima_data = cr2res_io_load_image(fname, det_nr)) == NULL) {
-                    cpl_msg_error(__func__, 
-                            "Cannot load image from File %s / Detector %d", 
-                            fname, det_nr) ;
-                    cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
-                    cpl_msg_indent_less() ;
-                    cpl_msg_indent_less() ;
-                    cpl_frameset_delete(rawframes) ;
-                    hdrl_parameter_destroy(collapse_params) ;
-                    cpl_free(labels);
-                    cpl_free(setting_id) ;
-                    cpl_frameset_delete(raw_one) ;
-                    hdrl_imagelist_delete(dark_cube) ;
-                    return -1 ;
-                }
-
-                /* Create the noise image */
-                cpl_msg_info(__func__, "Create the associated Noise image");
-                ron = 0.0 ;
-                if (cr2res_detector_shotnoise_model(
-                            hdrl_image_get_image(ima_data), gain, ron,
-                            &ima_err) != CPL_ERROR_NONE) {
-                    cpl_free(labels);
-                    cpl_msg_error(__func__, "Cannot create the Noise image") ;
-                    cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
-                    cpl_msg_indent_less() ;
-                    cpl_msg_indent_less() ;
-                    cpl_frameset_delete(rawframes) ;
-                    hdrl_parameter_destroy(collapse_params) ;
-                    cpl_free(setting_id) ;
-                    cpl_free(labels);
-                    cpl_frameset_delete(raw_one) ;
-                    hdrl_imagelist_delete(dark_cube) ;
-                    hdrl_image_delete(ima_data); 
-                    return -1 ;
-                }
-
-                /* Set the new error image */
-                ima_data_err =
-                    hdrl_image_create(hdrl_image_get_image(ima_data), ima_err);
-                cpl_image_delete(ima_err) ;
-                hdrl_image_delete(ima_data) ;
-                
-                /* Store the hdrl image in the dark_cube */
-                hdrl_imagelist_set(dark_cube, ima_data_err, i);
-            }
-
-            /* Get the proper collapsing function and do frames combination */
-            if (hdrl_imagelist_collapse(dark_cube, collapse_params,
-                    &(master_darks[det_nr-1]), &contrib_map) != CPL_ERROR_NONE){
-                cpl_msg_warning(__func__, "Cannot collapse Detector %d",det_nr);
-                master_darks[det_nr-1] = NULL ;
-                contrib_map = NULL ;
-            }
-            cpl_image_delete(contrib_map);
-       
-            /* Compute BPM from the MASTER dark */
-            if (master_darks[det_nr-1] != NULL) {
-                /* Compute Thresholds */
-                med = cpl_image_get_median_dev(
-                        hdrl_image_get_image(master_darks[det_nr-1]), &sigma) ;
-                if (cpl_error_get_code()) {
-                    cpl_error_reset() ;
-                    cpl_msg_warning(__func__, "Cannot compute statistics") ;
-                } else {
-                    bpm_low = med - bpm_kappa * sigma ;
-                    bpm_high = med + bpm_kappa * sigma ;
-
-                    cpl_msg_debug(__func__, "Median %.1f, Sigma %.1f"
-                        "BPM_low %.1f, BPM_hi %.1f"
-                        , med, sigma, bpm_low, bpm_high);
-                    /* Compute BPM */
-                    if ((my_bpm = cr2res_bpm_compute(
-                                hdrl_image_get_image(master_darks[det_nr-1]),
-                                bpm_low, bpm_high, bpm_lines_ratio, 
-                                0)) == NULL) {
-                        cpl_msg_warning(__func__, "Cannot create BPM") ;
-                    } else {
-                        /* Convert mask to BPM */
-                        bpms[det_nr-1] = cr2res_bpm_from_mask(my_bpm, 
-                                CR2RES_BPM_DARK);
-                        cpl_mask_delete(my_bpm) ;
-                    }
-                }
-            }
-                        
-            /* Set the BPM in the master dark and the RAW */
-            if (bpms[det_nr-1] != NULL) {
-                /* Get Mask */
-                bpm = cpl_mask_threshold_image_create(bpms[det_nr-1],-0.5,0.5) ;
-                cpl_mask_not(bpm) ;
-
-                /* In dark_cube */
-                for (i=0; i<hdrl_imagelist_get_size(dark_cube) ; i++) {
-                    hdrl_image_reject_from_mask(hdrl_imagelist_get(dark_cube, 
-                                i), bpm) ;
-                }
-
-                /* In Master Dark */
-                hdrl_image_reject_from_mask(master_darks[det_nr-1], bpm) ;
-
-                cpl_mask_delete(bpm) ;
-            }
-
-            /* QCs */
-            ext_plist[det_nr-1] = cpl_propertylist_new() ;
-            
-            /* QCs from RAW */
-            if (hdrl_imagelist_get_size(dark_cube) >= 3) {
-                ron1 = cr2res_dark_qc_ron(
-                        hdrl_image_get_image(hdrl_imagelist_get(dark_cube,0)), 
-                        hdrl_image_get_image(hdrl_imagelist_get(dark_cube,1)), 
-                        ron_hsize, ron_nsamples, ndit) ;
-                ron2 = cr2res_dark_qc_ron(
-                        hdrl_image_get_image(hdrl_imagelist_get(dark_cube,1)), 
-                        hdrl_image_get_image(hdrl_imagelist_get(dark_cube,2)), 
-                        ron_hsize, ron_nsamples, ndit) ;
-                if (cpl_error_get_code()) { 
-                    cpl_error_reset() ;
-                } else {
-                    cpl_propertylist_append_double(ext_plist[det_nr-1], 
-                            CR2RES_HEADER_QC_DARK_RON1, ron1) ;
-                    cpl_propertylist_append_double(ext_plist[det_nr-1], 
-                            CR2RES_HEADER_QC_DARK_RON2, ron2) ;
-                }
-            }
-            hdrl_imagelist_delete(dark_cube);
-
-            /* QCs from MASTER DARK */
-            if (master_darks[det_nr-1] != NULL) {
-                 /* Compute Thresholds */
-                med = cpl_image_get_median_dev(
-                        hdrl_image_get_image(master_darks[det_nr-1]), &sigma) ;
-                mean = cpl_image_get_mean(
-                        hdrl_image_get_image(master_darks[det_nr-1])) ;
-
-                cpl_propertylist_append_double(ext_plist[det_nr-1], 
-                        CR2RES_HEADER_QC_DARK_MEAN, mean) ;
-                cpl_propertylist_append_double(ext_plist[det_nr-1], 
-                        CR2RES_HEADER_QC_DARK_MEDIAN, med) ;
-                cpl_propertylist_append_double(ext_plist[det_nr-1], 
-                        CR2RES_HEADER_QC_DARK_STDEV, sigma) ;
-            }
-            /* QCs from BPM */
-            if (bpms[det_nr-1] != NULL) {
-                nb_bad = cr2res_bpm_count(bpms[det_nr-1], CR2RES_BPM_DARK) ;
-                cpl_propertylist_append_int(ext_plist[det_nr-1], 
-                        CR2RES_HEADER_QC_DARK_NBAD, nb_bad) ;
+        /* Reduce the detectors in parallel */
+        data.rawframes = raw_one ;
+        data.collapse_params = collapse_params ;
+        data.ron_hsize = ron_hsize ;
+        data.ron_nsamples = ron_nsamples ;
+        data.bpm_kappa = bpm_kappa ;
+        data.bpm_lines_ratio = bpm_lines_ratio ;
+        data.gain = gain ;
+        data.ndit = ndit ;
+        data.master_darks = master_darks ;
+        data.bpms = bpms ;
+        data.ext_plist = ext_plist ;
+        if (cr2res_reduce_detectors(cr2res_cal_dark_reduce_det, &data,
+                    reduce_det) != 0) {
+            /* The raw frames must be complete */
+            cpl_frameset_delete(rawframes) ;
+            cpl_frameset_delete(raw_one) ;
+            for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+                if (bpms[det_nr-1] != NULL) 
+                    cpl_image_delete(bpms[det_nr-1]);
+                if (master_darks[det_nr-1] != NULL) 
+                    hdrl_image_delete(master_darks[det_nr-1]);
+                if (ext_plist[det_nr-1] != NULL) 
+                    cpl_propertylist_delete(ext_plist[det_nr-1]);
             }
+            cpl_free(labels);
+            cpl_free(setting_id);
+            hdrl_parameter_destroy(collapse_params) ;
+            cpl_msg_error(__func__, "Cannot load the RAW images") ;
+            cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
             cpl_msg_indent_less() ;
+            return -1 ;
         }
 
         /* Save the results */
@@ -703,6 +591,227 @@ static int cr2res_cal_dark(
     return (int)cpl_error_get_code();
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_cal_dark_data inputs and products
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_dark_reduce_det(int det_nr, void * data)
+{
+    cr2res_cal_dark_data    *   d = (cr2res_cal_dark_data *)data ;
+
+    return cr2res_cal_dark_reduce(d->rawframes, d->collapse_params,
+            d->ron_hsize, d->ron_nsamples, d->bpm_kappa, d->bpm_lines_ratio,
+            d->gain, d->ndit, det_nr,
+            &(d->master_darks[det_nr-1]),
+            &(d->bpms[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the master dark for 1 setting, 1 detector
+  @param    rawframes           Raw frames from a single setting
+  @param    collapse_params     The frames combination parameters
+  @param    ron_hsize           Half size of the RON windows
+  @param    ron_nsamples        Number of samples for the RON
+  @param    bpm_kappa           Kappa value for BPM detection
+  @param    bpm_lines_ratio     Max fraction of BPM per line
+  @param    gain                The detector gain
+  @param    ndit                The NDIT of the raw frames
+  @param    reduce_det          The detector to compute
+  @param    master_dark         [out] the master dark or NULL
+  @param    bpm                 [out] the BPM or NULL
+  @param    ext_plist           [out] the header for saving the products
+  @return   0 if ok, -1 if a raw image cannot be loaded
+
+  A master dark that cannot be computed is not an error, the products
+  are left NULL and the detector is saved empty.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_dark_reduce(
+        const cpl_frameset      *   rawframes,
+        const hdrl_parameter    *   collapse_params,
+        int                         ron_hsize,
+        int                         ron_nsamples,
+        double                      bpm_kappa,
+        double                      bpm_lines_ratio,
+        double                      gain,
+        int                         ndit,
+        int                         reduce_det,
+        hdrl_image              **  master_dark,
+        cpl_image               **  bpm,
+        cpl_propertylist        **  ext_plist)
+{
+    hdrl_imagelist      *   dark_cube ;
+    cpl_mask            *   my_bpm ;
+    const char          *   fname ;
+    hdrl_image          *   ima_data ;
+    hdrl_image          *   ima_data_err ;
+    cpl_image           *   ima_err ;
+    cpl_image           *   contrib_map;
+    cpl_mask            *   bpm_mask ;
+    double                  bpm_high, bpm_low, med, sigma, mean, ron1, ron2,
+                            ron ;
+    int                     nb_frames, i, nb_bad ;
+
+    /* Check Inputs */
+    if (rawframes == NULL || collapse_params == NULL || master_dark == NULL
+            || bpm == NULL || ext_plist == NULL) return -1 ;
+
+    /* Initialise */
+    *master_dark = NULL ;
+    *bpm = NULL ;
+    *ext_plist = NULL ;
+    nb_frames = cpl_frameset_get_size(rawframes) ;
+
+    /* Loop on the frames */
+    dark_cube = hdrl_imagelist_new();
+    for (i=0; i<nb_frames ; i++) {
+        /* Identify current file */
+        fname=cpl_frame_get_filename(
+                cpl_frameset_get_position_const(rawframes, i)) ; 
+        cpl_msg_info(__func__, "Load Image from File %s / Detector %i", 
+                cr2res_get_base_name(fname), reduce_det) ;
+
+        /* Load the image */
+        if ((ima_data = cr2res_io_load_image(fname, reduce_det)) == NULL) {
+            cpl_msg_error(__func__, 
+                    "Cannot load image from File %s / Detector %d", 
+                    fname, reduce_det) ;
+            cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
+            hdrl_imagelist_delete(dark_cube) ;
+            return -1 ;
+        }
+
+        /* Create the noise image */
+        cpl_msg_info(__func__, "Create the associated Noise image");
+        ron = 0.0 ;
+        if (cr2res_detector_shotnoise_model(
+                    hdrl_image_get_image(ima_data), gain, ron,
+                    &ima_err) != CPL_ERROR_NONE) {
+            cpl_msg_error(__func__, "Cannot create the Noise image") ;
+            cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
+            hdrl_imagelist_delete(dark_cube) ;
+            hdrl_image_delete(ima_data); 
+            return -1 ;
+        }
+
+        /* Set the new error image */
+        ima_data_err =
+            hdrl_image_create(hdrl_image_get_image(ima_data), ima_err);
+        cpl_image_delete(ima_err) ;
+        hdrl_image_delete(ima_data) ;
+        
+        /* Store the hdrl image in the dark_cube */
+        hdrl_imagelist_set(dark_cube, ima_data_err, i);
+    }
+
+    /* Get the proper collapsing function and do frames combination */
+    if (hdrl_imagelist_collapse(dark_cube, collapse_params,
+            master_dark, &contrib_map) != CPL_ERROR_NONE){
+        cpl_msg_warning(__func__, "Cannot collapse Detector %d", reduce_det);
+        *master_dark = NULL ;
+        contrib_map = NULL ;
+    }
+    cpl_image_delete(contrib_map);
+
+    /* Compute BPM from the MASTER dark */
+    if (*master_dark != NULL) {
+        /* Compute Thresholds */
+        med = cpl_image_get_median_dev(
+                hdrl_image_get_image(*master_dark), &sigma) ;
+        if (cpl_error_get_code()) {
+            cpl_error_reset() ;
+            cpl_msg_warning(__func__, "Cannot compute statistics") ;
+        } else {
+            bpm_low = med - bpm_kappa * sigma ;
+            bpm_high = med + bpm_kappa * sigma ;
+
+            cpl_msg_debug(__func__, "Median %.1f, Sigma %.1f"
+                "BPM_low %.1f, BPM_hi %.1f"
+                , med, sigma, bpm_low, bpm_high);
+            /* Compute BPM */
+            if ((my_bpm = cr2res_bpm_compute(
+                        hdrl_image_get_image(*master_dark),
+                        bpm_low, bpm_high, bpm_lines_ratio, 0)) == NULL) {
+                cpl_msg_warning(__func__, "Cannot create BPM") ;
+            } else {
+                /* Convert mask to BPM */
+                *bpm = cr2res_bpm_from_mask(my_bpm, CR2RES_BPM_DARK);
+                cpl_mask_delete(my_bpm) ;
+            }
+        }
+    }
+                
+    /* Set the BPM in the master dark and the RAW */
+    if (*bpm != NULL) {
+        /* Get Mask */
+        bpm_mask = cpl_mask_threshold_image_create(*bpm, -0.5, 0.5) ;
+        cpl_mask_not(bpm_mask) ;
+
+        /* In dark_cube */
+        for (i=0; i<hdrl_imagelist_get_size(dark_cube) ; i++) {
+            hdrl_image_reject_from_mask(hdrl_imagelist_get(dark_cube, i),
+                    bpm_mask) ;
+        }
+
+        /* In Master Dark */
+        hdrl_image_reject_from_mask(*master_dark, bpm_mask) ;
+
+        cpl_mask_delete(bpm_mask) ;
+    }
+
+    /* QCs */
+    *ext_plist = cpl_propertylist_new() ;
+    
+    /* QCs from RAW */
+    if (hdrl_imagelist_get_size(dark_cube) >= 3) {
+        ron1 = cr2res_dark_qc_ron(
+                hdrl_image_get_image(hdrl_imagelist_get(dark_cube,0)), 
+                hdrl_image_get_image(hdrl_imagelist_get(dark_cube,1)), 
+                ron_hsize, ron_nsamples, ndit) ;
+        ron2 = cr2res_dark_qc_ron(
+                hdrl_image_get_image(hdrl_imagelist_get(dark_cube,1)), 
+                hdrl_image_get_image(hdrl_imagelist_get(dark_cube,2)), 
+                ron_hsize, ron_nsamples, ndit) ;
+        if (cpl_error_get_code()) { 
+            cpl_error_reset() ;
+        } else {
+            cpl_propertylist_append_double(*ext_plist, 
+                    CR2RES_HEADER_QC_DARK_RON1, ron1) ;
+            cpl_propertylist_append_double(*ext_plist, 
+                    CR2RES_HEADER_QC_DARK_RON2, ron2) ;
+        }
+    }
+    hdrl_imagelist_delete(dark_cube);
+
+    /* QCs from MASTER DARK */
+    if (*master_dark != NULL) {
+         /* Compute Thresholds */
+        med = cpl_image_get_median_dev(
+                hdrl_image_get_image(*master_dark), &sigma) ;
+        mean = cpl_image_get_mean(hdrl_image_get_image(*master_dark)) ;
+
+        cpl_propertylist_append_double(*ext_plist, 
+                CR2RES_HEADER_QC_DARK_MEAN, mean) ;
+        cpl_propertylist_append_double(*ext_plist, 
+                CR2RES_HEADER_QC_DARK_MEDIAN, med) ;
+        cpl_propertylist_append_double(*ext_plist, 
+                CR2RES_HEADER_QC_DARK_STDEV, sigma) ;
+    }
+    /* QCs from BPM */
+    if (*bpm != NULL) {
+        nb_bad = cr2res_bpm_count(*bpm, CR2RES_BPM_DARK) ;
+        cpl_propertylist_append_int(*ext_plist, 
+                CR2RES_HEADER_QC_DARK_NBAD, nb_bad) ;
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Comparison function to identify different settings
@@ -26,6 +26,7 @@
  -----------------------------------------------------------------------------*/
 
 #include <string.h>
+#include <math.h>
 #include <cpl.h>
 
 #include "cr2res_utils.h"
@@ -44,6 +45,28 @@
 
 #define RECIPE_STRING "cr2res_cal_detlin"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions of one setting */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    double                  bpm_kappa ;
+    int                     trace_degree ;
+    int                     trace_min_cluster ;
+    int                     trace_smooth_x ;
+    int                     trace_smooth_y ;
+    double                  trace_threshold ;
+    int                     trace_opening ;
+    int                     trace_collapse ;
+    int                     plotx ;
+    int                     ploty ;
+    hdrl_imagelist      **  coeffs ;
+    cpl_image           **  bpm ;
+    cpl_propertylist    **  ext_plist ;
+} cr2res_cal_detlin_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -77,6 +100,17 @@ static int cr2res_cal_detlin_reduce(
         hdrl_imagelist      **  coeffs,
         cpl_image           **  bpm,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_cal_detlin_load_ramp(
+        const cpl_frameset  *   sorted_frames,
+        const cpl_vector    *   dits,
+        int                     reduce_det,
+        int                     trace_collapse,
+        int                     plotx,
+        int                     ploty,
+        cr2res_detlin_sums  **  sums,
+        cpl_image           **  trace_input,
+        cpl_vector          **  plotvals) ;
+static int cr2res_cal_detlin_reduce_det(int det_nr, void * data) ;
 static int cr2res_cal_detlin_create(cpl_plugin *);
 static int cr2res_cal_detlin_exec(cpl_plugin *);
 static int cr2res_cal_detlin_destroy(cpl_plugin *);
@@ -112,20 +146,20 @@ Detector Linearity                                                      \n\
     save global_coeffs file                                             \n\
                                                                         \n\
     cr2res_cal_detlin_reduce()                                          \n\
-      load input imlist and dits                                        \n\
+      load the dits, add the input images one by one to the fit sums    \n\
       compute the traces (from 1. image, or collapsed if --trace_collapse)\n\
         use cr2res_trace(--trace_smooth, --trace_degree,                \n\
                          --trace_min_cluster, --trace_opening)          \n\
-      loop on the detector pixels pix:                                  \n\
-        if the pixel is within a trace:                                 \n\
-          cr2res_detlin_compute() computes polynomial(pix) and errors(pix)\n\
+      cr2res_detlin_sums_solve() fits all the pixels within a trace:    \n\
+        polynomial(pix) and errors(pix), NaN if the fit fails           \n\
       use the coeffs for the bpm computation                            \n\
       set the bad pixel coefficients as NaN                             \n\
       store the qc parameters in the returned property list             \n\
                                                                         \n\
   Library Functions used                                                \n\
     cr2res_trace()                                                      \n\
-    cr2res_detlin_compute()                                             \n\
+    cr2res_detlin_sums_add()                                            \n\
+    cr2res_detlin_sums_solve()                                          \n\
     cr2res_qc_detlin_gain()                                             \n\
     cr2res_qc_detlin_median()                                           \n\
     cr2res_qc_detlin_min_max_level()                                    \n\
@@ -358,6 +392,7 @@ static int cr2res_cal_detlin(
     hdrl_imagelist      *   coeffs[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpm[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_cal_detlin_data  data ;
     cpl_propertylist    *   plist ;
     char                *   out_file;
     int                     i, l, det_nr; 
@@ -449,35 +484,33 @@ static int cr2res_cal_detlin(
         cpl_msg_info(__func__, "Process SETTING %s", setting_id) ;
         cpl_msg_indent_more() ;
 
-        /* Loop on the detectors */
+        /* Initialise */
         for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-            cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-
-            /* Initialise */
             coeffs[det_nr-1] = NULL ;
             bpm[det_nr-1] = NULL ;
             ext_plist[det_nr-1] = NULL ;
+        }
 
-            /* Compute only one detector */
-            if (reduce_det != 0 && det_nr != reduce_det) continue ;
-    
-            /* Call the reduction function */
-            cpl_msg_indent_more() ;
-            if (cr2res_cal_detlin_reduce(raw_one, bpm_kappa,
-                        trace_degree, trace_min_cluster, trace_smooth_x,
-                        trace_smooth_y, trace_threshold, trace_opening, 
-                        trace_collapse, det_nr, plot_x, plot_y,
-                        &(coeffs[det_nr-1]),
-                        &(bpm[det_nr-1]),
-                        &(ext_plist[det_nr-1])) == -1) {
-                cpl_msg_warning(__func__, 
-                        "Failed to reduce SETTING %s / det %d", 
-                        setting_id, det_nr);
-                cpl_error_reset() ;
-            } 
-            cpl_msg_indent_less() ;
-
-            /* Merge the products */
+        /* Reduce the detectors in parallel */
+        data.rawframes = raw_one ;
+        data.bpm_kappa = bpm_kappa ;
+        data.trace_degree = trace_degree ;
+        data.trace_min_cluster = trace_min_cluster ;
+        data.trace_smooth_x = trace_smooth_x ;
+        data.trace_smooth_y = trace_smooth_y ;
+        data.trace_threshold = trace_threshold ;
+        data.trace_opening = trace_opening ;
+        data.trace_collapse = trace_collapse ;
+        data.plotx = plot_x ;
+        data.ploty = plot_y ;
+        data.coeffs = coeffs ;
+        data.bpm = bpm ;
+        data.ext_plist = ext_plist ;
+        cr2res_reduce_detectors(cr2res_cal_detlin_reduce_det, &data,
+                reduce_det) ;
+
+        /* Merge the products in the detectors order */
+        for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
             if (ext_plist[det_nr-1] != NULL && coeffs[det_nr-1] != NULL
                     && bpm[det_nr-1] != NULL) {
                 /* Take the first header as it is */
@@ -562,6 +595,27 @@ static int cr2res_cal_detlin(
     return (int)cpl_error_get_code();
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_cal_detlin_data inputs and products
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_detlin_reduce_det(int det_nr, void * data)
+{
+    cr2res_cal_detlin_data  *   d = (cr2res_cal_detlin_data *)data ;
+
+    return cr2res_cal_detlin_reduce(d->rawframes, d->bpm_kappa,
+            d->trace_degree, d->trace_min_cluster, d->trace_smooth_x,
+            d->trace_smooth_y, d->trace_threshold, d->trace_opening,
+            d->trace_collapse, det_nr, d->plotx, d->ploty,
+            &(d->coeffs[det_nr-1]),
+            &(d->bpm[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief  Compute the non-linearity for a single setting, single detector
@@ -602,12 +656,9 @@ static int cr2res_cal_detlin_reduce(
 {
     cpl_frameset        *   sorted_frames ;
     const char          *   first_file ;
-    hdrl_imagelist      *   imlist ;
-    hdrl_image          *   cur_im ;
-    double              *   pcur_im ;
+    cr2res_detlin_sums  *   sums ;
     cpl_vector          *   dits ;
-    hdrl_image          *   collapsed ;
-    cpl_image           *   contrib ;
+    cpl_image           *   trace_input ;
     hdrl_image          *   master_flat_loc ;
     cpl_table           *   traces ;
     cpl_imagelist       *   coeffs_loc ;
@@ -615,17 +666,15 @@ static int cr2res_cal_detlin_reduce(
     double              *   pcur_coeffs ;
     cpl_imagelist       *   errors_loc ;
     cpl_image           *   cur_errors ;
-    double              *   pcur_errors ;
     cpl_propertylist    *   plist ;
     cpl_image           *   bpm_loc ;
     int                 *   pbpm_loc ;
     cpl_image           *   trace_image ;
     int                 *   pti ;
     cpl_polynomial      *   fitted_poly ;
-    cpl_vector          *   fitted_errors ;
     cpl_vector          *   fitvals ;
     cpl_mask            *   bpm_mask ;
-    int                     i, j, k, idx, ext_nr_data, order, trace_id, nx, ny;
+    int                     i, j, idx, ext_nr_data, order, trace_id, nx, ny;
     cpl_size                max_degree, l ;
     double                  low_thresh, high_thresh, median, sigma ;
     int                     qc_nb_bad, qc_nbfailed, qc_nbsuccess ;
@@ -656,64 +705,44 @@ static int cr2res_cal_detlin_reduce(
         return -1 ;
     }
 
-    /* Load the image list */
-    if ((imlist = cr2res_io_load_image_list_from_set(sorted_frames,
-                    reduce_det)) == NULL) {
+    /* Load the DITs */
+    if ((dits = cr2res_io_read_dits(sorted_frames)) == NULL) {
         cpl_propertylist_delete(plist);
         cpl_frameset_delete(sorted_frames) ;
-        cpl_msg_error(__func__, "Failed to Load the images") ;
+        cpl_msg_error(__func__, "Failed to Load the DIT values") ;
         return -1 ;
     }
 
-    /* Load the DITs */
-    if ((dits = cr2res_io_read_dits(sorted_frames)) == NULL) {
-        hdrl_imagelist_delete(imlist) ;
+    /* Accumulate the ramp image by image */
+    cpl_msg_info(__func__, "Load the %"CPL_SIZE_FORMAT" images of the ramp",
+            cpl_frameset_get_size(sorted_frames)) ;
+    if (cr2res_cal_detlin_load_ramp(sorted_frames, dits, reduce_det,
+                trace_collapse, plotx, ploty, &sums, &trace_input,
+                &fitvals) == -1) {
+        cpl_msg_error(__func__, "Failed to Load the ramp") ;
+        cpl_vector_delete(dits); 
         cpl_propertylist_delete(plist);
         cpl_frameset_delete(sorted_frames) ;
-        cpl_msg_error(__func__, "Failed to Load the DIT values") ;
         return -1 ;
     }
     cpl_frameset_delete(sorted_frames) ;
 
-    /* Collapse all input images for the traces detection (only if wished) */
-    if (trace_collapse) {
-        cpl_msg_info(__func__, "Collapse the input images") ;
-        cpl_msg_indent_more() ;
-        if (hdrl_imagelist_collapse_mean(imlist, &collapsed, &contrib) !=
-                CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Failed to Collapse") ;
-            cpl_propertylist_delete(plist);
-            hdrl_imagelist_delete(imlist) ;
-            cpl_vector_delete(dits); 
-            cpl_msg_indent_less() ;
-            return -1 ;
-        }
-        cpl_msg_indent_less() ;
-    } else {
-        /* Only use the first image */
-        collapsed = hdrl_image_duplicate(hdrl_imagelist_get(imlist, 0)) ;
-    }
-
     /* Compute traces */
     cpl_msg_info(__func__, "Compute the traces") ;
-    cpl_msg_indent_more() ;
-    nx = hdrl_image_get_size_x(collapsed) ;
-    ny = hdrl_image_get_size_y(collapsed) ;
-    if ((traces = cr2res_trace(hdrl_image_get_image(collapsed), 
+    nx = cpl_image_get_size_x(trace_input) ;
+    ny = cpl_image_get_size_y(trace_input) ;
+    if ((traces = cr2res_trace(trace_input, 
                     trace_smooth_x, trace_smooth_y, trace_threshold, 
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
         cpl_msg_error(__func__, "Failed compute the traces") ;
-        hdrl_imagelist_delete(imlist) ;
+        cr2res_detlin_sums_delete(sums) ;
+        if (fitvals != NULL) cpl_vector_delete(fitvals) ;
         cpl_vector_delete(dits); 
         cpl_propertylist_delete(plist);
-        hdrl_image_delete(collapsed) ;
-        cpl_image_delete(contrib);
-        cpl_msg_indent_less() ;
+        cpl_image_delete(trace_input) ;
         return -1 ;
     }
-    hdrl_image_delete(collapsed) ;
-    cpl_image_delete(contrib);
-    cpl_msg_indent_less() ;
+    cpl_image_delete(trace_input) ;
 
     /* Allocate */
     bpm_loc = cpl_image_new(nx, ny, CPL_TYPE_INT) ;
@@ -734,7 +763,23 @@ static int cr2res_cal_detlin_reduce(
 
     /* Loop over the traces and compute the non-linearity */
     cpl_msg_info(__func__, "Compute Non Linearity") ;
-    cpl_msg_indent_more() ;
+
+    /* Fit all the trace pixels at once */
+    if (cr2res_detlin_sums_solve(sums, trace_image, coeffs_loc,
+                errors_loc) == -1) {
+        cpl_msg_error(__func__, "Failed to compute the non-linearity") ;
+        cpl_image_delete(trace_image) ;
+        cpl_imagelist_delete(coeffs_loc) ;
+        cpl_imagelist_delete(errors_loc) ;
+        cpl_image_delete(bpm_loc) ;
+        cr2res_detlin_sums_delete(sums) ;
+        if (fitvals != NULL) cpl_vector_delete(fitvals) ;
+        cpl_vector_delete(dits); 
+        cpl_propertylist_delete(plist);
+        return -1 ;
+    }
+    cr2res_detlin_sums_delete(sums) ;
+    pcur_coeffs = cpl_image_get_data_double(cpl_imagelist_get(coeffs_loc, 0));
 
     /* Loop on the traces pixels */
     qc_nbfailed = 0 ;
@@ -742,92 +787,45 @@ static int cr2res_cal_detlin_reduce(
     for (j=0 ; j<ny ; j++) {
         for (i=0 ; i<nx ; i++) {
             idx = i + j*nx ;
-            if (pti[idx] > 0) {
-                /* Prepare values to fit */
-                fitvals = cpl_vector_new(cpl_vector_get_size(dits)) ;
-                for (k=0 ; k<cpl_vector_get_size(dits) ; k++) {
-                    cur_im = hdrl_imagelist_get(imlist,  k) ;
-                    pcur_im = cpl_image_get_data_double(
-                            hdrl_image_get_image(cur_im)) ;
-                    cpl_vector_set(fitvals, k, (float)(pcur_im[idx])) ;
-                }
-
-                /* We are in a trace, let's compute the linearity */
-                if (cr2res_detlin_compute(dits, fitvals, max_degree,
-                            &fitted_poly, &fitted_errors) == -1) {
-                    qc_nbfailed++ ;
-                    /* Store the null Coefficients in the output image list */
-                    pbpm_loc[idx] = CR2RES_BPM_DETLIN ;
-                    for (l=0 ; l<=max_degree ; l++) {
-                        cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                        pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                        pcur_coeffs[idx] = 0.0/0.0 ;
-                        cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                        pcur_errors = cpl_image_get_data_double(cur_errors) ;
-                        pcur_errors[idx] = 0.0/0.0 ;
-                    } 
-                } else {
-                    qc_nbsuccess++ ;
-
-                    /* Plot the values and the fit */
-                    if (plotx==i+1 && ploty==j+1) {
-                        cpl_bivector * toplot_measure =
-                            cpl_bivector_wrap_vectors(dits, fitvals) ;
-                        cpl_vector * poly_eval = cr2res_polynomial_eval_vector(
-                                fitted_poly, dits) ;
-                        cpl_bivector * toplot_fitted =
-                            cpl_bivector_wrap_vectors(dits, poly_eval) ;
-                        cpl_plot_bivector(
-                        "set grid;set xlabel 'dits (s)';set ylabel 'int';",
-                        "t 'Measured Detlin' w lines", "", toplot_measure);
-                        cpl_plot_bivector(
-                        "set grid;set xlabel 'dits (s)';set ylabel 'int';",
-                        "t 'Fitted Detlin' w lines", "", toplot_fitted);
-                        cpl_bivector_unwrap_vectors(toplot_fitted) ;
-                        cpl_vector_delete(poly_eval) ;
-                        cpl_bivector_unwrap_vectors(toplot_measure) ;
-                    }
-
-                    /* Store the Coefficients in the output image list */
-                    pbpm_loc[idx] = 0 ;
-                    for (l=0 ; l<=max_degree ; l++) {
-                        cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                        pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                        pcur_coeffs[idx] =
-                            cpl_polynomial_get_coeff(fitted_poly, &l) ;
-                        cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                        pcur_errors = cpl_image_get_data_double(cur_errors) ;
-
-                        /* Store error */
-                        if (fitted_errors != NULL) {
-                            pcur_errors[idx] = cpl_vector_get(fitted_errors, l);
-                        } else {
-                            pcur_errors[idx] = 0.0 ;
-                        }
-                    }
-                    if (fitted_errors != NULL) cpl_vector_delete(fitted_errors);
-                    cpl_polynomial_delete(fitted_poly) ;
-                }
-                cpl_vector_delete(fitvals) ;
-            } else {
-                /* Outside the orders */
-                /* Set the values as NaNs */
-                for (l=0 ; l<=max_degree ; l++) {
-                    cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                    pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                    pcur_coeffs[idx] = 0.0/0.0 ;
-                    cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                    pcur_errors = cpl_image_get_data_double(cur_errors) ;
-                    pcur_errors[idx] = 0.0/0.0 ;
-                }
-                /* Set the BPM as bad */
+            if (pti[idx] <= 0) {
+                /* Outside the orders - the fitter set the values as NaNs */
                 pbpm_loc[idx] = CR2RES_BPM_OUTOFORDER ;
+            } else if (isnan(pcur_coeffs[idx])) {
+                /* Failed fit - the fitter set the values as NaNs */
+                qc_nbfailed++ ;
+                pbpm_loc[idx] = CR2RES_BPM_DETLIN ;
+            } else {
+                qc_nbsuccess++ ;
+                pbpm_loc[idx] = 0 ;
             }
         }
     }
-    cpl_msg_indent_less() ;
+
+    /* Plot the values and the fit */
+    if (fitvals != NULL && pbpm_loc[(plotx-1) + (ploty-1)*nx] == 0) {
+        idx = (plotx-1) + (ploty-1)*nx ;
+        fitted_poly = cpl_polynomial_new(1) ;
+        for (l=0 ; l<=max_degree ; l++) {
+            cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
+            pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
+            cpl_polynomial_set_coeff(fitted_poly, &l, pcur_coeffs[idx]) ;
+        }
+        cpl_bivector * toplot_measure = cpl_bivector_wrap_vectors(dits, fitvals);
+        cpl_vector * poly_eval = cr2res_polynomial_eval_vector(fitted_poly, dits);
+        cpl_bivector * toplot_fitted = cpl_bivector_wrap_vectors(dits, poly_eval);
+        cpl_plot_bivector(
+                "set grid;set xlabel 'dits (s)';set ylabel 'int';",
+                "t 'Measured Detlin' w lines", "", toplot_measure);
+        cpl_plot_bivector(
+                "set grid;set xlabel 'dits (s)';set ylabel 'int';",
+                "t 'Fitted Detlin' w lines", "", toplot_fitted);
+        cpl_bivector_unwrap_vectors(toplot_fitted) ;
+        cpl_vector_delete(poly_eval) ;
+        cpl_bivector_unwrap_vectors(toplot_measure) ;
+        cpl_polynomial_delete(fitted_poly) ;
+    }
+    if (fitvals != NULL) cpl_vector_delete(fitvals) ;
     cpl_image_delete(trace_image) ;
-    hdrl_imagelist_delete(imlist) ;
     cpl_vector_delete(dits); 
 
     /* Reject the bad pixels in the image lists */
@@ -847,6 +845,7 @@ static int cr2res_cal_detlin_reduce(
     /* Use the second coefficient stats for the BPM detection */
     cpl_msg_info(__func__, "BPM detection") ;
     cur_coeffs = cpl_imagelist_get(coeffs_loc, 1) ;
+    pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
 
     median = cpl_image_get_median_dev(cur_coeffs, &sigma) ;
     low_thresh = median - bpm_kappa * sigma ;
@@ -913,6 +912,139 @@ static int cr2res_cal_detlin_reduce(
     return 0 ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief  Load the DIT ramp of a detector image by image
+  @param sorted_frames      Raw frames sorted by increasing DIT
+  @param dits               The DITs of the frames
+  @param reduce_det         The detector to load
+  @param trace_collapse     Flag to collapse (or not) the images for tracing
+  @param plotx              xposition to plot
+  @param ploty              yposition to plot
+  @param sums               [out] the detlin fit sums of the ramp
+  @param trace_input        [out] the image to detect the traces on
+  @param plotvals           [out] the values of the plotted pixel, or NULL
+  @return  0 if ok, -1 otherwise
+
+  Only one raw image is held at a time: each one is added to the fit
+  sums and to the running mean of the good pixels (if trace_collapse),
+  then released. Without trace_collapse the first image is kept for the
+  traces detection.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_detlin_load_ramp(
+        const cpl_frameset  *   sorted_frames,
+        const cpl_vector    *   dits,
+        int                     reduce_det,
+        int                     trace_collapse,
+        int                     plotx,
+        int                     ploty,
+        cr2res_detlin_sums  **  sums,
+        cpl_image           **  trace_input,
+        cpl_vector          **  plotvals)
+{
+    cr2res_detlin_sums  *   sums_loc ;
+    cpl_image           *   trace_input_loc ;
+    cpl_image           *   contrib ;
+    cpl_vector          *   plotvals_loc ;
+    hdrl_image          *   cur_im ;
+    const cpl_image     *   cur_ima ;
+    const double        *   pcur_ima ;
+    const cpl_binary    *   pcur_bpm ;
+    double              *   ptrace_input ;
+    double              *   pcontrib ;
+    cpl_size                k, idx, nx, ny, nframes ;
+
+    /* Check Inputs */
+    if (sorted_frames == NULL || dits == NULL || sums == NULL ||
+            trace_input == NULL || plotvals == NULL) return -1 ;
+    nframes = cpl_frameset_get_size(sorted_frames) ;
+    if (nframes < 1 || cpl_vector_get_size(dits) != nframes) return -1 ;
+
+    /* Initialise */
+    sums_loc = NULL ;
+    trace_input_loc = contrib = NULL ;
+    plotvals_loc = NULL ;
+    nx = ny = 0 ;
+
+    /* Loop on the frames */
+    for (k=0 ; k<nframes ; k++) {
+        if ((cur_im = cr2res_io_load_image(cpl_frame_get_filename(
+                            cpl_frameset_get_position_const(sorted_frames, k)),
+                        reduce_det)) == NULL) {
+            cpl_msg_error(__func__, "Failed to Load the images") ;
+            break ;
+        }
+        cur_ima = hdrl_image_get_image_const(cur_im) ;
+
+        /* The first image gives the size */
+        if (k == 0) {
+            nx = cpl_image_get_size_x(cur_ima) ;
+            ny = cpl_image_get_size_y(cur_ima) ;
+            sums_loc = cr2res_detlin_sums_new(nx, ny) ;
+            if (trace_collapse) {
+                trace_input_loc = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+                contrib = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+            } else {
+                /* Only use the first image */
+                trace_input_loc = cpl_image_duplicate(cur_ima) ;
+            }
+            if (plotx >= 1 && plotx <= nx && ploty >= 1 && ploty <= ny)
+                plotvals_loc = cpl_vector_new(nframes) ;
+        }
+
+        /* Add the image to the fit */
+        if (cr2res_detlin_sums_add(sums_loc, cur_ima,
+                    cpl_vector_get(dits, k)) == -1) {
+            cpl_msg_error(__func__, "Failed to add the image %"
+                    CPL_SIZE_FORMAT " to the fit", k+1) ;
+            hdrl_image_delete(cur_im) ;
+            break ;
+        }
+        pcur_ima = cpl_image_get_data_double_const(cur_ima) ;
+
+        /* Sum the good pixels for the collapsed image */
+        if (trace_collapse) {
+            ptrace_input = cpl_image_get_data_double(trace_input_loc) ;
+            pcontrib = cpl_image_get_data_double(contrib) ;
+            pcur_bpm = cpl_image_get_bpm_const(cur_ima) == NULL ? NULL :
+                cpl_mask_get_data_const(cpl_image_get_bpm_const(cur_ima)) ;
+            for (idx=0 ; idx<nx*ny ; idx++) {
+                if (pcur_bpm != NULL && pcur_bpm[idx]) continue ;
+                ptrace_input[idx] += pcur_ima[idx] ;
+                pcontrib[idx] += 1.0 ;
+            }
+        }
+
+        /* Keep the values to plot */
+        if (plotvals_loc != NULL)
+            cpl_vector_set(plotvals_loc, k,
+                    (float)(pcur_ima[(plotx-1) + (ploty-1)*nx])) ;
+        hdrl_image_delete(cur_im) ;
+    }
+
+    /* Finish the collapsed image - no contribution gives a bad pixel */
+    if (k == nframes && trace_collapse) {
+        cpl_msg_info(__func__, "Collapse the input images") ;
+        cpl_image_divide(trace_input_loc, contrib) ;
+    }
+    if (contrib != NULL) cpl_image_delete(contrib) ;
+
+    /* Check */
+    if (k < nframes) {
+        cr2res_detlin_sums_delete(sums_loc) ;
+        if (trace_input_loc != NULL) cpl_image_delete(trace_input_loc) ;
+        if (plotvals_loc != NULL) cpl_vector_delete(plotvals_loc) ;
+        return -1 ;
+    }
+
+    /* Return */
+    *sums = sums_loc ;
+    *trace_input = trace_input_loc ;
+    *plotvals = plotvals_loc ;
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Comparison function to identify different settings
@@ -45,6 +45,43 @@
 
 #define RECIPE_STRING "cr2res_cal_flat"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions of one setting and */
+/* one decker position */
+typedef struct {
+    const cpl_frameset          *   rawframes ;
+    const cpl_frame             *   tw_frame ;
+    cr2res_calib_context        **  calib ;
+    const cpl_frame             *   bpm_frame ;
+    double                          bpm_low ;
+    double                          bpm_high ;
+    double                          bpm_linemax ;
+    int                             trace_degree ;
+    int                             trace_min_cluster ;
+    int                             trace_smooth_x ;
+    int                             trace_smooth_y ;
+    double                          trace_threshold ;
+    int                             trace_opening ;
+    cr2res_extr_method              extr_method ;
+    int                             extract_oversample ;
+    int                             extract_swath_width ;
+    int                             extract_height ;
+    double                          extract_smooth ;
+    int                             extract_nthreads ;
+    int                             reduce_order ;
+    int                             reduce_trace ;
+    hdrl_image                  **  master_flat ;
+    cpl_table                   **  trace_wave ;
+    cpl_table                   **  slit_func ;
+    cpl_table                   **  extract_1d ;
+    hdrl_image                  **  slit_model ;
+    cpl_image                   **  bpm ;
+    cpl_propertylist            **  ext_plist ;
+} cr2res_cal_flat_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -61,10 +98,8 @@ static int cr2res_cal_flat_compare(
 static int cr2res_cal_flat_reduce(
         const cpl_frameset  *   rawframes,
         const cpl_frame     *   tw_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
+        const cr2res_calib_context  *   calib,
         const cpl_frame     *   bpm_frame,
-        int                     calib_cosmics_corr,
         double                  bpm_low,
         double                  bpm_high,
         double                  bpm_linemax,
@@ -79,6 +114,7 @@ static int cr2res_cal_flat_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         int                     reduce_order,
         int                     reduce_trace,
@@ -89,6 +125,7 @@ static int cr2res_cal_flat_reduce(
         hdrl_image          **  slit_model,
         cpl_image           **  bpm,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_cal_flat_reduce_det(int det_nr, void * data) ;
 static int cr2res_cal_flat_create(cpl_plugin *);
 static int cr2res_cal_flat_exec(cpl_plugin *);
 static int cr2res_cal_flat_destroy(cpl_plugin *);
@@ -139,6 +176,8 @@ Flat                                                                    \n\
     CR2RES_CAL_FLAT_TW_MERGED_PROCATG "\n\
                                                                         \n\
   Algorithm                                                             \n\
+    loop on detectors d:                                                \n\
+      Load the calibrations of d                                        \n\
     group the input frames by different settings                        \n\
     loop on groups g:                                                   \n\
       loop on decker positions p:                                       \n\
@@ -163,7 +202,8 @@ Flat                                                                    \n\
                 on avg                                                  \n\
       For the following step, the computed TW is used if there is no    \n\
       input TW provided, the provided one is uѕed otherwise.            \n\
-      loop on the traces t:                                             \n\
+      cr2res_extract_traces() on the traces t (--extract_nthreads in    \n\
+        parallel), with e.g. --extract_method=OPT_CURV:                 \n\
         cr2res_extract_slitdec_curved(--extract_oversample,             \n\
                  --extract_swath_width, --extract_height,               \n\
                  --extract_smooth)                                      \n\
@@ -176,6 +216,8 @@ Flat                                                                    \n\
       store the qc parameters in the returned property list             \n\
                                                                         \n\
   Library functions uѕed:                                               \n\
+    cr2res_calib_context_new()                                          \n\
+    cr2res_calib_context_apply_imagelist()                              \n\
     cr2res_io_extract_decker_frameset()                                 \n\
     cr2res_trace()                                                      \n\
     cr2res_extract_slitdec_curved()                                     \n\
@@ -372,6 +414,14 @@ static int cr2res_cal_flat_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_flat.extract_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_cal_flat", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_cal_flat.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_cal_flat", 0);
@@ -451,8 +501,9 @@ static int cr2res_cal_flat(
     int                     calib_cosmics_corr, trace_degree, trace_min_cluster,
                             trace_opening,
                             extract_oversample, extract_swath_width,
-                            extract_height, reduce_det, reduce_order,
-                            reduce_trace, trace_smooth_x, trace_smooth_y ;
+                            extract_height, extract_nthreads, reduce_det,
+                            reduce_order, reduce_trace, trace_smooth_x,
+                            trace_smooth_y ;
     double                  bpm_low, bpm_high, bpm_lines_ratio,
                             trace_threshold, extract_smooth ;
     cr2res_extr_method      extr_method;
@@ -465,6 +516,7 @@ static int cr2res_cal_flat(
     const char          *   used_tag ;
     cpl_frameset        *   raw_one_setting ;
     cpl_frameset        *   raw_one_setting_decker ;
+    cr2res_calib_context    *   calib[CR2RES_NB_DETECTORS] ;
     cpl_size            *   labels ;
     cpl_size                nlabels ;
     cpl_propertylist    *   plist ;
@@ -482,6 +534,7 @@ static int cr2res_cal_flat(
     cpl_table           *   extract_1d[CR2RES_NB_DETECTORS] ;
     hdrl_image          *   slit_model[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpm[CR2RES_NB_DETECTORS] ;
+    cr2res_cal_flat_data    data ;
     char                *   out_file;
     int                     l, i, det_nr;
 
@@ -548,6 +601,9 @@ static int cr2res_cal_flat(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_flat.extract_smooth");
     extract_smooth = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_flat.extract_nthreads");
+    extract_nthreads = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_flat.detector");
     reduce_det = cpl_parameter_get_int(param);
@@ -591,6 +647,19 @@ static int cr2res_cal_flat(
         return -1 ;
     }
 
+    /* Load the calibrations once for all the settings and deckers */
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        calib[det_nr-1] = NULL ;
+        if (reduce_det != 0 && det_nr != reduce_det) continue ;
+        if ((calib[det_nr-1] = cr2res_calib_context_new(det_nr, 0,
+                        calib_cosmics_corr, NULL, master_dark_frame, 
+                        bpm_frame, detlin_frame)) == NULL) {
+            cpl_msg_warning(__func__,
+                    "Failed to load the calibrations of detector %d", det_nr);
+            cpl_error_reset() ;
+        }
+    }
+
     /* Loop on the settings */
     for (l=0 ; l<(int)nlabels ; l++) {
         /* Get the frames for the current setting */
@@ -625,45 +694,47 @@ static int cr2res_cal_flat(
             cpl_msg_info(__func__, "Reduce %s Frames", decker_desc[i]) ;
             cpl_msg_indent_more() ;
 
-            /* Loop on the detectors */
+            /* Initialise */
             for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-                /* Initialise */
                 master_flat[det_nr-1] = NULL ;
                 slit_func[det_nr-1] = NULL ;
                 extract_1d[det_nr-1] = NULL ;
                 slit_model[det_nr-1] = NULL ;
                 bpm[det_nr-1] = NULL ;
-
-                /* Compute only one detector */
-                if (reduce_det != 0 && det_nr != reduce_det) continue ;
-
-                cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-                cpl_msg_indent_more() ;
-
-                /* Call the reduction function */
-                if (cr2res_cal_flat_reduce(raw_one_setting_decker,
-                            trace_wave_frame, detlin_frame, master_dark_frame, 
-                            bpm_frame, calib_cosmics_corr, bpm_low, bpm_high, 
-                            bpm_lines_ratio, trace_degree, trace_min_cluster, 
-                            trace_smooth_x, trace_smooth_y, trace_threshold, 
-                            trace_opening, extr_method, extract_oversample, 
-                            extract_swath_width, extract_height, extract_smooth,
-                            det_nr, reduce_order, reduce_trace,
-                            &(master_flat[det_nr-1]),
-                            &(trace_wave[i][det_nr-1]),
-                            &(slit_func[det_nr-1]),
-                            &(extract_1d[det_nr-1]),
-                            &(slit_model[det_nr-1]),
-                            &(bpm[det_nr-1]),
-                            &(ext_plist[i][det_nr-1])) == -1) {
-                    cpl_msg_warning(__func__,
-                            "Failed to reduce detector %d of %s Frames",
-                            det_nr, decker_desc[i]);
-                    cpl_error_reset() ;
-                }
-                cpl_msg_indent_less() ;
             }
 
+            /* Reduce the detectors in parallel */
+            data.rawframes = raw_one_setting_decker ;
+            data.tw_frame = trace_wave_frame ;
+            data.calib = calib ;
+            data.bpm_frame = bpm_frame ;
+            data.bpm_low = bpm_low ;
+            data.bpm_high = bpm_high ;
+            data.bpm_linemax = bpm_lines_ratio ;
+            data.trace_degree = trace_degree ;
+            data.trace_min_cluster = trace_min_cluster ;
+            data.trace_smooth_x = trace_smooth_x ;
+            data.trace_smooth_y = trace_smooth_y ;
+            data.trace_threshold = trace_threshold ;
+            data.trace_opening = trace_opening ;
+            data.extr_method = extr_method ;
+            data.extract_oversample = extract_oversample ;
+            data.extract_swath_width = extract_swath_width ;
+            data.extract_height = extract_height ;
+            data.extract_smooth = extract_smooth ;
+            data.extract_nthreads = extract_nthreads ;
+            data.reduce_order = reduce_order ;
+            data.reduce_trace = reduce_trace ;
+            data.master_flat = master_flat ;
+            data.trace_wave = trace_wave[i] ;
+            data.slit_func = slit_func ;
+            data.extract_1d = extract_1d ;
+            data.slit_model = slit_model ;
+            data.bpm = bpm ;
+            data.ext_plist = ext_plist[i] ;
+            cr2res_reduce_detectors(cr2res_cal_flat_reduce_det, &data,
+                    reduce_det) ;
+
             /* Ѕave Products */
 
             /* SLIT_MODEL */
@@ -833,20 +904,51 @@ static int cr2res_cal_flat(
         cpl_msg_indent_less() ;
     }
     cpl_free(labels);
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++)
+        cr2res_calib_context_delete(calib[det_nr-1]) ;
     cpl_frameset_delete(rawframes) ;
 
     return (int)cpl_error_get_code();
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_cal_flat_data inputs and products
+  @return   0 if ok, -1 otherwise
+
+  The detectors without their calibrations are skipped.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_flat_reduce_det(int det_nr, void * data)
+{
+    cr2res_cal_flat_data    *   d = (cr2res_cal_flat_data *)data ;
+
+    if (d->calib[det_nr-1] == NULL) return 0 ;
+    return cr2res_cal_flat_reduce(d->rawframes, d->tw_frame,
+            d->calib[det_nr-1], d->bpm_frame, d->bpm_low, d->bpm_high,
+            d->bpm_linemax, d->trace_degree, d->trace_min_cluster,
+            d->trace_smooth_x, d->trace_smooth_y, d->trace_threshold,
+            d->trace_opening, d->extr_method, d->extract_oversample,
+            d->extract_swath_width, d->extract_height, d->extract_smooth,
+            d->extract_nthreads, det_nr, d->reduce_order, d->reduce_trace,
+            &(d->master_flat[det_nr-1]),
+            &(d->trace_wave[det_nr-1]),
+            &(d->slit_func[det_nr-1]),
+            &(d->extract_1d[det_nr-1]),
+            &(d->slit_model[det_nr-1]),
+            &(d->bpm[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief Compute the flat for 1 setting, 1 decker position, 1 detector
   @param rawframes          Input raw frames (same setting, same decker)
   @param tw_frame           Optional TW frame or NULL
-  @param detlin_frame       Associated detlin coefficients
-  @param master_dark_frame  Associated master dark
+  @param calib              The calibrations of the detector
   @param bpm_frame          Associated BPM
-  @param calib_cosmics_corr Flag to correct for cosmics
   @param bpm_low            Threshold for BPM detection
   @param bpm_high           Threshold for BPM detection
   @param bpm_linemax        Max fraction of BPM per line
@@ -861,6 +963,7 @@ static int cr2res_cal_flat(
   @param extract_swath_width Extraction related
   @param extract_height     Extraction related
   @param extract_smooth     Extraction related
+  @param extract_nthreads   Number of traces extracted in parallel
   @param reduce_det         The detector to compute
   @param reduce_order       The order to compute (-1 for all)
   @param reduce_trace       The trace to compute (-1 for all)
@@ -877,10 +980,8 @@ static int cr2res_cal_flat(
 static int cr2res_cal_flat_reduce(
         const cpl_frameset  *   rawframes,
         const cpl_frame     *   tw_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
+        const cr2res_calib_context  *   calib,
         const cpl_frame     *   bpm_frame,
-        int                     calib_cosmics_corr,
         double                  bpm_low,
         double                  bpm_high,
         double                  bpm_linemax,
@@ -895,6 +996,7 @@ static int cr2res_cal_flat_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         int                     reduce_order,
         int                     reduce_trace,
@@ -917,22 +1019,19 @@ static int cr2res_cal_flat_reduce(
     cpl_mask            *   bpm_flat ;
     cpl_table           *   computed_traces ;
     cpl_table           *   traces ;
-    cpl_bivector        **  spectrum ;
-    cpl_vector          **  slit_func_vec ;
     hdrl_image          *   model_master;
     cpl_table           *   slit_func_tab ;
     cpl_table           *   extract_tab ;
-    hdrl_image          *   model_tmp ;
     cpl_vector          *   dits ;
     int                 *   qc_order_nb ;
     double              *   qc_order_pos ;
     double                  qc_lamp_ints, qc_mean_level, qc_mean_flux,
                             qc_med_flux, qc_med_snr, qc_trace_centery ;
-    int                     i, j, badpix, ext_nr, nb_traces, order, trace_id,
-                            qc_overexposed, qc_nbbad, nbvals ;
+    int                     i, j, badpix, ext_nr, qc_overexposed,
+                            qc_nbbad, nbvals ;
 
     /* Check Inputs */
-    if (rawframes == NULL) return -1 ;
+    if (rawframes == NULL || calib == NULL) return -1 ;
     if (extr_method != CR2RES_EXTR_OPT_CURV && 
             extr_method != CR2RES_EXTR_SUM) {
         cpl_msg_error(__func__, "Failed to read the dits") ;
@@ -958,14 +1057,11 @@ static int cr2res_cal_flat_reduce(
 
     /* Calibrate the Data */
     cpl_msg_info(__func__, "Calibrate the input images") ;
-    cpl_msg_indent_more() ;
-    if ((imlist_calibrated = cr2res_calib_imagelist(imlist, reduce_det, 
-                    0, calib_cosmics_corr, NULL, master_dark_frame, bpm_frame, 
-                    detlin_frame, dits)) == NULL) {
+    if ((imlist_calibrated = cr2res_calib_context_apply_imagelist(calib, 
+                    imlist, dits)) == NULL) {
         cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
         cpl_vector_delete(dits) ;
         hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     } else {
         /* Replace the calibrated image in the list */
@@ -973,34 +1069,27 @@ static int cr2res_cal_flat_reduce(
         imlist = imlist_calibrated ;
     }
     cpl_vector_delete(dits) ;
-    cpl_msg_indent_less() ;
 
     /* Collapse */
     cpl_msg_info(__func__, "Collapse the input images") ;
-    cpl_msg_indent_more() ;
     if (hdrl_imagelist_collapse_mean(imlist, &collapsed, &contrib) !=
             CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse") ;
         hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
     hdrl_imagelist_delete(imlist) ;
     cpl_image_delete(contrib) ;
-    cpl_msg_indent_less() ;
 
     /* Compute traces */
     cpl_msg_info(__func__, "Compute the traces") ;
-    cpl_msg_indent_more() ;
     if ((computed_traces = cr2res_trace(hdrl_image_get_image(collapsed),
                     trace_smooth_x, trace_smooth_y, trace_threshold, 
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
         cpl_msg_error(__func__, "Failed compute the traces") ;
         hdrl_image_delete(collapsed) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
 
     /* Add The remaining Columns to the trace table */
     cr2res_trace_add_extra_columns(computed_traces, first_file, reduce_det) ;
@@ -1013,128 +1102,23 @@ static int cr2res_cal_flat_reduce(
         traces = cpl_table_duplicate(computed_traces) ;
     }
 
-    /* Extract */
-    nb_traces = cpl_table_get_nrow(traces) ;
-    spectrum = cpl_malloc(nb_traces * sizeof(cpl_bivector *)) ;
-    slit_func_vec = cpl_malloc(nb_traces * sizeof(cpl_vector *)) ;
-    model_master = hdrl_image_new(CR2RES_DETECTOR_SIZE, CR2RES_DETECTOR_SIZE) ;
-    hdrl_image_mul_scalar(model_master, (hdrl_value){0.0, 0.0}) ;
-
-    /* Loop over the traces and extract them */
+    /* Extract - the models are merged in the traces order */
     cpl_msg_info(__func__, "Extract the traces") ;
-    cpl_msg_indent_more() ;
-    for (i=0 ; i<nb_traces ; i++) {
-        /* Initialise */
-        slit_func_vec[i] = NULL ;
-        spectrum[i] = NULL ;
-        model_tmp = NULL ;
-
-        /* Get Order and trace id */
-        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
-        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
-
-        /* Check if this order needs to be skipped */
-        if (reduce_order > -1 && order != reduce_order) continue ;
-
-        /* Check if this trace needs to be skipped */
-        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
-
-        cpl_msg_info(__func__, "Process Order %d/Trace %d", order, trace_id) ;
-        cpl_msg_indent_more() ;
-
-        /* Call the Extraction */
-        if (extr_method == CR2RES_EXTR_SUM) {
-            if (cr2res_extract_sum_vert(collapsed, traces, order, trace_id, 
-                        extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
-                        &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_tmp = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_MEDIAN) {
-            if (cr2res_extract_median(collapsed, traces, order, trace_id, 
-                        extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
-                        &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (median-)extract the trace") ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_tmp = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_TILTSUM) {
-            if (cr2res_extract_sum_tilt(collapsed, traces, order, trace_id, 
-                        extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
-                        &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (tiltsum-)extract the trace") ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_tmp = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_VERT) {
-            if (cr2res_extract_slitdec_vert(collapsed, traces, NULL, order, 
-                        trace_id, extract_height, extract_swath_width, 
-                        extract_oversample, extract_smooth, 
-                        &(slit_func_vec[i]), &(spectrum[i]), &model_tmp) != 0) {
-                cpl_msg_error(__func__,
-                        "Cannot (slitdec-vert-) extract the trace") ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_tmp = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_CURV) {
-            if (cr2res_extract_slitdec_curved(collapsed, traces, NULL,order, 
-                        trace_id, extract_height, extract_swath_width, 
-                        extract_oversample, extract_smooth, 
-                        &(slit_func_vec[i]), &(spectrum[i]), &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (slitdec-) extract the trace") ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_tmp = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        }
-
-        /* Update the model global image */
-        if (model_tmp != NULL) {
-            hdrl_image_add_image(model_master, model_tmp) ;
-            hdrl_image_delete(model_tmp) ;
-        }
-        cpl_msg_indent_less() ;
-    }
-    cpl_msg_indent_less() ;
-
-    /* Create the slit_func_tab for the current detector */
-    slit_func_tab = cr2res_extract_SLITFUNC_create(slit_func_vec, traces) ;
-
-    /* Create the extracted_tab for the current detector */
-    extract_tab = cr2res_extract_EXTRACT1D_create(spectrum, traces) ;
-
-    /* Deallocate Vectors */
-    for (i=0 ; i<nb_traces ; i++) {
-        if (slit_func_vec[i] != NULL) cpl_vector_delete(slit_func_vec[i]) ;
-        if (spectrum[i] != NULL) cpl_bivector_delete(spectrum[i]) ;
+    if (cr2res_extract_traces(collapsed, traces, NULL, reduce_order,
+                reduce_trace, extr_method, extract_height,
+                extract_swath_width, extract_oversample, extract_smooth, 0, 0,
+                extract_nthreads, NULL, &extract_tab, &slit_func_tab,
+                &model_master, NULL) == -1) {
+        cpl_msg_error(__func__, "Failed to extract") ;
+        cpl_table_delete(traces) ;
+        hdrl_image_delete(collapsed) ;
+        cpl_table_delete(computed_traces) ;
+        return -1 ;
     }
-    cpl_free(spectrum) ;
-    cpl_free(slit_func_vec) ;
     cpl_table_delete(traces) ;
 
     /* Compute the Master flat */
     cpl_msg_info(__func__, "Compute the master flat") ;
-    cpl_msg_indent_more() ;
     if ((master_flat_loc = cr2res_master_flat(collapsed,
                     model_master, bpm_low, bpm_high, bpm_linemax,
                     &bpm_flat)) == NULL) {
@@ -1144,10 +1128,8 @@ static int cr2res_cal_flat_reduce(
         hdrl_image_delete(model_master) ;
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(computed_traces) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
     hdrl_image_delete(collapsed) ;
 
     /* Create BPM image */
@@ -1174,7 +1156,6 @@ static int cr2res_cal_flat_reduce(
         cpl_image_delete(bpm_im) ;
         cpl_mask_delete(bpm_flat) ;
         cpl_table_delete(computed_traces) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
 
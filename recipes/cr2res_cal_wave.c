@@ -48,6 +48,46 @@
 
 #define RECIPE_STRING "cr2res_cal_wave"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    const cpl_frame     *   detlin_frame ;
+    const cpl_frame     *   master_dark_frame ;
+    const cpl_frame     *   master_flat_frame ;
+    const cpl_frame     *   bpm_frame ;
+    const cpl_frame     *   trace_wave_frame ;
+    const cpl_frame     *   lines_frame ;
+    int                     reduce_order ;
+    int                     reduce_trace ;
+    cr2res_collapse         collapse ;
+    int                     ext_height ;
+    int                     ext_swath_width ;
+    int                     ext_oversample ;
+    double                  ext_smooth_slit ;
+    cr2res_wavecal_type     wavecal_type ;
+    int                     wl_degree ;
+    double                  wl_start ;
+    double                  wl_end ;
+    double                  wl_err ;
+    double                  wl_shift ;
+    int                     log_flag ;
+    int                     fallback_input_wavecal_flag ;
+    int                     keep_higher_degrees_flag ;
+    int                     clean_spectrum ;
+    int                     display ;
+    double                  display_wmin ;
+    double                  display_wmax ;
+    cpl_table           **  out_trace_wave ;
+    cpl_table           **  lines_diagnostics ;
+    cpl_table           **  out_extracted ;
+    hdrl_image          **  out_wave_map ;
+    cpl_propertylist    **  ext_plist ;
+} cr2res_cal_wave_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -92,6 +132,7 @@ static int cr2res_cal_wave_reduce(
         cpl_table           **  out_extracted,
         hdrl_image          **  out_wave_map,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_cal_wave_reduce_det(int det_nr, void * data) ;
 static int cr2res_cal_wave_create(cpl_plugin *);
 static int cr2res_cal_wave_exec(cpl_plugin *);
 static int cr2res_cal_wave_destroy(cpl_plugin *);
@@ -480,6 +521,7 @@ static int cr2res_cal_wave(
     cpl_table           *   out_extracted[CR2RES_NB_DETECTORS] ;
     hdrl_image          *   out_wave_map[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_cal_wave_data    data ;
     cpl_propertylist    *   plist ;
     char                *   setting_id ;
     int                     det_nr, order, i ;
@@ -678,34 +720,44 @@ static int cr2res_cal_wave(
                 cpl_table_new_column_array(out_trace_wave[det_nr-1],  
                         CR2RES_COL_WAVELENGTH_ERROR, CPL_TYPE_DOUBLE, 2) ;
             }
-            continue ;
         }
-
-        cpl_msg_info(__func__, "Process detector number %d", det_nr) ;
-        cpl_msg_indent_more() ;
-
-        /* Call the reduction function */
-        if (cr2res_cal_wave_reduce(rawframes, detlin_frame,
-                    master_dark_frame, master_flat_frame, bpm_frame,
-                    trace_wave_frame, lines_frame, det_nr, reduce_order,
-                    reduce_trace, collapse, ext_height, ext_swath_width,
-                    ext_oversample, ext_smooth_slit, wavecal_type, wl_degree, 
-                    wl_start, wl_end, wl_err, wl_shift, log_flag, 
-                    fallback_input_wavecal_flag,
-                    keep_higher_degrees_flag, clean_spectrum,
-                    display, display_wmin, 
-                    display_wmax, 
-                    &(out_trace_wave[det_nr-1]),
-                    &(lines_diagnostics[det_nr-1]),
-                    &(out_extracted[det_nr-1]),
-                    &(out_wave_map[det_nr-1]),
-                    &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
-            cpl_error_reset() ;
-        }
-        cpl_msg_indent_less() ;
     }
 
+    /* Reduce the detectors in parallel */
+    data.rawframes = rawframes ;
+    data.detlin_frame = detlin_frame ;
+    data.master_dark_frame = master_dark_frame ;
+    data.master_flat_frame = master_flat_frame ;
+    data.bpm_frame = bpm_frame ;
+    data.trace_wave_frame = trace_wave_frame ;
+    data.lines_frame = lines_frame ;
+    data.reduce_order = reduce_order ;
+    data.reduce_trace = reduce_trace ;
+    data.collapse = collapse ;
+    data.ext_height = ext_height ;
+    data.ext_swath_width = ext_swath_width ;
+    data.ext_oversample = ext_oversample ;
+    data.ext_smooth_slit = ext_smooth_slit ;
+    data.wavecal_type = wavecal_type ;
+    data.wl_degree = wl_degree ;
+    data.wl_start = wl_start ;
+    data.wl_end = wl_end ;
+    data.wl_err = wl_err ;
+    data.wl_shift = wl_shift ;
+    data.log_flag = log_flag ;
+    data.fallback_input_wavecal_flag = fallback_input_wavecal_flag ;
+    data.keep_higher_degrees_flag = keep_higher_degrees_flag ;
+    data.clean_spectrum = clean_spectrum ;
+    data.display = display ;
+    data.display_wmin = display_wmin ;
+    data.display_wmax = display_wmax ;
+    data.out_trace_wave = out_trace_wave ;
+    data.lines_diagnostics = lines_diagnostics ;
+    data.out_extracted = out_extracted ;
+    data.out_wave_map = out_wave_map ;
+    data.ext_plist = ext_plist ;
+    cr2res_reduce_detectors(cr2res_cal_wave_reduce_det, &data, reduce_det) ;
+
     /* Get the setting */
     plist = cpl_propertylist_load(cpl_frame_get_filename(
                 cpl_frameset_get_position(rawframes, 0)), 0) ;
@@ -779,6 +831,34 @@ static int cr2res_cal_wave(
     return (int)cpl_error_get_code();
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_cal_wave_data inputs and products
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_wave_reduce_det(int det_nr, void * data)
+{
+    cr2res_cal_wave_data    *   d = (cr2res_cal_wave_data *)data ;
+
+    return cr2res_cal_wave_reduce(d->rawframes, d->detlin_frame,
+            d->master_dark_frame, d->master_flat_frame, d->bpm_frame,
+            d->trace_wave_frame, d->lines_frame, det_nr, d->reduce_order,
+            d->reduce_trace, d->collapse, d->ext_height, d->ext_swath_width,
+            d->ext_oversample, d->ext_smooth_slit, d->wavecal_type,
+            d->wl_degree, d->wl_start, d->wl_end, d->wl_err, d->wl_shift,
+            d->log_flag, d->fallback_input_wavecal_flag,
+            d->keep_higher_degrees_flag, d->clean_spectrum, d->display,
+            d->display_wmin, d->display_wmax,
+            &(d->out_trace_wave[det_nr-1]),
+            &(d->lines_diagnostics[det_nr-1]),
+            &(d->out_extracted[det_nr-1]),
+            &(d->out_wave_map[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief Compute the Wavelength for a detector
@@ -920,11 +1000,9 @@ static int cr2res_cal_wave_reduce(
     contrib = NULL ;
     if (collapse == CR2RES_COLLAPSE_MEAN) {
         cpl_msg_info(__func__, "Collapse (Mean) the input frames") ;
-        cpl_msg_indent_more() ;
         hdrl_imagelist_collapse_mean(in_calib, &collapsed, &contrib) ;
     } else if (collapse == CR2RES_COLLAPSE_MEDIAN) {
         cpl_msg_info(__func__, "Collapse (Median) the input frames") ;
-        cpl_msg_indent_more() ;
         hdrl_imagelist_collapse_median(in_calib, &collapsed, &contrib) ;
     } else {
         /* Should never happen */
@@ -935,10 +1013,8 @@ static int cr2res_cal_wave_reduce(
     if (contrib != NULL) cpl_image_delete(contrib) ;
     if (cpl_error_get_code() != CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse: %d", cpl_error_get_code()) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
 
     /* Load the trace wave */
     cpl_msg_info(__func__, "Load the TRACE WAVE") ;
@@ -953,8 +1029,8 @@ static int cr2res_cal_wave_reduce(
     cpl_msg_info(__func__, "Spectra Extraction") ;
     if (cr2res_extract_traces(collapsed, tw_in, NULL, reduce_order, 
                 reduce_trace, CR2RES_EXTR_OPT_CURV, ext_height, ext_swath_width,
-                ext_oversample, ext_smooth_slit,
-                &extracted, &slit_func, &model_master) == -1) {
+                ext_oversample, ext_smooth_slit, 0, 0, 1, NULL,
+                &extracted, &slit_func, &model_master, NULL) == -1) {
         cpl_msg_error(__func__, "Failed to extract");
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(tw_in) ;
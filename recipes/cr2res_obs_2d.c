@@ -42,6 +42,21 @@
 
 #define RECIPE_STRING "cr2res_obs_2d"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions of one frame */
+typedef struct {
+    const cpl_frame             *   rawframe ;
+    const cpl_frame             *   trace_wave_frame ;
+    cr2res_calib_context        **  calib ;
+    int                             reduce_order ;
+    int                             reduce_trace ;
+    cpl_table                   **  extract ;
+    cpl_propertylist            **  ext_plist ;
+} cr2res_obs_2d_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -57,16 +72,13 @@ static int cr2res_obs_2d_check_inputs_validity(
 static int cr2res_obs_2d_reduce(
         const cpl_frame     *   rawframe,
         const cpl_frame     *   trace_wave_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
-        const cpl_frame     *   master_flat_frame,
-        const cpl_frame     *   bpm_frame,
-        int                     calib_cosmics_corr,
+        const cr2res_calib_context  *   calib,
         int                     reduce_det,
         int                     reduce_order,
         int                     reduce_trace,
         cpl_table           **  extract,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_obs_2d_reduce_det(int det_nr, void * data) ;
 
 static int cr2res_obs_2d_create(cpl_plugin *);
 static int cr2res_obs_2d_exec(cpl_plugin *);
@@ -104,6 +116,8 @@ static char cr2res_obs_2d_description[] = "\
     cr2res_obs_2d_extract.fits " CR2RES_OBS_2D_EXTRACT_PROCATG "        \n\
                                                                         \n\
   Algorithm                                                             \n\
+    loop on detectors d:                                                \n\
+      Load the calibrations of d                                        \n\
     loop on raw frames f:                                               \n\
       loop on detectors d:                                              \n\
         cr2res_obs_2d_reduce()                                          \n\
@@ -124,7 +138,8 @@ static char cr2res_obs_2d_description[] = "\
     cr2res_obs_2d_check_inputs_validity()                               \n\
     cr2res_pfits_get_dit()                                              \n\
     cr2res_io_load_image()                                              \n\
-    cr2res_calib_image()                                                \n\
+    cr2res_calib_context_new()                                          \n\
+    cr2res_calib_context_apply_image()                                  \n\
     cr2res_io_load_TRACE_WAVE()                                         \n\
     cr2res_extract2d_traces()                                           \n\
     cr2res_io_save_EXTRACT_2D()                                         \n\
@@ -288,6 +303,8 @@ static int cr2res_obs_2d(
     const cpl_frame     *   trace_wave_frame ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
     cpl_table           *   extract[CR2RES_NB_DETECTORS] ;
+    cr2res_calib_context    *   calib[CR2RES_NB_DETECTORS] ;
+    cr2res_obs_2d_data      data ;
     char                *   out_file;
     int                     i, det_nr; 
 
@@ -335,37 +352,41 @@ static int cr2res_obs_2d(
     
     cpl_msg_info(__func__, "TODO : Add support for SKY frames !") ;
 
+    /* Load the calibrations once for all the frames */
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        calib[det_nr-1] = NULL ;
+        if (reduce_det != 0 && det_nr != reduce_det) continue ;
+        if ((calib[det_nr-1] = cr2res_calib_context_new(det_nr, 0, 0,
+                        master_flat_frame, master_dark_frame, bpm_frame,
+                        detlin_frame)) == NULL) {
+            cpl_msg_warning(__func__,
+                    "Failed to load the calibrations of detector %d", det_nr);
+            cpl_error_reset() ;
+        }
+    }
+
     /* Loop on the RAW files */
     for (i=0 ; i<cpl_frameset_get_size(rawframes) ; i++) {
         
         /* Current frame */
         rawframe = cpl_frameset_get_position(rawframes, i);
 
-        /* Loop on the detectors */
+        /* Initialise */
         for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-            /* Initialise */
             extract[det_nr-1] = NULL ;
             ext_plist[det_nr-1] = NULL ;
-
-            /* Compute only one detector */
-            if (reduce_det != 0 && det_nr != reduce_det) continue ;
-        
-            cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-            cpl_msg_indent_more() ;
-            
-            /* Call the reduction function */
-            if (cr2res_obs_2d_reduce(rawframe, trace_wave_frame, detlin_frame, 
-                        master_dark_frame, master_flat_frame, bpm_frame,
-                        0, det_nr, reduce_order, reduce_trace,
-                        &(extract[det_nr-1]),
-                        &(ext_plist[det_nr-1])) == -1) {
-                cpl_msg_warning(__func__, "Failed to reduce detector %d", 
-                        det_nr);
-                cpl_error_reset() ;
-            }
-            cpl_msg_indent_less() ;
         }
 
+        /* Reduce the detectors in parallel */
+        data.rawframe = rawframe ;
+        data.trace_wave_frame = trace_wave_frame ;
+        data.calib = calib ;
+        data.reduce_order = reduce_order ;
+        data.reduce_trace = reduce_trace ;
+        data.extract = extract ;
+        data.ext_plist = ext_plist ;
+        cr2res_reduce_detectors(cr2res_obs_2d_reduce_det, &data, reduce_det) ;
+
         /* Ѕave Products */
 
         /* Extracted */
@@ -385,20 +406,39 @@ static int cr2res_obs_2d(
         }
         cpl_msg_indent_less() ;
     }
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++)
+        cr2res_calib_context_delete(calib[det_nr-1]) ;
     cpl_frameset_delete(rawframes) ;
     return (int)cpl_error_get_code();
 }
  
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_obs_2d_data inputs and products
+  @return   0 if ok, -1 otherwise
+
+  The detectors without their calibrations are skipped.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_obs_2d_reduce_det(int det_nr, void * data)
+{
+    cr2res_obs_2d_data  *   d = (cr2res_obs_2d_data *)data ;
+
+    if (d->calib[det_nr-1] == NULL) return 0 ;
+    return cr2res_obs_2d_reduce(d->rawframe, d->trace_wave_frame,
+            d->calib[det_nr-1], det_nr, d->reduce_order, d->reduce_trace,
+            &(d->extract[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief  Execute the 2d observation on one detector
   @param rawframe               Raw science frame
   @param trace_wave_frame       Trace Wave file
-  @param detlin_frame           Associated detlin coefficients
-  @param master_dark_frame      Associated master dark
-  @param master_flat_frame      Associated master flat
-  @param bpm_frame              Associated BPM
-  @param calib_cosmics_corr     Flag to correct for cosmics
+  @param calib                  The calibrations of the detector
   @param reduce_det             The detector to compute
   @param reduce_order           The order to reduce (-1 for all)
   @param reduce_trace           The trace to reduce (-1 for all)
@@ -410,11 +450,7 @@ static int cr2res_obs_2d(
 static int cr2res_obs_2d_reduce(
         const cpl_frame     *   rawframe,
         const cpl_frame     *   trace_wave_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
-        const cpl_frame     *   master_flat_frame,
-        const cpl_frame     *   bpm_frame,
-        int                     calib_cosmics_corr,
+        const cr2res_calib_context  *   calib,
         int                     reduce_det,
         int                     reduce_order,
         int                     reduce_trace,
@@ -435,7 +471,7 @@ static int cr2res_obs_2d_reduce(
 
     /* Check Inputs */
     if (extract == NULL || ext_plist == NULL || rawframe == NULL || 
-            trace_wave_frame == NULL) return -1 ;
+            trace_wave_frame == NULL || calib == NULL) return -1 ;
 
     /* Check raw frames consistency */
     if (cr2res_obs_2d_check_inputs_validity(rawframe) != 1) {
@@ -476,8 +512,7 @@ static int cr2res_obs_2d_reduce(
     }
 
     /* Calibrate the image */
-    if ((in_calib = cr2res_calib_image(in, reduce_det, 0, 0, master_flat_frame,
-            master_dark_frame, bpm_frame, detlin_frame, dit)) == NULL) {
+    if ((in_calib = cr2res_calib_context_apply_image(calib, in, dit)) == NULL) {
         cpl_msg_error(__func__, "Failed to apply the calibrations") ;
         hdrl_image_delete(in) ;
         return -1 ;
@@ -45,6 +45,43 @@
 
 #define RECIPE_STRING "cr2res_obs_nodding"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    const cpl_frameset  *   raw_flat_frames ;
+    const cpl_frame     *   trace_wave_frame ;
+    const cpl_frame     *   detlin_frame ;
+    const cpl_frame     *   master_dark_frame ;
+    const cpl_frame     *   master_flat_frame ;
+    const cpl_frame     *   bpm_frame ;
+    const cpl_frame     *   photo_flux_frame ;
+    int                     type ;
+    int                     nodding_invert ;
+    int                     extract_oversample ;
+    int                     extract_swath_width ;
+    int                     extract_height ;
+    double                  extract_smooth ;
+    int                     extract_warm_start ;
+    int                     extract_single_prec ;
+    int                     extract_nthreads ;
+    int                     disp_order_idx ;
+    int                     disp_trace ;
+    hdrl_image          **  combineda ;
+    cpl_table           **  extracta ;
+    cpl_table           **  slitfunca ;
+    hdrl_image          **  modela ;
+    hdrl_image          **  combinedb ;
+    cpl_table           **  extractb ;
+    cpl_table           **  slitfuncb ;
+    hdrl_image          **  modelb ;
+    cpl_table           **  throughput ;
+    cpl_propertylist    **  ext_plist ;
+} cr2res_obs_nodding_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -74,6 +111,9 @@ static int cr2res_obs_nodding_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_warm_start,
+        int                     extract_single_prec,
+        int                     extract_nthreads,
         int                     reduce_det,
         hdrl_image          **  combineda,
         cpl_table           **  extracta,
@@ -84,6 +124,7 @@ static int cr2res_obs_nodding_reduce(
         cpl_table           **  slitfuncb,
         hdrl_image          **  modelb,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_obs_nodding_reduce_det(int det_nr, void * data) ;
 
 static int cr2res_obs_nodding_create(cpl_plugin *);
 static int cr2res_obs_nodding_exec(cpl_plugin *);
@@ -308,6 +349,30 @@ static int cr2res_obs_nodding_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.extract_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_obs_nodding", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.extract_warm_start",
+            CPL_TYPE_BOOL,
+            "Start each swath from the previous swath solution",
+            "cr2res.cr2res_obs_nodding", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_warm_start");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.extract_single_prec",
+            CPL_TYPE_BOOL,
+            "Single precision slit decomposition weights",
+            "cr2res.cr2res_obs_nodding", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_single_prec");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_obs_nodding", 0);
@@ -385,9 +450,10 @@ static int cr2res_obs_nodding(
 {
     const cpl_parameter *   param ;
     int                     extract_oversample, extract_swath_width,
-                            extract_height, reduce_det, ndit, nexp,
+                            extract_height, extract_nthreads, reduce_det,
+                            extract_warm_start, extract_single_prec,
                             disp_order_idx, disp_trace, nodding_invert ;
-    double                  extract_smooth, ra, dec, dit, gain ;
+    double                  extract_smooth ;
     cpl_frameset        *   rawframes ;
     cpl_frameset        *   raw_flat_frames ;
     const cpl_frame     *   trace_wave_frame ;
@@ -405,14 +471,11 @@ static int cr2res_obs_nodding(
     cpl_table           *   slitfuncb[CR2RES_NB_DETECTORS] ;
     hdrl_image          *   modelb[CR2RES_NB_DETECTORS] ;
     cpl_table           *   throughput[CR2RES_NB_DETECTORS] ;
-    cpl_propertylist    *   plist ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_obs_nodding_data data ;
     char                *   out_file;
     int                     i, det_nr, type; 
 
-    /* Initialise */
-    gain = 0.0 ;
-
     /* RETRIEVE INPUT PARAMETERS */
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.nodding_invert");
@@ -429,6 +492,15 @@ static int cr2res_obs_nodding(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.extract_smooth");
     extract_smooth = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_nodding.extract_nthreads");
+    extract_nthreads = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_nodding.extract_warm_start");
+    extract_warm_start = cpl_parameter_get_bool(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_nodding.extract_single_prec");
+    extract_single_prec = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.detector");
     reduce_det = cpl_parameter_get_int(param);
@@ -472,9 +544,8 @@ static int cr2res_obs_nodding(
     /* Get the RAW flat frames */
     raw_flat_frames = cr2res_extract_frameset(frameset, CR2RES_FLAT_RAW) ;
 
-    /* Loop on the detectors */
+    /* Initialise */
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-        /* Initialise */
         combineda[det_nr-1] = NULL ;
         extracta[det_nr-1] = NULL ;
         slitfunca[det_nr-1] = NULL ;
@@ -485,69 +556,40 @@ static int cr2res_obs_nodding(
         modelb[det_nr-1] = NULL ;
         ext_plist[det_nr-1] = NULL ;
         throughput[det_nr-1] = NULL ;
-
-        /* Compute only one detector */
-        if (reduce_det != 0 && det_nr != reduce_det) continue ;
-    
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
-
-        /* Call the reduction function */
-        if (cr2res_obs_nodding_reduce(rawframes, raw_flat_frames, 
-                    trace_wave_frame, detlin_frame, master_dark_frame, 
-                    master_flat_frame, bpm_frame, nodding_invert, 0, 
-                    extract_oversample, extract_swath_width, extract_height, 
-                    extract_smooth, det_nr,
-                    &(combineda[det_nr-1]),
-                    &(extracta[det_nr-1]),
-                    &(slitfunca[det_nr-1]),
-                    &(modela[det_nr-1]),
-                    &(combinedb[det_nr-1]),
-                    &(extractb[det_nr-1]),
-                    &(slitfuncb[det_nr-1]),
-                    &(modelb[det_nr-1]),
-                    &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
-            cpl_error_reset() ;
-        } else if (type == 2) {
-            cpl_msg_info(__func__,
-                    "Sensitivity / Conversion / Throughput computation") ;
-            cpl_msg_indent_more() ;
-
-            /* Define the gain */
-            if (det_nr==1) gain = CR2RES_GAIN_CHIP1 ;
-            if (det_nr==2) gain = CR2RES_GAIN_CHIP2 ;
-            if (det_nr==3) gain = CR2RES_GAIN_CHIP3 ;
-
-            /* Get the RA and DEC observed */
-            plist=cpl_propertylist_load(cpl_frame_get_filename(
-                        cpl_frameset_get_position_const(rawframes, 0)), 0) ;
-            ra = cr2res_pfits_get_ra(plist) ;
-            dec = cr2res_pfits_get_dec(plist) ;
-            dit = cr2res_pfits_get_dit(plist) ;
-            ndit = cr2res_pfits_get_ndit(plist) ;
-            nexp = cr2res_pfits_get_nexp(plist) ;
-            cpl_propertylist_delete(plist) ;
-            if (cpl_error_get_code()) {
-                cpl_msg_indent_less() ;
-                cpl_error_reset() ;
-                cpl_msg_warning(__func__, "Missing Header Informations") ;
-            } else {
-                /* Compute the photometry */
-                if (cr2res_photom_engine(extracta[det_nr-1],
-                            cpl_frame_get_filename(photo_flux_frame),
-                            ra, dec, gain, dit*ndit*nexp, disp_order_idx,
-                            disp_trace, &(throughput[det_nr-1]))) {
-                    cpl_msg_warning(__func__, 
-                            "Failed to reduce detector %d", det_nr);
-                    cpl_error_reset() ;
-                }
-            }
-            cpl_msg_indent_less() ;
-        }
-        cpl_msg_indent_less() ;
     }
 
+    /* Reduce the detectors in parallel */
+    data.rawframes = rawframes ;
+    data.raw_flat_frames = raw_flat_frames ;
+    data.trace_wave_frame = trace_wave_frame ;
+    data.detlin_frame = detlin_frame ;
+    data.master_dark_frame = master_dark_frame ;
+    data.master_flat_frame = master_flat_frame ;
+    data.bpm_frame = bpm_frame ;
+    data.photo_flux_frame = photo_flux_frame ;
+    data.type = type ;
+    data.nodding_invert = nodding_invert ;
+    data.extract_oversample = extract_oversample ;
+    data.extract_swath_width = extract_swath_width ;
+    data.extract_height = extract_height ;
+    data.extract_smooth = extract_smooth ;
+    data.extract_warm_start = extract_warm_start ;
+    data.extract_single_prec = extract_single_prec ;
+    data.extract_nthreads = extract_nthreads ;
+    data.disp_order_idx = disp_order_idx ;
+    data.disp_trace = disp_trace ;
+    data.combineda = combineda ;
+    data.extracta = extracta ;
+    data.slitfunca = slitfunca ;
+    data.modela = modela ;
+    data.combinedb = combinedb ;
+    data.extractb = extractb ;
+    data.slitfuncb = slitfuncb ;
+    data.modelb = modelb ;
+    data.throughput = throughput ;
+    data.ext_plist = ext_plist ;
+    cr2res_reduce_detectors(cr2res_obs_nodding_reduce_det, &data, reduce_det);
+
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_combinedA.fits", RECIPE_STRING) ;
     cr2res_io_save_COMBINED(out_file, frameset, rawframes, parlist,
@@ -630,6 +672,78 @@ static int cr2res_obs_nodding(
     return (int)cpl_error_get_code();
 }
  
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_obs_nodding_data inputs and products
+  @return   0 if ok, -1 otherwise
+
+  The throughput of the standard stars is computed after the reduction.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_obs_nodding_reduce_det(int det_nr, void * data)
+{
+    cr2res_obs_nodding_data *   d = (cr2res_obs_nodding_data *)data ;
+    cpl_propertylist        *   plist ;
+    double                      ra, dec, dit, gain ;
+    int                         ndit, nexp ;
+
+    /* Call the reduction function */
+    if (cr2res_obs_nodding_reduce(d->rawframes, d->raw_flat_frames, 
+                d->trace_wave_frame, d->detlin_frame, d->master_dark_frame, 
+                d->master_flat_frame, d->bpm_frame, d->nodding_invert, 0, 
+                d->extract_oversample, d->extract_swath_width,
+                d->extract_height, d->extract_smooth, d->extract_warm_start,
+                d->extract_single_prec, d->extract_nthreads, det_nr,
+                &(d->combineda[det_nr-1]),
+                &(d->extracta[det_nr-1]),
+                &(d->slitfunca[det_nr-1]),
+                &(d->modela[det_nr-1]),
+                &(d->combinedb[det_nr-1]),
+                &(d->extractb[det_nr-1]),
+                &(d->slitfuncb[det_nr-1]),
+                &(d->modelb[det_nr-1]),
+                &(d->ext_plist[det_nr-1])) == -1) {
+        return -1 ;
+    }
+    if (d->type != 2) return 0 ;
+
+    cpl_msg_info(__func__,
+            "Sensitivity / Conversion / Throughput computation") ;
+
+    /* Define the gain */
+    gain = 0.0 ;
+    if (det_nr==1) gain = CR2RES_GAIN_CHIP1 ;
+    if (det_nr==2) gain = CR2RES_GAIN_CHIP2 ;
+    if (det_nr==3) gain = CR2RES_GAIN_CHIP3 ;
+
+    /* Get the RA and DEC observed */
+    plist=cpl_propertylist_load(cpl_frame_get_filename(
+                cpl_frameset_get_position_const(d->rawframes, 0)), 0) ;
+    ra = cr2res_pfits_get_ra(plist) ;
+    dec = cr2res_pfits_get_dec(plist) ;
+    dit = cr2res_pfits_get_dit(plist) ;
+    ndit = cr2res_pfits_get_ndit(plist) ;
+    nexp = cr2res_pfits_get_nexp(plist) ;
+    cpl_propertylist_delete(plist) ;
+    if (cpl_error_get_code()) {
+        cpl_error_reset() ;
+        cpl_msg_warning(__func__, "Missing Header Informations") ;
+    } else {
+        /* Compute the photometry */
+        if (cr2res_photom_engine(d->extracta[det_nr-1],
+                    cpl_frame_get_filename(d->photo_flux_frame),
+                    ra, dec, gain, dit*ndit*nexp, d->disp_order_idx,
+                    d->disp_trace, &(d->throughput[det_nr-1]))) {
+            cpl_msg_warning(__func__, 
+                    "Failed to reduce detector %d", det_nr);
+            cpl_error_reset() ;
+        }
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Execute the science recipe on a specific detector
@@ -646,6 +760,9 @@ static int cr2res_obs_nodding(
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_warm_start     Flag to start swaths from the previous one
+  @param extract_single_prec    Flag for single precision geometry weights
+  @param extract_nthreads       Number of traces extracted in parallel
   @param reduce_det             The detector to compute
   @param combineda              [out] Combined image (A)
   @param extracta               [out] extracted spectrum (A)
@@ -673,6 +790,9 @@ static int cr2res_obs_nodding_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_warm_start,
+        int                     extract_single_prec,
+        int                     extract_nthreads,
         int                     reduce_det,
         hdrl_image          **  combineda,
         cpl_table           **  extracta,
@@ -828,13 +948,11 @@ static int cr2res_obs_nodding_reduce(
     
     /* Collapse A-B and B-A */
     cpl_msg_info(__func__, "Collapse A-B and B-A") ;
-    cpl_msg_indent_more() ;
     if (hdrl_imagelist_collapse_mean(diff_a, &collapsed_a, &contrib_a) !=
             CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse A-B") ;
         hdrl_imagelist_delete(diff_a) ;
         hdrl_imagelist_delete(diff_b) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
     cpl_image_delete(contrib_a) ;
@@ -844,12 +962,10 @@ static int cr2res_obs_nodding_reduce(
         cpl_msg_error(__func__, "Failed to Collapse B-A") ;
         hdrl_imagelist_delete(diff_b) ;
         hdrl_image_delete(collapsed_a) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
     cpl_image_delete(contrib_b) ;
     hdrl_imagelist_delete(diff_b) ;
-    cpl_msg_indent_less() ;
 
     /* Load the trace wave */
     cpl_msg_info(__func__, "Load the TRACE WAVE") ;
@@ -864,7 +980,6 @@ static int cr2res_obs_nodding_reduce(
     /* Correct trace_wave with some provided raw flats */
     if (raw_flat_frames != NULL) {
         cpl_msg_info(__func__, "Try to correct the reproducibility error") ;
-        cpl_msg_indent_more() ;
         trace_wave_corrected = cr2res_trace_adjust(trace_wave, raw_flat_frames, 
                 reduce_det) ;
         if (trace_wave_corrected != NULL) {
@@ -872,7 +987,6 @@ static int cr2res_obs_nodding_reduce(
             trace_wave = trace_wave_corrected ;
             trace_wave_corrected = NULL ;
         }
-        cpl_msg_indent_less() ;
     }
 
     /* Compute the slit fractions for A and B positions extraction */   
@@ -983,8 +1097,9 @@ static int cr2res_obs_nodding_reduce(
     cpl_msg_info(__func__, "Spectra Extraction") ;
     if (cr2res_extract_traces(collapsed_a, trace_wave_a, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
-                extract_oversample, extract_smooth,
-                &extracted_a, &slit_func_a, &model_master_a) == -1) {
+                extract_oversample, extract_smooth, extract_warm_start,
+                extract_single_prec, extract_nthreads, NULL,
+                &extracted_a, &slit_func_a, &model_master_a, NULL) == -1) {
         cpl_msg_error(__func__, "Failed to extract A");
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
@@ -996,8 +1111,9 @@ static int cr2res_obs_nodding_reduce(
     /* TODO : Save trace_wave_a and b as products */
     if (cr2res_extract_traces(collapsed_b, trace_wave_b, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
-                extract_oversample, extract_smooth,
-                &extracted_b, &slit_func_b, &model_master_b) == -1) {
+                extract_oversample, extract_smooth, extract_warm_start,
+                extract_single_prec, extract_nthreads, NULL,
+                &extracted_b, &slit_func_b, &model_master_b, NULL) == -1) {
         cpl_msg_error(__func__, "Failed to extract B");
         cpl_table_delete(extracted_a) ;
         cpl_table_delete(slit_func_a) ;
@@ -46,6 +46,30 @@
 
 #define RECIPE_STRING "cr2res_obs_pol"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    const cpl_frameset  *   raw_flat_frames ;
+    const cpl_frame     *   trace_wave_frame ;
+    const cpl_frame     *   detlin_frame ;
+    const cpl_frame     *   master_dark_frame ;
+    const cpl_frame     *   master_flat_frame ;
+    const cpl_frame     *   bpm_frame ;
+    int                     extract_oversample ;
+    int                     extract_swath_width ;
+    int                     extract_height ;
+    double                  extract_smooth ;
+    int                     extract_cache_size ;
+    cpl_table           **  pol_speca ;
+    cpl_table           **  pol_specb ;
+    cpl_propertylist    **  ext_plista ;
+    cpl_propertylist    **  ext_plistb ;
+} cr2res_obs_pol_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -75,6 +99,7 @@ static int cr2res_obs_pol_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_cache_size,
         int                     reduce_det,
         cpl_table           **  pol_spec_a,
         cpl_table           **  pol_spec_b,
@@ -84,18 +109,17 @@ static int cr2res_obs_pol_reduce_one(
         const cpl_frameset  *   rawframes,
         const cpl_frameset  *   raw_flat_frames,
         const cpl_frame     *   trace_wave_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
-        const cpl_frame     *   master_flat_frame,
-        const cpl_frame     *   bpm_frame,
+        const cr2res_calib_context  *   calib,
         int                     calib_cosmics_corr,
         int                     extract_oversample,
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_cache_size,
         int                     reduce_det,
         cpl_table           **  pol_spec,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_obs_pol_reduce_det(int det_nr, void * data) ;
 static int cr2res_obs_pol_create(cpl_plugin *);
 static int cr2res_obs_pol_exec(cpl_plugin *);
 static int cr2res_obs_pol_destroy(cpl_plugin *);
@@ -189,7 +213,8 @@ Polarimetry Observation                                                 \n\
     cr2res_io_read_dits()                                               \n\
     cr2res_io_read_decker_positions()                                   \n\
     cr2res_io_load_image_list_from_set()                                \n\
-    cr2res_calib_imagelist()                                            \n\
+    cr2res_calib_context_new()                                          \n\
+    cr2res_calib_context_apply_imagelist()                              \n\
     cr2res_io_load_TRACE_WAVE()                                         \n\
     cr2res_pol_sort_frames()                                            \n\
     cr2res_trace_slit_fraction_create()                                 \n\
@@ -303,6 +328,15 @@ static int cr2res_obs_pol_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_pol.extract_cache_size",
+            CPL_TYPE_INT,
+            "Memory for the extraction geometry shared by the frames, in MB "
+            "(0 to recompute it for each frame)",
+            "cr2res.cr2res_obs_pol", 1024);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_cache_size");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_pol.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_obs_pol", 0);
@@ -366,7 +400,7 @@ static int cr2res_obs_pol(
 {
     const cpl_parameter *   param ;
     int                     extract_oversample, extract_swath_width,
-                            extract_height, reduce_det ;
+                            extract_height, extract_cache_size, reduce_det ;
     double                  extract_smooth ;
     cpl_frameset        *   rawframes ;
     cpl_frameset        *   raw_flat_frames ;
@@ -379,6 +413,7 @@ static int cr2res_obs_pol(
     cpl_table           *   pol_specb[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plista[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plistb[CR2RES_NB_DETECTORS] ;
+    cr2res_obs_pol_data     data ;
     char                *   out_file;
     int                     i, det_nr; 
 
@@ -397,6 +432,9 @@ static int cr2res_obs_pol(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_pol.extract_smooth");
     extract_smooth = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_pol.extract_cache_size");
+    extract_cache_size = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_pol.detector");
     reduce_det = cpl_parameter_get_int(param);
@@ -433,35 +471,33 @@ static int cr2res_obs_pol(
     /* Get the RAW flat frames */
     raw_flat_frames = cr2res_extract_frameset(frameset, CR2RES_FLAT_RAW) ;
 
-    /* Loop on the detectors */
+    /* Initialise */
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-        /* Initialise */
         pol_speca[det_nr-1] = NULL ;
         pol_specb[det_nr-1] = NULL ;
         ext_plista[det_nr-1] = NULL ;
         ext_plistb[det_nr-1] = NULL ;
-
-        /* Compute only one detector */
-        if (reduce_det != 0 && det_nr != reduce_det) continue ;
-    
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
-
-        /* Call the reduction function */
-        if (cr2res_obs_pol_reduce(rawframes, raw_flat_frames, trace_wave_frame, 
-                    detlin_frame, master_dark_frame, master_flat_frame, 
-                    bpm_frame, 0, extract_oversample, extract_swath_width, 
-                    extract_height, extract_smooth, det_nr,
-                    &(pol_speca[det_nr-1]),
-                    &(pol_specb[det_nr-1]),
-                    &(ext_plista[det_nr-1]),
-                    &(ext_plistb[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
-            cpl_error_reset() ;
-        }
-        cpl_msg_indent_less() ;
     }
 
+    /* Reduce the detectors in parallel */
+    data.rawframes = rawframes ;
+    data.raw_flat_frames = raw_flat_frames ;
+    data.trace_wave_frame = trace_wave_frame ;
+    data.detlin_frame = detlin_frame ;
+    data.master_dark_frame = master_dark_frame ;
+    data.master_flat_frame = master_flat_frame ;
+    data.bpm_frame = bpm_frame ;
+    data.extract_oversample = extract_oversample ;
+    data.extract_swath_width = extract_swath_width ;
+    data.extract_height = extract_height ;
+    data.extract_smooth = extract_smooth ;
+    data.extract_cache_size = extract_cache_size ;
+    data.pol_speca = pol_speca ;
+    data.pol_specb = pol_specb ;
+    data.ext_plista = ext_plista ;
+    data.ext_plistb = ext_plistb ;
+    cr2res_reduce_detectors(cr2res_obs_pol_reduce_det, &data, reduce_det) ;
+
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_pol_specA.fits", RECIPE_STRING) ;
     cr2res_io_save_POL_SPEC(out_file, frameset, rawframes, parlist,
@@ -492,6 +528,29 @@ static int cr2res_obs_pol(
     return (int)cpl_error_get_code();
 }
  
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_obs_pol_data inputs and products
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_obs_pol_reduce_det(int det_nr, void * data)
+{
+    cr2res_obs_pol_data *   d = (cr2res_obs_pol_data *)data ;
+
+    return cr2res_obs_pol_reduce(d->rawframes, d->raw_flat_frames,
+            d->trace_wave_frame, d->detlin_frame, d->master_dark_frame,
+            d->master_flat_frame, d->bpm_frame, 0, d->extract_oversample,
+            d->extract_swath_width, d->extract_height, d->extract_smooth,
+            d->extract_cache_size, det_nr,
+            &(d->pol_speca[det_nr-1]),
+            &(d->pol_specb[det_nr-1]),
+            &(d->ext_plista[det_nr-1]),
+            &(d->ext_plistb[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Execute the polarimetry recipe on a specific detector
@@ -507,6 +566,7 @@ static int cr2res_obs_pol(
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_cache_size     Extraction geometry cache size in MB (0: none)
   @param reduce_det             The detector to compute
   @param pol_speca              [out] polarimetry spectrum (A)
   @param pol_specb              [out] polarimetry spectrum (B)
@@ -528,6 +588,7 @@ static int cr2res_obs_pol_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_cache_size,
         int                     reduce_det,
         cpl_table           **  pol_speca,
         cpl_table           **  pol_specb,
@@ -541,6 +602,7 @@ static int cr2res_obs_pol_reduce(
     cpl_table           *   pol_specb_loc ;
     cpl_propertylist    *   ext_plista_loc ;
     cpl_propertylist    *   ext_plistb_loc ;
+    cr2res_calib_context    *   calib ;
     int                     i ;
 
     /* Check Inputs */
@@ -568,31 +630,38 @@ static int cr2res_obs_pol_reduce(
     }
     cpl_free(nod_positions) ;    
 
+    /* Load the calibrations once for both nodding positions */
+    if ((calib = cr2res_calib_context_new(reduce_det, 0, 0,
+                    master_flat_frame, master_dark_frame, bpm_frame,
+                    detlin_frame)) == NULL) {
+        cpl_msg_error(__func__, "Failed to load the calibrations") ;
+        if (rawframes_a != NULL) cpl_frameset_delete(rawframes_a);
+        if (rawframes_b != NULL) cpl_frameset_delete(rawframes_b);
+        return -1 ;
+    }
+
     /* Reduce A position */
     cpl_msg_info(__func__, "Compute Polarimetry for nodding A position") ;
-    cpl_msg_indent_more() ;
     if (cr2res_obs_pol_reduce_one(rawframes_a, raw_flat_frames, 
-                trace_wave_frame, detlin_frame, master_dark_frame, 
-                master_flat_frame, bpm_frame, 0, extract_oversample, 
-                extract_swath_width, extract_height, extract_smooth, reduce_det,
+                trace_wave_frame, calib, 0, extract_oversample, 
+                extract_swath_width, extract_height, extract_smooth,
+                extract_cache_size, reduce_det,
                 &pol_speca_loc, &ext_plista_loc) == -1) {
         cpl_msg_error(__func__, "Failed to Reduce A nodding frames") ;
     }
-    cpl_msg_indent_less() ;
     if (rawframes_a != NULL) cpl_frameset_delete(rawframes_a);
 
     /* Reduce B position */
     cpl_msg_info(__func__, "Compute Polarimetry for nodding B position") ;
-    cpl_msg_indent_more() ;
     if (cr2res_obs_pol_reduce_one(rawframes_b, raw_flat_frames, 
-                trace_wave_frame, detlin_frame, master_dark_frame, 
-                master_flat_frame, bpm_frame, 0, extract_oversample, 
-                extract_swath_width, extract_height, extract_smooth, reduce_det,
+                trace_wave_frame, calib, 0, extract_oversample, 
+                extract_swath_width, extract_height, extract_smooth,
+                extract_cache_size, reduce_det,
                 &pol_specb_loc, &ext_plistb_loc) == -1) {
         cpl_msg_error(__func__, "Failed to Reduce B nodding frames") ;
     }
-    cpl_msg_indent_less() ;
     if (rawframes_b != NULL) cpl_frameset_delete(rawframes_b);
+    cr2res_calib_context_delete(calib) ;
 
     *pol_speca = pol_speca_loc ;
     *pol_specb = pol_specb_loc ;
@@ -607,15 +676,13 @@ static int cr2res_obs_pol_reduce(
   @param rawframes              Raw science frames for 1 position
   @param raw_flat_frames        Raw flat frames 
   @param trace_wave_frame       Trace Wave file
-  @param detlin_frame           Associated detlin coefficients
-  @param master_dark_frame      Associated master dark
-  @param master_flat_frame      Associated master flat
-  @param bpm_frame              Associated BPM
+  @param calib                  The calibrations of the detector
   @param calib_cosmics_corr     Flag to correct for cosmics
   @param extract_oversample     Extraction related
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_cache_size     Extraction geometry cache size in MB (0: none)
   @param reduce_det             The detector to compute
   @param pol_spec               [out] polarimetry spectrum
   @param ext_plist              [out] the header for saving the products
@@ -626,15 +693,13 @@ static int cr2res_obs_pol_reduce_one(
         const cpl_frameset  *   rawframes,
         const cpl_frameset  *   raw_flat_frames,
         const cpl_frame     *   trace_wave_frame,
-        const cpl_frame     *   detlin_frame,
-        const cpl_frame     *   master_dark_frame,
-        const cpl_frame     *   master_flat_frame,
-        const cpl_frame     *   bpm_frame,
+        const cr2res_calib_context  *   calib,
         int                     calib_cosmics_corr,
         int                     extract_oversample,
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_cache_size,
         int                     reduce_det,
         cpl_table           **  pol_spec,
         cpl_propertylist    **  ext_plist)
@@ -652,6 +717,7 @@ static int cr2res_obs_pol_reduce_one(
     char                *   decker_name ;
     cpl_table           *   slit_func ;
     hdrl_image          *   model_master ;
+    cr2res_extract_geom_cache   *   geom_cache ;
     cpl_table           **  pol_spec_one_group ;
     cpl_table           **  extract_1d ;
     char                *   colname ;
@@ -709,8 +775,10 @@ static int cr2res_obs_pol_reduce_one(
     }
 
     /* Load the DITs if necessary */
-    if (master_dark_frame != NULL)  dits = cr2res_io_read_dits(rawframes) ;
-    else                            dits = NULL ;
+    if (cr2res_calib_context_needs_dits(calib))
+        dits = cr2res_io_read_dits(rawframes) ;
+    else
+        dits = NULL ;
     if (cpl_msg_get_level() == CPL_MSG_DEBUG && dits != NULL) 
         cpl_vector_dump(dits, stdout) ;
 
@@ -740,9 +808,8 @@ static int cr2res_obs_pol_reduce_one(
 
     /* Calibrate the images */
     cpl_msg_info(__func__, "Apply the calibrations") ;
-    if ((in_calib = cr2res_calib_imagelist(in, reduce_det, 0, 0, 
-                    master_flat_frame, master_dark_frame, bpm_frame, 
-                    detlin_frame, dits)) == NULL) {
+    if ((in_calib = cr2res_calib_context_apply_imagelist(calib, in,
+                    dits)) == NULL) {
         cpl_msg_error(__func__, "Failed to apply the calibrations") ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         cpl_free(decker_positions) ;
@@ -765,7 +832,6 @@ static int cr2res_obs_pol_reduce_one(
     /* Correct trace_wave with some provided raw flats */
     if (raw_flat_frames != NULL) {
         cpl_msg_info(__func__, "Try to correct the reproducibility error") ;
-        cpl_msg_indent_more() ;
         trace_wave_corrected = cr2res_trace_adjust(trace_wave, raw_flat_frames, 
                 reduce_det) ;
         if (trace_wave_corrected != NULL) {
@@ -773,13 +839,20 @@ static int cr2res_obs_pol_reduce_one(
             trace_wave = trace_wave_corrected ;
             trace_wave_corrected = NULL ;
         }
-        cpl_msg_indent_less() ;
     }
 
     /* Compute the number of groups */
     ngroups = nframes/CR2RES_POLARIMETRY_GROUP_SIZE ;
     nspec_group = 2*CR2RES_POLARIMETRY_GROUP_SIZE ;
 
+    /* All the frames are extracted with the same traces, the geometry */
+    /* of the slit decomposition is computed once and then reused */
+    if (extract_cache_size > 0)
+        geom_cache = cr2res_extract_geom_cache_new(
+                (cpl_size)extract_cache_size * 1024 * 1024) ;
+    else
+        geom_cache = NULL ;
+
     /* Allocate pol_spec_group containers */
     pol_spec_one_group = cpl_malloc(ngroups * sizeof(cpl_table*)) ;
     for (i = 0; i < ngroups; i++) pol_spec_one_group[i] = NULL;
@@ -788,7 +861,6 @@ static int cr2res_obs_pol_reduce_one(
     for (i=0 ; i<ngroups ; i++) {
         cpl_msg_info(__func__, "Process %d-group number %d/%d", 
                 CR2RES_POLARIMETRY_GROUP_SIZE, i+1, ngroups) ;
-        cpl_msg_indent_more() ;    
 
         /* Compute the proper order of the frames group */
         if ((pol_sorting = cr2res_pol_sort_frames(
@@ -829,7 +901,6 @@ static int cr2res_obs_pol_reduce_one(
                     "Extract Up Spectrum from %s (Det %d / Decker %s)", 
                     fname, reduce_det, decker_name) ;
             cpl_free(decker_name) ;
-            cpl_msg_indent_more() ;
            
             /* Get slit fraction for the upper trace */
             slit_frac = cr2res_trace_slit_fraction_create(
@@ -846,8 +917,9 @@ static int cr2res_obs_pol_reduce_one(
                         hdrl_imagelist_get_const(in_calib, frame_idx),
                         trace_wave_loc, NULL, -1, -1, CR2RES_EXTR_OPT_CURV, 
                         extract_height, extract_swath_width, extract_oversample,
-                        extract_smooth, &(extract_1d[2*j]), &slit_func, 
-                        &model_master) == -1) {
+                        extract_smooth, 0, 0, 1, geom_cache,
+                        &(extract_1d[2*j]), &slit_func,
+                        &model_master, NULL) == -1) {
                 cpl_msg_error(__func__, "Failed Extraction") ;
                 extract_1d[2*j] = NULL ;
             } else {
@@ -871,7 +943,6 @@ static int cr2res_obs_pol_reduce_one(
                 }
             }
             cpl_table_delete(trace_wave_loc) ;
-            cpl_msg_indent_less() ;
 
             /* Extract Down */
             decker_name = cr2res_decker_print_position(
@@ -880,7 +951,6 @@ static int cr2res_obs_pol_reduce_one(
                     "Extract Down Spectrum from %s (Det %d / Decker %s)", 
                     fname, reduce_det, decker_name) ;
             cpl_free(decker_name) ;
-            cpl_msg_indent_more() ;
            
             /* Get slit fraction for the lower trace */
             slit_frac = cr2res_trace_slit_fraction_create(
@@ -897,8 +967,9 @@ static int cr2res_obs_pol_reduce_one(
                         hdrl_imagelist_get_const(in_calib, frame_idx),
                         trace_wave_loc, NULL, -1, -1, CR2RES_EXTR_OPT_CURV, 
                         extract_height, extract_swath_width, extract_oversample,
-                        extract_smooth, &(extract_1d[2*j+1]), &slit_func, 
-                        &model_master) == -1) {
+                        extract_smooth, 0, 0, 1, geom_cache,
+                        &(extract_1d[2*j+1]), &slit_func,
+                        &model_master, NULL) == -1) {
                 cpl_msg_error(__func__, "Failed Extraction") ;
                 extract_1d[2*j+1] = NULL ;
             } else {
@@ -922,7 +993,6 @@ static int cr2res_obs_pol_reduce_one(
                 }
             }
             cpl_table_delete(trace_wave_loc) ;
-            cpl_msg_indent_less() ;
         }
         cpl_free(pol_sorting) ;
 
@@ -1055,10 +1125,10 @@ static int cr2res_obs_pol_reduce_one(
         cpl_free(demod_null) ;
         cpl_free(demod_intens) ;
         cpl_free(orders) ;
-        cpl_msg_indent_less() ;
     }
     cpl_free(decker_positions) ;
     hdrl_imagelist_delete(in_calib) ;
+    cr2res_extract_geom_cache_delete(geom_cache) ;
 
     /* Merge the groups together */
     if (ngroups > 1) {
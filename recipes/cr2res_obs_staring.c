@@ -43,6 +43,28 @@
 
 #define RECIPE_STRING "cr2res_obs_staring"
 
+/*-----------------------------------------------------------------------------
+                                Private types
+ -----------------------------------------------------------------------------*/
+
+/* Inputs and products of the detectors reductions */
+typedef struct {
+    const cpl_frameset  *   rawframes ;
+    const cpl_frame     *   trace_wave_frame ;
+    const cpl_frame     *   detlin_frame ;
+    const cpl_frame     *   master_dark_frame ;
+    const cpl_frame     *   master_flat_frame ;
+    const cpl_frame     *   bpm_frame ;
+    int                     extract_oversample ;
+    int                     extract_swath_width ;
+    int                     extract_height ;
+    double                  extract_smooth ;
+    cpl_table           **  extract ;
+    cpl_table           **  slitfunc ;
+    hdrl_image          **  model ;
+    cpl_propertylist    **  ext_plist ;
+} cr2res_obs_staring_data ;
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -74,6 +96,7 @@ static int cr2res_obs_staring_reduce(
         cpl_table           **  slitfunc,
         hdrl_image          **  model,
         cpl_propertylist    **  ext_plist) ;
+static int cr2res_obs_staring_reduce_det(int det_nr, void * data) ;
 static int cr2res_obs_staring_create(cpl_plugin *);
 static int cr2res_obs_staring_exec(cpl_plugin *);
 static int cr2res_obs_staring_destroy(cpl_plugin *);
@@ -339,6 +362,7 @@ static int cr2res_obs_staring(
     hdrl_image          *   model[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   plist ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_obs_staring_data data ;
     char                *   out_file;
     int                     i, det_nr, type; 
 
@@ -394,36 +418,31 @@ static int cr2res_obs_staring(
         return -1 ;
     }
       
-    /* Loop on the detectors */
+    /* Initialise */
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-        /* Initialise */
         extract[det_nr-1] = NULL ;
         slitfunc[det_nr-1] = NULL ;
         model[det_nr-1] = NULL ;
         ext_plist[det_nr-1] = NULL ;
-
-        /* Compute only one detector */
-        if (reduce_det != 0 && det_nr != reduce_det) continue ;
-    
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
-
-        /* Call the reduction function */
-        if (cr2res_obs_staring_reduce(rawframes, 
-                    trace_wave_frame, detlin_frame, master_dark_frame, 
-                    master_flat_frame, bpm_frame, 0, extract_oversample, 
-                    extract_swath_width, extract_height, extract_smooth, det_nr,
-                    &(extract[det_nr-1]),
-                    &(slitfunc[det_nr-1]),
-                    &(model[det_nr-1]),
-                    &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
-            cpl_error_reset() ;
-            cpl_msg_indent_less() ;
-        }
-        cpl_msg_indent_less() ;
     }
 
+    /* Reduce the detectors in parallel */
+    data.rawframes = rawframes ;
+    data.trace_wave_frame = trace_wave_frame ;
+    data.detlin_frame = detlin_frame ;
+    data.master_dark_frame = master_dark_frame ;
+    data.master_flat_frame = master_flat_frame ;
+    data.bpm_frame = bpm_frame ;
+    data.extract_oversample = extract_oversample ;
+    data.extract_swath_width = extract_swath_width ;
+    data.extract_height = extract_height ;
+    data.extract_smooth = extract_smooth ;
+    data.extract = extract ;
+    data.slitfunc = slitfunc ;
+    data.model = model ;
+    data.ext_plist = ext_plist ;
+    cr2res_reduce_detectors(cr2res_obs_staring_reduce_det, &data, reduce_det);
+
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_slitfunc.fits", RECIPE_STRING) ;
     cr2res_io_save_SLIT_FUNC(out_file, frameset, rawframes, parlist,
@@ -458,6 +477,28 @@ static int cr2res_obs_staring(
     return (int)cpl_error_get_code();
 }
  
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Reduce one detector, called by cr2res_reduce_detectors()
+  @param    det_nr      The detector to compute
+  @param    data        The cr2res_obs_staring_data inputs and products
+  @return   0 if ok, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_obs_staring_reduce_det(int det_nr, void * data)
+{
+    cr2res_obs_staring_data *   d = (cr2res_obs_staring_data *)data ;
+
+    return cr2res_obs_staring_reduce(d->rawframes, d->trace_wave_frame,
+            d->detlin_frame, d->master_dark_frame, d->master_flat_frame,
+            d->bpm_frame, 0, d->extract_oversample, d->extract_swath_width,
+            d->extract_height, d->extract_smooth, det_nr,
+            &(d->extract[det_nr-1]),
+            &(d->slitfunc[det_nr-1]),
+            &(d->model[det_nr-1]),
+            &(d->ext_plist[det_nr-1])) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Execute the science recipe on a specific detector
@@ -578,17 +619,14 @@ static int cr2res_obs_staring_reduce(
 
     /* Collapse the image list */
     cpl_msg_info(__func__, "Collapse") ;
-    cpl_msg_indent_more() ;
     if (hdrl_imagelist_collapse_mean(in_calib, &collapsed, &contrib) !=
             CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse") ;
         hdrl_imagelist_delete(in_calib) ;
-        cpl_msg_indent_less() ;
         return -1 ;
     }
     cpl_image_delete(contrib) ;
     hdrl_imagelist_delete(in_calib) ;
-    cpl_msg_indent_less() ;
 
     /* Load the trace wave */
     cpl_msg_info(__func__, "Load the TRACE WAVE") ;
@@ -603,8 +641,8 @@ static int cr2res_obs_staring_reduce(
     cpl_msg_info(__func__, "Spectra Extraction") ;
     if (cr2res_extract_traces(collapsed, trace_wave, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
-                extract_oversample, extract_smooth,
-                &extracted, &slit_func, &model_master) == -1) {
+                extract_oversample, extract_smooth, 0, 0, 1, NULL,
+                &extracted, &slit_func, &model_master, NULL) == -1) {
         cpl_msg_error(__func__, "Failed to extract");
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(trace_wave) ;
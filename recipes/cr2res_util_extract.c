@@ -116,8 +116,11 @@ Spectrum Extraction                                                     \n\
         Load the BPM and set them in the image                          \n\
         Load the input slit_func if available                           \n\
         Run the extraction cr2res_extract_traces(--method,--height,     \n\
-                 --swath_width,--oversample,--smooth_slit)              \n\
+                 --swath_width,--oversample,--smooth_slit,--nthreads,    \n\
+                 --warm_start,--single_prec)                            \n\
           -> creates SLIT_MODEL(f,d), SLIT_FUNC(f,d), EXTRACT_1D(f,d)   \n\
+        If --swath_width is -1, store the swath width chosen for each   \n\
+                 trace in the header                                    \n\
       Save SLIT_MODEL(f), SLIT_FUNC(f), EXTRACT_1D(f)                   \n\
                                                                         \n\
   Library functions uѕed                                                \n\
@@ -210,7 +213,8 @@ static int cr2res_util_extract_create(cpl_plugin * plugin)
     cpl_parameterlist_append(recipe->parameters, p);
 
     p = cpl_parameter_new_value("cr2res.cr2res_util_extract.swath_width",
-            CPL_TYPE_INT, "The swath width", "cr2res.cr2res_util_extract", 90);
+            CPL_TYPE_INT, "The swath width (-1 to choose it for each trace)",
+            "cr2res.cr2res_util_extract", 90);
     cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "swath_width");
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
@@ -230,9 +234,33 @@ static int cr2res_util_extract_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_util_extract", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.warm_start",
+            CPL_TYPE_BOOL,
+            "Start each swath from the previous swath solution",
+            "cr2res.cr2res_util_extract", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "warm_start");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.single_prec",
+            CPL_TYPE_BOOL,
+            "Single precision slit decomposition weights",
+            "cr2res.cr2res_util_extract", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "single_prec");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_util_extract.method",
             CPL_TYPE_STRING, "Extraction method (SUM / MEDIAN / TILTSUM / "
-            "OPT_VERT / OPT_CURV )",
+            "OPT_VERT / OPT_CURV / HORNE (needs the slit function) )",
             "cr2res.cr2res_util_extract", "OPT_CURV");
     cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "method");
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
@@ -322,7 +350,8 @@ static int cr2res_util_extract(
 {
     const cpl_parameter *   param;
     int                     oversample, swath_width, extr_height,
-                            reduce_det, reduce_order, reduce_trace ;
+                            reduce_det, reduce_order, reduce_trace,
+                            nthreads, warm_start, single_prec ;
     double                  smooth_slit, slit_low, slit_up ;
     cpl_array           *   slit_frac ;
     cpl_frameset        *   rawframes ;
@@ -344,7 +373,9 @@ static int cr2res_util_extract(
     cpl_table           *   slit_func_in ;
     cpl_image           *   bpm_img;
     cpl_mask            *   bpm_mask;
-    int                     det_nr, ext_nr, order, i ;
+    char                *   key_name ;
+    int                 *   swaths ;
+    int                     det_nr, ext_nr, order, trace_id, i, j ;
     cr2res_extr_method      extr_method;
 
     /* Needed for sscanf() */
@@ -360,6 +391,15 @@ static int cr2res_util_extract(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_util_extract.smooth_slit");
     smooth_slit = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.nthreads");
+    nthreads = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.warm_start");
+    warm_start = cpl_parameter_get_bool(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.single_prec");
+    single_prec = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_util_extract.detector");
     reduce_det = cpl_parameter_get_int(param);
@@ -381,6 +421,7 @@ static int cr2res_util_extract(
     else if (!strcmp(sval, "SUM"))      extr_method = CR2RES_EXTR_SUM;
     else if (!strcmp(sval, "MEDIAN"))   extr_method = CR2RES_EXTR_MEDIAN;
     else if (!strcmp(sval, "TILTSUM"))   extr_method = CR2RES_EXTR_TILTSUM;
+    else if (!strcmp(sval, "HORNE"))    extr_method = CR2RES_EXTR_HORNE;
     else {
         cpl_msg_error(__func__, "Invalid Extraction Method specified");
         cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
@@ -434,6 +475,13 @@ static int cr2res_util_extract(
         if (slit_frac != NULL) cpl_array_delete(slit_frac) ;
         return -1 ;
     }
+    if (extr_method == CR2RES_EXTR_HORNE && slit_func_frame == NULL) {
+        cpl_msg_error(__func__, "The HORNE method needs a slit function frame");
+        cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+        cpl_frameset_delete(rawframes) ;
+        if (slit_frac != NULL) cpl_array_delete(slit_frac) ;
+        return -1 ;
+    }
    
     /* Loop on the RAW frames */
     for (i=0 ; i<cpl_frameset_get_size(rawframes) ; i++) {
@@ -526,11 +574,16 @@ static int cr2res_util_extract(
             
             /* Compute the extraction */
             cpl_msg_info(__func__, "Spectra Extraction") ;
+            swaths = cpl_malloc(cpl_table_get_nrow(trace_table) *
+                    sizeof(int)) ;
             if (cr2res_extract_traces(science_hdrl, trace_table,
                         slit_func_in, reduce_order, reduce_trace, extr_method, 
                         extr_height, swath_width, oversample, smooth_slit, 
-                        &(extract_tab[det_nr-1]), &(slit_func_tab[det_nr-1]), 
-                        &(model_master[det_nr-1]))==-1) {
+                        warm_start, single_prec, nthreads, NULL,
+                        &(extract_tab[det_nr-1]),
+                        &(slit_func_tab[det_nr-1]), 
+                        &(model_master[det_nr-1]), swaths)==-1) {
+                cpl_free(swaths) ;
                 cpl_table_delete(trace_table) ;
                 hdrl_image_delete(science_hdrl) ;
                 if (slit_func_in != NULL) cpl_table_delete(slit_func_in) ;
@@ -540,6 +593,24 @@ static int cr2res_util_extract(
                 continue ;
             }
             if (slit_func_in != NULL) cpl_table_delete(slit_func_in) ;
+
+            /* QC - Swath widths chosen by the extraction */
+            if (swath_width <= 0 && ext_plist[det_nr-1] != NULL) {
+                for (j=0 ; j<cpl_table_get_nrow(trace_table) ; j++) {
+                    if (swaths[j] <= 0) continue ;
+                    order = cpl_table_get(trace_table, CR2RES_COL_ORDER, j,
+                            NULL) ;
+                    trace_id = cpl_table_get(trace_table, CR2RES_COL_TRACENB,
+                            j, NULL) ;
+                    key_name = cpl_sprintf(CR2RES_HEADER_QC_SWATH,
+                            cr2res_io_convert_order_idx_to_idxp(order),
+                            trace_id) ;
+                    cpl_propertylist_update_int(ext_plist[det_nr-1],
+                            key_name, swaths[j]) ;
+                    cpl_free(key_name) ;
+                }
+            }
+            cpl_free(swaths) ;
             hdrl_image_delete(science_hdrl) ;
             cpl_table_delete(trace_table) ;
             cpl_msg_indent_less() ;